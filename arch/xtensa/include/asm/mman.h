@@ -62,6 +62,7 @@
 #define MS_ASYNC	0x0001		/* sync memory asynchronously */
 #define MS_INVALIDATE	0x0002		/* invalidate mappings & caches */
 #define MS_SYNC		0x0004		/* synchronous memory sync */
+#define MS_OSYNC	0x0008		/* OptFS: ordering-only sync (osync) */
 
 /*
  * Flags for mlockall
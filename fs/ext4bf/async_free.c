@@ -0,0 +1,317 @@
+/*
+ *  linux/fs/ext4bf/async_free.c
+ *
+ * Background freeing of large deleted files.
+ *
+ * Freeing the blocks of a big file walks and journals its whole extent
+ * tree, which can keep the process doing the last iput() or ftruncate()
+ * busy for seconds.  With async_free, an unlinked inode holding at least
+ * s_async_free_min_mb is not evicted on its last iput(): ext4bf_drop_inode()
+ * keeps it cached and queues it for a per-sb kernel thread, which takes a
+ * new reference and truncates it from the end s_async_free_chunk_mb at a
+ * time, at idle I/O priority, before letting it go.  The inode is on the
+ * orphan list from the unlink on, so a crash at any point leaves recovery
+ * to finish the job.
+ *
+ * A truncate to 0 gets the same treatment by handing the extent tree to
+ * a new unlinked inode and dropping that.
+ *
+ * The inodes still queued when the thread is stopped, and any the VM
+ * reclaims before the thread gets to them, are freed inline as before.
+ * So are the queued ones when an allocation runs out of space.
+ */
+
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/ioprio.h>
+#include "ext4bf.h"
+#include "ext4bf_extents.h"
+#include "ext4bf_jbdbf.h"
+
+static int ext4bf_async_free_wanted(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+
+	return test_opt2(sb, ASYNC_FREE) && EXT4_SB(sb)->s_journal &&
+		S_ISREG(inode->i_mode) &&
+		ext4bf_test_inode_flag(inode, EXT4_INODE_EXTENTS) &&
+		!ext4bf_has_inline_data(inode) && ext4bf_can_truncate(inode) &&
+		(inode->i_blocks >> (20 - 9)) >= EXT4_SB(sb)->s_async_free_min_mb;
+}
+
+/*
+ * Called by ext4bf_drop_inode() with inode->i_lock held.  Returns 1 if the
+ * inode was queued and should stay cached.
+ */
+int ext4bf_async_free_queue(struct inode *inode)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(inode->i_sb);
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	int ret = 0;
+
+	if (inode->i_nlink || inode_unhashed(inode) || is_bad_inode(inode) ||
+	    ext4bf_test_inode_state(inode, EXT4_STATE_FREE_NOW) ||
+	    !ext4bf_async_free_wanted(inode))
+		return 0;
+
+	spin_lock(&sbi->s_async_free_lock);
+	if (sbi->s_async_free_tsk) {
+		if (list_empty(&ei->i_async_free))
+			list_add_tail(&ei->i_async_free,
+				      &sbi->s_async_free_list);
+		wake_up_process(sbi->s_async_free_tsk);
+		ret = 1;
+	}
+	spin_unlock(&sbi->s_async_free_lock);
+	return ret;
+}
+
+/*
+ * Called by ext4bf_clear_inode(): the inode got evicted while queued.
+ */
+void ext4bf_async_free_forget(struct inode *inode)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(inode->i_sb);
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+
+	if (list_empty(&ei->i_async_free))
+		return;
+	spin_lock(&sbi->s_async_free_lock);
+	list_del_init(&ei->i_async_free);
+	spin_unlock(&sbi->s_async_free_lock);
+}
+
+/*
+ * Take the next queued inode number off the list, recording it as the
+ * one being worked on if @busy.  The inode itself may be evicted as soon
+ * as the lock is dropped, so it is looked up again.
+ */
+static unsigned long ext4bf_async_free_next(struct ext4bf_sb_info *sbi,
+					    int busy)
+{
+	struct ext4bf_inode_info *ei;
+	unsigned long ino = 0;
+
+	spin_lock(&sbi->s_async_free_lock);
+	if (!list_empty(&sbi->s_async_free_list)) {
+		ei = list_first_entry(&sbi->s_async_free_list,
+				      struct ext4bf_inode_info, i_async_free);
+		list_del_init(&ei->i_async_free);
+		ino = ei->vfs_inode.i_ino;
+	}
+	if (busy)
+		sbi->s_async_free_busy = ino;
+	spin_unlock(&sbi->s_async_free_lock);
+	return ino;
+}
+
+static int ext4bf_async_free_idle(struct ext4bf_sb_info *sbi)
+{
+	int idle;
+
+	spin_lock(&sbi->s_async_free_lock);
+	idle = !sbi->s_async_free_busy;
+	spin_unlock(&sbi->s_async_free_lock);
+	return idle;
+}
+
+/*
+ * Drop the reference on a queued inode, truncating it down in steps
+ * first if @truncate.  Each ext4bf_truncate() call restarts its handle
+ * as needed, so a step never needs more than one chunk's worth of
+ * extent tree in a transaction.
+ */
+static void ext4bf_async_free_put(struct super_block *sb, unsigned long ino,
+				  int truncate)
+{
+	struct inode *inode;
+	loff_t chunk, size;
+
+	inode = ilookup(sb, ino);
+	if (!inode)
+		return;
+	/* the number may have been reused by a live file since */
+	if (inode->i_nlink) {
+		iput(inode);
+		return;
+	}
+
+	chunk = max_t(loff_t, (loff_t)EXT4_SB(sb)->s_async_free_chunk_mb << 20,
+		      sb->s_blocksize);
+	mutex_lock(&inode->i_mutex);
+	while (truncate && inode->i_size && !kthread_should_stop()) {
+		size = inode->i_size > chunk ? inode->i_size - chunk : 0;
+		truncate_setsize(inode, size);
+		ext4bf_truncate(inode);
+		cond_resched();
+	}
+	mutex_unlock(&inode->i_mutex);
+
+	ext4bf_set_inode_state(inode, EXT4_STATE_FREE_NOW);
+	iput(inode);	/* whatever is left is freed inline */
+}
+
+static int ext4bf_async_free_thread(void *data)
+{
+	struct super_block *sb = data;
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+	unsigned long ino;
+
+	set_freezable();
+	set_task_ioprio(current, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		ino = ext4bf_async_free_next(sbi, 1);
+		if (!ino) {
+			/* kthread_stop() may have come before our state */
+			if (!kthread_should_stop())
+				schedule();
+			__set_current_state(TASK_RUNNING);
+			try_to_freeze();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+		ext4bf_async_free_put(sb, ino, 1);
+		spin_lock(&sbi->s_async_free_lock);
+		sbi->s_async_free_busy = 0;
+		spin_unlock(&sbi->s_async_free_lock);
+		wake_up_all(&sbi->s_async_free_wait);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+/*
+ * Called by ext4bf_should_retry_alloc(): the space an allocation is
+ * missing may belong to files still queued for freeing.  Free them
+ * inline, wait for the one the thread is on, and return 1 if there was
+ * anything to free.  With a handle held the frees would need more of
+ * the journal than we may take, so just hurry the thread.
+ */
+int ext4bf_async_free_wait(struct super_block *sb)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+	unsigned long ino;
+	int pending;
+
+	spin_lock(&sbi->s_async_free_lock);
+	pending = sbi->s_async_free_busy ||
+		  !list_empty(&sbi->s_async_free_list);
+	if (pending && sbi->s_async_free_tsk)
+		wake_up_process(sbi->s_async_free_tsk);
+	spin_unlock(&sbi->s_async_free_lock);
+	if (!pending || ext4bf_journal_current_handle())
+		return pending;
+
+	while ((ino = ext4bf_async_free_next(sbi, 0)))
+		ext4bf_async_free_put(sb, ino, 0);
+	wait_event(sbi->s_async_free_wait, ext4bf_async_free_idle(sbi));
+	return 1;
+}
+
+/*
+ * Hand the blocks of @inode, just truncated to 0 by ext4bf_setattr() with
+ * i_mutex held and the page cache gone, to a new unlinked inode and queue
+ * that one instead.  Returns 1 if done, 0 if the caller should truncate.
+ */
+int ext4bf_async_free_truncate(struct inode *inode, loff_t old_size)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	struct inode *orphan;
+	handle_t *handle;
+
+	if (inode->i_size || !EXT4_SB(inode->i_sb)->s_async_free_tsk ||
+	    !ext4bf_async_free_wanted(inode))
+		return 0;
+
+	ext4bf_flush_completed_IO(inode);
+	orphan = ext4bf_new_orphan_inode(inode);
+	if (IS_ERR(orphan))
+		return 0;
+	/* both inodes, and the orphan list entry of @inode */
+	handle = ext4bf_journal_start(inode, 2 + 3);
+	if (IS_ERR(handle)) {
+		iput(orphan);
+		return 0;
+	}
+
+	down_write(&ei->i_data_sem);
+	ext4bf_discard_preallocations(inode);
+	ext4bf_set_inode_flag(orphan, EXT4_INODE_EXTENTS);
+	memcpy(EXT4_I(orphan)->i_data, ei->i_data, sizeof(ei->i_data));
+	/* the orphan is owned like @inode, so quota usage does not move */
+	spin_lock(&inode->i_lock);
+	orphan->i_blocks = inode->i_blocks;
+	inode->i_blocks = 0;
+	spin_unlock(&inode->i_lock);
+	ext4bf_ext_tree_init(handle, inode);
+	up_write(&ei->i_data_sem);
+
+	i_size_write(orphan, old_size);
+	EXT4_I(orphan)->i_disksize = old_size;
+	ext4bf_mark_inode_dirty(handle, orphan);
+
+	ei->i_disksize = 0;
+	ext4bf_clear_inode_flag(inode, EXT4_INODE_EOFBLOCKS);
+	if (!test_opt(inode->i_sb, NO_AUTO_DA_ALLOC))
+		ext4bf_set_inode_state(inode, EXT4_STATE_DA_ALLOC_CLOSE);
+	inode->i_mtime = inode->i_ctime = ext4bf_current_time(inode);
+	ext4bf_mark_inode_dirty(handle, inode);
+	if (inode->i_nlink)
+		ext4bf_orphan_del(handle, inode);
+	if (IS_SYNC(inode))
+		ext4bf_handle_sync(handle);
+	ext4bf_journal_stop(handle);
+
+	iput(orphan);
+	return 1;
+}
+
+/*
+ * Start the thread if async_free is set and the fs is writable.
+ */
+void ext4bf_async_free_start(struct super_block *sb)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+	struct task_struct *tsk;
+
+	if (sbi->s_async_free_tsk || !test_opt2(sb, ASYNC_FREE) ||
+	    (sb->s_flags & MS_RDONLY) || !sbi->s_journal)
+		return;
+
+	tsk = kthread_run(ext4bf_async_free_thread, sb, "ext4bf-free/%s",
+			  sb->s_id);
+	if (IS_ERR(tsk)) {
+		ext4bf_msg(sb, KERN_WARNING, "unable to start async_free "
+			   "thread: %ld", PTR_ERR(tsk));
+		return;
+	}
+	spin_lock(&sbi->s_async_free_lock);
+	sbi->s_async_free_tsk = tsk;
+	spin_unlock(&sbi->s_async_free_lock);
+}
+
+/*
+ * Stop the thread and free whatever is still queued inline.  The queued
+ * inodes are cached, so this must run before they are evicted at unmount
+ * and before a remount makes the fs read-only.
+ */
+void ext4bf_async_free_stop(struct super_block *sb)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+	struct task_struct *tsk;
+	unsigned long ino;
+
+	spin_lock(&sbi->s_async_free_lock);
+	tsk = sbi->s_async_free_tsk;
+	sbi->s_async_free_tsk = NULL;
+	spin_unlock(&sbi->s_async_free_lock);
+	if (!tsk)
+		return;
+
+	kthread_stop(tsk);
+	while ((ino = ext4bf_async_free_next(sbi, 0)))
+		ext4bf_async_free_put(sb, ino, 0);
+	wake_up_all(&sbi->s_async_free_wait);
+}
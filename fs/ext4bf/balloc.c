@@ -468,9 +468,11 @@ int ext4bf_claim_free_clusters(struct ext4bf_sb_info *sbi,
  */
 int ext4bf_should_retry_alloc(struct super_block *sb, int *retries)
 {
-	if (!ext4bf_has_free_clusters(EXT4_SB(sb), 1, 0) ||
-	    (*retries)++ > 3 ||
-	    !EXT4_SB(sb)->s_journal)
+	if ((*retries)++ > 3 || !EXT4_SB(sb)->s_journal)
+		return 0;
+	/* ext4bf: the space may be held by files still queued for freeing */
+	if (!ext4bf_async_free_wait(sb) &&
+	    !ext4bf_has_free_clusters(EXT4_SB(sb), 1, 0))
 		return 0;
 
 	jbd_debug(1, "%s: retrying operation after ENOSPC\n", sb->s_id);
@@ -19,14 +19,31 @@
 #include <linux/blkdev.h>
 #include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/rcupdate.h>
 #include "ext4bf.h"
 
+/*
+ * The zones are collected in an rbtree, which merges adjacent and
+ * overlapping ranges, and then flattened into a sorted array that
+ * lookups binary-search under rcu_read_lock().  The array is never
+ * modified once published; a rebuild publishes a new one.
+ */
 struct ext4bf_system_zone {
 	struct rb_node	node;
 	ext4bf_fsblk_t	start_blk;
 	unsigned int	count;
 };
 
+struct ext4bf_system_extent {
+	ext4bf_fsblk_t	start_blk;
+	ext4bf_fsblk_t	end_blk;	/* last block, inclusive */
+};
+
+struct ext4bf_system_blocks {
+	unsigned int			count;
+	struct ext4bf_system_extent	zones[];
+};
+
 static struct kmem_cache *ext4bf_system_zone_cachep;
 
 int __init ext4bf_init_system_zone(void)
@@ -55,12 +72,12 @@ static inline int can_merge(struct ext4bf_system_zone *entry1,
  * is, filesystem metadata blocks which should never be used by
  * inodes.
  */
-static int add_system_zone(struct ext4bf_sb_info *sbi,
+static int add_system_zone(struct rb_root *root,
 			   ext4bf_fsblk_t start_blk,
 			   unsigned int count)
 {
 	struct ext4bf_system_zone *new_entry = NULL, *entry;
-	struct rb_node **n = &sbi->system_blks.rb_node, *node;
+	struct rb_node **n = &root->rb_node, *node;
 	struct rb_node *parent = NULL, *new_node = NULL;
 
 	while (*n) {
@@ -92,7 +109,7 @@ static int add_system_zone(struct ext4bf_sb_info *sbi,
 		new_node = &new_entry->node;
 
 		rb_link_node(new_node, parent, n);
-		rb_insert_color(new_node, &sbi->system_blks);
+		rb_insert_color(new_node, root);
 	}
 
 	/* Can we merge to the left? */
@@ -102,7 +119,7 @@ static int add_system_zone(struct ext4bf_sb_info *sbi,
 		if (can_merge(entry, new_entry)) {
 			new_entry->start_blk = entry->start_blk;
 			new_entry->count += entry->count;
-			rb_erase(node, &sbi->system_blks);
+			rb_erase(node, root);
 			kmem_cache_free(ext4bf_system_zone_cachep, entry);
 		}
 	}
@@ -113,106 +130,136 @@ static int add_system_zone(struct ext4bf_sb_info *sbi,
 		entry = rb_entry(node, struct ext4bf_system_zone, node);
 		if (can_merge(new_entry, entry)) {
 			new_entry->count += entry->count;
-			rb_erase(node, &sbi->system_blks);
+			rb_erase(node, root);
 			kmem_cache_free(ext4bf_system_zone_cachep, entry);
 		}
 	}
 	return 0;
 }
 
-static void debug_print_tree(struct ext4bf_sb_info *sbi)
+static void release_system_zone_tree(struct rb_root *root)
 {
-	struct rb_node *node;
 	struct ext4bf_system_zone *entry;
-	int first = 1;
+	struct rb_node *n;
 
-	printk(KERN_INFO "System zones: ");
-	node = rb_first(&sbi->system_blks);
-	while (node) {
-		entry = rb_entry(node, struct ext4bf_system_zone, node);
-		printk("%s%llu-%llu", first ? "" : ", ",
-		       entry->start_blk, entry->start_blk + entry->count - 1);
-		first = 0;
-		node = rb_next(node);
+	while ((n = rb_first(root)) != NULL) {
+		entry = rb_entry(n, struct ext4bf_system_zone, node);
+		rb_erase(n, root);
+		kmem_cache_free(ext4bf_system_zone_cachep, entry);
 	}
+}
+
+static void debug_print_zones(struct ext4bf_system_blocks *system_blks)
+{
+	unsigned int i;
+
+	printk(KERN_INFO "System zones: ");
+	for (i = 0; i < system_blks->count; i++)
+		printk("%s%llu-%llu", i ? ", " : "",
+		       system_blks->zones[i].start_blk,
+		       system_blks->zones[i].end_blk);
 	printk("\n");
 }
 
+/*
+ * Replace the published zones with @new and free the old ones.  Mount,
+ * remount and online resize may race here, so updates are serialized by
+ * s_system_zone_mutex.
+ */
+static void publish_system_zone(struct ext4bf_sb_info *sbi,
+				struct ext4bf_system_blocks *new)
+{
+	struct ext4bf_system_blocks *old;
+
+	old = rcu_dereference_protected(sbi->system_blks,
+			lockdep_is_held(&sbi->s_system_zone_mutex));
+	rcu_assign_pointer(sbi->system_blks, new);
+	if (old) {
+		synchronize_rcu();
+		ext4bf_kvfree(old);
+	}
+}
+
+/*
+ * (Re)build the system zone.  Called at mount, remount and after an
+ * online resize added a group; lookups keep using the previous array
+ * until the new one is published.
+ */
 int ext4bf_setup_system_zone(struct super_block *sb)
 {
 	ext4bf_group_t ngroups = ext4bf_get_groups_count(sb);
 	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+	struct ext4bf_system_blocks *system_blks;
+	struct ext4bf_system_zone *entry;
 	struct ext4bf_group_desc *gdp;
+	struct rb_root root = RB_ROOT;
+	struct rb_node *node;
 	ext4bf_group_t i;
 	int flex_size = ext4bf_flex_bg_size(sbi);
-	int ret;
+	unsigned int count = 0;
+	int ret = 0;
 
 	if (!test_opt(sb, BLOCK_VALIDITY)) {
-		if (EXT4_SB(sb)->system_blks.rb_node)
-			ext4bf_release_system_zone(sb);
+		ext4bf_release_system_zone(sb);
 		return 0;
 	}
-	if (EXT4_SB(sb)->system_blks.rb_node)
-		return 0;
 
+	/* held across the rebuild so that a stale one cannot win */
+	mutex_lock(&sbi->s_system_zone_mutex);
 	for (i=0; i < ngroups; i++) {
 		if (ext4bf_bg_has_super(sb, i) &&
 		    ((i < 5) || ((i % flex_size) == 0)))
-			add_system_zone(sbi, ext4bf_group_first_block_no(sb, i),
+			add_system_zone(&root,
+					ext4bf_group_first_block_no(sb, i),
 					ext4bf_bg_num_gdb(sb, i) + 1);
 		gdp = ext4bf_get_group_desc(sb, i, NULL);
-		ret = add_system_zone(sbi, ext4bf_block_bitmap(sb, gdp), 1);
+		ret = add_system_zone(&root, ext4bf_block_bitmap(sb, gdp), 1);
 		if (ret)
-			return ret;
-		ret = add_system_zone(sbi, ext4bf_inode_bitmap(sb, gdp), 1);
+			goto out;
+		ret = add_system_zone(&root, ext4bf_inode_bitmap(sb, gdp), 1);
 		if (ret)
-			return ret;
-		ret = add_system_zone(sbi, ext4bf_inode_table(sb, gdp),
+			goto out;
+		ret = add_system_zone(&root, ext4bf_inode_table(sb, gdp),
 				sbi->s_itb_per_group);
 		if (ret)
-			return ret;
+			goto out;
+	}
+
+	for (node = rb_first(&root); node; node = rb_next(node))
+		count++;
+	system_blks = ext4bf_kvmalloc(sizeof(*system_blks) +
+			count * sizeof(system_blks->zones[0]), GFP_KERNEL);
+	if (!system_blks) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	system_blks->count = count;
+	count = 0;
+	for (node = rb_first(&root); node; node = rb_next(node)) {
+		entry = rb_entry(node, struct ext4bf_system_zone, node);
+		system_blks->zones[count].start_blk = entry->start_blk;
+		system_blks->zones[count].end_blk = entry->start_blk +
+						    entry->count - 1;
+		count++;
 	}
 
 	if (test_opt(sb, DEBUG))
-		debug_print_tree(EXT4_SB(sb));
-	return 0;
+		debug_print_zones(system_blks);
+	publish_system_zone(sbi, system_blks);
+out:
+	mutex_unlock(&sbi->s_system_zone_mutex);
+	release_system_zone_tree(&root);
+	return ret;
 }
 
 /* Called when the filesystem is unmounted */
 void ext4bf_release_system_zone(struct super_block *sb)
 {
-	struct rb_node	*n = EXT4_SB(sb)->system_blks.rb_node;
-	struct rb_node	*parent;
-	struct ext4bf_system_zone	*entry;
-
-	while (n) {
-		/* Do the node's children first */
-		if (n->rb_left) {
-			n = n->rb_left;
-			continue;
-		}
-		if (n->rb_right) {
-			n = n->rb_right;
-			continue;
-		}
-		/*
-		 * The node has no children; free it, and then zero
-		 * out parent's link to it.  Finally go to the
-		 * beginning of the loop and try to free the parent
-		 * node.
-		 */
-		parent = rb_parent(n);
-		entry = rb_entry(n, struct ext4bf_system_zone, node);
-		kmem_cache_free(ext4bf_system_zone_cachep, entry);
-		if (!parent)
-			EXT4_SB(sb)->system_blks = RB_ROOT;
-		else if (parent->rb_left == n)
-			parent->rb_left = NULL;
-		else if (parent->rb_right == n)
-			parent->rb_right = NULL;
-		n = parent;
-	}
-	EXT4_SB(sb)->system_blks = RB_ROOT;
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+
+	mutex_lock(&sbi->s_system_zone_mutex);
+	publish_system_zone(sbi, NULL);
+	mutex_unlock(&sbi->s_system_zone_mutex);
 }
 
 /*
@@ -223,8 +270,10 @@ void ext4bf_release_system_zone(struct super_block *sb)
 int ext4bf_data_block_valid(struct ext4bf_sb_info *sbi, ext4bf_fsblk_t start_blk,
 			  unsigned int count)
 {
-	struct ext4bf_system_zone *entry;
-	struct rb_node *n = sbi->system_blks.rb_node;
+	struct ext4bf_system_blocks *system_blks;
+	ext4bf_fsblk_t end_blk = start_blk + count - 1;
+	unsigned int lo, hi, mid;
+	int ret = 1;
 
 	if ((start_blk <= le32_to_cpu(sbi->s_es->s_first_data_block)) ||
 	    (start_blk + count < start_blk) ||
@@ -232,18 +281,28 @@ int ext4bf_data_block_valid(struct ext4bf_sb_info *sbi, ext4bf_fsblk_t start_blk
 		sbi->s_es->s_last_error_block = cpu_to_le64(start_blk);
 		return 0;
 	}
-	while (n) {
-		entry = rb_entry(n, struct ext4bf_system_zone, node);
-		if (start_blk + count - 1 < entry->start_blk)
-			n = n->rb_left;
-		else if (start_blk >= (entry->start_blk + entry->count))
-			n = n->rb_right;
-		else {
-			sbi->s_es->s_last_error_block = cpu_to_le64(start_blk);
-			return 0;
+
+	rcu_read_lock();
+	system_blks = rcu_dereference(sbi->system_blks);
+	if (system_blks) {
+		/* find the first zone that ends at or after start_blk */
+		lo = 0;
+		hi = system_blks->count;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (system_blks->zones[mid].end_blk < start_blk)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
+		if (lo < system_blks->count &&
+		    system_blks->zones[lo].start_blk <= end_blk)
+			ret = 0;
 	}
-	return 1;
+	rcu_read_unlock();
+	if (!ret)
+		sbi->s_es->s_last_error_block = cpu_to_le64(start_blk);
+	return ret;
 }
 
 int ext4bf_check_blockref(const char *function, unsigned int line,
@@ -590,7 +590,7 @@ int jbdbf_cleanup_journal_tail(journal_t *journal)
 	 * doesn't get called all that often.
 	 */
 	if ((journal->j_fs_dev != journal->j_dev) &&
-	    (journal->j_flags & JBD2_BARRIER))
+	    (journal->j_flags & (JBD2_BARRIER | JBD2_FAST_DEV)))
 		blkdev_issue_flush(journal->j_fs_dev, GFP_KERNEL, NULL);
 	if (!(journal->j_flags & JBD2_ABORT))
 		jbdbf_journal_update_superblock(journal, 1);
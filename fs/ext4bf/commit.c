@@ -164,9 +164,10 @@ static int journal_submit_commit_record(journal_t *journal,
 
 	if (journal->j_flags & JBD2_BARRIER &&
 	    !JBD2_HAS_INCOMPAT_FEATURE(journal,
-				       JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT))
+				       JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT)) {
+		tmp->h_flags |= JBD2_COMMIT_FLUSHED;
 		ret = submit_bh(WRITE_SYNC | WRITE_FLUSH_FUA, bh);
-	else
+	} else
 		ret = submit_bh(WRITE_SYNC, bh);
 	*cbh = bh;
 
@@ -174,6 +175,57 @@ static int journal_submit_commit_record(journal_t *journal,
     return ret; 
 }
 
+/*
+ * ext4bf: fold the commit record into the tail of the last descriptor
+ * block of the transaction (INCOMPAT_INLINE_COMMIT) and submit that
+ * batch, held back in j_wbuf[0..bufs) until the data the commit covers
+ * is on disk.  @crc32_sum covers every log block of the transaction
+ * before the batch; the descriptor itself is protected by being the
+ * block that carries the checksum, and recovery only trusts it if the
+ * sum over the blocks it describes matches.
+ */
+static void journal_submit_inline_commit(journal_t *journal,
+					 transaction_bf_t *commit_transaction,
+					 int bufs, __u32 crc32_sum)
+{
+	struct buffer_head **wbuf = journal->j_wbuf;
+	struct buffer_head *bh = wbuf[0];
+	journal_bf_header_t *header = (journal_bf_header_t *)bh->b_data;
+	struct commit_header *tmp = jbdbf_inline_commit_header(journal, bh);
+	struct timespec now = current_kernel_time();
+	int i, flushed;
+
+	for (i = 1; i < bufs; i++)
+		crc32_sum = jbdbf_checksum_data(crc32_sum, wbuf[i]);
+
+	header->h_blocktype = cpu_to_be32(JBD2_INLINE_COMMIT_BLOCK);
+
+	tmp->h_magic = cpu_to_be32(JBD2_MAGIC_NUMBER);
+	tmp->h_blocktype = cpu_to_be32(JBD2_COMMIT_BLOCK);
+	tmp->h_sequence = cpu_to_be32(commit_transaction->t_tid);
+	tmp->h_commit_sec = cpu_to_be64(now.tv_sec);
+	tmp->h_commit_nsec = cpu_to_be32(now.tv_nsec);
+	tmp->h_chksum_type 	= JBD2_CRC32_CHKSUM;
+	tmp->h_chksum_size 	= JBD2_CRC32_CHKSUM_SIZE;
+	tmp->h_chksum[0] 	= cpu_to_be32(crc32_sum);
+
+	/* as in journal_submit_commit_record(); the descriptor goes last */
+	flushed = (journal->j_flags & JBD2_BARRIER) &&
+		  !JBD2_HAS_INCOMPAT_FEATURE(journal,
+				JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT);
+	if (flushed)
+		tmp->h_flags |= JBD2_COMMIT_FLUSHED;
+
+	for (i = bufs - 1; i >= 0; i--) {
+		bh = wbuf[i];
+		lock_buffer(bh);
+		clear_buffer_dirty(bh);
+		set_buffer_uptodate(bh);
+		bh->b_end_io = journal_end_buffer_io_sync;
+		submit_bh(i == 0 && flushed ? WRITE_FLUSH : WRITE_SYNC, bh);
+	}
+}
+
 /*
  * This function along with journal_submit_commit_record
  * allows to write the commit record asynchronously.
@@ -214,6 +266,81 @@ static int journal_submit_inode_data_buffers(struct address_space *mapping)
 	return ret;
 }
 
+/*
+ * ext4bf: writepage callback for JBD2_ORDERED_CSUM.  Log a
+ * NEWLYAPPENDEDDATA tag for every newly allocated buffer of the page
+ * before it goes out, so that recovery, rather than a wait in commit,
+ * decides whether the data reached the disk.  In-place overwrites are
+ * not tagged: the flusher may rewrite them before the next commit, and
+ * the stale checksum would make recovery throw away a transaction whose
+ * data was on disk.  They are waited for after the commit record
+ * instead.  Returns -ENOMEM without writing the page if a tag can't be
+ * allocated.
+ */
+static int journal_csum_writepage(struct page *page,
+				  struct writeback_control *wbc, void *data)
+{
+	transaction_bf_t *commit_transaction = data;
+	struct address_space *mapping = page->mapping;
+	struct buffer_head *bh, *head;
+	struct jbdbf_data_tag *dtag, *next;
+	loff_t i_size = i_size_read(mapping->host);
+	loff_t pos = page_offset(page);
+	LIST_HEAD(tags);
+	int ret;
+
+	if (!page_has_buffers(page) || pos >= i_size)
+		goto write;
+	/* ->writepage() will just redirty a page that still needs blocks */
+	bh = head = page_buffers(page);
+	do {
+		if (buffer_delay(bh) || buffer_unwritten(bh))
+			goto write;
+	} while ((bh = bh->b_this_page) != head);
+
+	/* Checksum what will hit the disk: ->writepage() zeroes past EOF */
+	if (i_size - pos < PAGE_CACHE_SIZE)
+		zero_user_segment(page, i_size - pos, PAGE_CACHE_SIZE);
+	do {
+		if (pos + bh_offset(bh) >= i_size)
+			break;
+		if (!buffer_dirty(bh) || !buffer_mapped(bh) ||
+		    !buffer_csum_new(bh))
+			continue;
+		dtag = jbdbf_alloc_data_tag(GFP_NOFS);
+		if (!dtag) {
+			list_for_each_entry_safe(dtag, next, &tags, list)
+				jbdbf_free_data_tag(dtag);
+			redirty_page_for_writepage(wbc, page);
+			unlock_page(page);
+			return -ENOMEM;
+		}
+		dtag->b_blocknr = bh->b_blocknr;
+		dtag->crc32_data_sum = jbdbf_checksum_data(0, bh);
+		dtag->processed = 0;
+		list_add_tail(&dtag->list, &tags);
+	} while ((bh = bh->b_this_page) != head);
+	list_splice_tail(&tags, &commit_transaction->t_data_tag_list);
+write:
+	ret = mapping->a_ops->writepage(page, wbc);
+	mapping_set_error(mapping, ret);
+	return ret;
+}
+
+static int journal_submit_inode_data_csum(struct address_space *mapping,
+		transaction_bf_t *commit_transaction)
+{
+	struct writeback_control wbc = {
+		.sync_mode =  WB_SYNC_ALL,
+		.nr_to_write = mapping->nrpages * 2,
+		.range_start = 0,
+		.range_end = i_size_read(mapping->host),
+	};
+
+	return write_cache_pages(mapping, &wbc, journal_csum_writepage,
+				 commit_transaction);
+}
+
 /*
  * Submit all the data buffers of inode associated with the transaction to
  * disk.
@@ -223,7 +350,7 @@ static int journal_submit_inode_data_buffers(struct address_space *mapping)
  * operate on from being released while we write out pages.
  */
 static int journal_submit_data_buffers(journal_t *journal,
-		transaction_bf_t *commit_transaction)
+		transaction_bf_t *commit_transaction, int *csum)
 {
 	struct jbdbf_inode *jinode;
 	int err, ret = 0;
@@ -240,7 +367,16 @@ static int journal_submit_data_buffers(journal_t *journal,
 		 * block allocation  with delalloc. We need to write
 		 * only allocated blocks here.
 		 */
-		err = journal_submit_inode_data_buffers(mapping);
+		if (*csum) {
+			err = journal_submit_inode_data_csum(mapping,
+						commit_transaction);
+			/* Out of tags: order the rest the usual way. */
+			if (err == -ENOMEM) {
+				*csum = 0;
+				err = journal_submit_inode_data_buffers(mapping);
+			}
+		} else
+			err = journal_submit_inode_data_buffers(mapping);
 		if (!ret)
 			ret = err;
 		spin_lock(&journal->j_list_lock);
@@ -306,6 +442,21 @@ static int journal_finish_inode_data_buffers(journal_t *journal,
 	return ret;
 }
 
+static void journal_finish_ordered_data(journal_t *journal,
+		transaction_bf_t *commit_transaction)
+{
+	int err;
+
+	err = journal_finish_inode_data_buffers(journal, commit_transaction);
+	if (err) {
+		printk(KERN_WARNING
+			"JBD2: Detected IO errors while flushing file data "
+		       "on %s\n", journal->j_devname);
+		if (journal->j_flags & JBD2_ABORT_ON_SYNCDATA_ERR)
+			jbdbf_journal_abort(journal, err);
+	}
+}
+
 /*736  : Calculates the checksum of the buffer head*/
 __u32 jbdbf_checksum_data(__u32 crc32_sum, struct buffer_head *bh)
 {
@@ -328,6 +479,22 @@ __u32 jbdbf_checksum_data(__u32 crc32_sum, struct buffer_head *bh)
 	return checksum;
 }
 
+/*
+ * ext4bf: checksum of a block that is not in the page cache, e.g. the user
+ * buffer of an O_DIRECT write. Must match jbdbf_checksum_data().
+ */
+__u32 jbdbf_checksum_buf(__u32 crc32_sum, const void *buf, unsigned int len)
+{
+#if OPT_CHECKSUM_736
+	return 0;
+#endif
+#if OPT_CHECKSUM_FLETCHER
+	return fletcher32(crc32_sum, (void *)buf, len);
+#else
+	return crc32_be(crc32_sum, buf, len);
+#endif
+}
+
 static void write_tag_block(int tag_bytes, journal_block_tag_t *tag,
 				   unsigned long long block, __u32 data_checksum, __u32 block_type)
 {
@@ -371,6 +538,185 @@ __flush_data_batch(int *batch_count)
 	*batch_count = 0;
 }
 
+/*
+ * ext4bf: completion for the bios built by journal_submit_data_runs().  A
+ * bio_vec may cover several buffers of the same page.
+ */
+static void journal_end_data_run_bio(struct bio *bio, int error)
+{
+	struct bio_vec *bvec;
+	int i;
+
+	if (test_bit(BIO_UPTODATE, &bio->bi_flags))
+		error = 0;
+
+	__bio_for_each_segment(bvec, bio, i, 0) {
+		struct buffer_head *head = page_buffers(bvec->bv_page);
+		struct buffer_head *bh = head;
+		unsigned int offset = 0;
+
+		do {
+			if (offset >= bvec->bv_offset &&
+			    offset < bvec->bv_offset + bvec->bv_len) {
+				if (error) {
+					set_buffer_write_io_error(bh);
+					clear_buffer_uptodate(bh);
+				} else
+					set_buffer_uptodate(bh);
+				unlock_buffer(bh);
+			}
+			offset += bh->b_size;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+	bio_put(bio);
+}
+
+/*
+ * ext4bf: write out the runs of newly appended data blocks, one bio per
+ * contiguous stretch, and take the checksum of each block for its data tag
+ * while the buffer is locked for I/O.  Blocks truncated away since they
+ * were appended are dropped from their run.
+ */
+static void journal_submit_data_runs(journal_t *journal,
+				     transaction_bf_t *commit_transaction)
+{
+	struct jbdbf_data_run *run;
+	struct bio *bio;
+	unsigned int i;
+
+	list_for_each_entry(run, &commit_transaction->t_data_runs, dr_list) {
+		bio = NULL;
+		for (i = 0; i < run->dr_len; i++) {
+			struct buffer_head *bh = run->dr_bh[i];
+
+			lock_buffer(bh);
+			/* a rewrite from now on is staged again */
+			clear_buffer_datarun(bh);
+			smp_mb__after_clear_bit();
+			if (!buffer_mapped(bh) ||
+			    bh->b_blocknr != run->dr_start + i) {
+				unlock_buffer(bh);
+				put_bh(bh);
+				run->dr_bh[i] = NULL;
+				if (bio) {
+					submit_bio(WRITE_SYNC, bio);
+					bio = NULL;
+				}
+				continue;
+			}
+			run->dr_csum[i] = jbdbf_checksum_data(0, bh);
+			clear_buffer_dirty(bh);
+
+			if (bio && !bio_add_page(bio, bh->b_page, bh->b_size,
+						 bh_offset(bh))) {
+				submit_bio(WRITE_SYNC, bio);
+				bio = NULL;
+			}
+			if (!bio) {
+				bio = bio_alloc(GFP_NOFS, run->dr_len - i);
+				bio->bi_sector = bh->b_blocknr * (bh->b_size >> 9);
+				bio->bi_bdev = bh->b_bdev;
+				bio->bi_end_io = journal_end_data_run_bio;
+				bio_add_page(bio, bh->b_page, bh->b_size,
+					     bh_offset(bh));
+			}
+		}
+		if (bio)
+			submit_bio(WRITE_SYNC, bio);
+	}
+}
+
+/*
+ * ext4bf: move *@run and *@idx on to the next block of the committing
+ * transaction's data runs that needs a tag.  Returns 0 when none is left.
+ */
+static int journal_next_run_tag(transaction_bf_t *commit_transaction,
+				struct jbdbf_data_run **run, unsigned int *idx)
+{
+	while (*run) {
+		if (*idx == (*run)->dr_len) {
+			if (list_is_last(&(*run)->dr_list,
+					 &commit_transaction->t_data_runs))
+				*run = NULL;
+			else
+				*run = list_entry((*run)->dr_list.next,
+						  struct jbdbf_data_run,
+						  dr_list);
+			*idx = 0;
+			continue;
+		}
+		if ((*run)->dr_bh[*idx])
+			return 1;
+		(*idx)++;
+	}
+	return 0;
+}
+
+/*
+ * ext4bf: add the tags of the data runs, from *@run and *@idx on, to the
+ * descriptor being filled at *@tagp.  Returns 1 if it filled up first.
+ */
+static int journal_tag_data_runs(journal_t *journal,
+				 transaction_bf_t *commit_transaction,
+				 struct jbdbf_data_run **run, unsigned int *idx,
+				 char **tagp, int *space_left, int *first_tag,
+				 journal_block_tag_t **tag)
+{
+	int tag_bytes = journal_tag_bytes(journal);
+
+	while (journal_next_run_tag(commit_transaction, run, idx)) {
+		if (*space_left < tag_bytes + 16)
+			return 1;
+		*tag = (journal_block_tag_t *) *tagp;
+		write_tag_block(tag_bytes, *tag, (*run)->dr_start + *idx,
+				(*run)->dr_csum[*idx],
+				T_BLOCKTYPE_NEWLYAPPENDEDDATA);
+		(*tag)->t_flags = *first_tag ? 0 :
+				  cpu_to_be32(JBD2_FLAG_SAME_UUID);
+		*tagp += tag_bytes;
+		*space_left -= tag_bytes;
+		if (*first_tag) {
+			memcpy(*tagp, journal->j_uuid, 16);
+			*tagp += 16;
+			*space_left -= 16;
+			*first_tag = 0;
+		}
+		(*idx)++;
+	}
+	return 0;
+}
+
+/*
+ * ext4bf: wait for the data runs of the committing transaction and release
+ * them.  Their tags must have been logged already.
+ */
+static int journal_finish_data_runs(journal_t *journal,
+				    transaction_bf_t *commit_transaction)
+{
+	struct jbdbf_data_run *run, *next;
+	unsigned int i;
+	int ret = 0;
+
+	list_for_each_entry_safe(run, next, &commit_transaction->t_data_runs,
+				 dr_list) {
+		for (i = 0; i < run->dr_len; i++) {
+			struct buffer_head *bh = run->dr_bh[i];
+
+			if (!bh)
+				continue;
+			wait_on_buffer(bh);
+			if (unlikely(!buffer_uptodate(bh)))
+				ret = -EIO;
+			put_bh(bh);
+		}
+		list_del(&run->dr_list);
+		jbdbf_free_data_run(run);
+		cond_resched();
+	}
+	return ret;
+}
+
 /*
  * jbdbf_journal_commit_transaction
  *
@@ -400,6 +746,10 @@ void jbdbf_journal_commit_transaction(journal_t *journal)
 	struct buffer_head *cbh = NULL; /* For transactional checksums */
 	__u32 crc32_sum = ~0;
 	__u32 crc32_data_sum = ~0;
+	int inline_commit = jbdbf_has_inline_commit(journal);
+	struct jbdbf_data_run *tag_run = NULL;	/* next data run to log */
+	unsigned int tag_idx = 0;
+	int committed_inline = 0, inline_bufs = 0;
 #if PLUG_736
 	struct blk_plug plug;
 #endif
@@ -425,6 +775,13 @@ void jbdbf_journal_commit_transaction(journal_t *journal)
 	J_ASSERT(commit_transaction->t_state == T_RUNNING);
 
     int durable_commit = commit_transaction->t_durable_commit;
+	/*
+	 * ext4bf: barrier-free ordered mode.  Unless the commit has to be
+	 * durable, ordered data is checksummed into the descriptors and only
+	 * waited for once the commit record is out.
+	 */
+	int ordered_csum = (journal->j_flags & JBD2_ORDERED_CSUM) &&
+			   durable_commit != 1;
 
     mutex_lock(&commit_transaction->t_dirty_data_mutex);
 	jbd_debug(1, "JBD2: starting commit of transaction %d\n",
@@ -514,6 +871,18 @@ void jbdbf_journal_commit_transaction(journal_t *journal)
 	stats.run.rs_locked = jbdbf_time_diff(stats.run.rs_locked,
 					     stats.run.rs_flushing);
 
+	/*
+	 * ext4bf: no handle can touch this transaction any more, so collect
+	 * the data buffers staged per-CPU before a new transaction starts
+	 * staging its own.
+	 */
+	spin_lock(&journal->j_list_lock);
+	__jbdbf_journal_merge_dirty_data(commit_transaction);
+	spin_unlock(&journal->j_list_lock);
+
+	if (journal->j_lock_callback)
+		journal->j_lock_callback(journal, commit_transaction);
+
 	commit_transaction->t_state = T_FLUSH;
 	journal->j_committing_transaction = commit_transaction;
 	journal->j_running_transaction = NULL;
@@ -574,13 +943,23 @@ void jbdbf_journal_commit_transaction(journal_t *journal)
     jbd_debug(6, "EXT4BF: Ending the issue of data blocks\n");
 #endif
 
+	/*
+	 * ext4bf: data runs are a journal feature of their own, and must
+	 * not depend on DCHECKSUM, which only ext4bf.h defines.
+	 */
+	journal_submit_data_runs(journal, commit_transaction);
+	if (!list_empty(&commit_transaction->t_data_runs))
+		tag_run = list_first_entry(&commit_transaction->t_data_runs,
+					   struct jbdbf_data_run, dr_list);
+
     TIMESTAMP("END", "phase 3","");
     TIMESTAMP("START", "phase 4","");
 	/*
 	 * Now start flushing things to disk, in the order they appear
 	 * on the transaction lists.  Data blocks go first.
 	 */
-	err = journal_submit_data_buffers(journal, commit_transaction);
+	err = journal_submit_data_buffers(journal, commit_transaction,
+					  &ordered_csum);
 	if (err){
 	    jbd_debug(6, "EXT4BF: aborting journal because of errors in journal_submit_inode_data_buffers");
 		jbdbf_journal_abort(journal, err);
@@ -686,6 +1065,9 @@ void jbdbf_journal_commit_transaction(journal_t *journal)
 
 			tagp = &bh->b_data[sizeof(journal_bf_header_t)];
 			space_left = bh->b_size - sizeof(journal_bf_header_t);
+			/* ext4bf: keep room for a folded commit record. */
+			if (inline_commit)
+				space_left -= sizeof(struct commit_header);
 			first_tag = 1;
 			set_buffer_jwrite(bh);
 			set_buffer_dirty(bh);
@@ -732,8 +1114,15 @@ void jbdbf_journal_commit_transaction(journal_t *journal)
                 list_del(l);
                 jbdbf_free_data_tag(entry);
             }
+
             TIMESTAMP1("END", "phase 5","1D");
 #endif
+            /* Then the data runs; tag_run/tag_idx carry over to the next
+             * descriptor if this one fills up. */
+            if (journal_tag_data_runs(journal, commit_transaction,
+                                      &tag_run, &tag_idx, &tagp, &space_left,
+                                      &first_tag, &tag))
+                goto done_with_tags;
         TIMESTAMP("END", "5","1");
         }
         /* Where is the buffer to be written? */
@@ -834,6 +1223,22 @@ done_with_tags:
 			tag->t_flags |= cpu_to_be32(JBD2_FLAG_LAST_TAG);
             TIMESTAMP1("END", "phase 5","3A");
 start_journal_io:
+			/*
+			 * ext4bf: on a fast journal device the last batch of
+			 * the transaction carries its own commit record, so
+			 * the commit goes out together with the blocks it
+			 * covers instead of after them.  The batch is held
+			 * back until the data is waited for and flushed.
+			 */
+			if (inline_commit && descriptor && bufs &&
+			    commit_transaction->t_buffers == NULL &&
+			    !is_journal_aborted(journal)) {
+				committed_inline = 1;
+				inline_bufs = bufs;
+				descriptor = NULL;
+				bufs = 0;
+				continue;
+			}
 			for (i = 0; i < bufs; i++) {
 				struct buffer_head *bh = wbuf[i];
 				/*
@@ -864,16 +1269,69 @@ start_journal_io:
 		}
 	}
 
+	/*
+	 * ext4bf: the data run tags only go into the descriptors of logged
+	 * metadata.  Runs left over, all of them when the transaction logs
+	 * no metadata, get descriptor blocks of their own.  (A held back
+	 * inline commit batch never leaves any: the last descriptor before
+	 * it took every tag.)
+	 */
+	while (!committed_inline && !is_journal_aborted(journal) &&
+	       journal_next_run_tag(commit_transaction, &tag_run, &tag_idx)) {
+		struct buffer_head *bh;
+
+		descriptor = jbdbf_journal_get_descriptor_buffer(journal);
+		if (!descriptor) {
+			jbdbf_journal_abort(journal, -EIO);
+			break;
+		}
+		bh = jh2bhbf(descriptor);
+		header = (journal_bf_header_t *)&bh->b_data[0];
+		header->h_magic     = cpu_to_be32(JBD2_MAGIC_NUMBER);
+		header->h_blocktype = cpu_to_be32(JBD2_DESCRIPTOR_BLOCK);
+		header->h_sequence  = cpu_to_be32(commit_transaction->t_tid);
+		tagp = &bh->b_data[sizeof(journal_bf_header_t)];
+		space_left = bh->b_size - sizeof(journal_bf_header_t);
+		first_tag = 1;
+		journal_tag_data_runs(journal, commit_transaction, &tag_run,
+				      &tag_idx, &tagp, &space_left, &first_tag,
+				      &tag);
+		tag->t_flags |= cpu_to_be32(JBD2_FLAG_LAST_TAG);
+
+		set_buffer_jwrite(bh);
+		BUFFER_TRACE(bh, "ph3: file as descriptor");
+		jbdbf_journal_file_buffer(descriptor, commit_transaction,
+					 BJ_LogCtl);
+		if (JBD2_HAS_COMPAT_FEATURE(journal,
+					    JBD2_FEATURE_COMPAT_CHECKSUM))
+			crc32_sum = jbdbf_checksum_data(crc32_sum, bh);
+		lock_buffer(bh);
+		clear_buffer_dirty(bh);
+		set_buffer_uptodate(bh);
+		bh->b_end_io = journal_end_buffer_io_sync;
+		submit_bh(WRITE_SYNC, bh);
+		stats.run.rs_blocks_logged++;
+	}
+	descriptor = NULL;
+
         TIMESTAMP1("START", "phase 5","3D");
-	err = journal_finish_inode_data_buffers(journal, commit_transaction);
-	if (err) {
-		printk(KERN_WARNING
-			"JBD2: Detected IO errors while flushing file data "
-		       "on %s\n", journal->j_devname);
-		if (journal->j_flags & JBD2_ABORT_ON_SYNCDATA_ERR)
-			jbdbf_journal_abort(journal, err);
-		err = 0;
+	/*
+	 * ext4bf: tags that found no room in a descriptor (or no descriptor
+	 * at all) can't be verified by recovery, so the data they cover is
+	 * ordered by waiting for it after all.
+	 */
+	if (!list_empty(&commit_transaction->t_data_tag_list)) {
+		struct jbdbf_data_tag *dtag, *next_tag;
+
+		list_for_each_entry_safe(dtag, next_tag,
+				&commit_transaction->t_data_tag_list, list) {
+			list_del(&dtag->list);
+			jbdbf_free_data_tag(dtag);
+		}
+		ordered_csum = 0;
 	}
+	if (!ordered_csum)
+		journal_finish_ordered_data(journal, commit_transaction);
         TIMESTAMP1("END", "phase 5","3D");
     TIMESTAMP("END", "phase 5","3");
 wait_for_data:
@@ -901,6 +1359,8 @@ wait_for_data:
         JBUFFER_TRACE(jh, "ph4: unfile after journal write");
         jbdbf_journal_refile_buffer(journal, jh);
     }
+	if (journal_finish_data_runs(journal, commit_transaction))
+		err = -EIO;
 
 	write_lock(&journal->j_state_lock);
 	J_ASSERT(commit_transaction->t_state == T_COMMIT);
@@ -919,10 +1379,25 @@ wait_for_data:
 	    (journal->j_flags & JBD2_BARRIER))
 		blkdev_issue_flush(journal->j_fs_dev, GFP_KERNEL, NULL);
 
+	/*
+	 * ext4bf: a durable commit on a fast journal device must also make
+	 * the in-place data on the file system device durable, since the
+	 * journal flush below only covers j_dev.
+	 */
+	if ((durable_commit == 1) && (journal->j_flags & JBD2_FAST_DEV) &&
+	    (journal->j_fs_dev != journal->j_dev))
+		blkdev_issue_flush(journal->j_fs_dev, GFP_KERNEL, NULL);
+
     TIMESTAMP1("END", "phase 5","5A");
     TIMESTAMP1("START", "phase 5","5B");
+	if (committed_inline) {
+		journal_submit_inline_commit(journal, commit_transaction,
+					     inline_bufs, crc32_sum);
+		stats.run.rs_blocks_logged += inline_bufs;
+	}
 	/* Done it all: now write the commit record asynchronously. */
-	if (JBD2_HAS_INCOMPAT_FEATURE(journal,
+	if (!committed_inline &&
+	    JBD2_HAS_INCOMPAT_FEATURE(journal,
 				      JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT)) {
 		err = journal_submit_commit_record(journal, commit_transaction,
 						 &cbh, crc32_sum);
@@ -1059,7 +1534,8 @@ wait_for_iobuf:
 	commit_transaction->t_state = T_COMMIT_JFLUSH;
 	write_unlock(&journal->j_state_lock);
 
-	if (!JBD2_HAS_INCOMPAT_FEATURE(journal,
+	if (!committed_inline &&
+	    !JBD2_HAS_INCOMPAT_FEATURE(journal,
 				       JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT)) {
 		err = journal_submit_commit_record(journal, commit_transaction,
 						&cbh, crc32_sum);
@@ -1069,8 +1545,12 @@ wait_for_iobuf:
 	if (cbh)
 		err = journal_wait_on_commit_record(journal, cbh);
 
-	if ((JBD2_HAS_INCOMPAT_FEATURE(journal,
-				      JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT) &&
+	/* ext4bf: the commit record did not wait for ordered data. */
+	if (ordered_csum)
+		journal_finish_ordered_data(journal, commit_transaction);
+
+	if (((committed_inline || JBD2_HAS_INCOMPAT_FEATURE(journal,
+				      JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT)) &&
 	    journal->j_flags & JBD2_BARRIER)
 	    || (durable_commit == 1))
 	{
@@ -1201,6 +1681,8 @@ restart_loop:
                 clear_buffer_jbddirty(bh);
         } else {
             J_ASSERT_BH(bh, !buffer_dirty(bh));
+            /* freed: nothing left for the delayed checkpoint to write */
+            jbdbf_cancel_delayed_write(bh);
                 /*
                  * The buffer on BJ_Forget list and not jbddirty means
                  * it has been freed by this transaction and hence it
@@ -0,0 +1,278 @@
+/*
+ *  linux/fs/ext4bf/defrag.c
+ *
+ * Background defragmentation.
+ *
+ * ext4bf_ext_map_blocks() counts, per inode, the allocations that could
+ * not continue the extent before them on disk.  Once a file has more of
+ * those per megabyte than s_defrag_frags_per_mb it is queued by inode
+ * number, and a per-sb kernel thread later rewrites it with the same
+ * move-extent code EXT4_IOC_MOVE_EXT uses: the range is preallocated in
+ * an unlinked donor inode and, if that came out in fewer pieces, the
+ * donor's blocks are swapped in.  The orig's old blocks go back with the
+ * donor when it is evicted.
+ *
+ * The thread wakes every s_defrag_interval seconds and works only while
+ * the device has no requests in flight, moving at most s_defrag_max_mb
+ * per pass; a larger file is requeued where it stopped.  Sparse files
+ * and ranges with delayed blocks are left alone.
+ */
+
+#include <linux/fs.h>
+#include <linux/genhd.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/quotaops.h>
+#include "ext4bf.h"
+#include "ext4bf_extents.h"
+#include "ext4bf_jbdbf.h"
+
+static void ext4bf_defrag_queue(struct super_block *sb, unsigned long ino,
+				ext4bf_lblk_t next)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+	struct ext4bf_defrag_entry *de;
+	unsigned int i;
+
+	spin_lock(&sbi->s_defrag_lock);
+	for (i = 0; i < sbi->s_defrag_nr; i++)
+		if (sbi->s_defrag_queue[i].de_ino == ino)
+			goto out;
+	/* a full queue drops the file; it is queued again on its next
+	 * discontiguous allocation */
+	if (sbi->s_defrag_nr < EXT4_DEFRAG_QUEUE_LEN) {
+		de = &sbi->s_defrag_queue[sbi->s_defrag_nr++];
+		de->de_ino = ino;
+		de->de_next = next;
+	}
+out:
+	spin_unlock(&sbi->s_defrag_lock);
+}
+
+static int ext4bf_defrag_dequeue(struct ext4bf_sb_info *sbi,
+				 struct ext4bf_defrag_entry *de)
+{
+	int ret = 0;
+
+	spin_lock(&sbi->s_defrag_lock);
+	if (sbi->s_defrag_nr) {
+		*de = sbi->s_defrag_queue[0];
+		sbi->s_defrag_nr--;
+		memmove(&sbi->s_defrag_queue[0], &sbi->s_defrag_queue[1],
+			sbi->s_defrag_nr * sizeof(*de));
+		ret = 1;
+	}
+	spin_unlock(&sbi->s_defrag_lock);
+	return ret;
+}
+
+/*
+ * Called by ext4bf_ext_map_blocks() when a new extent could not be
+ * allocated right after the one before it.
+ */
+void ext4bf_defrag_note_alloc(struct inode *inode)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(inode->i_sb);
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	loff_t mb;
+
+	ei->i_frag_score++;
+	if (!test_opt2(inode->i_sb, AUTO_DEFRAG) || !S_ISREG(inode->i_mode))
+		return;
+	mb = max_t(loff_t, i_size_read(inode) >> 20, 1);
+	if (ei->i_frag_score > mb * sbi->s_defrag_frags_per_mb)
+		ext4bf_defrag_queue(inode->i_sb, inode->i_ino, 0);
+}
+
+/*
+ * Count the physically discontiguous pieces of [lblk, lblk + len).
+ * Returns -ENODATA if some of it is not allocated.
+ */
+static int ext4bf_defrag_count(struct inode *inode, ext4bf_lblk_t lblk,
+			       ext4bf_lblk_t len)
+{
+	struct ext4bf_map_blocks map;
+	ext4bf_fsblk_t next_pblk = 0;
+	int frags = 0, ret;
+
+	while (len) {
+		map.m_lblk = lblk;
+		map.m_len = len;
+		ret = ext4bf_map_blocks(NULL, inode, &map, 0);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			return -ENODATA;
+		if (map.m_pblk != next_pblk)
+			frags++;
+		next_pblk = map.m_pblk + ret;
+		lblk += ret;
+		len -= ret;
+	}
+	return frags;
+}
+
+/*
+ * Move [lblk, lblk + len) of @inode to freshly allocated blocks if that
+ * leaves it in fewer pieces.
+ */
+static int ext4bf_defrag_range(struct inode *inode, ext4bf_lblk_t lblk,
+			       ext4bf_lblk_t len)
+{
+	struct ext4bf_map_blocks map;
+	struct inode *donor;
+	handle_t *handle;
+	__u64 moved = 0;
+	int flags, frags, ret, err = 0;
+
+	frags = ext4bf_defrag_count(inode, lblk, len);
+	if (frags <= 1)
+		return frags;
+
+	donor = ext4bf_new_orphan_inode(inode);
+	if (IS_ERR(donor))
+		return PTR_ERR(donor);
+	i_size_write(donor, i_size_read(inode));
+
+	flags = EXT4_GET_BLOCKS_CREATE_UNINIT_EXT;
+	if (len <= EXT_UNINIT_MAX_LEN)
+		flags |= EXT4_GET_BLOCKS_NO_NORMALIZE;
+	map.m_lblk = lblk;
+	while (map.m_lblk < lblk + len) {
+		map.m_len = lblk + len - map.m_lblk;
+		handle = ext4bf_journal_start(donor,
+				ext4bf_chunk_trans_blocks(donor, map.m_len));
+		if (IS_ERR(handle)) {
+			err = PTR_ERR(handle);
+			goto out;
+		}
+		ret = ext4bf_map_blocks(handle, donor, &map, flags);
+		ext4bf_mark_inode_dirty(handle, donor);
+		err = ext4bf_journal_stop(handle);
+		if (ret <= 0)
+			err = ret ? ret : -ENOSPC;
+		if (err)
+			goto out;
+		map.m_lblk += ret;
+	}
+
+	/* not worth the copy if free space is no less fragmented */
+	ret = ext4bf_defrag_count(donor, lblk, len);
+	if (ret < 0 || ret >= frags)
+		goto out;
+
+	err = ext4bf_move_extents(inode, donor, lblk, lblk, len, &moved);
+	ext_debug("defrag inode %lu: %u blocks at %u, %d -> %d pieces, "
+		  "moved %llu, err %d\n", inode->i_ino, len, lblk, frags, ret,
+		  moved, err);
+out:
+	iput(donor);
+	return err;
+}
+
+/*
+ * Work on the queued file for at most @budget blocks, requeueing it if
+ * there is more to do.  Returns the number of blocks looked at.
+ */
+static long ext4bf_defrag_file(struct super_block *sb,
+			       struct ext4bf_defrag_entry *de, long budget)
+{
+	struct inode *inode;
+	ext4bf_lblk_t nblocks, len = 0;
+	int err;
+
+	inode = ext4bf_iget(sb, de->de_ino);
+	if (IS_ERR(inode))
+		return 0;
+	if (!S_ISREG(inode->i_mode) || !inode->i_nlink ||
+	    IS_SWAPFILE(inode) || IS_IMMUTABLE(inode) ||
+	    !ext4bf_test_inode_flag(inode, EXT4_INODE_EXTENTS) ||
+	    ext4bf_has_inline_data(inode))
+		goto out;
+
+	nblocks = (i_size_read(inode) + sb->s_blocksize - 1) >>
+		  sb->s_blocksize_bits;
+	/* the donor would fill in the holes of a sparse file */
+	if (inode->i_blocks <
+	    ((blkcnt_t)nblocks << (sb->s_blocksize_bits - 9)))
+		goto done;
+	if (de->de_next >= nblocks)
+		goto done;
+
+	len = min_t(long, nblocks - de->de_next, budget);
+	err = ext4bf_defrag_range(inode, de->de_next, len);
+	if (!err && de->de_next + len < nblocks) {
+		ext4bf_defrag_queue(sb, de->de_ino, de->de_next + len);
+		goto out;
+	}
+done:
+	EXT4_I(inode)->i_frag_score = 0;
+out:
+	iput(inode);
+	return len;
+}
+
+static int ext4bf_defrag_thread(void *data)
+{
+	struct super_block *sb = data;
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+	struct ext4bf_defrag_entry de;
+	long budget;
+
+	set_freezable();
+	while (!kthread_should_stop()) {
+		schedule_timeout_interruptible(
+				max(sbi->s_defrag_interval, 1U) * HZ);
+		try_to_freeze();
+
+		budget = (long)sbi->s_defrag_max_mb <<
+			 (20 - sb->s_blocksize_bits);
+		while (budget > 0 && !kthread_should_stop() &&
+		       !part_in_flight(sb->s_bdev->bd_part) &&
+		       ext4bf_defrag_dequeue(sbi, &de))
+			budget -= ext4bf_defrag_file(sb, &de, budget);
+	}
+	return 0;
+}
+
+/*
+ * Start the defragmenter if auto_defrag is set and the fs is writable.
+ */
+void ext4bf_defrag_start(struct super_block *sb)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+	struct task_struct *tsk;
+
+	if (sbi->s_defrag_tsk || !test_opt2(sb, AUTO_DEFRAG) ||
+	    (sb->s_flags & MS_RDONLY))
+		return;
+	if (!EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_EXTENTS) ||
+	    EXT4_HAS_RO_COMPAT_FEATURE(sb, EXT4_FEATURE_RO_COMPAT_BIGALLOC)) {
+		ext4bf_msg(sb, KERN_WARNING, "auto_defrag needs extents "
+			   "and does not support bigalloc");
+		return;
+	}
+
+	tsk = kthread_run(ext4bf_defrag_thread, sb, "ext4bf-defrag/%s",
+			  sb->s_id);
+	if (IS_ERR(tsk)) {
+		ext4bf_msg(sb, KERN_WARNING, "unable to start defrag "
+			   "thread: %ld", PTR_ERR(tsk));
+		return;
+	}
+	sbi->s_defrag_tsk = tsk;
+}
+
+/*
+ * Stop the defragmenter.  It holds inode references while it works, so
+ * this must run before the inodes are evicted at unmount.
+ */
+void ext4bf_defrag_stop(struct super_block *sb)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+
+	if (sbi->s_defrag_tsk) {
+		kthread_stop(sbi->s_defrag_tsk);
+		sbi->s_defrag_tsk = NULL;
+	}
+}
@@ -118,6 +118,8 @@ typedef __u32 ext4bf_lblk_t;
 /* data type for block group number */
 typedef unsigned int ext4bf_group_t;
 
+#include "extents_status.h"
+
 /*
  * Flags used in mballoc's allocation_context flags field.
  *
@@ -224,7 +226,6 @@ struct mpage_da_data {
  */
 #define	EXT4_IO_END_UNWRITTEN	0x0001
 #define EXT4_IO_END_ERROR	0x0002
-#define EXT4_IO_END_QUEUED	0x0004
 
 struct ext4bf_io_page {
 	struct page	*p_page;
@@ -240,9 +241,10 @@ typedef struct ext4bf_io_end {
 	struct page		*page;		/* page struct for buffer write */
 	loff_t			offset;		/* offset in the file */
 	ssize_t			size;		/* size of the extent */
-	struct work_struct	work;		/* data work queue */
 	struct kiocb		*iocb;		/* iocb struct for AIO */
 	int			result;		/* error value for AIO */
+	atomic_t		count;		/* bios in flight + builder */
+	int			bio_error;	/* error of a completed bio */
 	int			num_io_pages;
 	struct ext4bf_io_page	*pages[MAX_IO_PAGES];
 } ext4bf_io_end_t;
@@ -412,6 +414,7 @@ struct flex_groups {
 #define EXT4_EXTENTS_FL			0x00080000 /* Inode uses extents */
 #define EXT4_EA_INODE_FL	        0x00200000 /* Inode used for large EA */
 #define EXT4_EOFBLOCKS_FL		0x00400000 /* Blocks allocated beyond EOF */
+#define EXT4_INLINE_DATA_FL		0x10000000 /* Inode has inline data. */
 #define EXT4_RESERVED_FL		0x80000000 /* reserved for ext4bf lib */
 
 #define EXT4_FL_USER_VISIBLE		0x004BDFFF /* User visible flags */
@@ -468,6 +471,7 @@ enum {
 	EXT4_INODE_EXTENTS	= 19,	/* Inode uses extents */
 	EXT4_INODE_EA_INODE	= 21,	/* Inode used for large EA */
 	EXT4_INODE_EOFBLOCKS	= 22,	/* Blocks allocated beyond EOF */
+	EXT4_INODE_INLINE_DATA	= 28,	/* Data in inode. */
 	EXT4_INODE_RESERVED	= 31,	/* reserved for ext4bf lib */
 };
 
@@ -514,6 +518,7 @@ static inline void ext4bf_check_flag_values(void)
 	CHECK_FLAG_VALUE(EXTENTS);
 	CHECK_FLAG_VALUE(EA_INODE);
 	CHECK_FLAG_VALUE(EOFBLOCKS);
+	CHECK_FLAG_VALUE(INLINE_DATA);
 	CHECK_FLAG_VALUE(RESERVED);
 }
 
@@ -822,6 +827,8 @@ struct ext4bf_ext_cache {
 /*
  * fourth extended file system inode data in memory
  */
+struct ext4bf_dio_tags;
+
 struct ext4bf_inode_info {
 	__le32	i_data[15];	/* unconverted */
 	__u32	i_dtime;
@@ -853,6 +860,8 @@ struct ext4bf_inode_info {
 #endif
 
 	struct list_head i_orphan;	/* unlinked but open inodes */
+	unsigned int i_orphan_idx;	/* slot in the orphan file */
+	struct list_head i_async_free;	/* on s_async_free_list */
 
 	/*
 	 * i_disksize keeps track of what the inode size is ON DISK, not
@@ -885,7 +894,14 @@ struct ext4bf_inode_info {
 	struct inode vfs_inode;
 	struct jbdbf_inode *jinode;
 
-	struct ext4bf_ext_cache i_cached_extent;
+	/* extent status tree, protected by i_es_lock */
+	struct ext4bf_es_tree i_es_tree;
+	rwlock_t i_es_lock;
+	struct list_head i_es_lru;	/* on sbi->s_es_lru */
+	unsigned int i_es_lru_nr;	/* extents in i_es_tree */
+
+	/* allocations that did not continue the previous extent */
+	unsigned int i_frag_score;
 	/*
 	 * File creation time. Its function is same as that of
 	 * struct timespec i_{a,c,m}time in the generic inode.
@@ -918,9 +934,13 @@ struct ext4bf_inode_info {
 	/* completed IOs that might need unwritten extents handling */
 	struct list_head i_completed_io_list;
 	spinlock_t i_completed_io_lock;
+	/* converts everything on i_completed_io_list in one go */
+	struct work_struct i_unwritten_work;
 	atomic_t i_ioend_count;	/* Number of outstanding io_end structs */
 	/* current io_end structure for async DIO write*/
 	ext4bf_io_end_t *cur_aio_dio;
+	/* ext4bf: tags of the journalled O_DIRECT write [i_mutex] */
+	struct ext4bf_dio_tags *i_dio_tags;
 	atomic_t i_aiodio_unwritten; /* Nr. of inflight conversions pending */
 
 	spinlock_t i_block_reservation_lock;
@@ -931,6 +951,39 @@ struct ext4bf_inode_info {
 	 */
 	tid_t i_sync_tid;
 	tid_t i_datasync_tid;
+	/* transaction that created the inode, if EXT4_STATE_CREATED */
+	tid_t i_create_tid;
+
+	/*
+	 * ext4bf: multi-page buffered write in progress [i_mutex]: the
+	 * task doing it, its size and end, and the last block mapping,
+	 * reused by the following pages.
+	 */
+	struct task_struct *i_write_task;
+	size_t i_write_len;
+	loff_t i_write_end;
+	struct ext4bf_map_blocks i_write_map;
+	int i_write_orphan;
+
+	/*
+	 * ext4bf: redirect_write of the page that write is at [i_mutex]:
+	 * between write_begin and write_end, i_redirect_len new blocks from
+	 * i_redirect_new map i_redirect_lblk in place of those from
+	 * i_redirect_old.
+	 */
+	ext4bf_lblk_t i_redirect_lblk;
+	ext4bf_fsblk_t i_redirect_old;
+	ext4bf_fsblk_t i_redirect_new;
+	unsigned int i_redirect_len;
+
+	/*
+	 * ext4bf: the raw inode at i_deferred_offset in i_deferred_bh is
+	 * already part of the running transaction and is refreshed when it
+	 * locks for commit [s_deferred_lock].
+	 */
+	struct list_head i_deferred_list;
+	struct buffer_head *i_deferred_bh;
+	unsigned long i_deferred_offset;
 };
 
 /*
@@ -984,6 +1037,20 @@ struct ext4bf_inode_info {
 
 #define EXT4_MOUNT2_EXPLICIT_DELALLOC	0x00000001 /* User explicitly
 						      specified delalloc */
+#define EXT4_MOUNT2_JOURNAL_FAST_DEV	0x00000002 /* External journal is
+						      on a fast device */
+#define EXT4_MOUNT2_LAZYTIME		0x00000004 /* Keep timestamp-only
+						      updates in memory */
+#define EXT4_MOUNT2_ORDERED_CSUM	0x00000008 /* Checksum ordered data
+						      instead of waiting on it
+						      before commit */
+#define EXT4_MOUNT2_NO_PREFETCH_BLOCK_BITMAPS	0x00000010 /* Don't warm
+						      buddies after mount */
+#define EXT4_MOUNT2_AUTO_DEFRAG		0x00000020 /* Defragment fragmented
+						      files in the background */
+#define EXT4_MOUNT2_ASYNC_FREE		0x00000040 /* Free the blocks of large
+						      deleted files in the
+						      background */
 
 #define clear_opt(sb, opt)		EXT4_SB(sb)->s_mount_opt &= \
 						~EXT4_MOUNT_##opt
@@ -1136,11 +1203,30 @@ struct ext4bf_super_block {
 	__le32	s_usr_quota_inum;	/* inode for tracking user quota */
 	__le32	s_grp_quota_inum;	/* inode for tracking group quota */
 	__le32	s_overhead_clusters;	/* overhead blocks/clusters in fs */
-	__le32  s_reserved[109];        /* Padding to the end of the block */
+	__le32	s_reserved_pad2[13];	/* fields this fs does not use */
+	__le32	s_orphan_file_inum;	/* inode for tracking orphan inodes */
+	__le32  s_reserved[95];         /* Padding to the end of the block */
 };
 
 #define EXT4_S_ERR_LEN (EXT4_S_ERR_END - EXT4_S_ERR_START)
 
+/*
+ * Each block of the orphan file is an array of inode numbers, 0 for a
+ * free slot, followed by this tail.
+ */
+#define EXT4_ORPHAN_BLOCK_MAGIC 0x0b10ca04
+
+struct ext4bf_orphan_block_tail {
+	__le32 ob_magic;
+	__le32 ob_checksum;	/* only with metadata_csum, not checked here */
+};
+
+static inline int ext4bf_inodes_per_orphan_block(unsigned long blocksize)
+{
+	return (blocksize - sizeof(struct ext4bf_orphan_block_tail)) /
+		sizeof(__u32);
+}
+
 #ifdef __KERNEL__
 
 /*
@@ -1149,6 +1235,43 @@ struct ext4bf_super_block {
 #define EXT4_MF_MNTDIR_SAMPLED	0x0001
 #define EXT4_MF_FS_ABORTED	0x0002	/* Fatal error detected */
 
+/*
+ * Per-CPU position of the last inode allocation, see find_group_other()
+ */
+struct ext4bf_inode_cursor {
+	ext4bf_group_t	ic_group;	/* ~0 if none yet */
+	unsigned long	ic_ino;		/* next bit to try in ic_group */
+};
+
+/*
+ * A file waiting for the background defragmenter, see defrag.c
+ */
+struct ext4bf_defrag_entry {
+	unsigned long	de_ino;
+	ext4bf_lblk_t	de_next;	/* first block not looked at yet */
+};
+
+#define EXT4_DEFRAG_QUEUE_LEN	32
+#define EXT4_DEFRAG_FRAGS_PER_MB	8
+#define EXT4_DEFRAG_MAX_MB		64
+#define EXT4_DEFRAG_INTERVAL		30	/* seconds */
+
+#define EXT4_ASYNC_FREE_MIN_MB		256
+#define EXT4_ASYNC_FREE_CHUNK_MB	128
+
+/*
+ * The orphan file, read in at mount and pinned, see namei.c
+ */
+struct ext4bf_orphan_block {
+	atomic_t ob_free_entries;	/* free slots in the block */
+	struct buffer_head *ob_bh;
+};
+
+struct ext4bf_orphan_info {
+	int of_blocks;			/* 0 without an orphan file */
+	struct ext4bf_orphan_block *of_binfo;
+};
+
 /*
  * fourth extended-fs super-block data in memory
  */
@@ -1194,6 +1317,7 @@ struct ext4bf_sb_info {
 	struct percpu_counter s_freeinodes_counter;
 	struct percpu_counter s_dirs_counter;
 	struct percpu_counter s_dirtyclusters_counter;
+	struct ext4bf_inode_cursor __percpu *s_inode_cursor;
 	struct blockgroup_lock *s_blockgroup_lock;
 	struct proc_dir_entry *s_proc;
 	struct kobject s_kobj;
@@ -1203,6 +1327,7 @@ struct ext4bf_sb_info {
 	struct journal_s *s_journal;
 	struct list_head s_orphan;
 	struct mutex s_orphan_lock;
+	struct ext4bf_orphan_info s_orphan_info;
 	unsigned long s_resize_flags;		/* Flags indicating if there
 						   is a resizer */
 	unsigned long s_commit_interval;
@@ -1214,7 +1339,8 @@ struct ext4bf_sb_info {
 	int s_jquota_fmt;			/* Format of quota to use */
 #endif
 	unsigned int s_want_extra_isize; /* New inodes should reserve # bytes */
-	struct rb_root system_blks;
+	struct ext4bf_system_blocks __rcu *system_blks;
+	struct mutex s_system_zone_mutex;	/* serializes system_blks updates */
 
 #ifdef EXTENTS_STATS
 	/* ext4bf extents stats */
@@ -1229,6 +1355,12 @@ struct ext4bf_sb_info {
 	unsigned long extent_cache_hits;
 	unsigned long extent_cache_misses;
 
+	/* reclaim of extent status trees */
+	struct shrinker s_es_shrinker;
+	struct list_head s_es_lru;	/* inodes with cached extents */
+	spinlock_t s_es_lru_lock;
+	struct percpu_counter s_extent_cache_cnt;
+
 	/* for buddy allocator */
 	struct ext4bf_group_info ***s_group_info;
 	struct inode *s_buddy_cache;
@@ -1238,12 +1370,31 @@ struct ext4bf_sb_info {
 
 	/* tunables */
 	unsigned long s_stripe;
+	unsigned long s_redirect_write;	/* ext4bf: overwrite size (bytes) from
+					   which blocks are redirected, 0=off */
+	/* ext4bf: inodes whose raw copy is redone at commit */
+	struct list_head s_deferred_inodes;
+	spinlock_t s_deferred_lock;
 	unsigned int s_mb_stream_request;
 	unsigned int s_mb_max_to_scan;
 	unsigned int s_mb_min_to_scan;
 	unsigned int s_mb_stats;
 	unsigned int s_mb_order2_reqs;
 	unsigned int s_mb_group_prealloc;
+	unsigned int s_mb_optimize_scan;
+	/* initialised groups, indexed by largest free order and by the
+	 * order of their average fragment size */
+	struct list_head *s_mb_largest_free_orders;
+	rwlock_t *s_mb_largest_free_orders_locks;
+	struct list_head *s_mb_avg_fragment_size;
+	rwlock_t *s_mb_avg_fragment_size_locks;
+	atomic_t s_mb_uninit_groups;	/* groups not in the index yet */
+	/* background buddy prefetch after mount */
+	struct workqueue_struct *s_mb_prefetch_wq;
+	struct ext4bf_mb_prefetch *s_mb_prefetch;
+	atomic_t s_mb_prefetch_next;	/* first group of the next batch */
+	atomic_t s_mb_prefetch_active;	/* workers still running */
+	int s_mb_prefetch_stop;
 	unsigned int s_max_writeback_mb_bump;
 	/* where last allocation was done - for stream allocation */
 	unsigned long s_mb_last_group;
@@ -1289,8 +1440,30 @@ struct ext4bf_sb_info {
 	/* Kernel thread for multiple mount protection */
 	struct task_struct *s_mmp_tsk;
 
+	/* Background defragmentation */
+	struct task_struct *s_defrag_tsk;
+	spinlock_t s_defrag_lock;
+	unsigned int s_defrag_nr;
+	struct ext4bf_defrag_entry s_defrag_queue[EXT4_DEFRAG_QUEUE_LEN];
+	unsigned int s_defrag_frags_per_mb;	/* queue files above this */
+	unsigned int s_defrag_max_mb;	/* moved per pass */
+	unsigned int s_defrag_interval;	/* seconds between passes */
+
+	/* Background freeing of large deleted files */
+	struct task_struct *s_async_free_tsk;
+	spinlock_t s_async_free_lock;
+	struct list_head s_async_free_list;
+	unsigned long s_async_free_busy;	/* inode the thread works on */
+	wait_queue_head_t s_async_free_wait;	/* for the queue to drain */
+	unsigned int s_async_free_min_mb;	/* smaller files freed inline */
+	unsigned int s_async_free_chunk_mb;	/* truncated per step */
+
 	/* record the last minlen when FITRIM is called. */
 	atomic_t s_last_trim_minblks;
+
+	/* discard batches not yet released to the buddy */
+	atomic_t s_discard_batches;
+	wait_queue_head_t s_discard_wait;
 };
 
 static inline struct ext4bf_sb_info *EXT4_SB(struct super_block *sb)
@@ -1339,6 +1512,11 @@ enum {
 	EXT4_STATE_DIO_UNWRITTEN,	/* need convert on dio done*/
 	EXT4_STATE_NEWENTRY,		/* File just added to dir */
 	EXT4_STATE_DELALLOC_RESERVED,	/* blks already reserved for delalloc */
+	EXT4_STATE_MAY_INLINE_DATA,	/* may have in-inode data */
+	EXT4_STATE_LAZY_TIME,		/* timestamps dirty in memory only */
+	EXT4_STATE_ORPHAN_FILE,		/* inode is in the orphan file */
+	EXT4_STATE_FREE_NOW,		/* don't queue for async_free again */
+	EXT4_STATE_CREATED,		/* holds only blocks since i_create_tid */
 };
 
 #define EXT4_INODE_BIT_FNS(name, field, offset)				\
@@ -1371,6 +1549,14 @@ static inline void ext4bf_clear_state_flags(struct ext4bf_inode_info *ei)
 	/* We depend on the fact that callers will set i_flags */
 }
 #endif
+
+/* Bytes of file data that i_block holds for an inode with inline data. */
+#define EXT4_MIN_INLINE_DATA_SIZE	(sizeof(__le32) * EXT4_N_BLOCKS)
+
+static inline int ext4bf_has_inline_data(struct inode *inode)
+{
+	return ext4bf_test_inode_flag(inode, EXT4_INODE_INLINE_DATA);
+}
 #else
 /* Assume that user mode programs are passing in an ext4bffs superblock, not
  * a kernel struct super_block.  This will allow us to call the feature-test
@@ -1429,6 +1615,7 @@ static inline void ext4bf_clear_state_flags(struct ext4bf_inode_info *ei)
 #define EXT4_FEATURE_COMPAT_EXT_ATTR		0x0008
 #define EXT4_FEATURE_COMPAT_RESIZE_INODE	0x0010
 #define EXT4_FEATURE_COMPAT_DIR_INDEX		0x0020
+#define EXT4_FEATURE_COMPAT_ORPHAN_FILE		0x1000 /* Orphan file exists */
 
 #define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
 #define EXT4_FEATURE_RO_COMPAT_LARGE_FILE	0x0002
@@ -1439,6 +1626,8 @@ static inline void ext4bf_clear_state_flags(struct ext4bf_inode_info *ei)
 #define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE	0x0040
 #define EXT4_FEATURE_RO_COMPAT_QUOTA		0x0100
 #define EXT4_FEATURE_RO_COMPAT_BIGALLOC		0x0200
+#define EXT4_FEATURE_RO_COMPAT_ORPHAN_PRESENT	0x10000 /* Orphan file may be
+							   non-empty */
 
 #define EXT4_FEATURE_INCOMPAT_COMPRESSION	0x0001
 #define EXT4_FEATURE_INCOMPAT_FILETYPE		0x0002
@@ -1451,6 +1640,7 @@ static inline void ext4bf_clear_state_flags(struct ext4bf_inode_info *ei)
 #define EXT4_FEATURE_INCOMPAT_FLEX_BG		0x0200
 #define EXT4_FEATURE_INCOMPAT_EA_INODE		0x0400 /* EA in inode */
 #define EXT4_FEATURE_INCOMPAT_DIRDATA		0x1000 /* data in dirent */
+#define EXT4_FEATURE_INCOMPAT_INLINE_DATA	0x8000 /* data in inode */
 
 #define EXT2_FEATURE_COMPAT_SUPP	EXT4_FEATURE_COMPAT_EXT_ATTR
 #define EXT2_FEATURE_INCOMPAT_SUPP	(EXT4_FEATURE_INCOMPAT_FILETYPE| \
@@ -1474,7 +1664,8 @@ static inline void ext4bf_clear_state_flags(struct ext4bf_inode_info *ei)
 					 EXT4_FEATURE_INCOMPAT_EXTENTS| \
 					 EXT4_FEATURE_INCOMPAT_64BIT| \
 					 EXT4_FEATURE_INCOMPAT_FLEX_BG| \
-					 EXT4_FEATURE_INCOMPAT_MMP)
+					 EXT4_FEATURE_INCOMPAT_MMP| \
+					 EXT4_FEATURE_INCOMPAT_INLINE_DATA)
 #define EXT4_FEATURE_RO_COMPAT_SUPP	(EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER| \
 					 EXT4_FEATURE_RO_COMPAT_LARGE_FILE| \
 					 EXT4_FEATURE_RO_COMPAT_GDT_CSUM| \
@@ -1482,7 +1673,8 @@ static inline void ext4bf_clear_state_flags(struct ext4bf_inode_info *ei)
 					 EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE | \
 					 EXT4_FEATURE_RO_COMPAT_BTREE_DIR |\
 					 EXT4_FEATURE_RO_COMPAT_HUGE_FILE |\
-					 EXT4_FEATURE_RO_COMPAT_BIGALLOC)
+					 EXT4_FEATURE_RO_COMPAT_BIGALLOC |\
+					 EXT4_FEATURE_RO_COMPAT_ORPHAN_PRESENT)
 
 /*
  * Default values for user and/or group using reserved blocks
@@ -1870,6 +2062,7 @@ extern struct inode *ext4bf_new_inode(handle_t *, struct inode *, int,
 				    const struct qstr *qstr, __u32 goal,
 				    uid_t *owner);
 extern void ext4bf_free_inode(handle_t *, struct inode *);
+extern struct inode *ext4bf_new_orphan_inode(struct inode *inode);
 extern struct inode * ext4bf_orphan_get(struct super_block *, unsigned long);
 extern unsigned long ext4bf_count_free_inodes(struct super_block *);
 extern unsigned long ext4bf_count_dirs(struct super_block *);
@@ -1910,6 +2103,8 @@ extern void ext4bf_exit_mballoc(void);
 extern void ext4bf_free_blocks(handle_t *handle, struct inode *inode,
 			     struct buffer_head *bh, ext4bf_fsblk_t block,
 			     unsigned long count, int flags);
+extern void ext4bf_mb_prefetch_start(struct super_block *sb);
+extern void ext4bf_mb_wait_discard(struct super_block *sb);
 extern int ext4bf_mb_add_groupinfo(struct super_block *sb,
 		ext4bf_group_t i, struct ext4bf_group_desc *desc);
 extern int ext4bf_group_add_blocks(handle_t *handle, struct super_block *sb,
@@ -1933,9 +2128,17 @@ extern void ext4bf_evict_inode(struct inode *);
 extern void ext4bf_clear_inode(struct inode *);
 extern int  ext4bf_sync_inode(handle_t *, struct inode *);
 extern void ext4bf_dirty_inode(struct inode *, int);
+extern int ext4bf_flush_lazy_time(struct inode *);
+extern void ext4bf_flush_deferred_inode(struct inode *);
+extern void ext4bf_journal_lock_callback(journal_t *, transaction_bf_t *);
 extern int ext4bf_change_inode_journal_flag(struct inode *, int);
 extern int ext4bf_get_inode_loc(struct inode *, struct ext4bf_iloc *);
 extern int ext4bf_can_truncate(struct inode *inode);
+extern int ext4bf_begin_multipage_write(struct inode *inode, loff_t pos,
+				       size_t len);
+extern int ext4bf_end_multipage_write(struct inode *inode);
+extern ssize_t ext4bf_perform_multipage_write(struct file *file,
+					      struct iov_iter *i, loff_t pos);
 extern void ext4bf_truncate(struct inode *);
 extern int ext4bf_punch_hole(struct file *file, loff_t offset, loff_t length);
 extern int ext4bf_truncate_restart_trans(handle_t *, struct inode *, int nblocks);
@@ -1957,9 +2160,24 @@ extern int ext4bf_discard_partial_page_buffers_no_lock(handle_t *handle,
 		loff_t length, int flags);
 extern int ext4bf_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf);
 extern qsize_t *ext4bf_get_reserved_space(struct inode *inode);
+extern int ext4bf_commit_page_range(handle_t *handle, struct inode *inode,
+				    struct page *page, unsigned from,
+				    unsigned to);
 extern void ext4bf_da_update_reserve_space(struct inode *inode,
 					int used, int quota_claim);
 
+/* inline.c */
+extern int ext4bf_try_to_write_inline_data(struct address_space *mapping,
+					   struct inode *inode, loff_t pos,
+					   unsigned len, unsigned flags,
+					   struct page **pagep);
+extern int ext4bf_write_inline_data_end(struct inode *inode, loff_t pos,
+					unsigned len, unsigned copied,
+					struct page *page);
+extern int ext4bf_readpage_inline(struct inode *inode, struct page *page);
+extern int ext4bf_convert_inline_data(struct inode *inode);
+extern int ext4bf_inline_data_truncate(struct inode *inode);
+
 /* indirect.c */
 extern int ext4bf_ind_map_blocks(handle_t *handle, struct inode *inode,
 				struct ext4bf_map_blocks *map, int flags);
@@ -1980,6 +2198,9 @@ extern int ext4bf_ext_migrate(struct inode *);
 /* namei.c */
 extern int ext4bf_orphan_add(handle_t *, struct inode *);
 extern int ext4bf_orphan_del(handle_t *, struct inode *);
+extern int ext4bf_init_orphan_info(struct super_block *sb);
+extern void ext4bf_release_orphan_info(struct super_block *sb);
+extern int ext4bf_orphan_file_empty(struct super_block *sb);
 extern int ext4bf_htree_fill_tree(struct file *dir_file, __u32 start_hash,
 				__u32 start_minor_hash, __u32 *next_hash);
 
@@ -2196,7 +2417,11 @@ struct ext4bf_group_info {
 	ext4bf_grpblk_t	bb_free;	/* total free blocks */
 	ext4bf_grpblk_t	bb_fragments;	/* nr of freespace fragments */
 	ext4bf_grpblk_t	bb_largest_free_order;/* order of largest frag in BG */
+	int		bb_avg_fragment_size_order;	/* order of free/fragments */
+	ext4bf_group_t	bb_group;	/* group number */
 	struct          list_head bb_prealloc_list;
+	struct		list_head bb_largest_free_order_node;
+	struct		list_head bb_avg_fragment_size_node;
 #ifdef DOUBLE_CHECK
 	void            *bb_bitmap;
 #endif
@@ -2331,28 +2556,55 @@ extern long ext4bf_fallocate(struct file *file, int mode, loff_t offset,
 			  loff_t len);
 extern int ext4bf_convert_unwritten_extents(struct inode *inode, loff_t offset,
 			  ssize_t len);
+extern int ext4bf_ext_redirect_alloc(handle_t *handle, struct inode *inode,
+				     ext4bf_lblk_t lblk, unsigned int len,
+				     ext4bf_fsblk_t *newblk);
+extern int ext4bf_ext_redirect_blocks(handle_t *handle, struct inode *inode,
+				      ext4bf_lblk_t lblk, unsigned int len,
+				      ext4bf_fsblk_t oldblk,
+				      ext4bf_fsblk_t newblk);
 extern int ext4bf_map_blocks(handle_t *handle, struct inode *inode,
 			   struct ext4bf_map_blocks *map, int flags);
 extern int ext4bf_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 			__u64 start, __u64 len);
 /* move_extent.c */
-extern int ext4bf_move_extents(struct file *o_filp, struct file *d_filp,
+extern int ext4bf_move_extents(struct inode *orig_inode,
+			     struct inode *donor_inode,
 			     __u64 start_orig, __u64 start_donor,
 			     __u64 len, __u64 *moved_len);
 
+/* defrag.c */
+extern void ext4bf_defrag_note_alloc(struct inode *inode);
+extern void ext4bf_defrag_start(struct super_block *sb);
+extern void ext4bf_defrag_stop(struct super_block *sb);
+
+/* async_free.c */
+extern int ext4bf_async_free_queue(struct inode *inode);
+extern void ext4bf_async_free_forget(struct inode *inode);
+extern int ext4bf_async_free_truncate(struct inode *inode, loff_t old_size);
+extern void ext4bf_async_free_start(struct super_block *sb);
+extern void ext4bf_async_free_stop(struct super_block *sb);
+extern int ext4bf_async_free_wait(struct super_block *sb);
+
 /* page-io.c */
 extern int __init ext4bf_init_pageio(void);
 extern void ext4bf_exit_pageio(void);
 extern void ext4bf_ioend_wait(struct inode *);
 extern void ext4bf_free_io_end(ext4bf_io_end_t *io);
 extern ext4bf_io_end_t *ext4bf_init_io_end(struct inode *inode, gfp_t flags);
-extern int ext4bf_end_io_nolock(ext4bf_io_end_t *io);
+extern int ext4bf_do_flush_completed_IO(struct inode *inode);
+extern void ext4bf_end_io_work(struct work_struct *work);
 extern void ext4bf_io_submit(struct ext4bf_io_submit *io);
 extern int ext4bf_bio_write_page(struct ext4bf_io_submit *io,
 			       struct page *page,
 			       int len,
 			       struct writeback_control *wbc);
 
+/* readpage.c */
+extern int ext4bf_mpage_readpages(struct address_space *mapping,
+				  struct list_head *pages, struct page *page,
+				  unsigned nr_pages);
+
 /* mmp.c */
 extern int ext4bf_multi_mount_protect(struct super_block *, ext4bf_fsblk_t);
 
@@ -2368,11 +2620,18 @@ enum ext4bf_state_bits {
 	BH_Da_Mapped,	/* Delayed allocated block that now has a mapping. This
 			 * flag is set when ext4bf_map_blocks is called on a
 			 * delayed allocated block to get its real mapping. */
+	BH_Appended,	/* Block allocated by page_mkwrite for a journalled
+			 * inode that has not been handed to the journal yet. */
+	BH_Csum_New,	/* Block allocated by get_block and not written since,
+			 * see journal_csum_writepage(). */
 };
 
 BUFFER_FNS(Uninit, uninit)
 TAS_BUFFER_FNS(Uninit, uninit)
 BUFFER_FNS(Da_Mapped, da_mapped)
+BUFFER_FNS(Appended, appended)
+TAS_BUFFER_FNS(Appended, appended)
+BUFFER_FNS(Csum_New, csum_new)
 
 /*
  * Add new method to test wether block and inode bitmaps are properly
@@ -140,6 +140,13 @@ typedef int (*ext_prepare_callback)(struct inode *, ext4bf_lblk_t,
  */
 #define EXT_MAX_BLOCKS	0xffffffff
 
+/*
+ * Deepest extent tree we accept.  Path arrays are sized for it, so one
+ * array can be handed back to ext4bf_ext_find_extent() however the tree
+ * changed in between.
+ */
+#define EXT4_EXT_MAX_DEPTH	5
+
 /*
  * EXT_INIT_MAX_LEN is the maximum number of blocks we can have in an
  * initialized extent. This is 2^15 and not (2^16 - 1), since we use the
@@ -197,7 +204,7 @@ static inline unsigned short ext_depth(struct inode *inode)
 static inline void
 ext4bf_ext_invalidate_cache(struct inode *inode)
 {
-	EXT4_I(inode)->i_cached_extent.ec_len = 0;
+	ext4bf_es_remove_extent(inode, 0, EXT_MAX_BLOCKS);
 }
 
 static inline void ext4bf_ext_mark_uninitialized(struct ext4bf_extent *ext)
@@ -640,10 +640,16 @@ ext4bf_ext_find_extent(struct inode *inode, ext4bf_lblk_t block,
 	eh = ext_inode_hdr(inode);
 	depth = ext_depth(inode);
 
+	if (unlikely(depth > EXT4_EXT_MAX_DEPTH)) {
+		EXT4_ERROR_INODE(inode, "depth %d > max %d",
+				 depth, EXT4_EXT_MAX_DEPTH);
+		return ERR_PTR(-EIO);
+	}
+
 	/* account possible depth increase */
 	if (!path) {
-		path = kzalloc(sizeof(struct ext4bf_ext_path) * (depth + 2),
-				GFP_NOFS);
+		path = kzalloc(sizeof(struct ext4bf_ext_path) *
+				(EXT4_EXT_MAX_DEPTH + 2), GFP_NOFS);
 		if (!path)
 			return ERR_PTR(-ENOMEM);
 		alloc = 1;
@@ -1666,14 +1672,17 @@ int ext4bf_ext_insert_extent(handle_t *handle, struct inode *inode,
 	struct ext4bf_extent *nearex; /* nearest extent */
 	struct ext4bf_ext_path *npath = NULL;
 	int depth, len, err;
-	ext4bf_lblk_t next;
+	ext4bf_lblk_t next, new_lblk;
 	unsigned uninitialized = 0;
+	unsigned int new_len;
 	int flags = 0;
 
 	if (unlikely(ext4bf_ext_get_actual_len(newext) == 0)) {
 		EXT4_ERROR_INODE(inode, "ext4bf_ext_get_actual_len(newext) == 0");
 		return -EIO;
 	}
+	new_lblk = le32_to_cpu(newext->ee_block);
+	new_len = ext4bf_ext_get_actual_len(newext);
 	depth = ext_depth(inode);
 	ex = path[depth].p_ext;
 	if (unlikely(path[depth].p_hdr == NULL)) {
@@ -1828,7 +1837,8 @@ cleanup:
 		ext4bf_ext_drop_refs(npath);
 		kfree(npath);
 	}
-	ext4bf_ext_invalidate_cache(inode);
+	/* merging changes no other mapping; only the new range is stale */
+	ext4bf_es_remove_extent(inode, new_lblk, new_len);
 	return err;
 }
 
@@ -1930,12 +1940,6 @@ static int ext4bf_ext_walk_space(struct inode *inode, ext4bf_lblk_t block,
 			break;
 		}
 
-		if (ext_depth(inode) != depth) {
-			/* depth was changed. we have to realloc path */
-			kfree(path);
-			path = NULL;
-		}
-
 		block = cbex.ec_block + cbex.ec_len;
 	}
 
@@ -1947,21 +1951,6 @@ static int ext4bf_ext_walk_space(struct inode *inode, ext4bf_lblk_t block,
 	return err;
 }
 
-static void
-ext4bf_ext_put_in_cache(struct inode *inode, ext4bf_lblk_t block,
-			__u32 len, ext4bf_fsblk_t start)
-{
-	struct ext4bf_ext_cache *cex;
-	BUG_ON(len == 0);
-	spin_lock(&EXT4_I(inode)->i_block_reservation_lock);
-	//trace_ext4_ext_put_in_cache(inode, block, len, start);
-	cex = &EXT4_I(inode)->i_cached_extent;
-	cex->ec_block = block;
-	cex->ec_len = len;
-	cex->ec_start = start;
-	spin_unlock(&EXT4_I(inode)->i_block_reservation_lock);
-}
-
 /*
  * ext4bf_ext_put_gap_in_cache:
  * calculate boundaries of the gap that the requested block fits into
@@ -2008,90 +1997,9 @@ ext4bf_ext_put_gap_in_cache(struct inode *inode, struct ext4bf_ext_path *path,
 	}
 
 	ext_debug(" -> %u:%lu\n", lblock, len);
-	ext4bf_ext_put_in_cache(inode, lblock, len, 0);
-}
-
-/*
- * ext4bf_ext_check_cache()
- * Checks to see if the given block is in the cache.
- * If it is, the cached extent is stored in the given
- * cache extent pointer.  If the cached extent is a hole,
- * this routine should be used instead of
- * ext4bf_ext_in_cache if the calling function needs to
- * know the size of the hole.
- *
- * @inode: The files inode
- * @block: The block to look for in the cache
- * @ex:    Pointer where the cached extent will be stored
- *         if it contains block
- *
- * Return 0 if cache is invalid; 1 if the cache is valid
- */
-static int ext4bf_ext_check_cache(struct inode *inode, ext4bf_lblk_t block,
-	struct ext4bf_ext_cache *ex){
-	struct ext4bf_ext_cache *cex;
-	struct ext4bf_sb_info *sbi;
-	int ret = 0;
-
-	/*
-	 * We borrow i_block_reservation_lock to protect i_cached_extent
-	 */
-	spin_lock(&EXT4_I(inode)->i_block_reservation_lock);
-	cex = &EXT4_I(inode)->i_cached_extent;
-	sbi = EXT4_SB(inode->i_sb);
-
-	/* has cache valid data? */
-	if (cex->ec_len == 0)
-		goto errout;
-
-	if (in_range(block, cex->ec_block, cex->ec_len)) {
-		memcpy(ex, cex, sizeof(struct ext4bf_ext_cache));
-		ext_debug("%u cached by %u:%u:%llu\n",
-				block,
-				cex->ec_block, cex->ec_len, cex->ec_start);
-		ret = 1;
-	}
-errout:
-	if (!ret)
-		sbi->extent_cache_misses++;
-	else
-		sbi->extent_cache_hits++;
-	//trace_ext4_ext_in_cache(inode, block, ret);
-	spin_unlock(&EXT4_I(inode)->i_block_reservation_lock);
-	return ret;
+	ext4bf_es_insert_extent(inode, lblock, len, 0, EXTENT_STATUS_HOLE);
 }
 
-/*
- * ext4bf_ext_in_cache()
- * Checks to see if the given block is in the cache.
- * If it is, the cached extent is stored in the given
- * extent pointer.
- *
- * @inode: The files inode
- * @block: The block to look for in the cache
- * @ex:    Pointer where the cached extent will be stored
- *         if it contains block
- *
- * Return 0 if cache is invalid; 1 if the cache is valid
- */
-static int
-ext4bf_ext_in_cache(struct inode *inode, ext4bf_lblk_t block,
-			struct ext4bf_extent *ex)
-{
-	struct ext4bf_ext_cache cex;
-	int ret = 0;
-
-	if (ext4bf_ext_check_cache(inode, block, &cex)) {
-		ex->ee_block = cpu_to_le32(cex.ec_block);
-		ext4bf_ext_store_pblock(ex, cex.ec_start);
-		ex->ee_len = cpu_to_le16(cex.ec_len);
-		ret = 1;
-	}
-
-	return ret;
-}
-
-
 /*
  * ext4bf_ext_rm_idx:
  * removes index from the index block.
@@ -2502,7 +2410,7 @@ static int ext4bf_ext_remove_space(struct inode *inode, ext4bf_lblk_t start)
 		return PTR_ERR(handle);
 
 again:
-	ext4bf_ext_invalidate_cache(inode);
+	ext4bf_es_remove_extent(inode, start, EXT_MAX_BLOCKS - start);
 
 	//trace_ext4_ext_remove_space(inode, start, depth);
 
@@ -2900,6 +2808,136 @@ out:
 	return err ? err : map->m_len;
 }
 
+/*
+ * ext4bf: redirect-on-write.  Allocate up to @len new blocks for the
+ * overwrite of the logical blocks from @lblk, which must be mapped by an
+ * initialized extent.  They are placed right after the left neighbour's
+ * blocks when it was redirected too, so sequential overwrites stay
+ * contiguous.
+ *
+ * Returns the number of blocks allocated from @newblk, or a negative error;
+ * -EAGAIN if @lblk is not mapped that way.
+ */
+int ext4bf_ext_redirect_alloc(handle_t *handle, struct inode *inode,
+			      ext4bf_lblk_t lblk, unsigned int len,
+			      ext4bf_fsblk_t *newblk)
+{
+	struct ext4bf_ext_path *path;
+	struct ext4bf_extent *ex, *left;
+	struct ext4bf_allocation_request ar;
+	ext4bf_lblk_t ee_block;
+	ext4bf_fsblk_t goal;
+	int depth, err = 0;
+
+	path = ext4bf_ext_find_extent(inode, lblk, NULL);
+	if (IS_ERR(path))
+		return PTR_ERR(path);
+	depth = ext_depth(inode);
+	ex = path[depth].p_ext;
+	if (!ex || ext4bf_ext_is_uninitialized(ex) ||
+	    lblk < le32_to_cpu(ex->ee_block) ||
+	    lblk >= le32_to_cpu(ex->ee_block) + ext4bf_ext_get_actual_len(ex)) {
+		err = -EAGAIN;
+		goto out;
+	}
+
+	ee_block = le32_to_cpu(ex->ee_block);
+	goal = ext4bf_ext_pblock(ex) + (lblk - ee_block);
+	if (lblk == ee_block && ex > EXT_FIRST_EXTENT(path[depth].p_hdr)) {
+		left = ex - 1;
+		if (le32_to_cpu(left->ee_block) +
+		    ext4bf_ext_get_actual_len(left) == lblk)
+			goal = ext4bf_ext_pblock(left) +
+				ext4bf_ext_get_actual_len(left);
+	}
+
+	memset(&ar, 0, sizeof(ar));
+	ar.inode = inode;
+	ar.goal = goal;
+	ar.logical = lblk;
+	ar.len = len;
+	ar.flags = EXT4_MB_HINT_DATA;
+	*newblk = ext4bf_mb_new_blocks(handle, &ar, &err);
+	if (!err)
+		err = ar.len;
+out:
+	ext4bf_ext_drop_refs(path);
+	kfree(path);
+	return err;
+}
+
+/*
+ * ext4bf: redirect-on-write.  Move the logical blocks [lblk, lblk + len) of
+ * @inode, which must be mapped onto @oldblk by one initialized extent, onto
+ * @newblk from ext4bf_ext_redirect_alloc().  The caller writes the new
+ * blocks in place instead of journalling the overwrite, and frees the old
+ * ones (through the journal, so they are revoked and only reused after the
+ * delay).  Swapping @oldblk and @newblk moves the range back.
+ *
+ * Returns 0, or a negative error; on -EAGAIN the range is left mapped as
+ * before.
+ */
+int ext4bf_ext_redirect_blocks(handle_t *handle, struct inode *inode,
+			       ext4bf_lblk_t lblk, unsigned int len,
+			       ext4bf_fsblk_t oldblk, ext4bf_fsblk_t newblk)
+{
+	struct ext4bf_ext_path *path;
+	struct ext4bf_extent *ex;
+	struct ext4bf_map_blocks map;
+	int depth, err = 0;
+
+	path = ext4bf_ext_find_extent(inode, lblk, NULL);
+	if (IS_ERR(path))
+		return PTR_ERR(path);
+	depth = ext_depth(inode);
+	ex = path[depth].p_ext;
+	if (!ex || ext4bf_ext_is_uninitialized(ex) ||
+	    lblk < le32_to_cpu(ex->ee_block) ||
+	    lblk + len > le32_to_cpu(ex->ee_block) +
+			 ext4bf_ext_get_actual_len(ex) ||
+	    ext4bf_ext_pblock(ex) + (lblk - le32_to_cpu(ex->ee_block)) !=
+			oldblk) {
+		err = -EAGAIN;
+		goto out;
+	}
+
+	/* Give the range an extent of its own; PRE_IO keeps the pieces
+	 * from being merged back together. */
+	map.m_lblk = lblk;
+	map.m_len = len;
+	err = ext4bf_split_extent(handle, inode, path, &map, 0,
+				  EXT4_GET_BLOCKS_PRE_IO);
+	if (err < 0)
+		goto out;
+	err = 0;
+
+	ext4bf_ext_drop_refs(path);
+	path = ext4bf_ext_find_extent(inode, lblk, path);
+	if (IS_ERR(path))
+		return PTR_ERR(path);
+	depth = ext_depth(inode);
+	ex = path[depth].p_ext;
+	if (!ex || le32_to_cpu(ex->ee_block) != lblk ||
+	    ext4bf_ext_get_actual_len(ex) != len) {
+		EXT4_ERROR_INODE(inode, "bad extent after split at %u",
+				 (unsigned) lblk);
+		err = -EIO;
+		goto out;
+	}
+
+	err = ext4bf_ext_get_access(handle, inode, path + depth);
+	if (err)
+		goto out;
+	ext4bf_ext_store_pblock(ex, newblk);
+	ext4bf_ext_try_to_merge(inode, path, ex);
+	err = ext4bf_ext_dirty(handle, inode, path + depth);
+	ext4bf_es_remove_extent(inode, lblk, len);
+out:
+	ext4bf_ext_drop_refs(path);
+	kfree(path);
+	return err;
+}
+
 #define EXT4_EXT_ZERO_LEN 7
 /*
  * This function is called by ext4bf_ext_map_blocks() if someone tries to write
@@ -3714,18 +3752,20 @@ int ext4bf_ext_map_blocks(handle_t *handle, struct inode *inode,
 	unsigned int allocated_clusters = 0;
 	unsigned int punched_out = 0;
 	unsigned int result = 0;
+	int discontig = 0;
 	struct ext4bf_allocation_request ar;
 	ext4bf_io_end_t *io = EXT4_I(inode)->cur_aio_dio;
 	ext4bf_lblk_t cluster_offset;
+	struct extent_status es;
 
 	ext_debug("blocks %u/%u requested for inode %lu\n",
 		  map->m_lblk, map->m_len, inode->i_ino);
 	//trace_ext4_ext_map_blocks_enter(inode, map->m_lblk, map->m_len, flags);
 
-	/* check in cache */
+	/* check in extent status tree */
 	if (!(flags & EXT4_GET_BLOCKS_PUNCH_OUT_EXT) &&
-		ext4bf_ext_in_cache(inode, map->m_lblk, &newex)) {
-		if (!newex.ee_start_lo && !newex.ee_start_hi) {
+		ext4bf_es_lookup_extent(inode, map->m_lblk, &es)) {
+		if (es.es_status == EXTENT_STATUS_HOLE) {
 			if ((sbi->s_cluster_ratio > 1) &&
 			    ext4bf_find_delalloc_cluster(inode, map->m_lblk, 0))
 				map->m_flags |= EXT4_MAP_FROM_CLUSTER;
@@ -3738,18 +3778,28 @@ int ext4bf_ext_map_blocks(handle_t *handle, struct inode *inode,
 				goto out2;
 			}
 			/* we should allocate requested block */
-		} else {
+		} else if (es.es_status == EXTENT_STATUS_WRITTEN) {
 			/* block is already allocated */
 			if (sbi->s_cluster_ratio > 1)
 				map->m_flags |= EXT4_MAP_FROM_CLUSTER;
-			newblock = map->m_lblk
-				   - le32_to_cpu(newex.ee_block)
-				   + ext4bf_ext_pblock(&newex);
+			newblock = map->m_lblk - es.es_lblk + es.es_pblk;
 			/* number of remaining blocks in the extent */
-			allocated = ext4bf_ext_get_actual_len(&newex) -
-				(map->m_lblk - le32_to_cpu(newex.ee_block));
+			allocated = es.es_len - (map->m_lblk - es.es_lblk);
 			goto out;
+		} else if (flags == 0) {
+			/*
+			 * Plain lookup of an uninitialized extent: report
+			 * it as handle_uninitialized_extents() would.
+			 */
+			allocated = es.es_len - (map->m_lblk - es.es_lblk);
+			if (allocated > map->m_len)
+				allocated = map->m_len;
+			map->m_flags |= EXT4_MAP_UNWRITTEN;
+			map->m_pblk = map->m_lblk - es.es_lblk + es.es_pblk;
+			map->m_len = allocated;
+			return allocated;
 		}
+		/* uninitialized extent to split or convert: walk the tree */
 	}
 
 	/* find extent for this block */
@@ -3802,15 +3852,24 @@ int ext4bf_ext_map_blocks(handle_t *handle, struct inode *inode,
 				  ee_block, ee_len, newblock);
 
 			if ((flags & EXT4_GET_BLOCKS_PUNCH_OUT_EXT) == 0) {
-				/*
-				 * Do not put uninitialized extent
-				 * in the cache
-				 */
 				if (!ext4bf_ext_is_uninitialized(ex)) {
-					ext4bf_ext_put_in_cache(inode, ee_block,
-						ee_len, ee_start);
+					ext4bf_es_insert_extent(inode, ee_block,
+						ee_len, ee_start,
+						EXTENT_STATUS_WRITTEN);
 					goto out;
 				}
+				/*
+				 * Cache uninitialized extents only for plain
+				 * lookups; anything else may split or convert
+				 * them, so drop what is cached first.
+				 */
+				if (flags == 0)
+					ext4bf_es_insert_extent(inode, ee_block,
+						ee_len, ee_start,
+						EXTENT_STATUS_UNWRITTEN);
+				else
+					ext4bf_es_remove_extent(inode, ee_block,
+								ee_len);
 				ret = ext4bf_ext_handle_uninitialized_extents(
 					handle, inode, map, path, flags,
 					allocated, newblock);
@@ -4008,6 +4067,8 @@ int ext4bf_ext_map_blocks(handle_t *handle, struct inode *inode,
 		goto out2;
 	ext_debug("allocate new block: goal %llu, found %llu/%u\n",
 		  ar.goal, newblock, allocated);
+	/* the file gains a piece if this does not follow its left extent */
+	discontig = path[depth].p_ext && newblock != ar.goal;
 	free_on_err = 1;
 	allocated_clusters = ar.len;
 	ar.len = EXT4_C2B(sbi, ar.len) - offset;
@@ -4065,6 +4126,8 @@ got_allocated_blocks:
 		allocated = map->m_len;
 	map->m_flags |= EXT4_MAP_NEW;
 	jbd_debug(6, "EXT4BF: mapped new allocated block at %lu\n", newblock);
+	if (discontig)
+		ext4bf_defrag_note_alloc(inode);
 
 	/*
 	 * Update reserved blocks/metadata blocks after successful
@@ -4152,10 +4215,14 @@ got_allocated_blocks:
 	 * when it is _not_ an uninitialized extent.
 	 */
 	if ((flags & EXT4_GET_BLOCKS_UNINIT_EXT) == 0) {
-		ext4bf_ext_put_in_cache(inode, map->m_lblk, allocated, newblock);
+		ext4bf_es_insert_extent(inode, map->m_lblk, allocated,
+					newblock, EXTENT_STATUS_WRITTEN);
 		ext4bf_update_inode_fsync_trans(handle, inode, 1);
-	} else
+	} else {
+		ext4bf_es_insert_extent(inode, map->m_lblk, allocated,
+					newblock, EXTENT_STATUS_UNWRITTEN);
 		ext4bf_update_inode_fsync_trans(handle, inode, 0);
+	}
 out:
 	if (allocated > map->m_len)
 		allocated = map->m_len;
@@ -4307,6 +4374,12 @@ long ext4bf_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
 	struct ext4bf_map_blocks map;
 	unsigned int credits, blkbits = inode->i_blkbits;
 
+	if (ext4bf_has_inline_data(inode)) {
+		ret = ext4bf_convert_inline_data(inode);
+		if (ret)
+			return ret;
+	}
+
 	/*
 	 * currently supporting (pre)allocate mode for extent-based
 	 * files _only_
@@ -4427,13 +4500,26 @@ int ext4bf_convert_unwritten_extents(struct inode *inode, loff_t offset,
 	 * credits to insert 1 extent into extent tree
 	 */
 	credits = ext4bf_chunk_trans_blocks(inode, max_blocks);
+	handle = ext4bf_journal_start(inode, credits);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	/*
+	 * ext4bf: a writeback run may cover several unwritten extents.  They
+	 * are converted under one handle for as long as it can be extended.
+	 */
 	while (ret >= 0 && ret < max_blocks) {
 		map.m_lblk += ret;
 		map.m_len = (max_blocks -= ret);
-		handle = ext4bf_journal_start(inode, credits);
-		if (IS_ERR(handle)) {
-			ret = PTR_ERR(handle);
-			break;
+		if (ret > 0 && ext4bf_handle_valid(handle) &&
+		    handle->h_buffer_credits < credits &&
+		    ext4bf_journal_extend(handle, credits)) {
+			ext4bf_mark_inode_dirty(handle, inode);
+			ret2 = ext4bf_journal_stop(handle);
+			if (ret2)
+				return ret2;
+			handle = ext4bf_journal_start(inode, credits);
+			if (IS_ERR(handle))
+				return PTR_ERR(handle);
 		}
 		ret = ext4bf_map_blocks(handle, inode, &map,
 				      EXT4_GET_BLOCKS_IO_CONVERT_EXT);
@@ -4443,12 +4529,11 @@ int ext4bf_convert_unwritten_extents(struct inode *inode, loff_t offset,
 				    "returned error inode#%lu, block=%u, "
 				    "max_blocks=%u", __func__,
 				    inode->i_ino, map.m_lblk, map.m_len);
-		}
-		ext4bf_mark_inode_dirty(handle, inode);
-		ret2 = ext4bf_journal_stop(handle);
-		if (ret <= 0 || ret2 )
 			break;
+		}
 	}
+	ext4bf_mark_inode_dirty(handle, inode);
+	ret2 = ext4bf_journal_stop(handle);
 	return ret > 0 ? ret2 : ret;
 }
 
@@ -4708,7 +4793,7 @@ int ext4bf_ext_punch_hole(struct file *file, loff_t offset, loff_t length)
 {
 	struct inode *inode = file->f_path.dentry->d_inode;
 	struct super_block *sb = inode->i_sb;
-	struct ext4bf_ext_cache cache_ex;
+	struct extent_status es;
 	ext4bf_lblk_t first_block, last_block, num_blocks, iblock, max_blocks;
 	struct address_space *mapping = inode->i_mapping;
 	struct ext4bf_map_blocks map;
@@ -4869,13 +4954,11 @@ int ext4bf_ext_punch_hole(struct file *file, loff_t offset, loff_t length)
 			 * put it in the cache.  So we can get the hole
 			 * out of the cache
 			 */
-			memset(&cache_ex, 0, sizeof(cache_ex));
-			if ((ext4bf_ext_check_cache(inode, iblock, &cache_ex)) &&
-				!cache_ex.ec_start) {
+			if (ext4bf_es_lookup_extent(inode, iblock, &es) &&
+			    es.es_status == EXTENT_STATUS_HOLE) {
 
 				/* The hole is cached */
-				num_blocks = cache_ex.ec_block +
-				cache_ex.ec_len - iblock;
+				num_blocks = es.es_lblk + es.es_len - iblock;
 
 			} else {
 				/* The block could not be identified */
@@ -4921,6 +5004,19 @@ int ext4bf_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 	ext4bf_lblk_t start_blk;
 	int error = 0;
 
+	if (ext4bf_has_inline_data(inode)) {
+		if (fiemap_check_flags(fieinfo, EXT4_FIEMAP_FLAGS))
+			return -EBADR;
+		if (start >= i_size_read(inode))
+			return 0;
+		error = fiemap_fill_next_extent(fieinfo, 0, 0,
+						i_size_read(inode),
+						FIEMAP_EXTENT_DATA_INLINE |
+						FIEMAP_EXTENT_NOT_ALIGNED |
+						FIEMAP_EXTENT_LAST);
+		return error < 0 ? error : 0;
+	}
+
 	/* fallback to generic here if not in extents fmt */
 	if (!(ext4bf_test_inode_flag(inode, EXT4_INODE_EXTENTS)))
 		return generic_block_fiemap(inode, fieinfo, start, len,
@@ -0,0 +1,389 @@
+/*
+ *  fs/ext4bf/extents_status.c
+ *
+ * Extent status tree: an in-memory rbtree per inode of logical block
+ * ranges whose mapping is known, each either written (initialized),
+ * unwritten (uninitialized) or a hole.  ext4bf_ext_map_blocks() answers
+ * from it without walking the on-disk extent tree, and fills it in from
+ * every lookup that does walk the tree.
+ *
+ * Ranges never overlap; adjacent ranges with the same status and
+ * contiguous physical blocks are merged.  Since this is only a cache,
+ * a range that would have to be split when memory is short is simply
+ * dropped.  Whoever changes the on-disk mapping of a range removes it
+ * from the tree first, under i_data_sem held for writing.
+ *
+ * Inodes with cached extents sit on a per-sb LRU list, from which the
+ * shrinker drops whole trees under memory pressure.
+ */
+
+#include <linux/fs.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include "ext4bf.h"
+#include "ext4bf_extents.h"
+
+static struct kmem_cache *ext4bf_es_cachep;
+
+int __init ext4bf_init_es(void)
+{
+	ext4bf_es_cachep = KMEM_CACHE(extent_status, SLAB_RECLAIM_ACCOUNT);
+	if (ext4bf_es_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void ext4bf_exit_es(void)
+{
+	kmem_cache_destroy(ext4bf_es_cachep);
+}
+
+void ext4bf_es_init_tree(struct ext4bf_es_tree *tree)
+{
+	tree->root = RB_ROOT;
+	tree->cache_es = NULL;
+}
+
+static inline ext4bf_lblk_t ext4bf_es_end(struct extent_status *es)
+{
+	return es->es_lblk + es->es_len - 1;
+}
+
+static inline struct extent_status *ext4bf_es_entry(struct rb_node *node)
+{
+	return node ? rb_entry(node, struct extent_status, rb_node) : NULL;
+}
+
+/*
+ * Return the extent containing @lblk, or else the first one after it.
+ */
+static struct extent_status *__es_tree_search(struct rb_root *root,
+					      ext4bf_lblk_t lblk)
+{
+	struct rb_node *node = root->rb_node;
+	struct extent_status *es = NULL;
+
+	while (node) {
+		es = rb_entry(node, struct extent_status, rb_node);
+		if (lblk < es->es_lblk)
+			node = node->rb_left;
+		else if (lblk > ext4bf_es_end(es))
+			node = node->rb_right;
+		else
+			return es;
+	}
+
+	if (es && lblk > ext4bf_es_end(es))
+		es = ext4bf_es_entry(rb_next(&es->rb_node));
+	return es;
+}
+
+static int ext4bf_es_can_merge(struct extent_status *es1,
+			       struct extent_status *es2)
+{
+	if (es1->es_status != es2->es_status)
+		return 0;
+	if ((u64)es1->es_len + es2->es_len > EXT_MAX_BLOCKS)
+		return 0;
+	if (ext4bf_es_end(es1) + 1 != es2->es_lblk)
+		return 0;
+	if (es1->es_status != EXTENT_STATUS_HOLE &&
+	    es1->es_pblk + es1->es_len != es2->es_pblk)
+		return 0;
+	return 1;
+}
+
+static void ext4bf_es_free(struct inode *inode, struct extent_status *es)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+
+	rb_erase(&es->rb_node, &ei->i_es_tree.root);
+	if (ei->i_es_tree.cache_es == es)
+		ei->i_es_tree.cache_es = NULL;
+	ei->i_es_lru_nr--;
+	percpu_counter_dec(&EXT4_SB(inode->i_sb)->s_extent_cache_cnt);
+	kmem_cache_free(ext4bf_es_cachep, es);
+}
+
+static struct extent_status *
+ext4bf_es_try_to_merge_left(struct inode *inode, struct extent_status *es)
+{
+	struct extent_status *prev = ext4bf_es_entry(rb_prev(&es->rb_node));
+
+	if (prev && ext4bf_es_can_merge(prev, es)) {
+		prev->es_len += es->es_len;
+		ext4bf_es_free(inode, es);
+		es = prev;
+	}
+	return es;
+}
+
+static struct extent_status *
+ext4bf_es_try_to_merge_right(struct inode *inode, struct extent_status *es)
+{
+	struct extent_status *next = ext4bf_es_entry(rb_next(&es->rb_node));
+
+	if (next && ext4bf_es_can_merge(es, next)) {
+		es->es_len += next->es_len;
+		ext4bf_es_free(inode, next);
+	}
+	return es;
+}
+
+/*
+ * Insert @newes, which must not overlap anything in the tree, merging
+ * it into a neighbour where possible.  Returns NULL if there was no
+ * memory for a new node.
+ */
+static struct extent_status *__es_insert(struct inode *inode,
+					 struct extent_status *newes)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	struct ext4bf_es_tree *tree = &ei->i_es_tree;
+	struct rb_node **p = &tree->root.rb_node;
+	struct rb_node *parent = NULL;
+	struct extent_status *es;
+
+	while (*p) {
+		parent = *p;
+		es = rb_entry(parent, struct extent_status, rb_node);
+
+		if (newes->es_lblk < es->es_lblk) {
+			if (ext4bf_es_can_merge(newes, es)) {
+				es->es_lblk = newes->es_lblk;
+				es->es_len += newes->es_len;
+				es->es_pblk = newes->es_pblk;
+				es = ext4bf_es_try_to_merge_left(inode, es);
+				goto out;
+			}
+			p = &(*p)->rb_left;
+		} else if (newes->es_lblk > ext4bf_es_end(es)) {
+			if (ext4bf_es_can_merge(es, newes)) {
+				es->es_len += newes->es_len;
+				es = ext4bf_es_try_to_merge_right(inode, es);
+				goto out;
+			}
+			p = &(*p)->rb_right;
+		} else {
+			BUG();
+		}
+	}
+
+	es = kmem_cache_alloc(ext4bf_es_cachep, GFP_ATOMIC);
+	if (!es)
+		return NULL;
+	es->es_lblk = newes->es_lblk;
+	es->es_len = newes->es_len;
+	es->es_pblk = newes->es_pblk;
+	es->es_status = newes->es_status;
+	rb_link_node(&es->rb_node, parent, p);
+	rb_insert_color(&es->rb_node, &tree->root);
+	ei->i_es_lru_nr++;
+	percpu_counter_inc(&EXT4_SB(inode->i_sb)->s_extent_cache_cnt);
+out:
+	tree->cache_es = es;
+	return es;
+}
+
+/*
+ * Remove [lblk, end] from the tree, trimming the extents that stick
+ * out on either side.
+ */
+static void __es_remove_extent(struct inode *inode, ext4bf_lblk_t lblk,
+			       ext4bf_lblk_t end)
+{
+	struct ext4bf_es_tree *tree = &EXT4_I(inode)->i_es_tree;
+	struct extent_status *es, tail;
+	ext4bf_lblk_t orig_end, n;
+
+	es = __es_tree_search(&tree->root, lblk);
+	if (!es || es->es_lblk > end)
+		return;
+	tree->cache_es = NULL;
+
+	if (es->es_lblk < lblk) {
+		orig_end = ext4bf_es_end(es);
+		es->es_len = lblk - es->es_lblk;
+		if (orig_end > end) {
+			/* punched out of the middle: re-add the tail */
+			tail.es_lblk = end + 1;
+			tail.es_len = orig_end - end;
+			tail.es_status = es->es_status;
+			tail.es_pblk = 0;
+			if (es->es_status != EXTENT_STATUS_HOLE)
+				tail.es_pblk = es->es_pblk +
+					       (end + 1 - es->es_lblk);
+			__es_insert(inode, &tail);
+			return;
+		}
+		es = ext4bf_es_entry(rb_next(&es->rb_node));
+	}
+
+	while (es && ext4bf_es_end(es) <= end) {
+		struct extent_status *next;
+
+		next = ext4bf_es_entry(rb_next(&es->rb_node));
+		ext4bf_es_free(inode, es);
+		es = next;
+	}
+
+	if (es && es->es_lblk <= end) {
+		n = end + 1 - es->es_lblk;
+		es->es_lblk = end + 1;
+		es->es_len -= n;
+		if (es->es_status != EXTENT_STATUS_HOLE)
+			es->es_pblk += n;
+	}
+}
+
+static void ext4bf_es_lru_add(struct inode *inode)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	struct ext4bf_sb_info *sbi = EXT4_SB(inode->i_sb);
+
+	if (!list_empty(&ei->i_es_lru))
+		return;
+	spin_lock(&sbi->s_es_lru_lock);
+	if (list_empty(&ei->i_es_lru))
+		list_add_tail(&ei->i_es_lru, &sbi->s_es_lru);
+	spin_unlock(&sbi->s_es_lru_lock);
+}
+
+void ext4bf_es_lru_del(struct inode *inode)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	struct ext4bf_sb_info *sbi = EXT4_SB(inode->i_sb);
+
+	spin_lock(&sbi->s_es_lru_lock);
+	list_del_init(&ei->i_es_lru);
+	spin_unlock(&sbi->s_es_lru_lock);
+}
+
+/*
+ * Look up the extent containing @lblk.  Returns 1 and a copy of it in
+ * @es if the mapping of @lblk is cached, 0 otherwise.
+ */
+int ext4bf_es_lookup_extent(struct inode *inode, ext4bf_lblk_t lblk,
+			    struct extent_status *es)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	struct ext4bf_sb_info *sbi = EXT4_SB(inode->i_sb);
+	struct ext4bf_es_tree *tree = &ei->i_es_tree;
+	struct extent_status *es1;
+	int found = 0;
+
+	read_lock(&ei->i_es_lock);
+	es1 = tree->cache_es;
+	if (!es1 || !in_range(lblk, es1->es_lblk, es1->es_len)) {
+		es1 = __es_tree_search(&tree->root, lblk);
+		if (es1 && !in_range(lblk, es1->es_lblk, es1->es_len))
+			es1 = NULL;
+	}
+	if (es1) {
+		es->es_lblk = es1->es_lblk;
+		es->es_len = es1->es_len;
+		es->es_pblk = es1->es_pblk;
+		es->es_status = es1->es_status;
+		tree->cache_es = es1;
+		found = 1;
+	}
+	read_unlock(&ei->i_es_lock);
+
+	if (found)
+		sbi->extent_cache_hits++;
+	else
+		sbi->extent_cache_misses++;
+	return found;
+}
+
+/*
+ * Record that [lblk, lblk + len) maps to @pblk with @status, replacing
+ * whatever was cached for that range.
+ */
+void ext4bf_es_insert_extent(struct inode *inode, ext4bf_lblk_t lblk,
+			     ext4bf_lblk_t len, ext4bf_fsblk_t pblk,
+			     unsigned int status)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	struct extent_status newes;
+
+	BUG_ON(len == 0);
+	newes.es_lblk = lblk;
+	newes.es_len = len;
+	newes.es_pblk = status == EXTENT_STATUS_HOLE ? 0 : pblk;
+	newes.es_status = status;
+
+	write_lock(&ei->i_es_lock);
+	__es_remove_extent(inode, lblk, lblk + len - 1);
+	__es_insert(inode, &newes);
+	write_unlock(&ei->i_es_lock);
+
+	ext4bf_es_lru_add(inode);
+}
+
+/*
+ * Forget the mapping of [lblk, lblk + len); len may run to
+ * EXT_MAX_BLOCKS to drop everything from lblk on.
+ */
+void ext4bf_es_remove_extent(struct inode *inode, ext4bf_lblk_t lblk,
+			     ext4bf_lblk_t len)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	ext4bf_lblk_t end;
+
+	if (len == 0)
+		return;
+	end = lblk + len - 1;
+	if (end < lblk)
+		end = EXT_MAX_BLOCKS - 1;
+
+	write_lock(&ei->i_es_lock);
+	__es_remove_extent(inode, lblk, end);
+	write_unlock(&ei->i_es_lock);
+}
+
+static int ext4bf_es_shrink(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct ext4bf_sb_info *sbi = container_of(shrink,
+					struct ext4bf_sb_info, s_es_shrinker);
+	struct ext4bf_inode_info *ei;
+	struct list_head *cur, *tmp;
+	LIST_HEAD(skipped);
+	int nr_to_scan = sc->nr_to_scan;
+	int nr_shrunk = 0;
+
+	if (!nr_to_scan)
+		goto out;
+
+	spin_lock(&sbi->s_es_lru_lock);
+	list_for_each_safe(cur, tmp, &sbi->s_es_lru) {
+		ei = list_entry(cur, struct ext4bf_inode_info, i_es_lru);
+		if (!write_trylock(&ei->i_es_lock)) {
+			list_move_tail(cur, &skipped);
+			continue;
+		}
+		nr_shrunk += ei->i_es_lru_nr;
+		__es_remove_extent(&ei->vfs_inode, 0, EXT_MAX_BLOCKS - 1);
+		write_unlock(&ei->i_es_lock);
+		list_del_init(&ei->i_es_lru);
+		if (nr_shrunk >= nr_to_scan)
+			break;
+	}
+	list_splice_tail(&skipped, &sbi->s_es_lru);
+	spin_unlock(&sbi->s_es_lru_lock);
+out:
+	return percpu_counter_read_positive(&sbi->s_extent_cache_cnt);
+}
+
+void ext4bf_es_register_shrinker(struct ext4bf_sb_info *sbi)
+{
+	sbi->s_es_shrinker.shrink = ext4bf_es_shrink;
+	sbi->s_es_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&sbi->s_es_shrinker);
+}
+
+void ext4bf_es_unregister_shrinker(struct ext4bf_sb_info *sbi)
+{
+	if (sbi->s_es_shrinker.shrink)
+		unregister_shrinker(&sbi->s_es_shrinker);
+}
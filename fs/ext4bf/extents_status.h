@@ -0,0 +1,47 @@
+/*
+ *  fs/ext4bf/extents_status.h
+ *
+ * Per-inode cache of the logical to physical block mapping, kept as an
+ * rbtree of non-overlapping ranges.  See extents_status.c.
+ */
+
+#ifndef _EXT4BF_EXTENTS_STATUS_H
+#define _EXT4BF_EXTENTS_STATUS_H
+
+/* es_status values */
+#define EXTENT_STATUS_WRITTEN	0x01	/* initialized extent */
+#define EXTENT_STATUS_UNWRITTEN	0x02	/* uninitialized extent */
+#define EXTENT_STATUS_HOLE	0x04	/* no blocks mapped */
+
+struct ext4bf_sb_info;
+
+struct extent_status {
+	struct rb_node rb_node;
+	ext4bf_lblk_t es_lblk;		/* first logical block */
+	ext4bf_lblk_t es_len;		/* length in blocks */
+	ext4bf_fsblk_t es_pblk;		/* first physical block, 0 for holes */
+	unsigned int es_status;
+};
+
+struct ext4bf_es_tree {
+	struct rb_root root;
+	struct extent_status *cache_es;	/* last extent looked up */
+};
+
+extern int __init ext4bf_init_es(void);
+extern void ext4bf_exit_es(void);
+extern void ext4bf_es_init_tree(struct ext4bf_es_tree *tree);
+
+extern int ext4bf_es_lookup_extent(struct inode *inode, ext4bf_lblk_t lblk,
+				   struct extent_status *es);
+extern void ext4bf_es_insert_extent(struct inode *inode, ext4bf_lblk_t lblk,
+				    ext4bf_lblk_t len, ext4bf_fsblk_t pblk,
+				    unsigned int status);
+extern void ext4bf_es_remove_extent(struct inode *inode, ext4bf_lblk_t lblk,
+				    ext4bf_lblk_t len);
+
+extern void ext4bf_es_register_shrinker(struct ext4bf_sb_info *sbi);
+extern void ext4bf_es_unregister_shrinker(struct ext4bf_sb_info *sbi);
+extern void ext4bf_es_lru_del(struct inode *inode);
+
+#endif /* _EXT4BF_EXTENTS_STATUS_H */
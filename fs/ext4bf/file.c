@@ -89,6 +89,67 @@ ext4bf_unaligned_aio(struct inode *inode, const struct iovec *iov,
 	return 0;
 }
 
+/*
+ * ext4bf: generic_file_aio_write() for large buffered writes to journalled
+ * inodes, run as one multi-page write (see ext4bf_begin_multipage_write()).
+ * The checks are those of __generic_file_aio_write(); the copy is
+ * ext4bf_perform_multipage_write() instead of generic_perform_write().
+ */
+static ssize_t
+ext4bf_multipage_file_write(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos)
+{
+	struct file *file = iocb->ki_filp;
+	struct address_space *mapping = file->f_mapping;
+	struct inode *inode = mapping->host;
+	struct blk_plug plug;
+	struct iov_iter i;
+	size_t count = 0;
+	ssize_t ret;
+	int err;
+
+	BUG_ON(iocb->ki_pos != pos);
+
+	ret = generic_segment_checks(iov, &nr_segs, &count, VERIFY_READ);
+	if (ret)
+		return ret;
+
+	mutex_lock(&inode->i_mutex);
+	blk_start_plug(&plug);
+	vfs_check_frozen(inode->i_sb, SB_FREEZE_WRITE);
+	/* We can write back this queue in page reclaim */
+	current->backing_dev_info = mapping->backing_dev_info;
+	ret = generic_write_checks(file, &pos, &count, 0);
+	if (ret || !count)
+		goto out;
+	ret = file_remove_suid(file);
+	if (ret)
+		goto out;
+	file_update_time(file);
+
+	ret = ext4bf_begin_multipage_write(inode, pos, count);
+	if (!ret) {
+		iov_iter_init(&i, iov, nr_segs, count, 0);
+		ret = ext4bf_perform_multipage_write(file, &i, pos);
+		err = ext4bf_end_multipage_write(inode);
+		if (ret == 0)
+			ret = err;
+		if (ret > 0)
+			iocb->ki_pos = pos + ret;
+	}
+out:
+	current->backing_dev_info = NULL;
+	mutex_unlock(&inode->i_mutex);
+
+	if (ret > 0 || ret == -EIOCBQUEUED) {
+		err = generic_write_sync(file, pos, ret);
+		if (err < 0 && ret > 0)
+			ret = err;
+	}
+	blk_finish_plug(&plug);
+	return ret;
+}
+
 static ssize_t
 ext4bf_file_write(struct kiocb *iocb, const struct iovec *iov,
 		unsigned long nr_segs, loff_t pos)
@@ -133,7 +194,17 @@ ext4bf_file_write(struct kiocb *iocb, const struct iovec *iov,
 		ext4bf_aiodio_wait(inode);
 	}
 
-	ret = generic_file_aio_write(iocb, iov, nr_segs, pos);
+	/* redirect_write needs the multi-page path, even for one page */
+	if (ext4bf_should_journal_data(inode) &&
+	    ext4bf_test_inode_flag(inode, EXT4_INODE_EXTENTS) &&
+	    !(iocb->ki_filp->f_flags & O_DIRECT) &&
+	    (iov_length(iov, nr_segs) > PAGE_CACHE_SIZE ||
+	     (EXT4_SB(inode->i_sb)->s_redirect_write &&
+	      iov_length(iov, nr_segs) >=
+			EXT4_SB(inode->i_sb)->s_redirect_write)))
+		ret = ext4bf_multipage_file_write(iocb, iov, nr_segs, pos);
+	else
+		ret = generic_file_aio_write(iocb, iov, nr_segs, pos);
 
 	if (unaligned_aio)
 		mutex_unlock(ext4bf_aio_mutex(inode));
@@ -76,45 +76,13 @@ static void dump_completed_IO(struct inode * inode)
  * The inode keeps track of a list of pending/completed IO that
  * might needs to do the conversion. This function walks through
  * the list and convert the related unwritten extents for completed IO
- * to written.
+ * to written, merging adjacent IOs into one conversion.
  * The function return the number of pending IOs on success.
  */
 int ext4bf_flush_completed_IO(struct inode *inode)
 {
-	ext4bf_io_end_t *io;
-	struct ext4bf_inode_info *ei = EXT4_I(inode);
-	unsigned long flags;
-	int ret = 0;
-	int ret2 = 0;
-
 	dump_completed_IO(inode);
-	spin_lock_irqsave(&ei->i_completed_io_lock, flags);
-	while (!list_empty(&ei->i_completed_io_list)){
-		io = list_entry(ei->i_completed_io_list.next,
-				ext4bf_io_end_t, list);
-		list_del_init(&io->list);
-		/*
-		 * Calling ext4bf_end_io_nolock() to convert completed
-		 * IO to written.
-		 *
-		 * When ext4bf_sync_file() is called, run_queue() may already
-		 * about to flush the work corresponding to this io structure.
-		 * It will be upset if it founds the io structure related
-		 * to the work-to-be schedule is freed.
-		 *
-		 * Thus we need to keep the io structure still valid here after
-		 * conversion finished. The io structure has a flag to
-		 * avoid double converting from both fsync and background work
-		 * queue work.
-		 */
-		spin_unlock_irqrestore(&ei->i_completed_io_lock, flags);
-		ret = ext4bf_end_io_nolock(io);
-		if (ret < 0)
-			ret2 = ret;
-		spin_lock_irqsave(&ei->i_completed_io_lock, flags);
-	}
-	spin_unlock_irqrestore(&ei->i_completed_io_lock, flags);
-	return (ret2 < 0) ? ret2 : 0;
+	return ext4bf_do_flush_completed_IO(inode);
 }
 
 /*
@@ -242,6 +210,13 @@ int ext4bf_sync_file(struct file *file, loff_t start, loff_t end, int datasync)
 		goto out;
 	}
 
+	/* Timestamps held back by lazytime have to reach the journal */
+	if (!datasync) {
+		ret = ext4bf_flush_lazy_time(inode);
+		if (ret)
+			goto out;
+	}
+
 	/*
 	 * data=writeback,ordered:
 	 *  The caller's filemap_fdatawrite()/wait will sync the data.
@@ -313,6 +288,13 @@ int ext4bf_osync_file(struct file *file, loff_t start, loff_t end)
 		goto out;
 	}
 
+	/* Timestamps held back by lazytime have to reach the journal */
+	if (!datasync) {
+		ret = ext4bf_flush_lazy_time(inode);
+		if (ret)
+			goto out;
+	}
+
 	/*
 	 * data=writeback,ordered:
 	 *  The caller's filemap_fdatawrite()/wait will sync the data.
@@ -379,6 +361,13 @@ int ext4bf_dsync_file(struct file *file, loff_t start, loff_t end)
 		goto out;
 	}
 
+	/* Timestamps held back by lazytime have to reach the journal */
+	if (!datasync) {
+		ret = ext4bf_flush_lazy_time(inode);
+		if (ret)
+			goto out;
+	}
+
 	/*
 	 * data=writeback,ordered:
 	 *  The caller's filemap_fdatawrite()/wait will sync the data.
@@ -502,8 +502,38 @@ fallback_retry:
 	return -1;
 }
 
-static int find_group_other(struct super_block *sb, struct inode *parent,
-			    ext4bf_group_t *group, int mode)
+/*
+ * Is the inode bitmap of @group already part of the running transaction?
+ * Allocating from such a group doesn't add another buffer to it.
+ */
+static int inode_bitmap_in_transaction(handle_t *handle,
+				       struct super_block *sb,
+				       ext4bf_group_t group)
+{
+	struct ext4bf_group_desc *desc;
+	struct buffer_head *bh;
+	int ret = 0;
+
+	if (!ext4bf_handle_valid(handle))
+		return 0;
+	desc = ext4bf_get_group_desc(sb, group, NULL);
+	if (!desc)
+		return 0;
+	bh = sb_find_get_block(sb, ext4bf_inode_bitmap(sb, desc));
+	if (!bh)
+		return 0;
+	jbdbf_lock_bh_state(bh);
+	if (buffer_jbd(bh) &&
+	    bh2jhbf(bh)->b_transaction == handle->h_transaction)
+		ret = 1;
+	jbdbf_unlock_bh_state(bh);
+	brelse(bh);
+	return ret;
+}
+
+static int find_group_other(handle_t *handle, struct super_block *sb,
+			    struct inode *parent, ext4bf_group_t *group,
+			    int mode)
 {
 	ext4bf_group_t parent_group = EXT4_I(parent)->i_block_group;
 	ext4bf_group_t i, last, ngroups = ext4bf_get_groups_count(sb);
@@ -516,8 +546,16 @@ static int find_group_other(struct super_block *sb, struct inode *parent,
 	 * find another flex group, and store that information in the
 	 * parent directory's inode information so that use that flex
 	 * group for future allocations.
+	 *
+	 * Within the flex group, each CPU keeps allocating from the group
+	 * it used last as long as that group's bitmap is already in the
+	 * running transaction, and otherwise starts looking at a group of
+	 * its own, so parallel creators don't all pile onto the first
+	 * group's bitmap.
 	 */
 	if (flex_size > 1) {
+		struct ext4bf_inode_cursor *ic;
+		ext4bf_group_t first, start;
 		int retry = 0;
 
 	try_again:
@@ -525,13 +563,32 @@ static int find_group_other(struct super_block *sb, struct inode *parent,
 		last = parent_group + flex_size;
 		if (last > ngroups)
 			last = ngroups;
-		for  (i = parent_group; i < last; i++) {
+
+		ic = get_cpu_ptr(EXT4_SB(sb)->s_inode_cursor);
+		start = ic->ic_group;
+		first = parent_group + smp_processor_id() % flex_size;
+		put_cpu_ptr(EXT4_SB(sb)->s_inode_cursor);
+
+		if (start >= parent_group && start < last &&
+		    inode_bitmap_in_transaction(handle, sb, start)) {
+			desc = ext4bf_get_group_desc(sb, start, NULL);
+			if (desc && ext4bf_free_inodes_count(sb, desc)) {
+				*group = start;
+				return 0;
+			}
+		}
+		if (first >= last)
+			first = parent_group;
+		i = first;
+		do {
 			desc = ext4bf_get_group_desc(sb, i, NULL);
 			if (desc && ext4bf_free_inodes_count(sb, desc)) {
 				*group = i;
 				return 0;
 			}
-		}
+			if (++i == last)
+				i = parent_group;
+		} while (i != first);
 		if (!retry && EXT4_I(parent)->i_last_alloc_group != ~0) {
 			retry = 1;
 			parent_group = EXT4_I(parent)->i_last_alloc_group;
@@ -712,6 +769,8 @@ struct inode *ext4bf_new_inode(handle_t *handle, struct inode *dir, int mode,
 	struct inode *ret;
 	ext4bf_group_t i;
 	ext4bf_group_t flex_group;
+	struct ext4bf_inode_cursor *ic;
+	unsigned long start_ino;
 
 	/* Cannot create files in a deleted directory */
 	if (!dir || !dir->i_nlink)
@@ -741,7 +800,13 @@ struct inode *ext4bf_new_inode(handle_t *handle, struct inode *dir, int mode,
 	if (S_ISDIR(mode))
 		ret2 = find_group_orlov(sb, dir, &group, mode, qstr);
 	else
-		ret2 = find_group_other(sb, dir, &group, mode);
+		ret2 = find_group_other(handle, sb, dir, &group, mode);
+
+	/* carry on from where this CPU's last allocation left off */
+	ic = get_cpu_ptr(sbi->s_inode_cursor);
+	if (ic->ic_group == group)
+		ino = ic->ic_ino;
+	put_cpu_ptr(sbi->s_inode_cursor);
 
 got_group:
 	EXT4_I(dir)->i_last_alloc_group = group;
@@ -761,10 +826,16 @@ got_group:
 		if (!inode_bitmap_bh)
 			goto fail;
 
+		start_ino = ino;
 repeat_in_this_group:
 		ino = ext4bf_find_next_zero_bit((unsigned long *)
 					      inode_bitmap_bh->b_data,
 					      EXT4_INODES_PER_GROUP(sb), ino);
+		if (ino >= EXT4_INODES_PER_GROUP(sb) && start_ino) {
+			/* wrap around to the inodes before the cursor */
+			ino = start_ino = 0;
+			goto repeat_in_this_group;
+		}
 
 		if (ino < EXT4_INODES_PER_GROUP(sb)) {
 
@@ -791,14 +862,19 @@ repeat_in_this_group:
 					goto fail;
 				/* zero bit is inode number 1*/
 				ino++;
+				ic = get_cpu_ptr(sbi->s_inode_cursor);
+				ic->ic_group = group;
+				ic->ic_ino = ino;
+				put_cpu_ptr(sbi->s_inode_cursor);
 				goto got;
 			}
 			/* we lost it */
 			ext4bf_handle_release_buffer(handle, inode_bitmap_bh);
 			ext4bf_handle_release_buffer(handle, group_desc_bh);
 
-			if (++ino < EXT4_INODES_PER_GROUP(sb))
-				goto repeat_in_this_group;
+			/* the search wraps to the inodes before the cursor */
+			ino++;
+			goto repeat_in_this_group;
 		}
 
 		/*
@@ -927,9 +1003,16 @@ got:
 		}
 	}
 
+	/* Small files are kept in the inode until they outgrow it. */
+	if (EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_INLINE_DATA) &&
+	    S_ISREG(mode))
+		ext4bf_set_inode_state(inode, EXT4_STATE_MAY_INLINE_DATA);
+
 	if (ext4bf_handle_valid(handle)) {
 		ei->i_sync_tid = handle->h_transaction->t_tid;
 		ei->i_datasync_tid = handle->h_transaction->t_tid;
+		ei->i_create_tid = handle->h_transaction->t_tid;
+		ext4bf_set_inode_state(inode, EXT4_STATE_CREATED);
 	}
 
 	err = ext4bf_mark_inode_dirty(handle, inode);
@@ -965,6 +1048,48 @@ fail_drop:
 	return ERR_PTR(err);
 }
 
+/*
+ * Create an unlinked regular file owned like @inode, with its inode near
+ * @inode's so that its blocks are allocated near @inode's too.  It is on
+ * the orphan list, so it and whatever blocks it holds go away on the
+ * last iput() or on the next mount after a crash.
+ */
+struct inode *ext4bf_new_orphan_inode(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct inode *orphan;
+	handle_t *handle;
+	uid_t owner[2];
+	__u32 goal;
+
+	handle = ext4bf_journal_start(inode, EXT4_DATA_TRANS_BLOCKS(sb) +
+					EXT4_INDEX_EXTRA_TRANS_BLOCKS + 3 +
+					EXT4_MAXQUOTAS_INIT_BLOCKS(sb) + 1);
+	if (IS_ERR(handle))
+		return ERR_CAST(handle);
+
+	goal = (((inode->i_ino - 1) / EXT4_INODES_PER_GROUP(sb)) *
+		EXT4_INODES_PER_GROUP(sb)) + 1;
+	/* blocks the new inode ends up with are charged to @inode's owner */
+	owner[0] = inode->i_uid;
+	owner[1] = inode->i_gid;
+	orphan = ext4bf_new_inode(handle, sb->s_root->d_inode, S_IFREG,
+				  NULL, goal, owner);
+	if (!IS_ERR(orphan)) {
+		orphan->i_op = &ext4bf_file_inode_operations;
+		orphan->i_fop = &ext4bf_file_operations;
+		ext4bf_set_aops(orphan);
+		ext4bf_clear_inode_state(orphan, EXT4_STATE_MAY_INLINE_DATA);
+		/* it is meant to be handed blocks that are not its own */
+		ext4bf_clear_inode_state(orphan, EXT4_STATE_CREATED);
+		clear_nlink(orphan);
+		ext4bf_orphan_add(handle, orphan);
+		unlock_new_inode(orphan);
+	}
+	ext4bf_journal_stop(handle);
+	return orphan;
+}
+
 /* Verify that we are loading a valid orphan from disk */
 struct inode *ext4bf_orphan_get(struct super_block *sb, unsigned long ino)
 {
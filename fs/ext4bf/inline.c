@@ -0,0 +1,477 @@
+/*
+ *  linux/fs/ext4bf/inline.c
+ *
+ * Inline data: the contents of small regular files are kept in the inode
+ * body, in i_block and in the in-inode "system.data" attribute, and are
+ * journalled with the inode instead of being written to a data block.
+ * A file moves to blocks as soon as a write no longer fits.
+ */
+
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+
+#include "ext4bf_jbdbf.h"
+#include "ext4bf.h"
+#include "xattr.h"
+
+/*
+ * Largest file that can be kept inline: i_block plus whatever room the
+ * inode body has left for the data attribute.
+ */
+static loff_t ext4bf_get_max_inline_size(struct inode *inode)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	struct ext4bf_iloc iloc;
+	size_t free;
+
+	if (ei->i_extra_isize == 0 || ext4bf_get_inode_loc(inode, &iloc))
+		return EXT4_MIN_INLINE_DATA_SIZE;
+	down_read(&ei->xattr_sem);
+	free = ext4bf_xattr_ibody_inline_free(inode, &iloc,
+					      EXT4_XATTR_INDEX_SYSTEM,
+					      EXT4_XATTR_SYSTEM_DATA);
+	up_read(&ei->xattr_sem);
+	brelse(iloc.bh);
+	return min_t(loff_t, EXT4_MIN_INLINE_DATA_SIZE + free,
+		     PAGE_CACHE_SIZE);
+}
+
+/* Fill page 0 of @inode from its inline data and mark it uptodate. */
+static int ext4bf_read_inline_data(struct inode *inode, struct page *page)
+{
+	size_t size = min_t(loff_t, i_size_read(inode), PAGE_CACHE_SIZE);
+	size_t len = min_t(size_t, size, EXT4_MIN_INLINE_DATA_SIZE);
+	void *kaddr;
+	int ret = 0;
+
+	kaddr = kmap(page);
+	memcpy(kaddr, EXT4_I(inode)->i_data, len);
+	if (size > len) {
+		ret = ext4bf_xattr_ibody_inline_get(inode,
+						    EXT4_XATTR_INDEX_SYSTEM,
+						    EXT4_XATTR_SYSTEM_DATA,
+						    kaddr + len, size - len);
+		if (ret >= 0)
+			len += ret;
+		else if (ret == -ENODATA)
+			ret = 0;
+	}
+	if (ret >= 0) {
+		memset(kaddr + len, 0, PAGE_CACHE_SIZE - len);
+		flush_dcache_page(page);
+		SetPageUptodate(page);
+		ret = 0;
+	}
+	kunmap(page);
+	return ret;
+}
+
+/*
+ * Store the first @size bytes of @page as the inline data of @inode.  The
+ * inode is journalled by @handle together with the new contents.
+ */
+static int ext4bf_write_inline_data(handle_t *handle, struct inode *inode,
+				    struct page *page, size_t size)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	size_t len = min_t(size_t, size, EXT4_MIN_INLINE_DATA_SIZE);
+	struct ext4bf_iloc iloc;
+	void *kaddr;
+	int ret;
+
+	ret = ext4bf_reserve_inode_write(handle, inode, &iloc);
+	if (ret)
+		return ret;
+
+	kaddr = kmap(page);
+	down_write(&ei->xattr_sem);
+	ret = ext4bf_xattr_ibody_inline_set(handle, inode, &iloc,
+					    EXT4_XATTR_INDEX_SYSTEM,
+					    EXT4_XATTR_SYSTEM_DATA,
+					    kaddr + len, size - len);
+	/* Without room in the inode body only i_block is used. */
+	if (ret == -ENOSPC && size == len)
+		ret = 0;
+	if (!ret) {
+		memset(ei->i_data, 0, sizeof(ei->i_data));
+		memcpy(ei->i_data, kaddr, len);
+	}
+	up_write(&ei->xattr_sem);
+	kunmap(page);
+
+	if (ret) {
+		brelse(iloc.bh);
+		return ret;
+	}
+	return ext4bf_mark_iloc_dirty(handle, inode, &iloc);
+}
+
+/* Turn an empty inode that may hold inline data into one that does. */
+static int ext4bf_create_inline_data(handle_t *handle, struct inode *inode)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	struct ext4bf_iloc iloc;
+	int ret;
+
+	ret = ext4bf_reserve_inode_write(handle, inode, &iloc);
+	if (ret)
+		return ret;
+
+	down_write(&ei->xattr_sem);
+	ret = ext4bf_xattr_ibody_inline_set(handle, inode, &iloc,
+					    EXT4_XATTR_INDEX_SYSTEM,
+					    EXT4_XATTR_SYSTEM_DATA, "", 0);
+	if (ret == -ENOSPC)
+		ret = 0;
+	if (!ret) {
+		memset(ei->i_data, 0, sizeof(ei->i_data));
+		ext4bf_clear_inode_flag(inode, EXT4_INODE_EXTENTS);
+		ext4bf_set_inode_flag(inode, EXT4_INODE_INLINE_DATA);
+	}
+	up_write(&ei->xattr_sem);
+
+	if (ret) {
+		brelse(iloc.bh);
+		return ret;
+	}
+	return ext4bf_mark_iloc_dirty(handle, inode, &iloc);
+}
+
+/*
+ * Called by write_begin for inodes that have, or may get, inline data.
+ * Returns 1 with page 0 locked and the handle running when the write is
+ * done inline, 0 when it has to go to blocks (any inline data has been
+ * moved out by then), or a negative error.
+ */
+int ext4bf_try_to_write_inline_data(struct address_space *mapping,
+				    struct inode *inode, loff_t pos,
+				    unsigned len, unsigned flags,
+				    struct page **pagep)
+{
+	handle_t *handle;
+	struct page *page;
+	int ret;
+
+	if (!ext4bf_has_inline_data(inode) &&
+	    (!ext4bf_test_inode_state(inode, EXT4_STATE_MAY_INLINE_DATA) ||
+	     i_size_read(inode)))
+		return 0;
+
+	if (max_t(loff_t, i_size_read(inode), pos + len) >
+	    ext4bf_get_max_inline_size(inode))
+		return ext4bf_convert_inline_data(inode);
+
+	handle = ext4bf_journal_start(inode, EXT4_DATA_TRANS_BLOCKS(inode->i_sb));
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	/* We cannot recurse into the filesystem as the transaction is already
+	 * started */
+	flags |= AOP_FLAG_NOFS;
+	page = grab_cache_page_write_begin(mapping, 0, flags);
+	if (!page) {
+		ext4bf_journal_stop(handle);
+		return -ENOMEM;
+	}
+
+	ret = 0;
+	if (!ext4bf_has_inline_data(inode)) {
+		if (!ext4bf_test_inode_state(inode, EXT4_STATE_MAY_INLINE_DATA))
+			goto out;
+		ret = ext4bf_create_inline_data(handle, inode);
+		if (ret)
+			goto out;
+		ext4bf_clear_inode_state(inode, EXT4_STATE_MAY_INLINE_DATA);
+	}
+	if (!PageUptodate(page)) {
+		ret = ext4bf_read_inline_data(inode, page);
+		if (ret)
+			goto out;
+	}
+	*pagep = page;
+	return 1;
+
+out:
+	unlock_page(page);
+	page_cache_release(page);
+	ext4bf_journal_stop(handle);
+	return ret;
+}
+
+/* write_end counterpart of ext4bf_try_to_write_inline_data(). */
+int ext4bf_write_inline_data_end(struct inode *inode, loff_t pos,
+				 unsigned len, unsigned copied,
+				 struct page *page)
+{
+	handle_t *handle = ext4bf_journal_current_handle();
+	loff_t size = inode->i_size;
+	int ret, ret2;
+
+	if (copied < len && !PageUptodate(page))
+		copied = 0;
+	if (pos + copied > size)
+		size = pos + copied;
+
+	/* Only grow the file once the bytes are actually in the inode. */
+	ret = ext4bf_write_inline_data(handle, inode, page, size);
+	if (!ret && size > inode->i_size)
+		i_size_write(inode, size);
+	if (!ret && size > EXT4_I(inode)->i_disksize) {
+		ext4bf_update_i_disksize(inode, size);
+		ret = ext4bf_mark_inode_dirty(handle, inode);
+	}
+	EXT4_I(inode)->i_datasync_tid = handle->h_transaction->t_tid;
+	unlock_page(page);
+	page_cache_release(page);
+
+	ret2 = ext4bf_journal_stop(handle);
+	if (!ret)
+		ret = ret2;
+	return ret ? ret : copied;
+}
+
+int ext4bf_readpage_inline(struct inode *inode, struct page *page)
+{
+	int ret = 0;
+
+	if (!page->index)
+		ret = ext4bf_read_inline_data(inode, page);
+	else if (!PageUptodate(page)) {
+		zero_user_segment(page, 0, PAGE_CACHE_SIZE);
+		SetPageUptodate(page);
+	}
+	unlock_page(page);
+	return ret;
+}
+
+/*
+ * Map the logical blocks [0, @nr) of @inode, whose inline data has just
+ * been dropped, onto the blocks from @pblk.
+ */
+static int ext4bf_map_converted_blocks(handle_t *handle, struct inode *inode,
+				       ext4bf_fsblk_t pblk, unsigned nr)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	struct ext4bf_ext_path *path;
+	struct ext4bf_extent newex;
+	unsigned i;
+	int ret;
+
+	if (!ext4bf_test_inode_flag(inode, EXT4_INODE_EXTENTS)) {
+		for (i = 0; i < nr; i++)
+			ei->i_data[i] = cpu_to_le32(pblk + i);
+		return ext4bf_mark_inode_dirty(handle, inode);
+	}
+
+	down_write(&ei->i_data_sem);
+	path = ext4bf_ext_find_extent(inode, 0, NULL);
+	if (IS_ERR(path)) {
+		ret = PTR_ERR(path);
+	} else {
+		newex.ee_block = 0;
+		newex.ee_len = cpu_to_le16(nr);
+		ext4bf_ext_store_pblock(&newex, pblk);
+		ret = ext4bf_ext_insert_extent(handle, inode, path, &newex, 0);
+		ext4bf_ext_drop_refs(path);
+		kfree(path);
+	}
+	ext4bf_ext_invalidate_cache(inode);
+	up_write(&ei->i_data_sem);
+	return ret;
+}
+
+/*
+ * Move the inline data of @inode to newly allocated blocks.  They are
+ * allocated before the inline data is dropped, so running out of space or
+ * quota leaves the file inline and intact.  The blocks are instantiated
+ * through page 0 like any buffered write, so for journalled inodes they go
+ * in place as a data run of the transaction that drops the inline data.
+ * Page 0's lock serialises this against inline writers.
+ */
+int ext4bf_convert_inline_data(struct inode *inode)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	struct ext4bf_allocation_request ar;
+	struct ext4bf_iloc iloc;
+	struct buffer_head *bh;
+	ext4bf_fsblk_t pblk = 0;
+	handle_t *handle;
+	struct page *page;
+	unsigned size, nr, i;
+	int ret, ret2;
+
+	ext4bf_clear_inode_state(inode, EXT4_STATE_MAY_INLINE_DATA);
+	if (!ext4bf_has_inline_data(inode))
+		return 0;
+
+	handle = ext4bf_journal_start(inode,
+				      ext4bf_writepage_trans_blocks(inode) + 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	page = grab_cache_page_write_begin(inode->i_mapping, 0,
+					   AOP_FLAG_NOFS);
+	if (!page) {
+		ret = -ENOMEM;
+		goto out_stop;
+	}
+	ret = 0;
+	if (!ext4bf_has_inline_data(inode))
+		goto out_unlock;
+	if (!PageUptodate(page)) {
+		ret = ext4bf_read_inline_data(inode, page);
+		if (ret)
+			goto out_unlock;
+	}
+	size = min_t(loff_t, i_size_read(inode), PAGE_CACHE_SIZE);
+	nr = (size + (1 << inode->i_blkbits) - 1) >> inode->i_blkbits;
+
+	if (nr) {
+		memset(&ar, 0, sizeof(ar));
+		ar.inode = inode;
+		ar.goal = ext4bf_inode_to_goal_block(inode);
+		ar.len = nr;
+		ar.flags = EXT4_MB_HINT_DATA;
+		pblk = ext4bf_mb_new_blocks(handle, &ar, &ret);
+		if (ret)
+			goto out_unlock;
+		if (ar.len < nr) {
+			ext4bf_free_blocks(handle, inode, NULL, pblk, ar.len, 0);
+			ret = -ENOSPC;
+			goto out_unlock;
+		}
+	}
+
+	ret = ext4bf_reserve_inode_write(handle, inode, &iloc);
+	if (ret)
+		goto out_free;
+	down_write(&ei->xattr_sem);
+	ret = ext4bf_xattr_ibody_inline_set(handle, inode, &iloc,
+					    EXT4_XATTR_INDEX_SYSTEM,
+					    EXT4_XATTR_SYSTEM_DATA, NULL, 0);
+	if (!ret) {
+		memset(ei->i_data, 0, sizeof(ei->i_data));
+		ext4bf_clear_inode_flag(inode, EXT4_INODE_INLINE_DATA);
+	}
+	up_write(&ei->xattr_sem);
+	if (ret) {
+		brelse(iloc.bh);
+		goto out_free;
+	}
+	ret = ext4bf_mark_iloc_dirty(handle, inode, &iloc);
+	if (ret)
+		goto out_free;
+	if (EXT4_HAS_INCOMPAT_FEATURE(inode->i_sb,
+				      EXT4_FEATURE_INCOMPAT_EXTENTS)) {
+		ext4bf_set_inode_flag(inode, EXT4_INODE_EXTENTS);
+		ext4bf_ext_tree_init(handle, inode);
+	}
+	if (!nr)
+		goto out_unlock;
+
+	ret = ext4bf_map_converted_blocks(handle, inode, pblk, nr);
+	if (ret) {
+		/* Put the data back inline rather than lose it. */
+		memset(ei->i_data, 0, sizeof(ei->i_data));
+		ext4bf_clear_inode_flag(inode, EXT4_INODE_EXTENTS);
+		ext4bf_set_inode_flag(inode, EXT4_INODE_INLINE_DATA);
+		if (ext4bf_write_inline_data(handle, inode, page, size))
+			EXT4_ERROR_INODE(inode, "lost inline data");
+		goto out_free;
+	}
+
+	/* New buffers make the page go in place rather than be journalled. */
+	if (!page_has_buffers(page))
+		create_empty_buffers(page, 1 << inode->i_blkbits, 0);
+	bh = page_buffers(page);
+	for (i = 0; i < nr; i++, bh = bh->b_this_page) {
+		map_bh(bh, inode->i_sb, pblk + i);
+		set_buffer_new(bh);
+		set_buffer_csum_new(bh);
+		set_buffer_uptodate(bh);
+		unmap_underlying_metadata(bh->b_bdev, bh->b_blocknr);
+	}
+	ret = ext4bf_commit_page_range(handle, inode, page, 0, size);
+	goto out_unlock;
+
+out_free:
+	if (nr)
+		ext4bf_free_blocks(handle, inode, NULL, pblk, nr, 0);
+out_unlock:
+	unlock_page(page);
+	page_cache_release(page);
+out_stop:
+	ret2 = ext4bf_journal_stop(handle);
+	return ret ? ret : ret2;
+}
+
+/* Trim the inline data of @inode to its new i_size. */
+int ext4bf_inline_data_truncate(struct inode *inode)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	size_t size = min_t(loff_t, inode->i_size, PAGE_CACHE_SIZE);
+	struct ext4bf_iloc iloc;
+	handle_t *handle;
+	void *value = NULL;
+	int len = 0, ret, ret2;
+
+	if (size > EXT4_MIN_INLINE_DATA_SIZE) {
+		len = ext4bf_xattr_ibody_inline_get(inode,
+						    EXT4_XATTR_INDEX_SYSTEM,
+						    EXT4_XATTR_SYSTEM_DATA,
+						    NULL, 0);
+		/* The data already ends before the new size. */
+		if (len == -ENODATA ||
+		    (len >= 0 && len <= size - EXT4_MIN_INLINE_DATA_SIZE))
+			return 0;
+		if (len < 0)
+			return len;
+		value = kmalloc(len, GFP_NOFS);
+		if (!value)
+			return -ENOMEM;
+		ret = ext4bf_xattr_ibody_inline_get(inode,
+						    EXT4_XATTR_INDEX_SYSTEM,
+						    EXT4_XATTR_SYSTEM_DATA,
+						    value, len);
+		if (ret < 0)
+			goto out_free;
+		len = size - EXT4_MIN_INLINE_DATA_SIZE;
+	}
+
+	handle = ext4bf_journal_start(inode, EXT4_DATA_TRANS_BLOCKS(inode->i_sb));
+	if (IS_ERR(handle)) {
+		ret = PTR_ERR(handle);
+		goto out_free;
+	}
+	ret = ext4bf_reserve_inode_write(handle, inode, &iloc);
+	if (ret)
+		goto out_stop;
+
+	down_write(&ei->xattr_sem);
+	if (ext4bf_has_inline_data(inode)) {
+		if (size < EXT4_MIN_INLINE_DATA_SIZE)
+			memset((char *)ei->i_data + size, 0,
+			       EXT4_MIN_INLINE_DATA_SIZE - size);
+		ret = ext4bf_xattr_ibody_inline_set(handle, inode, &iloc,
+						    EXT4_XATTR_INDEX_SYSTEM,
+						    EXT4_XATTR_SYSTEM_DATA,
+						    value ? value : "", len);
+		if (ret == -ENOSPC && !len)
+			ret = 0;
+	}
+	up_write(&ei->xattr_sem);
+	if (ret)
+		brelse(iloc.bh);
+	else
+		ret = ext4bf_mark_iloc_dirty(handle, inode, &iloc);
+
+out_stop:
+	ret2 = ext4bf_journal_stop(handle);
+	if (!ret)
+		ret = ret2;
+out_free:
+	kfree(value);
+	return ret;
+}
@@ -29,6 +29,7 @@
 #include <linux/buffer_head.h>
 #include <linux/writeback.h>
 #include <linux/pagevec.h>
+#include <linux/swap.h>
 #include <linux/mpage.h>
 #include <linux/namei.h>
 #include <linux/uio.h>
@@ -78,6 +79,16 @@ static void ext4bf_end_io_buffer_write(struct buffer_head *bh, int uptodate);
 static int __ext4bf_journalled_writepage(struct page *page, unsigned int len);
 static int ext4bf_bh_delay_or_unwritten(handle_t *handle, struct buffer_head *bh);
 
+/*
+ * ext4bf: once its page goes to disk a block is no longer new, and
+ * journal_csum_writepage() must not tag a later rewrite of it.
+ */
+static int ext4bf_bh_clear_csum_new(handle_t *handle, struct buffer_head *bh)
+{
+	clear_buffer_csum_new(bh);
+	return 0;
+}
+
 /*
  * Test whether an inode is a fast symlink.
  */
@@ -128,8 +139,12 @@ void ext4bf_evict_inode(struct inode *inode)
 	*/
 
 	ext4bf_ioend_wait(inode);
+	/* the conversion work may still be unlocking i_mutex */
+	cancel_work_sync(&EXT4_I(inode)->i_unwritten_work);
 
 	if (inode->i_nlink) {
+		if (EXT4_SB(inode->i_sb)->s_journal)
+			ext4bf_flush_lazy_time(inode);
 		/*
 		 * When journalling data dirty buffers are tracked only in the
 		 * journal. So although mm thinks everything is clean and
@@ -480,6 +495,9 @@ int ext4bf_map_blocks(handle_t *handle, struct inode *inode,
 	ext_debug("ext4bf_map_blocks(): inode %lu, flag %d, max_blocks %u,"
 		  "logical block %lu\n", inode->i_ino, flags, map->m_len,
 		  (unsigned long) map->m_lblk);
+	/* i_block holds file data, not a block map; see inline.c. */
+	if (WARN_ON_ONCE(ext4bf_has_inline_data(inode)))
+		return -EIO;
 	/*
 	 * Try to see if we can get the block without requesting a new
 	 * file system block.
@@ -622,6 +640,10 @@ static int _ext4bf_get_block(struct inode *inode, sector_t iblock,
 		map_bh(bh, inode->i_sb, map.m_pblk);
 		bh->b_state = (bh->b_state & ~EXT4_MAP_FLAGS) | map.m_flags;
 		bh->b_size = inode->i_sb->s_blocksize * map.m_len;
+		if (map.m_flags & EXT4_MAP_NEW)
+			set_buffer_csum_new(bh);
+		else
+			clear_buffer_csum_new(bh);
 		ret = 0;
 	}
 	if (started)
@@ -636,6 +658,33 @@ int ext4bf_get_block(struct inode *inode, sector_t iblock,
 			       create ? EXT4_GET_BLOCKS_CREATE : 0);
 }
 
+/*
+ * ext4bf: get_block for buffered writes to journalled inodes.  Blocks of a
+ * preallocated (unwritten) extent are handed back still unwritten, so that
+ * write_end_fn() writes them in place as a data run like newly allocated
+ * blocks; ext4bf_jdata_convert_unwritten() then converts the extent in the
+ * same transaction.
+ */
+static int ext4bf_get_block_jdata(struct inode *inode, sector_t iblock,
+				  struct buffer_head *bh, int create)
+{
+	struct ext4bf_map_blocks map;
+	int ret;
+
+	map.m_lblk = iblock;
+	map.m_len = 1;
+	ret = ext4bf_map_blocks(NULL, inode, &map, 0);
+	if (ret < 0)
+		return ret;
+	if (ret > 0 && (map.m_flags & EXT4_MAP_UNWRITTEN)) {
+		map_bh(bh, inode->i_sb, map.m_pblk);
+		set_buffer_unwritten(bh);
+		set_buffer_new(bh);
+		return 0;
+	}
+	return ext4bf_get_block(inode, iblock, bh, create);
+}
+
 /*
  * `handle' can be NULL if create is zero
  */
@@ -781,6 +830,13 @@ static int do_journal_get_write_access(handle_t *handle,
 
 	if (!buffer_mapped(bh) || buffer_freed(bh))
 		return 0;
+	/*
+	 * ext4bf: a delayed block has no disk block to journal yet; it is
+	 * written as a data run once ext4bf_jdata_alloc_delayed() allocates
+	 * it, which must not find a journal_bf_head on it.
+	 */
+	if (buffer_delay(bh))
+		return 0;
 	/*
 	 * __block_write_begin() could have dirtied some buffers. Clean
 	 * the dirty bit as jbdbf_journal_get_write_access() could complain
@@ -797,6 +853,49 @@ static int do_journal_get_write_access(handle_t *handle,
 	return ret;
 }
 
+/*
+ * ext4bf: write_begin counterpart of do_journal_get_write_access() for
+ * barrier-free data.  Newly allocated blocks and blocks of preallocated
+ * extents are tracked as data runs by write_end_fn() and need no
+ * journal_bf_head, so skip write access for them.  So are delayed
+ * blocks, including ones rewritten after __block_write_begin() cleared
+ * their new bit.
+ */
+static int do_journal_get_data_access(handle_t *handle,
+				      struct buffer_head *bh)
+{
+	if (buffer_delay(bh))
+		return 0;
+#if defined(DCHECKSUM) && defined(PARTJ)
+	if (buffer_mapped(bh) && (buffer_new(bh) || buffer_unwritten(bh)) &&
+	    !buffer_jbd(bh) && bh->b_blocktype == B_BLOCKTYPE_DATA) {
+		clear_buffer_dirty(bh);
+		return 0;
+	}
+#endif
+	return do_journal_get_write_access(handle, bh);
+}
+
+/*
+ * ext4bf: page_mkwrite counterpart of do_journal_get_data_access().  Blocks
+ * that page_mkwrite just allocated are written in place as a data run of
+ * the allocating transaction; the data stored into the page later is
+ * journalled by writepage(s) like any other overwrite.
+ */
+static int do_journal_get_mkwrite_access(handle_t *handle,
+					 struct buffer_head *bh)
+{
+#if defined(DCHECKSUM) && defined(PARTJ)
+	if (test_clear_buffer_appended(bh) && buffer_mapped(bh) &&
+	    !buffer_freed(bh) && !buffer_jbd(bh) &&
+	    bh->b_blocktype == B_BLOCKTYPE_DATA) {
+		clear_buffer_dirty(bh);
+		return jbdbf_journal_dirty_data_run(handle, bh);
+	}
+#endif
+	return do_journal_get_write_access(handle, bh);
+}
+
 /* ext4bf - ext4bf: walk and print page buffers with given tid. */
 static void walk_and_print_buffers(tid_t tid,
                  struct buffer_head *head,
@@ -829,6 +928,445 @@ static void walk_and_print_buffers(tid_t tid,
 }
 /* */
 
+/*
+ * ext4bf: multi-page buffered writes on journalled inodes.
+ *
+ * ext4bf_file_write() brackets large write()s with
+ * ext4bf_begin_multipage_write() and ext4bf_end_multipage_write(), and
+ * copies the pages with ext4bf_perform_multipage_write().  The pages then
+ * share one handle, blocks are mapped or allocated one extent at a time
+ * instead of one page at a time, and i_disksize is updated once at the end
+ * instead of by every page.
+ */
+static inline int ext4bf_in_multipage_write(struct inode *inode)
+{
+	return EXT4_I(inode)->i_write_task == current;
+}
+
+static int ext4bf_multipage_credits(struct inode *inode, loff_t len)
+{
+	journal_t *journal = EXT4_JOURNAL(inode);
+	int nrblocks = min_t(loff_t, (len >> inode->i_blkbits) + 2,
+			     journal->j_max_transaction_buffers);
+	int credits;
+
+	/* data blocks that get journalled, their mapping, orphan + inode */
+	credits = nrblocks + ext4bf_chunk_trans_blocks(inode, nrblocks) + 2;
+	return min(credits, journal->j_max_transaction_buffers / 2);
+}
+
+/*
+ * ext4bf: redirect-on-write for large overwrites (redirect_write=).  Blocks
+ * that such a write covers completely and that are already on disk are
+ * moved to new blocks, and are then written in place with a data tag like
+ * appended data instead of going through the journal and checkpoint.
+ *
+ * Each page is redirected within the handle that spans its write_begin and
+ * write_end: write_begin allocates the new blocks, next to those of the
+ * previous page, and switches the mapping under the page lock so that
+ * nobody reads a new block before its data is copied in; write_end frees
+ * the old blocks once the page is fully copied, and moves it back onto them
+ * after a short copy.  Nothing outlives the handle, so a crash leaks no
+ * blocks.  Blocks that still carry journal state, or whose redirect fails,
+ * take the journalled path as before.
+ */
+static int ext4bf_should_redirect_write(struct inode *inode)
+{
+	unsigned long threshold = EXT4_SB(inode->i_sb)->s_redirect_write;
+
+	return threshold && ext4bf_in_multipage_write(inode) &&
+		EXT4_I(inode)->i_write_len >= threshold &&
+		ext4bf_test_inode_flag(inode, EXT4_INODE_EXTENTS);
+}
+
+/* Redirect the blocks of @page that [from, to) overwrites completely. */
+static int ext4bf_redirect_page_blocks(handle_t *handle, struct inode *inode,
+				       struct page *page, unsigned from,
+				       unsigned to)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	struct buffer_head *head = page_buffers(page);
+	struct buffer_head *bh = head, *first = NULL;
+	unsigned block_start = 0, block_end;
+	ext4bf_lblk_t lblk = (ext4bf_lblk_t) page->index <<
+				(PAGE_CACHE_SHIFT - inode->i_blkbits);
+	ext4bf_lblk_t first_lblk = 0;
+	ext4bf_fsblk_t oldblk, newblk;
+	unsigned int nr = 0, i;
+	int err, alloc;
+
+	/* the first run of such blocks that is contiguous on disk */
+	do {
+		block_end = block_start + bh->b_size;
+		if (block_start < from || block_end > to ||
+		    !buffer_mapped(bh) || buffer_new(bh) || buffer_jbd(bh) ||
+		    buffer_datarun(bh) || buffer_delay(bh) ||
+		    buffer_unwritten(bh) ||
+		    (nr && bh->b_blocknr != first->b_blocknr + nr)) {
+			if (nr)
+				break;
+		} else if (!nr++) {
+			first = bh;
+			first_lblk = lblk;
+		}
+		block_start = block_end;
+		lblk++;
+		bh = bh->b_this_page;
+	} while (bh != head);
+	if (!nr)
+		return 0;
+
+	/* the switch here, and in write_end the switch back or the frees */
+	err = ext4bf_journal_extend(handle,
+			2 * ext4bf_writepage_trans_blocks(inode));
+	if (err)
+		return err < 0 ? err : 0;
+
+	oldblk = first->b_blocknr;
+	down_write(&ei->i_data_sem);
+	alloc = ext4bf_ext_redirect_alloc(handle, inode, first_lblk, nr,
+					  &newblk);
+	err = alloc < 0 ? alloc : 0;
+	if (alloc > 0) {
+		if ((unsigned int) alloc < nr)
+			err = -EAGAIN;
+		else
+			err = ext4bf_ext_redirect_blocks(handle, inode,
+							 first_lblk, nr,
+							 oldblk, newblk);
+		if (err)
+			ext4bf_free_blocks(handle, inode, NULL, newblk,
+					   alloc, 0);
+	}
+	up_write(&ei->i_data_sem);
+	if (err == -EAGAIN || err == -ENOSPC)
+		return 0;
+	if (err)
+		return err;
+
+	ei->i_redirect_lblk = first_lblk;
+	ei->i_redirect_old = oldblk;
+	ei->i_redirect_new = newblk;
+	ei->i_redirect_len = nr;
+	for (bh = first, i = 0; i < nr; bh = bh->b_this_page, i++) {
+		bh->b_blocknr = newblk + i;
+		set_buffer_new(bh);
+		unmap_underlying_metadata(bh->b_bdev, bh->b_blocknr);
+	}
+	return 0;
+}
+
+/*
+ * Finish the redirect of the page being written, under the handle that
+ * started it: free the blocks it replaced, or with @undo (a short copy, or
+ * a failed write_begin) move the page back onto them before
+ * page_zero_new_buffers() can zero the new blocks in place of the data.
+ */
+static int ext4bf_redirect_page_end(handle_t *handle, struct inode *inode,
+				    struct page *page, int undo)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	unsigned int len = ei->i_redirect_len, i;
+	ext4bf_lblk_t lblk = (ext4bf_lblk_t) page->index <<
+				(PAGE_CACHE_SHIFT - inode->i_blkbits);
+	struct buffer_head *bh;
+	int err;
+
+	if (!len)
+		return 0;
+	ei->i_redirect_len = 0;
+	if (!undo) {
+		ext4bf_free_blocks(handle, inode, NULL, ei->i_redirect_old, len,
+				   EXT4_FREE_BLOCKS_FORGET);
+		return 0;
+	}
+
+	down_write(&ei->i_data_sem);
+	err = ext4bf_ext_redirect_blocks(handle, inode, ei->i_redirect_lblk,
+					 len, ei->i_redirect_new,
+					 ei->i_redirect_old);
+	up_write(&ei->i_data_sem);
+	ei->i_write_map.m_len = 0;
+	if (err) {
+		ext4bf_free_blocks(handle, inode, NULL, ei->i_redirect_old, len,
+				   EXT4_FREE_BLOCKS_FORGET);
+		return err;
+	}
+	ext4bf_free_blocks(handle, inode, NULL, ei->i_redirect_new, len, 0);
+
+	for (bh = page_buffers(page); lblk < ei->i_redirect_lblk; lblk++)
+		bh = bh->b_this_page;
+	for (i = 0; i < len; bh = bh->b_this_page, i++) {
+		bh->b_blocknr = ei->i_redirect_old + i;
+		clear_buffer_new(bh);
+		err = do_journal_get_write_access(handle, bh);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+int ext4bf_begin_multipage_write(struct inode *inode, loff_t pos, size_t len)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	handle_t *handle;
+	int ret;
+
+	ei->i_write_orphan = 0;
+	if (pos + len > inode->i_size && ext4bf_can_truncate(inode)) {
+		/* Blocks may be allocated beyond what gets copied. */
+		handle = ext4bf_journal_start(inode, 3);
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
+		ret = ext4bf_orphan_add(handle, inode);
+		ext4bf_journal_stop(handle);
+		if (ret)
+			return ret;
+		ei->i_write_orphan = 1;
+	}
+	ei->i_write_task = current;
+	ei->i_write_len = len;
+	ei->i_write_end = pos + len;
+	ei->i_write_map.m_len = 0;
+	ei->i_redirect_len = 0;
+	return 0;
+}
+
+int ext4bf_end_multipage_write(struct inode *inode)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	int short_write = ei->i_write_orphan && inode->i_size < ei->i_write_end;
+	handle_t *handle;
+	int ret = 0, err;
+
+	ei->i_write_task = NULL;
+	ei->i_write_len = 0;
+	ei->i_write_map.m_len = 0;
+	if (inode->i_size > ei->i_disksize ||
+	    (ei->i_write_orphan && !short_write && inode->i_nlink)) {
+		handle = ext4bf_journal_start(inode, 3);
+		if (IS_ERR(handle)) {
+			ret = PTR_ERR(handle);
+			goto out;
+		}
+		if (inode->i_size > ei->i_disksize) {
+			ext4bf_update_i_disksize(inode, inode->i_size);
+			ret = ext4bf_mark_inode_dirty(handle, inode);
+		}
+		if (ei->i_write_orphan && !short_write && inode->i_nlink)
+			ext4bf_orphan_del(handle, inode);
+		err = ext4bf_journal_stop(handle);
+		if (!ret)
+			ret = err;
+	}
+out:
+	if (short_write) {
+		/* Trim the blocks allocated beyond i_size. */
+		ext4bf_truncate_failed_write(inode);
+		if (inode->i_nlink)
+			ext4bf_orphan_del(NULL, inode);
+	}
+	ei->i_write_orphan = 0;
+	return ret;
+}
+
+/*
+ * Credits one page of a multi-page write needs left in the handle.  A
+ * page past the cached mapping and past i_size may allocate the rest of
+ * the write as one extent.
+ */
+static int ext4bf_multipage_page_credits(struct inode *inode, loff_t pos,
+					 int needed)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	struct ext4bf_map_blocks *map = &ei->i_write_map;
+	loff_t start = pos & PAGE_CACHE_MASK;
+	ext4bf_lblk_t lblk = start >> inode->i_blkbits;
+	ext4bf_lblk_t last = (start + PAGE_CACHE_SIZE - 1) >> inode->i_blkbits;
+
+	if (start + PAGE_CACHE_SIZE <= inode->i_size ||
+	    (map->m_len && lblk >= map->m_lblk &&
+	     last < map->m_lblk + map->m_len))
+		return needed;
+	return max(needed, ext4bf_multipage_credits(inode,
+						    ei->i_write_end - pos));
+}
+
+/*
+ * generic_perform_write() for a multi-page write.  The pages share one
+ * handle, started with credits for as much of the rest of the write as a
+ * transaction takes, that write_begin and write_end nest in.  It is
+ * stopped and started again when its credits run out or its transaction
+ * begins to commit, and before the user buffer is faulted in or dirty
+ * pages are throttled, since either may wait for a commit.
+ */
+ssize_t ext4bf_perform_multipage_write(struct file *file,
+				       struct iov_iter *i, loff_t pos)
+{
+	struct address_space *mapping = file->f_mapping;
+	const struct address_space_operations *a_ops = mapping->a_ops;
+	struct inode *inode = mapping->host;
+	handle_t *handle = NULL;
+	unsigned long dirtied = 0;
+	unsigned int flags = 0;
+	ssize_t written = 0;
+	long status = 0;
+	int needed, err;
+
+	if (segment_eq(get_fs(), KERNEL_DS))
+		flags |= AOP_FLAG_UNINTERRUPTIBLE;
+
+	do {
+		struct page *page;
+		unsigned long offset;	/* Offset into pagecache page */
+		unsigned long bytes;	/* Bytes to write to page */
+		size_t copied;		/* Bytes copied from user */
+		void *fsdata;
+
+		offset = (pos & (PAGE_CACHE_SIZE - 1));
+		bytes = min_t(unsigned long, PAGE_CACHE_SIZE - offset,
+			      iov_iter_count(i));
+
+again:
+		needed = ext4bf_multipage_page_credits(inode, pos,
+				ext4bf_writepage_trans_blocks(inode) + 1);
+		if (handle && ext4bf_journal_extend(handle,
+				max(needed - handle->h_buffer_credits, 0))) {
+			status = ext4bf_journal_stop(handle);
+			handle = NULL;
+			if (status)
+				break;
+		}
+		if (!handle) {
+			balance_dirty_pages_ratelimited_nr(mapping, dirtied);
+			dirtied = 0;
+			if (unlikely(iov_iter_fault_in_readable(i, bytes))) {
+				status = -EFAULT;
+				break;
+			}
+			handle = ext4bf_journal_start(inode, max(needed,
+					ext4bf_multipage_credits(inode,
+						EXT4_I(inode)->i_write_end - pos)));
+			if (IS_ERR(handle)) {
+				status = PTR_ERR(handle);
+				handle = NULL;
+				break;
+			}
+		}
+
+		status = a_ops->write_begin(file, mapping, pos, bytes, flags,
+					    &page, &fsdata);
+		if (unlikely(status))
+			break;
+
+		if (mapping_writably_mapped(mapping))
+			flush_dcache_page(page);
+
+		pagefault_disable();
+		copied = iov_iter_copy_from_user_atomic(page, i, offset, bytes);
+		pagefault_enable();
+		flush_dcache_page(page);
+
+		mark_page_accessed(page);
+		status = a_ops->write_end(file, mapping, pos, bytes, copied,
+					  page, fsdata);
+		if (unlikely(status < 0))
+			break;
+		copied = status;
+		dirtied++;
+
+		cond_resched();
+
+		iov_iter_advance(i, copied);
+		if (unlikely(copied < bytes)) {
+			/* The rest is faulted in with the handle stopped. */
+			status = ext4bf_journal_stop(handle);
+			handle = NULL;
+			if (status)
+				break;
+			if (!copied) {
+				bytes = min_t(unsigned long,
+					      PAGE_CACHE_SIZE - offset,
+					      iov_iter_single_seg_count(i));
+				goto again;
+			}
+		}
+		pos += copied;
+		written += copied;
+
+		if (fatal_signal_pending(current)) {
+			status = -EINTR;
+			break;
+		}
+	} while (iov_iter_count(i));
+
+	if (handle) {
+		err = ext4bf_journal_stop(handle);
+		if (!status)
+			status = err;
+	}
+	balance_dirty_pages_ratelimited_nr(mapping, dirtied);
+	return written ? written : status;
+}
+
+/*
+ * get_block for multi-page writes: one ext4bf_map_blocks() call maps or
+ * allocates as much of the rest of the write as fits in one extent, and
+ * the following blocks are served from that mapping.  Inside i_size a
+ * mapping never extends past the current page, so that a short copy
+ * cannot leave allocated but unwritten blocks visible.
+ */
+static int ext4bf_get_block_multipage(struct inode *inode, sector_t iblock,
+				      struct buffer_head *bh, int create)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	struct ext4bf_map_blocks *map = &ei->i_write_map;
+	unsigned int blkbits = inode->i_blkbits;
+	sector_t eof_blk, last;
+	int ret;
+
+	if (!map->m_len || iblock < map->m_lblk ||
+	    iblock >= map->m_lblk + map->m_len) {
+		eof_blk = (inode->i_size + (1 << blkbits) - 1) >> blkbits;
+		if (iblock < eof_blk) {
+			last = (iblock | ((1 << (PAGE_CACHE_SHIFT - blkbits)) - 1));
+			last = min(last, eof_blk - 1);
+		} else
+			last = (ei->i_write_end - 1) >> blkbits;
+		map->m_lblk = iblock;
+		map->m_len = max(last, iblock) - iblock + 1;
+		ret = ext4bf_map_blocks(ext4bf_journal_current_handle(),
+					inode, map,
+					create ? EXT4_GET_BLOCKS_CREATE : 0);
+		if (ret <= 0) {
+			map->m_len = 0;
+			return ret;
+		}
+	}
+	map_bh(bh, inode->i_sb, map->m_pblk + (iblock - map->m_lblk));
+	bh->b_state = (bh->b_state & ~EXT4_MAP_FLAGS) | map->m_flags;
+	bh->b_size = 1 << blkbits;
+	return 0;
+}
+
+static int ext4bf_nonda_switch(struct super_block *sb);
+static int ext4bf_da_get_block_prep(struct inode *inode, sector_t iblock,
+				  struct buffer_head *bh, int create);
+
+/*
+ * ext4bf: delayed allocation for journalled inodes.  write_begin only
+ * reserves space for holes; the blocks are allocated by writepages, which
+ * hands them to the allocating transaction as data runs so that they are
+ * written in place with data tags.  Overwrites are journalled as before.
+ */
+static int ext4bf_should_jdata_delalloc(struct inode *inode)
+{
+	return test_opt(inode->i_sb, DELALLOC) &&
+		ext4bf_should_journal_data(inode) &&
+		ext4bf_test_inode_flag(inode, EXT4_INODE_EXTENTS) &&
+		!ext4bf_nonda_switch(inode->i_sb);
+}
+
 static int ext4bf_get_block_write(struct inode *inode, sector_t iblock,
 		   struct buffer_head *bh_result, int create);
 static int ext4bf_write_begin(struct file *file, struct address_space *mapping,
@@ -839,10 +1377,22 @@ static int ext4bf_write_begin(struct file *file, struct address_space *mapping,
 	int ret, needed_blocks;
 	handle_t *handle;
 	int retries = 0;
+	int multipage;
 	struct page *page;
 	pgoff_t index;
 	unsigned from, to;
 
+	if (ext4bf_should_journal_data(inode)) {
+		ret = ext4bf_try_to_write_inline_data(mapping, inode, pos, len,
+						      flags, pagep);
+		if (ret)
+			return ret < 0 ? ret : 0;
+	} else if (ext4bf_has_inline_data(inode)) {
+		ret = ext4bf_convert_inline_data(inode);
+		if (ret)
+			return ret;
+	}
+
 	/*
 	 * Reserve one block more for addition to orphan list in case
 	 * we allocate blocks but write fails for some reason
@@ -853,6 +1403,8 @@ static int ext4bf_write_begin(struct file *file, struct address_space *mapping,
 	to = from + len;
 
 retry:
+	/* A multi-page write nests this in its handle, see above. */
+	multipage = ext4bf_in_multipage_write(inode);
 	handle = ext4bf_journal_start(inode, needed_blocks);
 	if (IS_ERR(handle)) {
 		ret = PTR_ERR(handle);
@@ -873,9 +1425,25 @@ retry:
 
 	if (ext4bf_should_dioread_nolock(inode))
 		ret = __block_write_begin(page, pos, len, ext4bf_get_block_write);
+	else if (ext4bf_should_jdata_delalloc(inode))
+		ret = __block_write_begin(page, pos, len,
+					  ext4bf_da_get_block_prep);
+	else if (multipage)
+		ret = __block_write_begin(page, pos, len,
+					  ext4bf_get_block_multipage);
+	else if (ext4bf_should_journal_data(inode))
+		ret = __block_write_begin(page, pos, len,
+					  ext4bf_get_block_jdata);
 	else
 		ret = __block_write_begin(page, pos, len, ext4bf_get_block);
 
+	if (!ret && ext4bf_should_journal_data(inode) &&
+	    ext4bf_should_redirect_write(inode)) {
+		ret = ext4bf_redirect_page_blocks(handle, inode, page, from, to);
+		/* The extent tree has changed under the cached mapping. */
+		EXT4_I(inode)->i_write_map.m_len = 0;
+	}
+
 	if (!ret && ext4bf_should_journal_data(inode)) {
         /* ext4bf-ext4bf: mark buffers as data blocks. */
         jbd_debug(6, "EXT4BF: marking data from write_begin\n");
@@ -883,10 +1451,11 @@ retry:
                 handle->h_transaction->t_tid, page_buffers(page), from, to);
         /* */
         ret = walk_page_buffers(handle, page_buffers(page),
-				from, to, NULL, do_journal_get_write_access);
+				from, to, NULL, do_journal_get_data_access);
 	}
 
 	if (ret) {
+		ext4bf_redirect_page_end(handle, inode, page, 1);
 		unlock_page(page);
 		page_cache_release(page);
 		/*
@@ -897,11 +1466,13 @@ retry:
 		 * Add inode to orphan list in case we crash before
 		 * truncate finishes
 		 */
-		if (pos + len > inode->i_size && ext4bf_can_truncate(inode))
+		if (pos + len > inode->i_size && ext4bf_can_truncate(inode) &&
+		    !multipage)
 			ext4bf_orphan_add(handle, inode);
 
 		ext4bf_journal_stop(handle);
-		if (pos + len > inode->i_size) {
+		/* A multi-page write trims in ext4bf_end_multipage_write(). */
+		if (pos + len > inode->i_size && !multipage) {
 			ext4bf_truncate_failed_write(inode);
 			/*
 			 * If truncate failed early the inode might
@@ -925,6 +1496,12 @@ static int write_end_fn(handle_t *handle, struct buffer_head *bh)
 {
 	if (!buffer_mapped(bh) || buffer_freed(bh))
 		return 0;
+	if (buffer_delay(bh)) {
+		/* ext4bf: delayed allocation, see ext4bf_jdata_alloc_delayed() */
+		set_buffer_uptodate(bh);
+		mark_buffer_dirty(bh);
+		return 0;
+	}
 #ifdef DCHECKSUM
 	jbd_debug(6, "EXT4BF: Inside write end fn for block %lu\n", bh->b_blocknr);
 	set_buffer_uptodate(bh);
@@ -933,6 +1510,12 @@ static int write_end_fn(handle_t *handle, struct buffer_head *bh)
     if (bh->b_blocktype == B_BLOCKTYPE_DATA) {
 #endif
 #ifdef PARTJ
+        /*
+         * ext4bf: newly appended block, or block of a preallocated
+         * extent, without a journal_bf_head.
+         */
+        if ((buffer_new(bh) || buffer_unwritten(bh)) && !buffer_jbd(bh))
+            return jbdbf_journal_dirty_data_run(handle, bh);
         if (buffer_new(bh)) {
 #endif
 #ifdef DCHECKSUM
@@ -953,6 +1536,37 @@ static int write_end_fn(handle_t *handle, struct buffer_head *bh)
 	return ext4bf_handle_dirty_metadata(handle, NULL, bh);
 }
 
+/*
+ * ext4bf: commit [from, to) of a locked page whose blocks were just
+ * instantiated by __block_write_begin(), the way the write_end of the
+ * inode's data mode would.  Used when inline data moves to a block.
+ */
+int ext4bf_commit_page_range(handle_t *handle, struct inode *inode,
+			     struct page *page, unsigned from, unsigned to)
+{
+	int ret;
+
+	if (ext4bf_should_journal_data(inode)) {
+		walk_and_print_buffers(handle->h_transaction->t_tid,
+				       page_buffers(page), from, to);
+		ret = walk_page_buffers(handle, page_buffers(page), from, to,
+					NULL, do_journal_get_data_access);
+		if (!ret)
+			ret = walk_page_buffers(handle, page_buffers(page),
+						from, to, NULL, write_end_fn);
+		if (!ret)
+			ext4bf_set_inode_state(inode, EXT4_STATE_JDATA);
+		return ret;
+	}
+	if (ext4bf_should_order_data(inode)) {
+		ret = ext4bf_jbdbf_file_inode(handle, inode);
+		if (ret)
+			return ret;
+	}
+	block_commit_write(page, from, to);
+	return 0;
+}
+
 static int ext4bf_generic_write_end(struct file *file,
 				  struct address_space *mapping,
 				  loff_t pos, unsigned len, unsigned copied,
@@ -1099,6 +1713,52 @@ static int ext4bf_writeback_write_end(struct file *file,
 	return ret ? ret : copied;
 }
 
+/*
+ * ext4bf: convert the preallocated extents under the unwritten buffers in
+ * [from, to), which write_end_fn() has just queued as data runs.  The
+ * conversion runs under the caller's handle, so it commits in the same
+ * transaction as the data tags and recovery validates the blocks like any
+ * other newly appended data.
+ */
+static int ext4bf_jdata_convert_unwritten(struct inode *inode,
+					  struct page *page,
+					  unsigned from, unsigned to)
+{
+	struct buffer_head *head = page_buffers(page), *bh = head;
+	unsigned block_start = 0, block_end;
+	unsigned first = to, last = from;
+	int ret;
+
+	do {
+		block_end = block_start + bh->b_size;
+		if (block_end > from && block_start < to &&
+		    buffer_unwritten(bh)) {
+			first = min(first, block_start);
+			last = max(last, block_end);
+		}
+		block_start = block_end;
+		bh = bh->b_this_page;
+	} while (bh != head);
+	if (first >= last)
+		return 0;
+
+	ret = ext4bf_convert_unwritten_extents(inode,
+					       page_offset(page) + first,
+					       last - first);
+	if (ret)
+		return ret;
+
+	block_start = 0;
+	do {
+		block_end = block_start + bh->b_size;
+		if (block_start >= first && block_end <= last)
+			clear_buffer_unwritten(bh);
+		block_start = block_end;
+		bh = bh->b_this_page;
+	} while (bh != head);
+	return 0;
+}
+
 static int ext4bf_journalled_write_end(struct file *file,
 				     struct address_space *mapping,
 				     loff_t pos, unsigned len, unsigned copied,
@@ -1108,23 +1768,32 @@ static int ext4bf_journalled_write_end(struct file *file,
 	struct inode *inode = mapping->host;
 	int ret = 0, ret2;
 	int partial = 0;
+	int multipage;
 	unsigned from, to;
 	loff_t new_i_size;
 
 	//trace_ext4_journalled_write_end(inode, pos, len, copied);
+	if (ext4bf_has_inline_data(inode))
+		return ext4bf_write_inline_data_end(inode, pos, len, copied,
+						    page);
 	from = pos & (PAGE_CACHE_SIZE - 1);
 	to = from + len;
 
 	BUG_ON(!ext4bf_handle_valid(handle));
 
+	ret = ext4bf_redirect_page_end(handle, inode, page, copied < len);
 	if (copied < len) {
 		if (!PageUptodate(page))
 			copied = 0;
 		page_zero_new_buffers(page, from+copied, to);
 	}
 
-	ret = walk_page_buffers(handle, page_buffers(page), from,
-				to, &partial, write_end_fn);
+	ret2 = walk_page_buffers(handle, page_buffers(page), from,
+				 to, &partial, write_end_fn);
+	if (!ret)
+		ret = ret2;
+	if (!ret)
+		ret = ext4bf_jdata_convert_unwritten(inode, page, from, to);
 	if (!partial)
 		SetPageUptodate(page);
 	new_i_size = pos + copied;
@@ -1132,7 +1801,14 @@ static int ext4bf_journalled_write_end(struct file *file,
 		i_size_write(inode, pos+copied);
 	ext4bf_set_inode_state(inode, EXT4_STATE_JDATA);
 	EXT4_I(inode)->i_datasync_tid = handle->h_transaction->t_tid;
-	if (new_i_size > EXT4_I(inode)->i_disksize) {
+	/*
+	 * A multi-page write updates i_disksize once, at its end; delayed
+	 * blocks update it when they are allocated.
+	 */
+	multipage = ext4bf_in_multipage_write(inode);
+	if (new_i_size > EXT4_I(inode)->i_disksize && !multipage &&
+	    !walk_page_buffers(NULL, page_buffers(page), from, to, NULL,
+			       ext4bf_bh_delay_or_unwritten)) {
 		ext4bf_update_i_disksize(inode, new_i_size);
 		ret2 = ext4bf_mark_inode_dirty(handle, inode);
 		if (!ret)
@@ -1141,7 +1817,8 @@ static int ext4bf_journalled_write_end(struct file *file,
 
 	unlock_page(page);
 	page_cache_release(page);
-	if (pos + len > inode->i_size && ext4bf_can_truncate(inode))
+	if (pos + len > inode->i_size && ext4bf_can_truncate(inode) &&
+	    !multipage)
 		/* if we have allocated more blocks and copied
 		 * less. We will have blocks allocated outside
 		 * inode->i_size. So truncate them
@@ -1151,7 +1828,7 @@ static int ext4bf_journalled_write_end(struct file *file,
 	ret2 = ext4bf_journal_stop(handle);
 	if (!ret)
 		ret = ret2;
-	if (pos + len > inode->i_size) {
+	if (pos + len > inode->i_size && !multipage) {
 		ext4bf_truncate_failed_write(inode);
 		/*
 		 * If truncate failed early the inode might still be
@@ -1432,6 +2109,8 @@ static int mpage_da_submit_io(struct mpage_da_data *mpd,
 				block_commit_write(page, 0, len);
 
 			clear_page_dirty_for_io(page);
+			walk_page_buffers(NULL, page_bufs, 0, PAGE_CACHE_SIZE,
+					  NULL, ext4bf_bh_clear_csum_new);
 			/*
 			 * Delalloc doesn't support data journalling,
 			 * but eventually maybe we'll lift this
@@ -1909,18 +2588,15 @@ static int __ext4bf_journalled_writepage(struct page *page,
 
 	BUG_ON(!ext4bf_handle_valid(handle));
 
+	/* ext4bf: mark buffers as data blocks. */
+	walk_and_print_buffers(handle->h_transaction->t_tid, page_bufs, 0, len);
+
 	ret = walk_page_buffers(handle, page_bufs, 0, len, NULL,
 				do_journal_get_write_access);
 
 	err = walk_page_buffers(handle, page_bufs, 0, len, NULL,
 				write_end_fn);
-    /* ext4bf: mark buffers as data blocks. */
-    /*
-    walk_and_print_buffers(
-            handle->h_transaction->t_tid, page_buffers(page), 0, len);
-    */
-    /* */
-    if (ret == 0)
+	if (ret == 0)
 		ret = err;
 	EXT4_I(inode)->i_datasync_tid = handle->h_transaction->t_tid;
 	err = ext4bf_journal_stop(handle);
@@ -2038,6 +2714,8 @@ static int ext4bf_writepage(struct page *page,
 		 */
 		return __ext4bf_journalled_writepage(page, len);
 
+	walk_page_buffers(NULL, page_bufs, 0, PAGE_CACHE_SIZE, NULL,
+			  ext4bf_bh_clear_csum_new);
 	if (buffer_uninit(page_bufs)) {
 		ext4bf_set_bh_endio(page_bufs, inode);
 		ret = block_write_full_page_endio(page, noalloc_get_block_write,
@@ -2049,6 +2727,417 @@ static int ext4bf_writepage(struct page *page,
 	return ret;
 }
 
+#define EXT4BF_JDATA_BATCH	16
+
+/*
+ * ext4bf: journal up to EXT4BF_JDATA_BATCH pages that were dirtied through
+ * mmap with a single handle.  The pages have already been unlocked and
+ * their buffers pinned with bget_one().
+ */
+static int __ext4bf_journalled_writepages(struct inode *inode,
+					  struct page **pages,
+					  unsigned int *lens, int nr)
+{
+	handle_t *handle;
+	int i, ret = 0, err;
+
+	handle = ext4bf_journal_start(inode,
+			ext4bf_journal_blocks_per_page(inode) * nr);
+	if (IS_ERR(handle)) {
+		ret = PTR_ERR(handle);
+		goto out;
+	}
+	for (i = 0; i < nr; i++) {
+		struct buffer_head *page_bufs = page_buffers(pages[i]);
+
+		walk_and_print_buffers(handle->h_transaction->t_tid,
+				       page_bufs, 0, lens[i]);
+		err = walk_page_buffers(handle, page_bufs, 0, lens[i], NULL,
+					do_journal_get_write_access);
+		if (!err)
+			err = walk_page_buffers(handle, page_bufs, 0, lens[i],
+						NULL, write_end_fn);
+		if (!ret)
+			ret = err;
+	}
+	EXT4_I(inode)->i_datasync_tid = handle->h_transaction->t_tid;
+	err = ext4bf_journal_stop(handle);
+	if (!ret)
+		ret = err;
+	ext4bf_set_inode_state(inode, EXT4_STATE_JDATA);
+out:
+	for (i = 0; i < nr; i++) {
+		walk_page_buffers(NULL, page_buffers(pages[i]), 0, lens[i],
+				  NULL, bput_one);
+		page_cache_release(pages[i]);
+	}
+	return ret;
+}
+
+#define EXT4BF_JDATA_DA_BATCH	32
+
+/*
+ * Number of buffers from @bh on, in @pages[@i..@nr), that are in the same
+ * delayed or unwritten state as @bh.
+ */
+static unsigned int ext4bf_jdata_da_run_len(struct page **pages, int i,
+					    int nr, struct buffer_head *bh)
+{
+	int delay = buffer_delay(bh);
+	unsigned int len = 0;
+	struct buffer_head *head = page_buffers(pages[i]);
+
+	for (;;) {
+		if (!(delay ? buffer_delay(bh) : buffer_unwritten(bh)))
+			return len;
+		len++;
+		bh = bh->b_this_page;
+		if (bh == head) {
+			if (++i == nr)
+				return len;
+			head = bh = page_buffers(pages[i]);
+		}
+	}
+}
+
+/*
+ * Allocate the delayed and unwritten blocks of @nr contiguous locked
+ * pages with @handle.  The new blocks are written in place by the
+ * transaction as data runs; pages that are left with nothing to journal
+ * are cleaned.  The pages are unlocked and released.
+ */
+static int ext4bf_jdata_alloc_run(handle_t *handle, struct inode *inode,
+				  struct page **pages, int nr,
+				  struct writeback_control *wbc)
+{
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	unsigned int bits = PAGE_CACHE_SHIFT - inode->i_blkbits;
+	struct ext4bf_map_blocks map;
+	struct buffer_head *head, *bh;
+	ext4bf_lblk_t lblk;
+	loff_t disksize = 0;
+	int i, n, flags, ret = 0, stop = 0;
+
+	map.m_len = 0;
+	for (i = 0; i < nr; i++) {
+		lblk = (ext4bf_lblk_t) pages[i]->index << bits;
+		head = bh = page_buffers(pages[i]);
+		do {
+			if (!buffer_delay(bh) && !buffer_unwritten(bh))
+				goto next;
+			if (!map.m_len || lblk >= map.m_lblk + map.m_len) {
+				map.m_lblk = lblk;
+				map.m_len = ext4bf_jdata_da_run_len(pages, i, nr,
+								    bh);
+				flags = EXT4_GET_BLOCKS_CREATE;
+				if (buffer_delay(bh))
+					flags |= EXT4_GET_BLOCKS_DELALLOC_RESERVE;
+				n = ext4bf_chunk_trans_blocks(inode, map.m_len);
+				if (handle->h_buffer_credits < n &&
+				    ext4bf_journal_extend(handle, n)) {
+					/* Left to the next writeback. */
+					stop = 1;
+					break;
+				}
+				ret = ext4bf_map_blocks(handle, inode, &map,
+							flags);
+				if (ret <= 0) {
+					stop = 1;
+					break;
+				}
+				ret = 0;
+				if (map.m_flags & EXT4_MAP_NEW)
+					for (n = 0; n < map.m_len; n++)
+						unmap_underlying_metadata(
+							inode->i_sb->s_bdev,
+							map.m_pblk + n);
+			}
+			map_bh(bh, inode->i_sb,
+			       map.m_pblk + (lblk - map.m_lblk));
+			clear_buffer_delay(bh);
+			clear_buffer_unwritten(bh);
+			bh->b_blocktype = B_BLOCKTYPE_DATA;
+			if (test_clear_buffer_dirty(bh)) {
+				ret = jbdbf_journal_dirty_data_run(handle, bh);
+				if (ret) {
+					stop = 1;
+					break;
+				}
+			}
+next:
+			lblk++;
+			bh = bh->b_this_page;
+		} while (bh != head);
+		if (stop)
+			break;
+		disksize = ((loff_t) pages[i]->index + 1) << PAGE_CACHE_SHIFT;
+	}
+	if (ret < 0 && ret != -ENOSPC)
+		ext4bf_msg(inode->i_sb, KERN_CRIT,
+			   "delayed block allocation failed for inode %lu "
+			   "with error %d", inode->i_ino, ret);
+
+	/* Pages [0, i) are fully allocated. */
+	disksize = min(disksize, i_size_read(inode));
+	if (disksize > ei->i_disksize) {
+		ext4bf_update_i_disksize(inode, disksize);
+		n = ext4bf_mark_inode_dirty(handle, inode);
+		if (!ret)
+			ret = n;
+	}
+	for (n = 0; n < nr; n++) {
+		if (n < i && !PageChecked(pages[n]) &&
+		    clear_page_dirty_for_io(pages[n]))
+			wbc->nr_to_write--;
+		unlock_page(pages[n]);
+		page_cache_release(pages[n]);
+	}
+	ext4bf_set_inode_state(inode, EXT4_STATE_JDATA);
+	ei->i_datasync_tid = handle->h_transaction->t_tid;
+	return ret == -ENOSPC ? 0 : ret;
+}
+
+/*
+ * ext4bf: allocation pass of writepages for journalled inodes with delayed
+ * allocation.  Dirty pages with delayed or unwritten buffers are gathered
+ * into runs of contiguous pages; each run is allocated with one handle,
+ * started before the pages are locked, so that mballoc sees the whole
+ * run at once.
+ */
+static int ext4bf_jdata_alloc_delayed(struct address_space *mapping,
+				      struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct page *run[EXT4BF_JDATA_DA_BATCH];
+	handle_t *handle = NULL;
+	struct pagevec pvec;
+	pgoff_t index, end;
+	int nr_pages, nr = 0, i, done = 0;
+	int ret = 0, err;
+
+	pagevec_init(&pvec, 0);
+	if (wbc->range_cyclic) {
+		index = 0;
+		end = -1;
+	} else {
+		index = wbc->range_start >> PAGE_CACHE_SHIFT;
+		end = wbc->range_end >> PAGE_CACHE_SHIFT;
+	}
+	while (!ret && !done && index <= end) {
+		nr_pages = pagevec_lookup_tag(&pvec, mapping, &index,
+				PAGECACHE_TAG_DIRTY,
+				min(end - index, (pgoff_t)PAGEVEC_SIZE - 1) + 1);
+		if (nr_pages == 0)
+			break;
+		for (i = 0; i < nr_pages; i++) {
+			struct page *page = pvec.pages[i];
+
+			if (page->index > end) {
+				index = end + 1;
+				break;
+			}
+			if (nr && (run[nr - 1]->index + 1 != page->index ||
+				   nr == EXT4BF_JDATA_DA_BATCH ||
+				   nr >= wbc->nr_to_write)) {
+				ret = ext4bf_jdata_alloc_run(handle, inode,
+							     run, nr, wbc);
+				nr = 0;
+				err = ext4bf_journal_stop(handle);
+				handle = NULL;
+				if (!ret)
+					ret = err;
+				if (ret)
+					break;
+			}
+			/* the caller's budget is spent */
+			if (wbc->nr_to_write <= 0) {
+				done = 1;
+				break;
+			}
+			if (!handle) {
+				handle = ext4bf_journal_start(inode,
+					ext4bf_chunk_trans_blocks(inode,
+					EXT4BF_JDATA_DA_BATCH *
+					ext4bf_journal_blocks_per_page(inode)));
+				if (IS_ERR(handle)) {
+					ret = PTR_ERR(handle);
+					handle = NULL;
+					break;
+				}
+			}
+			lock_page(page);
+			if (unlikely(page->mapping != mapping) ||
+			    !PageDirty(page) || PageWriteback(page) ||
+			    !page_has_buffers(page) ||
+			    !walk_page_buffers(NULL, page_buffers(page), 0,
+					PAGE_CACHE_SIZE, NULL,
+					ext4bf_bh_delay_or_unwritten)) {
+				unlock_page(page);
+				continue;
+			}
+			page_cache_get(page);
+			run[nr++] = page;
+		}
+		pagevec_release(&pvec);
+		cond_resched();
+	}
+	if (nr) {
+		err = ext4bf_jdata_alloc_run(handle, inode, run, nr, wbc);
+		if (!ret)
+			ret = err;
+	}
+	if (handle) {
+		err = ext4bf_journal_stop(handle);
+		if (!ret)
+			ret = err;
+	}
+	return ret;
+}
+
+/*
+ * ext4bf: writepages for journalled inodes.  Runs of contiguous pages
+ * that were dirtied through mmap are journalled with one handle per run
+ * instead of one per page; everything else goes through
+ * ext4bf_writepage().  The blocks are marked as data so that commit tags
+ * them like data written with write(); blocks that page_mkwrite allocated
+ * were already written in place with the transaction that allocated them.
+ */
+static int ext4bf_journalled_writepages(struct address_space *mapping,
+				       struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct page *batch[EXT4BF_JDATA_BATCH];
+	unsigned int lens[EXT4BF_JDATA_BATCH];
+	struct pagevec pvec;
+	pgoff_t index, end, done_index;
+	int cycled, range_whole = 0;
+	int nr_pages, nr = 0, i;
+	int ret = 0, err, done = 0;
+	loff_t size;
+
+	pagevec_init(&pvec, 0);
+	if (wbc->range_cyclic) {
+		index = mapping->writeback_index;
+		cycled = (index == 0);
+		end = -1;
+	} else {
+		index = wbc->range_start >> PAGE_CACHE_SHIFT;
+		end = wbc->range_end >> PAGE_CACHE_SHIFT;
+		if (wbc->range_start == 0 && wbc->range_end == LLONG_MAX)
+			range_whole = 1;
+		cycled = 1;
+	}
+	if (test_opt(inode->i_sb, DELALLOC)) {
+		ret = ext4bf_jdata_alloc_delayed(mapping, wbc);
+		if (ret)
+			return ret;
+	}
+retry:
+	done_index = index;
+	while (!done && index <= end) {
+		nr_pages = pagevec_lookup_tag(&pvec, mapping, &index,
+				PAGECACHE_TAG_DIRTY,
+				min(end - index, (pgoff_t)PAGEVEC_SIZE - 1) + 1);
+		if (nr_pages == 0)
+			break;
+
+		for (i = 0; i < nr_pages; i++) {
+			struct page *page = pvec.pages[i];
+			unsigned int len;
+
+			if (page->index > end) {
+				done = 1;
+				break;
+			}
+			done_index = page->index;
+
+			/*
+			 * Only contiguous pages share a handle; it must be
+			 * started without any page locked.
+			 */
+			if (nr && batch[nr - 1]->index + 1 != page->index) {
+				err = __ext4bf_journalled_writepages(inode,
+							batch, lens, nr);
+				nr = 0;
+				if (err && !ret)
+					ret = err;
+			}
+
+			lock_page(page);
+			if (unlikely(page->mapping != mapping) ||
+			    !PageDirty(page)) {
+				unlock_page(page);
+				continue;
+			}
+			if (PageWriteback(page)) {
+				if (wbc->sync_mode == WB_SYNC_NONE) {
+					unlock_page(page);
+					continue;
+				}
+				wait_on_page_writeback(page);
+			}
+			if (!clear_page_dirty_for_io(page)) {
+				unlock_page(page);
+				continue;
+			}
+
+			size = i_size_read(inode);
+			if (page->index == size >> PAGE_CACHE_SHIFT)
+				len = size & ~PAGE_CACHE_MASK;
+			else
+				len = PAGE_CACHE_SIZE;
+			if (!PageChecked(page) || !page_has_buffers(page) ||
+			    page_offset(page) >= size || !len ||
+			    walk_page_buffers(NULL, page_buffers(page), 0, len,
+					NULL, ext4bf_bh_delay_or_unwritten)) {
+				err = ext4bf_writepage(page, wbc);
+			} else {
+				ClearPageChecked(page);
+				walk_page_buffers(NULL, page_buffers(page), 0,
+						  len, NULL, bget_one);
+				page_cache_get(page);
+				unlock_page(page);
+				batch[nr] = page;
+				lens[nr++] = len;
+				err = 0;
+				if (nr == EXT4BF_JDATA_BATCH) {
+					err = __ext4bf_journalled_writepages(
+						inode, batch, lens, nr);
+					nr = 0;
+				}
+			}
+			if (err) {
+				ret = err;
+				done_index = page->index + 1;
+				done = 1;
+				break;
+			}
+			if (--wbc->nr_to_write <= 0 &&
+			    wbc->sync_mode == WB_SYNC_NONE) {
+				done = 1;
+				break;
+			}
+		}
+		pagevec_release(&pvec);
+		cond_resched();
+	}
+	if (nr) {
+		err = __ext4bf_journalled_writepages(inode, batch, lens, nr);
+		nr = 0;
+		if (err && !ret)
+			ret = err;
+	}
+	if (!cycled && !done) {
+		cycled = 1;
+		index = 0;
+		end = mapping->writeback_index - 1;
+		goto retry;
+	}
+	if (wbc->range_cyclic || (range_whole && wbc->nr_to_write > 0))
+		mapping->writeback_index = done_index;
+	return ret;
+}
+
 /*
  * This is called via ext4bf_da_writepages() to
  * calculate the total number of credits to reserve to fit
@@ -2483,6 +3572,12 @@ static int ext4bf_da_write_begin(struct file *file, struct address_space *mappin
 
 	index = pos >> PAGE_CACHE_SHIFT;
 
+	if (ext4bf_has_inline_data(inode)) {
+		ret = ext4bf_convert_inline_data(inode);
+		if (ret)
+			return ret;
+	}
+
 	if (ext4bf_nonda_switch(inode->i_sb)) {
 		*fsdata = (void *)FALL_BACK_TO_NONDELALLOC;
 		return ext4bf_write_begin(file, mapping, pos,
@@ -2708,6 +3803,10 @@ static sector_t ext4bf_bmap(struct address_space *mapping, sector_t block)
 	journal_t *journal;
 	int err;
 
+	/* Inline data has no block to map. */
+	if (ext4bf_has_inline_data(inode))
+		return 0;
+
 	if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY) &&
 			test_opt(inode->i_sb, DELALLOC)) {
 		/*
@@ -2753,15 +3852,22 @@ static sector_t ext4bf_bmap(struct address_space *mapping, sector_t block)
 
 static int ext4bf_readpage(struct file *file, struct page *page)
 {
+	struct inode *inode = page->mapping->host;
+
 	//trace_ext4_readpage(page);
-	return mpage_readpage(page, ext4bf_get_block);
+	if (ext4bf_has_inline_data(inode))
+		return ext4bf_readpage_inline(inode, page);
+	return ext4bf_mpage_readpages(page->mapping, NULL, page, 1);
 }
 
 static int
 ext4bf_readpages(struct file *file, struct address_space *mapping,
 		struct list_head *pages, unsigned nr_pages)
 {
-	return mpage_readpages(mapping, pages, nr_pages, ext4bf_get_block);
+	/* Inline data is read by ext4bf_readpage(). */
+	if (ext4bf_has_inline_data(mapping->host))
+		return 0;
+	return ext4bf_mpage_readpages(mapping, pages, NULL, nr_pages);
 }
 
 static void ext4bf_invalidatepage_free_endio(struct page *page, unsigned long offset)
@@ -2882,7 +3988,7 @@ out:
 	spin_unlock_irqrestore(&ei->i_completed_io_lock, flags);
 
 	/* queue the work to convert unwritten extents to written */
-	queue_work(wq, &io_end->work);
+	queue_work(wq, &EXT4_I(inode)->i_unwritten_work);
 
 	/* XXX: probably should move into the real I/O completion handler */
 	inode_dio_done(inode);
@@ -2919,7 +4025,7 @@ static void ext4bf_end_io_buffer_write(struct buffer_head *bh, int uptodate)
 
 	wq = EXT4_SB(inode->i_sb)->dio_unwritten_wq;
 	/* queue the work to convert unwritten extents to written */
-	queue_work(wq, &io_end->work);
+	queue_work(wq, &EXT4_I(inode)->i_unwritten_work);
 out:
 	bh->b_private = NULL;
 	bh->b_end_io = NULL;
@@ -3068,6 +4174,280 @@ static ssize_t ext4bf_ext_direct_IO(int rw, struct kiocb *iocb,
 	return ext4bf_ind_direct_IO(rw, iocb, iov, offset, nr_segs);
 }
 
+/*
+ * ext4bf: does the page cache hold any page of [start, end]?  With
+ * journalled data such a page may be newer than its home location.
+ */
+static int ext4bf_dio_range_cached(struct address_space *mapping,
+				   loff_t start, loff_t end)
+{
+	struct page *page;
+	int ret;
+
+	if (!mapping->nrpages)
+		return 0;
+	if (!find_get_pages(mapping, start >> PAGE_CACHE_SHIFT, 1, &page))
+		return 0;
+	ret = page->index <= (end >> PAGE_CACHE_SHIFT);
+	page_cache_release(page);
+	return ret;
+}
+
+/*
+ * ext4bf: is any block of the range mapped and initialized?  Such blocks
+ * may still be referenced by a committed transaction and are not written
+ * in place by O_DIRECT.
+ */
+static int ext4bf_dio_range_overwrites(struct inode *inode, loff_t offset,
+				       size_t count)
+{
+	struct ext4bf_map_blocks map;
+	struct extent_status es;
+	int ret;
+
+	map.m_lblk = offset >> inode->i_blkbits;
+	map.m_len = count >> inode->i_blkbits;
+	while (map.m_len) {
+		ret = ext4bf_map_blocks(NULL, inode, &map, 0);
+		if (ret < 0)
+			return ret;
+		if (ret == 0) {
+			/* the lookup has cached the whole hole; skip it */
+			ret = 1;
+			if (ext4bf_es_lookup_extent(inode, map.m_lblk, &es) &&
+			    es.es_status == EXTENT_STATUS_HOLE)
+				ret = min_t(ext4bf_lblk_t, map.m_len,
+					    es.es_lblk + es.es_len -
+					    map.m_lblk);
+		} else if (!(map.m_flags & EXT4_MAP_UNWRITTEN))
+			return 1;
+		map.m_lblk += ret;
+		map.m_len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * ext4bf: data tags of a journalled O_DIRECT write.  The checksum of each
+ * block is taken from the pages of its bio as the bio is submitted, not
+ * from the user buffer afterwards, which the caller may have changed by
+ * then.  A block may straddle two bios; its running checksum is kept in
+ * @crc until the rest arrives.
+ */
+struct ext4bf_dio_tags {
+	struct list_head list;		/* in file order */
+	ext4bf_fsblk_t blocknr;		/* block being summed */
+	unsigned int done;		/* bytes of it summed so far */
+	__u32 crc;
+	int err;
+};
+
+static void ext4bf_dio_submit_tagged(int rw, struct bio *bio,
+				     struct inode *inode, loff_t file_offset)
+{
+	struct ext4bf_dio_tags *tags = EXT4_I(inode)->i_dio_tags;
+	unsigned int blocksize = inode->i_sb->s_blocksize;
+	sector_t sector = bio->bi_sector;
+	unsigned int start = (sector << 9) & (blocksize - 1);
+	struct jbdbf_data_tag *dtag;
+	struct bio_vec *bvec;
+	unsigned int off, n;
+	char *kaddr;
+	int i;
+
+	if (!start) {
+		tags->blocknr = sector >> (inode->i_blkbits - 9);
+		tags->done = 0;
+		tags->crc = 0;
+	} else if (tags->blocknr != sector >> (inode->i_blkbits - 9) ||
+		   tags->done != start)
+		tags->err = -EIO;
+
+	bio_for_each_segment(bvec, bio, i) {
+		for (off = 0; off < bvec->bv_len; off += n) {
+			n = min(bvec->bv_len - off, blocksize - tags->done);
+			kaddr = kmap_atomic(bvec->bv_page, KM_USER0);
+			tags->crc = jbdbf_checksum_buf(tags->crc,
+					kaddr + bvec->bv_offset + off, n);
+			kunmap_atomic(kaddr, KM_USER0);
+			tags->done += n;
+			if (tags->done < blocksize)
+				continue;
+
+			dtag = jbdbf_alloc_data_tag(GFP_NOFS);
+			if (dtag) {
+				dtag->b_blocknr = tags->blocknr;
+				dtag->crc32_data_sum = tags->crc;
+				dtag->processed = 0;
+				list_add_tail(&dtag->list, &tags->list);
+			} else
+				tags->err = -ENOMEM;
+			tags->blocknr++;
+			tags->done = 0;
+			tags->crc = 0;
+		}
+	}
+	submit_bio(rw, bio);
+}
+
+static void ext4bf_dio_free_tags(struct list_head *list)
+{
+	struct jbdbf_data_tag *dtag, *next;
+
+	list_for_each_entry_safe(dtag, next, list, list) {
+		list_del(&dtag->list);
+		jbdbf_free_data_tag(dtag);
+	}
+}
+
+/*
+ * ext4bf: hand the tags of the first @len bytes written to the running
+ * transaction and drop the rest.  The bios cover the range in order, so
+ * those are the first tags on the list.
+ */
+static int ext4bf_dio_tag_blocks(handle_t *handle, struct inode *inode,
+				 struct ext4bf_dio_tags *tags, ssize_t len)
+{
+	unsigned long nr = len >> inode->i_blkbits;
+	struct jbdbf_data_tag *dtag, *next;
+	LIST_HEAD(done);
+
+	list_for_each_entry_safe(dtag, next, &tags->list, list) {
+		if (!nr)
+			break;
+		list_move_tail(&dtag->list, &done);
+		nr--;
+	}
+	ext4bf_dio_free_tags(&tags->list);
+	if (nr && !tags->err)
+		tags->err = -EIO;
+	if (tags->err) {
+		ext4bf_dio_free_tags(&done);
+		return tags->err;
+	}
+	spin_lock(&data_tag_lock);
+	list_splice_tail(&done, &handle->h_transaction->t_data_tag_list);
+	spin_unlock(&data_tag_lock);
+	return 0;
+}
+
+/*
+ * O_DIRECT for inodes whose data is journalled (data=journal and the
+ * barrier-free mode).
+ *
+ * Reads go to disk unless the page cache holds part of the range, whose
+ * journalled contents may not have been checkpointed yet.
+ *
+ * Writes go straight from the user pages to the home location only if
+ * every block in the range is a hole or unwritten: the blocks are
+ * allocated unwritten as for ordinary extent DIO, and once the data is
+ * on disk a single handle records a NEWLYAPPENDEDDATA tag with the
+ * checksum each block had when its bio was submitted, converts the extents and updates i_size.
+ * After a crash recovery uses the tags to tell whether the data made
+ * it, exactly as for buffered appends.
+ *
+ * Overwrites of initialized blocks, unaligned and async writes return 0
+ * so that the VFS falls back to the journalled buffered path.
+ */
+static ssize_t ext4bf_journalled_direct_IO(int rw, struct kiocb *iocb,
+			      const struct iovec *iov, loff_t offset,
+			      unsigned long nr_segs)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file->f_mapping->host;
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	size_t count = iov_length(iov, nr_segs);
+	unsigned int blkmask = inode->i_sb->s_blocksize - 1;
+	loff_t final_size = offset + count;
+	struct ext4bf_dio_tags tags;
+	handle_t *handle;
+	ssize_t ret;
+	int orphan = 0;
+	int retries = 0;
+	int err;
+
+	if (!count)
+		return 0;
+	if (ext4bf_dio_range_cached(file->f_mapping, offset, final_size - 1))
+		return 0;
+	if (rw == READ)
+		return ext4bf_ind_direct_IO(rw, iocb, iov, offset, nr_segs);
+
+	if (!is_sync_kiocb(iocb) || (offset & blkmask) || (count & blkmask))
+		return 0;
+	ret = ext4bf_dio_range_overwrites(inode, offset, count);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
+	if (final_size > inode->i_size) {
+		/* Credits for sb + inode write */
+		handle = ext4bf_journal_start(inode, 2);
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
+		ret = ext4bf_orphan_add(handle, inode);
+		if (ret) {
+			ext4bf_journal_stop(handle);
+			return ret;
+		}
+		orphan = 1;
+		ei->i_disksize = inode->i_size;
+		ext4bf_journal_stop(handle);
+	}
+
+	iocb->private = NULL;
+	ei->cur_aio_dio = NULL;
+	INIT_LIST_HEAD(&tags.list);
+	ei->i_dio_tags = &tags;
+retry:
+	tags.err = 0;
+	ret = __blockdev_direct_IO(rw, iocb, inode, inode->i_sb->s_bdev,
+				   iov, offset, nr_segs,
+				   ext4bf_get_block_write, NULL,
+				   ext4bf_dio_submit_tagged, DIO_LOCKING);
+	if (ret == -ENOSPC && ext4bf_should_retry_alloc(inode->i_sb, &retries)) {
+		ext4bf_dio_free_tags(&tags.list);
+		goto retry;
+	}
+	ei->i_dio_tags = NULL;
+	if (ret < 0 && final_size > i_size_read(inode))
+		ext4bf_truncate_failed_write(inode);
+	if (ret > 0)
+		ret &= ~(ssize_t)blkmask;
+
+	/* Credits for the tagged extents + sb + inode write */
+	handle = ext4bf_journal_start(inode,
+			ext4bf_chunk_trans_blocks(inode, count >> inode->i_blkbits) + 2);
+	if (IS_ERR(handle)) {
+		/* The data is on disk but nothing points at it yet. */
+		if (orphan && inode->i_nlink)
+			ext4bf_orphan_del(NULL, inode);
+		ext4bf_clear_inode_state(inode, EXT4_STATE_DIO_UNWRITTEN);
+		ext4bf_dio_free_tags(&tags.list);
+		return PTR_ERR(handle);
+	}
+	if (ret > 0) {
+		err = ext4bf_dio_tag_blocks(handle, inode, &tags, ret);
+		if (!err && ext4bf_test_inode_state(inode,
+						EXT4_STATE_DIO_UNWRITTEN))
+			err = ext4bf_convert_unwritten_extents(inode, offset, ret);
+		if (err)
+			ret = err;
+	}
+	ext4bf_dio_free_tags(&tags.list);
+	ext4bf_clear_inode_state(inode, EXT4_STATE_DIO_UNWRITTEN);
+	if (orphan && inode->i_nlink)
+		ext4bf_orphan_del(handle, inode);
+	if (ret > 0 && offset + ret > inode->i_size) {
+		ei->i_disksize = offset + ret;
+		i_size_write(inode, offset + ret);
+		ext4bf_mark_inode_dirty(handle, inode);
+	}
+	err = ext4bf_journal_stop(handle);
+	if (ret == 0)
+		ret = err;
+	return ret;
+}
+
 static ssize_t ext4bf_direct_IO(int rw, struct kiocb *iocb,
 			      const struct iovec *iov, loff_t offset,
 			      unsigned long nr_segs)
@@ -3076,11 +4456,20 @@ static ssize_t ext4bf_direct_IO(int rw, struct kiocb *iocb,
 	struct inode *inode = file->f_mapping->host;
 	ssize_t ret;
 
+	/* Inline data falls back to buffered I/O. */
+	if (ext4bf_has_inline_data(inode))
+		return 0;
+
 	/*
-	 * If we are doing data journalling we don't support O_DIRECT
+	 * With data journalling O_DIRECT is only supported for extent
+	 * files; see ext4bf_journalled_direct_IO().
 	 */
-	if (ext4bf_should_journal_data(inode))
-		return 0;
+	if (ext4bf_should_journal_data(inode)) {
+		if (!ext4bf_test_inode_flag(inode, EXT4_INODE_EXTENTS))
+			return 0;
+		return ext4bf_journalled_direct_IO(rw, iocb, iov, offset,
+						   nr_segs);
+	}
 
 	//trace_ext4_direct_IO_enter(inode, offset, iov_length(iov, nr_segs), rw);
 	if (ext4bf_test_inode_flag(inode, EXT4_INODE_EXTENTS))
@@ -3145,11 +4534,12 @@ static const struct address_space_operations ext4bf_journalled_aops = {
 	.readpage		= ext4bf_readpage,
 	.readpages		= ext4bf_readpages,
 	.writepage		= ext4bf_writepage,
+	.writepages		= ext4bf_journalled_writepages,
 	.write_begin		= ext4bf_write_begin,
 	.write_end		= ext4bf_journalled_write_end,
 	.set_page_dirty		= ext4bf_journalled_set_page_dirty,
 	.bmap			= ext4bf_bmap,
-	.invalidatepage		= ext4bf_invalidatepage,
+	.invalidatepage		= ext4bf_da_invalidatepage,
 	.releasepage		= ext4bf_releasepage,
 	.direct_IO		= ext4bf_direct_IO,
 	.is_partially_uptodate  = block_is_partially_uptodate,
@@ -3592,7 +4982,9 @@ void ext4bf_truncate(struct inode *inode)
 	if (inode->i_size == 0 && !test_opt(inode->i_sb, NO_AUTO_DA_ALLOC))
 		ext4bf_set_inode_state(inode, EXT4_STATE_DA_ALLOC_CLOSE);
 
-	if (ext4bf_test_inode_flag(inode, EXT4_INODE_EXTENTS))
+	if (ext4bf_has_inline_data(inode))
+		ext4bf_inline_data_truncate(inode);
+	else if (ext4bf_test_inode_flag(inode, EXT4_INODE_EXTENTS))
 		ext4bf_ext_truncate(inode);
 	else
 		ext4bf_ind_truncate(inode);
@@ -3957,6 +5349,8 @@ struct inode *ext4bf_iget(struct super_block *sb, unsigned long ino)
 				 ei->i_file_acl);
 		ret = -EIO;
 		goto bad_inode;
+	} else if (ext4bf_has_inline_data(inode)) {
+		/* i_block holds file data, see inline.c */
 	} else if (ext4bf_test_inode_flag(inode, EXT4_INODE_EXTENTS)) {
 		if (S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) ||
 		    (S_ISLNK(inode->i_mode) &&
@@ -4053,25 +5447,14 @@ static int ext4bf_inode_blocks_set(handle_t *handle,
 }
 
 /*
- * Post the struct inode info into an on-disk inode location in the
- * buffer-cache.  This gobbles the caller's reference to the
- * buffer_head in the inode location struct.
- *
- * The caller must have write access to iloc->bh.
+ * Copy the struct inode info into @raw_inode.  Fields that are not
+ * tracked in the in-memory inode are left alone.
  */
-static int ext4bf_do_update_inode(handle_t *handle,
-				struct inode *inode,
-				struct ext4bf_iloc *iloc)
+static int ext4bf_fill_raw_inode(struct inode *inode,
+				 struct ext4bf_inode *raw_inode)
 {
-	struct ext4bf_inode *raw_inode = ext4bf_raw_inode(iloc);
 	struct ext4bf_inode_info *ei = EXT4_I(inode);
-	struct buffer_head *bh = iloc->bh;
-	int err = 0, rc, block;
-
-	/* For fields not not tracking in the in-memory inode,
-	 * initialise them to zero for new inodes. */
-	if (ext4bf_test_inode_state(inode, EXT4_STATE_NEW))
-		memset(raw_inode, 0, EXT4_SB(inode->i_sb)->s_inode_size);
+	int block;
 
 	ext4bf_get_inode_flags(ei);
 	raw_inode->i_mode = cpu_to_le16(inode->i_mode);
@@ -4106,8 +5489,8 @@ static int ext4bf_do_update_inode(handle_t *handle,
 	EXT4_INODE_SET_XTIME(i_atime, inode, raw_inode);
 	EXT4_EINODE_SET_XTIME(i_crtime, ei, raw_inode);
 
-	if (ext4bf_inode_blocks_set(handle, raw_inode, ei))
-		goto out_brelse;
+	if (ext4bf_inode_blocks_set(NULL, raw_inode, ei))
+		return -EFBIG;
 	raw_inode->i_dtime = cpu_to_le32(ei->i_dtime);
 	raw_inode->i_flags = cpu_to_le32(ei->i_flags & 0xFFFFFFFF);
 	if (EXT4_SB(inode->i_sb)->s_es->s_creator_os !=
@@ -4116,28 +5499,6 @@ static int ext4bf_do_update_inode(handle_t *handle,
 			cpu_to_le16(ei->i_file_acl >> 32);
 	raw_inode->i_file_acl_lo = cpu_to_le32(ei->i_file_acl);
 	ext4bf_isize_set(raw_inode, ei->i_disksize);
-	if (ei->i_disksize > 0x7fffffffULL) {
-		struct super_block *sb = inode->i_sb;
-		if (!EXT4_HAS_RO_COMPAT_FEATURE(sb,
-				EXT4_FEATURE_RO_COMPAT_LARGE_FILE) ||
-				EXT4_SB(sb)->s_es->s_rev_level ==
-				cpu_to_le32(EXT4_GOOD_OLD_REV)) {
-			/* If this is the first large file
-			 * created, add a flag to the superblock.
-			 */
-			err = ext4bf_journal_get_write_access(handle,
-					EXT4_SB(sb)->s_sbh);
-			if (err)
-				goto out_brelse;
-			ext4bf_update_dynamic_rev(sb);
-			EXT4_SET_RO_COMPAT_FEATURE(sb,
-					EXT4_FEATURE_RO_COMPAT_LARGE_FILE);
-			sb->s_dirt = 1;
-			ext4bf_handle_sync(handle);
-			err = ext4bf_handle_dirty_metadata(handle, NULL,
-					EXT4_SB(sb)->s_sbh);
-		}
-	}
 	raw_inode->i_generation = cpu_to_le32(inode->i_generation);
 	if (S_ISCHR(inode->i_mode) || S_ISBLK(inode->i_mode)) {
 		if (old_valid_dev(inode->i_rdev)) {
@@ -4161,12 +5522,143 @@ static int ext4bf_do_update_inode(handle_t *handle,
 			cpu_to_le32(inode->i_version >> 32);
 		raw_inode->i_extra_isize = cpu_to_le16(ei->i_extra_isize);
 	}
+	return 0;
+}
+
+/* The first file over 2GB has to set the large_file feature. */
+static int ext4bf_needs_large_file(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+
+	return EXT4_I(inode)->i_disksize > 0x7fffffffULL &&
+		(!EXT4_HAS_RO_COMPAT_FEATURE(sb,
+				EXT4_FEATURE_RO_COMPAT_LARGE_FILE) ||
+		 EXT4_SB(sb)->s_es->s_rev_level ==
+				cpu_to_le32(EXT4_GOOD_OLD_REV));
+}
+
+/*
+ * ext4bf: coalesced inode updates.  Once an inode has been copied into its
+ * inode table buffer under a transaction, the buffer stays in that
+ * transaction until it commits.  Further ext4bf_mark_inode_dirty() calls
+ * in the same transaction then skip write access and the copy, and the
+ * raw inode is refreshed once by ext4bf_journal_lock_callback().
+ */
+static void ext4bf_defer_inode_update(struct inode *inode,
+				      struct ext4bf_iloc *iloc)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(inode->i_sb);
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+
+	spin_lock(&sbi->s_deferred_lock);
+	if (list_empty(&ei->i_deferred_list)) {
+		get_bh(iloc->bh);
+		ei->i_deferred_bh = iloc->bh;
+		ei->i_deferred_offset = iloc->offset;
+		list_add_tail(&ei->i_deferred_list, &sbi->s_deferred_inodes);
+	}
+	spin_unlock(&sbi->s_deferred_lock);
+}
+
+/* Refresh the raw copy of a deferred inode and drop it from the list. */
+static void __ext4bf_flush_deferred_inode(struct ext4bf_inode_info *ei)
+{
+	struct buffer_head *bh = ei->i_deferred_bh;
+
+	ext4bf_fill_raw_inode(&ei->vfs_inode,
+			      (struct ext4bf_inode *)(bh->b_data +
+						      ei->i_deferred_offset));
+	list_del_init(&ei->i_deferred_list);
+	ei->i_deferred_bh = NULL;
+	brelse(bh);
+}
+
+/*
+ * Called before the inode goes away.  A queued inode's buffer still
+ * belongs to a transaction that has not reached the lock callback, so the
+ * copy can be done right here.
+ */
+void ext4bf_flush_deferred_inode(struct inode *inode)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(inode->i_sb);
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+
+	if (list_empty_careful(&ei->i_deferred_list))
+		return;
+	spin_lock(&sbi->s_deferred_lock);
+	if (!list_empty(&ei->i_deferred_list))
+		__ext4bf_flush_deferred_inode(ei);
+	spin_unlock(&sbi->s_deferred_lock);
+}
+
+/*
+ * j_lock_callback: @transaction is locked and has no handles left, and
+ * every queued inode was queued under it.
+ */
+void ext4bf_journal_lock_callback(journal_t *journal,
+				  transaction_bf_t *transaction)
+{
+	struct super_block *sb = journal->j_private;
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+
+	spin_lock(&sbi->s_deferred_lock);
+	while (!list_empty(&sbi->s_deferred_inodes))
+		__ext4bf_flush_deferred_inode(
+			list_first_entry(&sbi->s_deferred_inodes,
+					 struct ext4bf_inode_info,
+					 i_deferred_list));
+	spin_unlock(&sbi->s_deferred_lock);
+}
+
+/*
+ * Post the struct inode info into an on-disk inode location in the
+ * buffer-cache.  This gobbles the caller's reference to the
+ * buffer_head in the inode location struct.
+ *
+ * The caller must have write access to iloc->bh.
+ */
+static int ext4bf_do_update_inode(handle_t *handle,
+				struct inode *inode,
+				struct ext4bf_iloc *iloc)
+{
+	struct ext4bf_inode *raw_inode = ext4bf_raw_inode(iloc);
+	struct buffer_head *bh = iloc->bh;
+	int err = 0, rc;
+
+	/* For fields not not tracking in the in-memory inode,
+	 * initialise them to zero for new inodes. */
+	if (ext4bf_test_inode_state(inode, EXT4_STATE_NEW))
+		memset(raw_inode, 0, EXT4_SB(inode->i_sb)->s_inode_size);
+
+	if (ext4bf_fill_raw_inode(inode, raw_inode))
+		goto out_brelse;
+	if (ext4bf_needs_large_file(inode)) {
+		struct super_block *sb = inode->i_sb;
+
+		/* If this is the first large file
+		 * created, add a flag to the superblock.
+		 */
+		err = ext4bf_journal_get_write_access(handle,
+				EXT4_SB(sb)->s_sbh);
+		if (err)
+			goto out_brelse;
+		ext4bf_update_dynamic_rev(sb);
+		EXT4_SET_RO_COMPAT_FEATURE(sb,
+				EXT4_FEATURE_RO_COMPAT_LARGE_FILE);
+		sb->s_dirt = 1;
+		ext4bf_handle_sync(handle);
+		err = ext4bf_handle_dirty_metadata(handle, NULL,
+				EXT4_SB(sb)->s_sbh);
+	}
 
 	BUFFER_TRACE(bh, "call ext4bf_handle_dirty_metadata");
 	rc = ext4bf_handle_dirty_metadata(handle, NULL, bh);
 	if (!err)
 		err = rc;
 	ext4bf_clear_inode_state(inode, EXT4_STATE_NEW);
+	ext4bf_clear_inode_state(inode, EXT4_STATE_LAZY_TIME);
+	if (!err && ext4bf_handle_valid(handle))
+		ext4bf_defer_inode_update(inode, iloc);
 
 	ext4bf_update_inode_fsync_trans(handle, inode, 0);
 out_brelse:
@@ -4224,10 +5716,16 @@ int ext4bf_write_inode(struct inode *inode, struct writeback_control *wbc)
 			return -EIO;
 		}
 
-		if (wbc->sync_mode != WB_SYNC_ALL)
+		if (wbc->sync_mode != WB_SYNC_ALL) {
+			/* Keep lazy timestamps on the dirty list until synced */
+			if (ext4bf_test_inode_state(inode, EXT4_STATE_LAZY_TIME))
+				mark_inode_dirty_sync(inode);
 			return 0;
+		}
 
-		err = ext4bf_force_commit(inode->i_sb);
+		err = ext4bf_flush_lazy_time(inode);
+		if (!err)
+			err = ext4bf_force_commit(inode->i_sb);
 	} else {
 		struct ext4bf_iloc iloc;
 
@@ -4360,9 +5858,12 @@ int ext4bf_setattr(struct dentry *dentry, struct iattr *attr)
 	}
 
 	if (attr->ia_valid & ATTR_SIZE) {
-		if (attr->ia_size != i_size_read(inode)) {
+		loff_t old_size = i_size_read(inode);
+
+		if (attr->ia_size != old_size) {
 			truncate_setsize(inode, attr->ia_size);
-			ext4bf_truncate(inode);
+			if (!ext4bf_async_free_truncate(inode, old_size))
+				ext4bf_truncate(inode);
 		} else if (ext4bf_test_inode_flag(inode, EXT4_INODE_EOFBLOCKS))
 			ext4bf_truncate(inode);
 	}
@@ -4592,6 +6093,39 @@ static int ext4bf_expand_extra_isize(struct inode *inode,
 					  raw_inode, handle);
 }
 
+/*
+ * If the inode is already queued for a refresh at commit, there is
+ * nothing to copy now: the running transaction owns the inode buffer.
+ * Returns 1 if the update was absorbed.
+ */
+static int ext4bf_mark_inode_deferred(handle_t *handle, struct inode *inode)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(inode->i_sb);
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	int ret = 0;
+
+	if (!ext4bf_handle_valid(handle) ||
+	    list_empty_careful(&ei->i_deferred_list))
+		return 0;
+	if (ei->i_extra_isize < sbi->s_want_extra_isize &&
+	    !ext4bf_test_inode_state(inode, EXT4_STATE_NO_EXPAND))
+		return 0;
+	if (ext4bf_needs_large_file(inode))
+		return 0;
+
+	spin_lock(&sbi->s_deferred_lock);
+	if (!list_empty(&ei->i_deferred_list)) {
+		if (test_opt(inode->i_sb, I_VERSION))
+			inode_inc_iversion(inode);
+		ext4bf_clear_inode_state(inode, EXT4_STATE_LAZY_TIME);
+		ret = 1;
+	}
+	spin_unlock(&sbi->s_deferred_lock);
+	if (ret)
+		ext4bf_update_inode_fsync_trans(handle, inode, 0);
+	return ret;
+}
+
 /*
  * What we do here is to mark the in-core inode as clean with respect to inode
  * dirtiness (it may still be data-dirty).
@@ -4622,6 +6156,8 @@ int ext4bf_mark_inode_dirty(handle_t *handle, struct inode *inode)
 
 	might_sleep();
 	//trace_ext4_mark_inode_dirty(inode, _RET_IP_);
+	if (ext4bf_mark_inode_deferred(handle, inode))
+		return 0;
 	err = ext4bf_reserve_inode_write(handle, inode, &iloc);
 	if (ext4bf_handle_valid(handle) &&
 	    EXT4_I(inode)->i_extra_isize < sbi->s_want_extra_isize &&
@@ -4676,6 +6212,17 @@ void ext4bf_dirty_inode(struct inode *inode, int flags)
 {
 	handle_t *handle;
 
+	/*
+	 * lazytime: a timestamp-only update (I_DIRTY_SYNC without
+	 * I_DIRTY_DATASYNC) stays in memory until something else logs the
+	 * inode, the inode is synced, or it is evicted.
+	 */
+	if (test_opt2(inode->i_sb, LAZYTIME) && flags == I_DIRTY_SYNC &&
+	    !ext4bf_journal_current_handle()) {
+		ext4bf_set_inode_state(inode, EXT4_STATE_LAZY_TIME);
+		return;
+	}
+
 	handle = ext4bf_journal_start(inode, 2);
 	if (IS_ERR(handle))
 		goto out;
@@ -4687,6 +6234,25 @@ out:
 	return;
 }
 
+/*
+ * Log timestamps held back by lazytime.  Called wherever the on-disk
+ * inode has to be current: fsync, sync writeback and eviction.
+ */
+int ext4bf_flush_lazy_time(struct inode *inode)
+{
+	handle_t *handle;
+	int err;
+
+	if (!ext4bf_test_inode_state(inode, EXT4_STATE_LAZY_TIME))
+		return 0;
+	handle = ext4bf_journal_start(inode, 2);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	err = ext4bf_mark_inode_dirty(handle, inode);
+	ext4bf_journal_stop(handle);
+	return err;
+}
+
 #if 0
 /*
  * Bind an inode's backing buffer_head into this transaction, to prevent
@@ -4777,6 +6343,20 @@ static int ext4bf_bh_unmapped(handle_t *handle, struct buffer_head *bh)
 	return !buffer_mapped(bh);
 }
 
+/*
+ * ext4bf: get_block for page_mkwrite on journalled inodes.  Remembers the
+ * blocks it allocates, as buffer_new does not survive block_commit_write().
+ */
+static int ext4bf_get_block_mkwrite(struct inode *inode, sector_t iblock,
+				    struct buffer_head *bh_result, int create)
+{
+	int ret = ext4bf_get_block(inode, iblock, bh_result, create);
+
+	if (!ret && buffer_new(bh_result))
+		set_buffer_appended(bh_result);
+	return ret;
+}
+
 int ext4bf_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
 	struct page *page = vmf->page;
@@ -4795,6 +6375,12 @@ int ext4bf_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
 	 * __block_page_mkwrite() to do a reliable check.
 	 */
 	vfs_check_frozen(inode->i_sb, SB_FREEZE_WRITE);
+	/* Stores through a mapping need a block behind page 0. */
+	if (ext4bf_has_inline_data(inode)) {
+		ret = ext4bf_convert_inline_data(inode);
+		if (ret)
+			goto out_ret;
+	}
 	/* Delalloc case is easy... */
 	if (test_opt(inode->i_sb, DELALLOC) &&
 	    !ext4bf_should_journal_data(inode) &&
@@ -4837,6 +6423,8 @@ int ext4bf_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
 	/* OK, we need to fill the hole... */
 	if (ext4bf_should_dioread_nolock(inode))
 		get_block = ext4bf_get_block_write;
+	else if (ext4bf_should_journal_data(inode))
+		get_block = ext4bf_get_block_mkwrite;
 	else
 		get_block = ext4bf_get_block;
 retry_alloc:
@@ -4847,8 +6435,11 @@ retry_alloc:
 	}
 	ret = __block_page_mkwrite(vma, vmf, get_block);
 	if (!ret && ext4bf_should_journal_data(inode)) {
+		/* ext4bf: mark buffers as data blocks. */
+		walk_and_print_buffers(handle->h_transaction->t_tid,
+				       page_buffers(page), 0, PAGE_CACHE_SIZE);
 		if (walk_page_buffers(handle, page_buffers(page), 0,
-			  PAGE_CACHE_SIZE, NULL, do_journal_get_write_access)) {
+			  PAGE_CACHE_SIZE, NULL, do_journal_get_mkwrite_access)) {
 			unlock_page(page);
 			ret = VM_FAULT_SIGBUS;
 			ext4bf_journal_stop(handle);
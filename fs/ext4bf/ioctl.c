@@ -244,8 +244,10 @@ setversion_out:
 		if (err)
 			goto mext_out;
 
-		err = ext4bf_move_extents(filp, donor_filp, me.orig_start,
-					me.donor_start, me.len, &me.moved_len);
+		err = ext4bf_move_extents(filp->f_dentry->d_inode,
+					donor_filp->f_dentry->d_inode,
+					me.orig_start, me.donor_start,
+					me.len, &me.moved_len);
 		mnt_drop_write(filp->f_path.mnt);
 		if (me.moved_len > 0)
 			file_remove_suid(donor_filp);
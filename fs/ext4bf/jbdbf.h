@@ -170,6 +170,11 @@ typedef struct journal_s	journal_t;	/* Journal control structure */
 #define JBD2_SUPERBLOCK_V1	3
 #define JBD2_SUPERBLOCK_V2	4
 #define JBD2_REVOKE_BLOCK	5
+/*
+ * ext4bf: descriptor block whose tail carries the commit header of its
+ * transaction (fast external journal device, see INCOMPAT_INLINE_COMMIT).
+ */
+#define JBD2_INLINE_COMMIT_BLOCK	6
 
 /*
  * Standard header for all descriptor blocks:
@@ -200,12 +205,20 @@ struct commit_header {
 	__be32          h_sequence;
 	unsigned char   h_chksum_type;
 	unsigned char   h_chksum_size;
-	unsigned char 	h_padding[2];
+	unsigned char	h_flags;
+	unsigned char 	h_padding;
 	__be32 		h_chksum[JBD2_CHECKSUM_BYTES];
 	__be64		h_commit_sec;
 	__be32		h_commit_nsec;
 };
 
+/*
+ * ext4bf: commit_header h_flags.  A FLUSHED commit record went out with a
+ * preflush, so the data of every earlier transaction is on stable storage
+ * and recovery need not verify its NEWLYAPPENDEDDATA tags any more.
+ */
+#define JBD2_COMMIT_FLUSHED	0x01
+
 /*
  * The block tag: used to describe a single buffer in the journal.
  * t_blocknr_high is only used if INCOMPAT_64BIT is set, so this
@@ -314,6 +327,7 @@ typedef struct journal_superblock_s
 #define JBD2_FEATURE_INCOMPAT_REVOKE		0x00000001
 #define JBD2_FEATURE_INCOMPAT_64BIT		0x00000002
 #define JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT	0x00000004
+#define JBD2_FEATURE_INCOMPAT_INLINE_COMMIT	0x00000100
 
 #define JBD2_FEATURE_COMPAT_DATACHECKSUM    0x00000002
 
@@ -322,7 +336,8 @@ typedef struct journal_superblock_s
 #define JBD2_KNOWN_ROCOMPAT_FEATURES	0
 #define JBD2_KNOWN_INCOMPAT_FEATURES	(JBD2_FEATURE_INCOMPAT_REVOKE | \
 					JBD2_FEATURE_INCOMPAT_64BIT | \
-					JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT)
+					JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT | \
+					JBD2_FEATURE_INCOMPAT_INLINE_COMMIT)
 
 #ifdef __KERNEL__
 
@@ -507,6 +522,38 @@ struct transaction_chp_stats_s {
 	__u32			cs_dropped;
 };
 
+/*
+ * ext4bf: per-CPU staging list for barrier-free data buffers.  Buffers
+ * filed by jbdbf_journal_dirty_data() land here as BJ_Dirtystaged so the
+ * per-block write path never takes j_list_lock; they always belong to the
+ * running transaction and are moved to its t_dirty_data_list by
+ * __jbdbf_journal_merge_dirty_data().
+ */
+struct jbdbf_dirty_data_pcpu {
+	spinlock_t		lock;
+	struct journal_bf_head	*list;
+	unsigned long		nr;
+	struct list_head	runs;	/* struct jbdbf_data_run */
+};
+
+/*
+ * ext4bf: a run of newly appended, physically contiguous data blocks.
+ * NEWLYAPPENDEDDATA blocks are tracked this way instead of with a
+ * journal_bf_head and a jbdbf_data_tag each: the buffers are only pinned,
+ * commit writes each run with as few bios as possible and takes the
+ * checksums for the data tags as it submits them.
+ */
+#define JBDBF_DATA_RUN_BLOCKS	64
+#define JBDBF_DATA_RUN_LOOKBACK	4	/* runs searched for a neighbour */
+
+struct jbdbf_data_run {
+	struct list_head	dr_list;
+	unsigned long long	dr_start;	/* first file system block */
+	unsigned int		dr_len;
+	struct buffer_head	*dr_bh[JBDBF_DATA_RUN_BLOCKS];
+	__u32			dr_csum[JBDBF_DATA_RUN_BLOCKS];
+};
+
 struct transaction_bf_s
 {
 	/* Pointer to the journal for this transaction. [no locking] */
@@ -678,7 +725,12 @@ struct transaction_bf_s
 	 */
 	struct list_head	t_data_tag_list;
 
-	/* Number of dirty data blocks for this transaction. */
+	/* Runs of newly appended data blocks (struct jbdbf_data_run),
+	 * merged from the per-CPU lists. [j_list_lock] */
+	struct list_head	t_data_runs;
+
+	/* Number of dirty data blocks for this transaction, not counting
+	 * those still staged per-CPU. [j_list_lock] */
 	unsigned long       t_num_dirty_blocks;
 
     /*
@@ -1027,6 +1079,14 @@ struct journal_s
 	void			(*j_commit_callback)(journal_t *,
 						     transaction_bf_t *);
 
+	/*
+	 * ext4bf: called with j_state_lock held once a transaction is locked
+	 * for commit and no handle is left on it, before its buffers are
+	 * written.  Must not sleep.
+	 */
+	void			(*j_lock_callback)(journal_t *,
+						   transaction_bf_t *);
+
 	/*
 	 * Journal statistics
 	 */
@@ -1034,6 +1094,12 @@ struct journal_s
 	struct proc_dir_entry	*j_proc_entry;
 	struct transaction_bf_stats_s j_stats;
 
+	/*
+	 * ext4bf: dirty data buffers of the running transaction, staged
+	 * per-CPU. [jbdbf_dirty_data_pcpu.lock]
+	 */
+	struct jbdbf_dirty_data_pcpu __percpu *j_dirty_data_pcpu;
+
 	/* Failed journal commit ID */
 	unsigned int		j_failed_commit;
 
@@ -1056,6 +1122,11 @@ struct journal_s
 #define JBD2_ABORT_ON_SYNCDATA_ERR	0x040	/* Abort the journal on file
 						 * data write error in ordered
 						 * mode */
+#define JBD2_FAST_DEV	0x080	/* Journal lives on a fast external
+				 * device (RAM-disk, NVRAM) */
+#define JBD2_ORDERED_CSUM	0x100	/* Checksum ordered-mode data in the
+					 * descriptors instead of waiting for
+					 * it before the commit record */
 
 /*
  * Function declarations for the journaling transaction and buffer
@@ -1067,6 +1138,9 @@ extern void jbdbf_journal_unfile_buffer(journal_t *, struct journal_bf_head *);
 extern void __jbdbf_journal_refile_buffer(struct journal_bf_head *);
 extern void jbdbf_journal_refile_buffer(journal_t *, struct journal_bf_head *);
 extern void __jbdbf_journal_file_buffer(struct journal_bf_head *, transaction_bf_t *, int);
+extern void __jbdbf_journal_merge_dirty_data(transaction_bf_t *);
+extern struct buffer_head *jbdbf_journal_next_dirty_data(journal_t *,
+							 transaction_bf_t *);
 extern void __journal_free_buffer(struct journal_bf_head *bh);
 extern void jbdbf_journal_file_buffer(struct journal_bf_head *, transaction_bf_t *, int);
 extern void __journal_clean_data_list(transaction_bf_t *transaction);
@@ -1160,6 +1234,7 @@ void		 jbdbf_journal_set_triggers(struct buffer_head *,
 					   struct jbdbf_buffer_trigger_type *type);
 extern int	 jbdbf_journal_dirty_metadata (handle_t *, struct buffer_head *);
 extern int	 jbdbf_journal_dirty_data (handle_t *, struct buffer_head *);
+extern int	 jbdbf_journal_dirty_data_run(handle_t *, struct buffer_head *);
 extern void	 jbdbf_journal_release_buffer (handle_t *, struct buffer_head *);
 extern int	 jbdbf_journal_forget (handle_t *, struct buffer_head *);
 extern void	 journal_sync_buffer (struct buffer_head *);
@@ -1255,6 +1330,19 @@ static inline void jbdbf_free_data_tag(struct jbdbf_data_tag *dtag)
 	kmem_cache_free(jbdbf_data_tag_cache, dtag);
 }
 
+/* jbdbf data run cache management. */
+extern struct kmem_cache *jbdbf_data_run_cache;
+
+static inline struct jbdbf_data_run *jbdbf_alloc_data_run(gfp_t gfp_flags)
+{
+	return kmem_cache_alloc(jbdbf_data_run_cache, gfp_flags);
+}
+
+static inline void jbdbf_free_data_run(struct jbdbf_data_run *run)
+{
+	kmem_cache_free(jbdbf_data_run_cache, run);
+}
+
 /* Primary revoke support */
 #define JOURNAL_REVOKE_DEFAULT_HASH 256
 extern int	   jbdbf_journal_init_revoke(journal_t *, int);
@@ -1337,6 +1425,24 @@ static inline void jbdbf_journal_abort_handle(handle_t *handle)
 /* Comparison functions for transaction IDs: perform comparisons using
  * modulo arithmetic so that they work over sequence number wraps. */
 
+/*
+ * ext4bf: with INCOMPAT_INLINE_COMMIT the last descriptor block of a
+ * transaction carries the commit header in its final bytes, so the commit
+ * costs no extra log block and no extra round trip to the journal device.
+ */
+static inline int jbdbf_has_inline_commit(journal_t *journal)
+{
+	return JBD2_HAS_INCOMPAT_FEATURE(journal,
+					 JBD2_FEATURE_INCOMPAT_INLINE_COMMIT);
+}
+
+static inline struct commit_header *
+jbdbf_inline_commit_header(journal_t *journal, struct buffer_head *bh)
+{
+	return (struct commit_header *)(bh->b_data + journal->j_blocksize -
+					sizeof(struct commit_header));
+}
+
 static inline int tid_gt(tid_t x, tid_t y)
 {
 	int difference = (x - y);
@@ -1378,15 +1484,30 @@ static inline int jbd_space_needed(journal_t *journal)
 #define BJ_LogCtl	    5	/* Buffer contains log descriptors */
 #define BJ_Reserved	    6	/* Buffer is reserved for access by journal */
 #define BJ_Dirtydata    7   /* Buffer contains dirty data that should be written out. */
-#define BJ_Types	    8
+#define BJ_Dirtystaged  8   /* Dirty data still on a per-CPU staging list */
+#define BJ_Types	    9
 
 extern int jbd_blocks_per_page(struct inode *inode);
 
 extern __u32 jbdbf_checksum_data(__u32 crc32_sum, struct buffer_head *bh);
+extern __u32 jbdbf_checksum_buf(__u32 crc32_sum, const void *buf,
+				unsigned int len);
 
 /* For testing. */
 #define JBDBF_CHECKPOINT_INTERVAL 30000
 
+/*
+ * ext4bf: forget the delayed checkpoint write a non-durable commit put on
+ * @bh, for a buffer whose contents are no longer wanted.
+ */
+static inline void jbdbf_cancel_delayed_write(struct buffer_head *bh)
+{
+	if (bh->b_delayed_write) {
+		bh->b_delayed_write = 0;
+		bh->b_blocktype = B_BLOCKTYPE_NORMAL;
+	}
+}
+
 #ifdef __KERNEL__
 
 #define buffer_trace_init(bh)	do {} while (0)
@@ -32,6 +32,12 @@ struct journal_bf_head {
 	 */
 	unsigned b_jlist;
 
+	/*
+	 * ext4bf: CPU whose staging list holds this buffer while b_jlist is
+	 * BJ_Dirtystaged [jbd_lock_bh_state()]
+	 */
+	int b_dirty_cpu;
+
 	/*
 	 * This flag signals the buffer has been modified by
 	 * the currently running transaction
@@ -65,6 +71,9 @@ struct journal_bf_head {
 	 * transaction (if there is one).  Only applies to buffers on a
 	 * transaction's data or metadata journaling list.
 	 * [j_list_lock] [jbd_lock_bh_state()]
+	 * ext4bf: staging a data buffer that is on no checkpoint list sets
+	 * it under the bh state lock and the per-CPU staging lock only,
+	 * see jbdbf_journal_dirty_data().
 	 */
 	transaction_bf_t *b_transaction;
 
@@ -63,6 +63,7 @@ EXPORT_SYMBOL(jbdbf_journal_get_undo_access);
 EXPORT_SYMBOL(jbdbf_journal_set_triggers);
 EXPORT_SYMBOL(jbdbf_journal_dirty_metadata);
 EXPORT_SYMBOL(jbdbf_journal_dirty_data);
+EXPORT_SYMBOL(jbdbf_journal_dirty_data_run);
 EXPORT_SYMBOL(jbdbf_journal_release_buffer);
 EXPORT_SYMBOL(jbdbf_journal_forget);
 #if 0
@@ -100,6 +101,7 @@ EXPORT_SYMBOL(jbdbf_journal_release_jbd_inode);
 EXPORT_SYMBOL(jbdbf_journal_begin_ordered_truncate);
 EXPORT_SYMBOL(jbdbf_inode_cache);
 EXPORT_SYMBOL(jbdbf_checksum_data);
+EXPORT_SYMBOL(jbdbf_checksum_buf);
 EXPORT_SYMBOL(jbdbf_alloc_data_tag);
 EXPORT_SYMBOL(jbdbf_free_data_tag);
 EXPORT_SYMBOL(jbdbf_data_tag_cache);
@@ -152,52 +154,41 @@ static void write_out_dirty_blocks(journal_t *journal)  {
     unsigned static int write_dirt_cnt = 0;
     printk("736: write_out_dirty_blocks journal.c : %d \n");
 #endif
+    struct buffer_head *bh;
+    int data_batch_count = 0;
+
 	read_lock(&journal->j_state_lock);
     transaction_bf_t *commit_transaction =  
 					journal->j_running_transaction; 
 	read_unlock(&journal->j_state_lock);
     if (!commit_transaction) return;
     mutex_lock(&commit_transaction->t_dirty_data_mutex);
+    /* ext4bf: pick up the buffers staged per-CPU, unless the transaction
+     * has been committed in the meantime. */
+    read_lock(&journal->j_state_lock);
+    if (journal->j_running_transaction == commit_transaction) {
+        spin_lock(&journal->j_list_lock);
+        __jbdbf_journal_merge_dirty_data(commit_transaction);
+        spin_unlock(&journal->j_list_lock);
+    }
+    read_unlock(&journal->j_state_lock);
     jbd_debug(6, "Doing early processing of blocks for transaction %lu\n",
             commit_transaction->t_tid);
     /* EXT4BF - ext4bf: attempt to read the data blocks inside the t_forget list of the
      * the current transaction. */
-    struct journal_bf_head *jh, *jh_next;
-    jh = commit_transaction->t_dirty_data_list;
-    int data_batch_count = 0;
-    /* List of buffer heads to submit. */
-    while(1) {
-        if (!jh) {
-            jbd_debug(6, "EXT4BF: got empty forget list\n");
-            break;
+    while ((bh = jbdbf_journal_next_dirty_data(journal, commit_transaction))) {
+        if (bh->b_blocktype != B_BLOCKTYPE_DATA) {
+            put_bh(bh);
+            continue;
         }
-        struct buffer_head *bh = jh2bhbf(jh);
-        if (!bh) break;
-        jbdbf_lock_bh_state(bh);
-        if (bh->b_blocktype == B_BLOCKTYPE_DATA){
-            jbd_debug(6, "got block %lu in forget list\n", bh->b_blocknr);
-            /* Process the data buffer. */
-            get_bh(bh);
-            set_buffer_jwrite(bh);
-            j_dirty_data_bhs[data_batch_count++] = bh;
-            if (data_batch_count == EXT4BF_DATA_BATCH) {
-                __flush_data_batch(&data_batch_count);
-            }
-        }
-	    jbdbf_unlock_bh_state(bh);
-        /* If we are looping back, break */
-        if (jh->b_tnext == commit_transaction->t_dirty_data_list) {
-            /* We're done; flush remaining buffers and exit. */
-            if (data_batch_count) {
-                __flush_data_batch(&data_batch_count);
-            }
-            if (jh) jbdbf_journal_refile_buffer(journal, jh);
-            break;
-        }
-        jh_next = jh->b_tnext;
-        if (jh) jbdbf_journal_refile_buffer(journal, jh);
-		jh = jh_next;
+        jbd_debug(6, "got block %lu in forget list\n", bh->b_blocknr);
+        set_buffer_jwrite(bh);
+        j_dirty_data_bhs[data_batch_count++] = bh;
+        if (data_batch_count == EXT4BF_DATA_BATCH)
+            __flush_data_batch(&data_batch_count);
     }
+    if (data_batch_count)
+        __flush_data_batch(&data_batch_count);
     commit_transaction->t_num_dirty_blocks = 0;
     mutex_unlock(&commit_transaction->t_dirty_data_mutex);
     /* */
@@ -1037,7 +1028,7 @@ static void jbdbf_stats_proc_exit(journal_t *journal)
 static journal_t * journal_init_common (void)
 {
 	journal_t *journal;
-	int err;
+	int err, cpu;
 
 	journal = kzalloc(sizeof(*journal), GFP_KERNEL);
 	if (!journal)
@@ -1069,6 +1060,20 @@ static journal_t * journal_init_common (void)
 		return NULL;
 	}
 
+	journal->j_dirty_data_pcpu = alloc_percpu(struct jbdbf_dirty_data_pcpu);
+	if (!journal->j_dirty_data_pcpu) {
+		jbdbf_journal_destroy_revoke(journal);
+		kfree(journal);
+		return NULL;
+	}
+	for_each_possible_cpu(cpu) {
+		struct jbdbf_dirty_data_pcpu *pcpu =
+			per_cpu_ptr(journal->j_dirty_data_pcpu, cpu);
+
+		spin_lock_init(&pcpu->lock);
+		INIT_LIST_HEAD(&pcpu->runs);
+	}
+
 	spin_lock_init(&journal->j_history_lock);
 
 	return journal;
@@ -1143,6 +1148,7 @@ journal_t * jbdbf_journal_init_dev(struct block_device *bdev,
 out_err:
 	kfree(journal->j_wbuf);
 	jbdbf_stats_proc_exit(journal);
+	free_percpu(journal->j_dirty_data_pcpu);
 	kfree(journal);
 	return NULL;
 }
@@ -1217,6 +1223,7 @@ journal_t * jbdbf_journal_init_inode (struct inode *inode)
 out_err:
 	kfree(journal->j_wbuf);
 	jbdbf_stats_proc_exit(journal);
+	free_percpu(journal->j_dirty_data_pcpu);
 	kfree(journal);
 	return NULL;
 }
@@ -1568,6 +1575,7 @@ int jbdbf_journal_destroy(journal_t *journal)
 		iput(journal->j_inode);
 	if (journal->j_revoke)
 		jbdbf_journal_destroy_revoke(journal);
+	free_percpu(journal->j_dirty_data_pcpu);
 	kfree(journal->j_wbuf);
 	kfree(journal);
 
@@ -2479,6 +2487,7 @@ static void __exit jbdbf_remove_jbd_stats_proc_entry(void)
 
 struct kmem_cache *jbdbf_handle_cache, *jbdbf_inode_cache;
 struct kmem_cache *jbdbf_data_tag_cache;
+struct kmem_cache *jbdbf_data_run_cache;
 
 static int __init journal_init_handle_cache(void)
 {
@@ -2499,6 +2508,11 @@ static int __init journal_init_handle_cache(void)
 		kmem_cache_destroy(jbdbf_data_tag_cache);
 		return -ENOMEM;
 	}
+	jbdbf_data_run_cache = KMEM_CACHE(jbdbf_data_run, 0);
+	if (jbdbf_data_run_cache == NULL) {
+		printk(KERN_EMERG "JBDBF: failed to create data run cache\n");
+		return -ENOMEM;
+	}
 	return 0;
 }
 
@@ -2510,6 +2524,8 @@ static void jbdbf_journal_destroy_handle_cache(void)
 		kmem_cache_destroy(jbdbf_inode_cache);
 	if (jbdbf_data_tag_cache)
 		kmem_cache_destroy(jbdbf_data_tag_cache);
+	if (jbdbf_data_run_cache)
+		kmem_cache_destroy(jbdbf_data_run_cache);
 }
 
 /*
@@ -24,6 +24,7 @@
 #include "mballoc.h"
 #include <linux/debugfs.h>
 #include <linux/slab.h>
+#include <linux/list_sort.h>
 
 /* EXT4BF: extra headers for barrier-free ext4. */
 #include <linux/time.h>
@@ -160,6 +161,15 @@
  * can be used for allocation. ext4bf_mb_good_group explains how the groups are
  * checked.
  *
+ * With /sys/fs/ext4bf/<partition>/mb_optimize_scan set (the default for
+ * file systems of MB_DEFAULT_LINEAR_SCAN_THRESHOLD groups or more), the
+ * first two criteria don't walk the groups.  Initialised groups are kept
+ * on per-order lists by bb_largest_free_order and by the order of their
+ * average free extent (bb_free / bb_fragments), so cr 0 and cr 1 pick a
+ * handful of candidate groups straight from the list for the request
+ * size.  Groups whose buddy was never loaded are not on the lists, so
+ * until they all are the linear scan still runs after the index misses.
+ *
  * Both the prealloc space are getting populated as above. So for the first
  * request we will hit the buddy cache which will result in this prealloc
  * space getting filled. The prealloc space is then later used for the
@@ -685,11 +695,14 @@ static void ext4bf_mb_mark_free_simple(struct super_block *sb,
 
 /*
  * Cache the order of the largest free extent we have available in this block
- * group.
+ * group, and keep the group on the matching s_mb_largest_free_orders list.
+ * Called with the group locked.
  */
 static void
 mb_set_largest_free_order(struct super_block *sb, struct ext4bf_group_info *grp)
 {
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+	int old = grp->bb_largest_free_order;
 	int i;
 	int bits;
 
@@ -702,6 +715,54 @@ mb_set_largest_free_order(struct super_block *sb, struct ext4bf_group_info *grp)
 			break;
 		}
 	}
+
+	if (old == grp->bb_largest_free_order &&
+	    !list_empty(&grp->bb_largest_free_order_node))
+		return;
+	if (!list_empty(&grp->bb_largest_free_order_node)) {
+		write_lock(&sbi->s_mb_largest_free_orders_locks[old]);
+		list_del_init(&grp->bb_largest_free_order_node);
+		write_unlock(&sbi->s_mb_largest_free_orders_locks[old]);
+	}
+	i = grp->bb_largest_free_order;
+	if (i >= 0) {
+		write_lock(&sbi->s_mb_largest_free_orders_locks[i]);
+		list_add_tail(&grp->bb_largest_free_order_node,
+			      &sbi->s_mb_largest_free_orders[i]);
+		write_unlock(&sbi->s_mb_largest_free_orders_locks[i]);
+	}
+}
+
+/*
+ * Keep the group on the s_mb_avg_fragment_size list for the order of
+ * its average free extent.  Called with the group locked.
+ */
+static void
+mb_update_avg_fragment_size(struct super_block *sb,
+			    struct ext4bf_group_info *grp)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+	int old = grp->bb_avg_fragment_size_order;
+	int new = -1;
+
+	if (grp->bb_free && grp->bb_fragments)
+		new = min_t(int, fls(grp->bb_free / grp->bb_fragments) - 1,
+			    MB_NUM_ORDERS(sb) - 1);
+	if (new == old)
+		return;
+
+	if (old >= 0) {
+		write_lock(&sbi->s_mb_avg_fragment_size_locks[old]);
+		list_del_init(&grp->bb_avg_fragment_size_node);
+		write_unlock(&sbi->s_mb_avg_fragment_size_locks[old]);
+	}
+	grp->bb_avg_fragment_size_order = new;
+	if (new >= 0) {
+		write_lock(&sbi->s_mb_avg_fragment_size_locks[new]);
+		list_add_tail(&grp->bb_avg_fragment_size_node,
+			      &sbi->s_mb_avg_fragment_size[new]);
+		write_unlock(&sbi->s_mb_avg_fragment_size_locks[new]);
+	}
 }
 
 static noinline_for_stack
@@ -747,8 +808,10 @@ void ext4bf_mb_generate_buddy(struct super_block *sb,
 		grp->bb_free = free;
 	}
 	mb_set_largest_free_order(sb, grp);
+	mb_update_avg_fragment_size(sb, grp);
 
-	clear_bit(EXT4_GROUP_INFO_NEED_INIT_BIT, &(grp->bb_state));
+	if (test_and_clear_bit(EXT4_GROUP_INFO_NEED_INIT_BIT, &(grp->bb_state)))
+		atomic_dec(&EXT4_SB(sb)->s_mb_uninit_groups);
 
 	period = get_cycles() - period;
 	spin_lock(&EXT4_SB(sb)->s_bal_lock);
@@ -1385,6 +1448,7 @@ void mb_free_blocks(struct inode *inode, struct ext4bf_buddy *e4b,
 		} while (1);
 	}
 	mb_set_largest_free_order(sb, e4b->bd_info);
+	mb_update_avg_fragment_size(sb, e4b->bd_info);
 	mb_check_buddy(e4b);
 }
 
@@ -1512,6 +1576,7 @@ static int mb_mark_used(struct ext4bf_buddy *e4b, struct ext4bf_free_extent *ex)
 		e4b->bd_info->bb_counters[ord]++;
 	}
 	mb_set_largest_free_order(e4b->bd_sb, e4b->bd_info);
+	mb_update_avg_fragment_size(e4b->bd_sb, e4b->bd_info);
 
 	ext4bf_set_bits(EXT4_MB_BITMAP(e4b), ex->fe_start, len0);
 	mb_check_buddy(e4b);
@@ -1914,7 +1979,17 @@ static int ext4bf_mb_good_group(struct ext4bf_allocation_context *ac,
 
 	/* We only do this if the grp has never been initialized */
 	if (unlikely(EXT4_MB_GRP_NEED_INIT(grp))) {
-		int ret = ext4bf_mb_init_group(ac->ac_sb, group);
+		int ret;
+
+		/*
+		 * cr 0 and 1 are the cheap passes: while the prefetcher is
+		 * still warming buddies, don't stall them reading bitmaps
+		 * of cold groups in the allocating task.
+		 */
+		if (cr < 2 &&
+		    atomic_read(&EXT4_SB(ac->ac_sb)->s_mb_prefetch_active))
+			return 0;
+		ret = ext4bf_mb_init_group(ac->ac_sb, group);
 		if (ret)
 			return 0;
 	}
@@ -1957,12 +2032,146 @@ static int ext4bf_mb_good_group(struct ext4bf_allocation_context *ac,
 	return 0;
 }
 
+/*
+ * Try to allocate from @group at criterion @cr.
+ */
+static int ext4bf_mb_scan_group(struct ext4bf_allocation_context *ac,
+				ext4bf_group_t group, int cr)
+{
+	struct super_block *sb = ac->ac_sb;
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+	struct ext4bf_buddy e4b;
+	int err;
+
+	/* This now checks without needing the buddy page */
+	if (!ext4bf_mb_good_group(ac, group, cr))
+		return 0;
+
+	err = ext4bf_mb_load_buddy(sb, group, &e4b);
+	if (err)
+		return err;
+
+	ext4bf_lock_group(sb, group);
+
+	/*
+	 * We need to check again after locking the
+	 * block group
+	 */
+	if (!ext4bf_mb_good_group(ac, group, cr)) {
+		ext4bf_unlock_group(sb, group);
+		ext4bf_mb_unload_buddy(&e4b);
+		return 0;
+	}
+
+	ac->ac_groups_scanned++;
+	if (cr == 0)
+		ext4bf_mb_simple_scan_group(ac, &e4b);
+	else if (cr == 1 && sbi->s_stripe &&
+			!(ac->ac_g_ex.fe_len % sbi->s_stripe))
+		ext4bf_mb_scan_aligned(ac, &e4b);
+	else
+		ext4bf_mb_complex_scan_group(ac, &e4b);
+
+	ext4bf_unlock_group(sb, group);
+	ext4bf_mb_unload_buddy(&e4b);
+	return 0;
+}
+
+/*
+ * Pick up to @nr groups good for cr 0 from the largest free order lists,
+ * starting with the smallest order that can satisfy the request.
+ */
+static int ext4bf_mb_choose_groups_cr0(struct ext4bf_allocation_context *ac,
+				       ext4bf_group_t *groups, int nr)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(ac->ac_sb);
+	struct ext4bf_group_info *grp;
+	int order, found = 0;
+
+	for (order = ac->ac_2order;
+	     order < MB_NUM_ORDERS(ac->ac_sb) && found < nr; order++) {
+		if (list_empty(&sbi->s_mb_largest_free_orders[order]))
+			continue;
+		read_lock(&sbi->s_mb_largest_free_orders_locks[order]);
+		list_for_each_entry(grp, &sbi->s_mb_largest_free_orders[order],
+				    bb_largest_free_order_node) {
+			if (EXT4_MB_GRP_NEED_INIT(grp) ||
+			    !ext4bf_mb_good_group(ac, grp->bb_group, 0))
+				continue;
+			groups[found++] = grp->bb_group;
+			if (found == nr)
+				break;
+		}
+		read_unlock(&sbi->s_mb_largest_free_orders_locks[order]);
+	}
+	return found;
+}
+
+/*
+ * Pick up to @nr groups good for cr 1 from the average fragment size
+ * lists, starting with the order of the goal length.
+ */
+static int ext4bf_mb_choose_groups_cr1(struct ext4bf_allocation_context *ac,
+				       ext4bf_group_t *groups, int nr)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(ac->ac_sb);
+	struct ext4bf_group_info *grp;
+	int order, found = 0;
+
+	for (order = fls(ac->ac_g_ex.fe_len) - 1;
+	     order < MB_NUM_ORDERS(ac->ac_sb) && found < nr; order++) {
+		if (list_empty(&sbi->s_mb_avg_fragment_size[order]))
+			continue;
+		read_lock(&sbi->s_mb_avg_fragment_size_locks[order]);
+		list_for_each_entry(grp, &sbi->s_mb_avg_fragment_size[order],
+				    bb_avg_fragment_size_node) {
+			if (EXT4_MB_GRP_NEED_INIT(grp) ||
+			    !ext4bf_mb_good_group(ac, grp->bb_group, 1))
+				continue;
+			groups[found++] = grp->bb_group;
+			if (found == nr)
+				break;
+		}
+		read_unlock(&sbi->s_mb_avg_fragment_size_locks[order]);
+	}
+	return found;
+}
+
+/*
+ * Use the group index instead of walking every group at cr 0 and cr 1.
+ * Returns 1 if the linear scan can be skipped for this criterion, which
+ * is not the case while some groups have never been initialised and so
+ * are missing from the index.
+ */
+static int ext4bf_mb_scan_indexed(struct ext4bf_allocation_context *ac,
+				  int cr, int *errp)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(ac->ac_sb);
+	ext4bf_group_t groups[MB_INDEX_SCAN_BATCH];
+	int i, nr;
+
+	if (cr == 0)
+		nr = ext4bf_mb_choose_groups_cr0(ac, groups,
+						 MB_INDEX_SCAN_BATCH);
+	else
+		nr = ext4bf_mb_choose_groups_cr1(ac, groups,
+						 MB_INDEX_SCAN_BATCH);
+
+	for (i = 0; i < nr; i++) {
+		*errp = ext4bf_mb_scan_group(ac, groups[i], cr);
+		if (*errp || ac->ac_status != AC_STATUS_CONTINUE)
+			return 1;
+	}
+	return atomic_read(&sbi->s_mb_uninit_groups) == 0;
+}
+
 static noinline_for_stack int
 ext4bf_mb_regular_allocator(struct ext4bf_allocation_context *ac)
 {
 	ext4bf_group_t ngroups, group, i;
 	int cr;
 	int err = 0;
+	int optimize_scan;
 	struct ext4bf_sb_info *sbi;
 	struct super_block *sb;
 	struct ext4bf_buddy e4b;
@@ -1970,9 +2179,12 @@ ext4bf_mb_regular_allocator(struct ext4bf_allocation_context *ac)
 	sb = ac->ac_sb;
 	sbi = EXT4_SB(sb);
 	ngroups = ext4bf_get_groups_count(sb);
+	optimize_scan = sbi->s_mb_optimize_scan;
 	/* non-extent files are limited to low blocks/groups */
-	if (!(ext4bf_test_inode_flag(ac->ac_inode, EXT4_INODE_EXTENTS)))
+	if (!(ext4bf_test_inode_flag(ac->ac_inode, EXT4_INODE_EXTENTS))) {
 		ngroups = sbi->s_blockfile_groups;
+		optimize_scan = 0;
+	}
 
 	BUG_ON(ac->ac_status == AC_STATUS_FOUND);
 
@@ -2028,42 +2240,22 @@ repeat:
 		 */
 		group = ac->ac_g_ex.fe_group;
 
+		if (cr < 2 && optimize_scan) {
+			if (ext4bf_mb_scan_indexed(ac, cr, &err)) {
+				if (err)
+					goto out;
+				continue;
+			}
+		}
+
 		for (i = 0; i < ngroups; group++, i++) {
 			if (group == ngroups)
 				group = 0;
 
-			/* This now checks without needing the buddy page */
-			if (!ext4bf_mb_good_group(ac, group, cr))
-				continue;
-
-			err = ext4bf_mb_load_buddy(sb, group, &e4b);
+			err = ext4bf_mb_scan_group(ac, group, cr);
 			if (err)
 				goto out;
 
-			ext4bf_lock_group(sb, group);
-
-			/*
-			 * We need to check again after locking the
-			 * block group
-			 */
-			if (!ext4bf_mb_good_group(ac, group, cr)) {
-				ext4bf_unlock_group(sb, group);
-				ext4bf_mb_unload_buddy(&e4b);
-				continue;
-			}
-
-			ac->ac_groups_scanned++;
-			if (cr == 0)
-				ext4bf_mb_simple_scan_group(ac, &e4b);
-			else if (cr == 1 && sbi->s_stripe &&
-					!(ac->ac_g_ex.fe_len % sbi->s_stripe))
-				ext4bf_mb_scan_aligned(ac, &e4b);
-			else
-				ext4bf_mb_complex_scan_group(ac, &e4b);
-
-			ext4bf_unlock_group(sb, group);
-			ext4bf_mb_unload_buddy(&e4b);
-
 			if (ac->ac_status != AC_STATUS_CONTINUE)
 				break;
 		}
@@ -2246,6 +2438,7 @@ int ext4bf_mb_add_groupinfo(struct super_block *sb, ext4bf_group_t group,
 	memset(meta_group_info[i], 0, kmem_cache_size(cachep));
 	set_bit(EXT4_GROUP_INFO_NEED_INIT_BIT,
 		&(meta_group_info[i]->bb_state));
+	atomic_inc(&sbi->s_mb_uninit_groups);
 
 	/*
 	 * initialize bb_free to be able to skip
@@ -2263,6 +2456,10 @@ int ext4bf_mb_add_groupinfo(struct super_block *sb, ext4bf_group_t group,
 	init_rwsem(&meta_group_info[i]->alloc_sem);
 	meta_group_info[i]->bb_free_root = RB_ROOT;
 	meta_group_info[i]->bb_largest_free_order = -1;  /* uninit */
+	meta_group_info[i]->bb_avg_fragment_size_order = -1;
+	meta_group_info[i]->bb_group = group;
+	INIT_LIST_HEAD(&meta_group_info[i]->bb_largest_free_order_node);
+	INIT_LIST_HEAD(&meta_group_info[i]->bb_avg_fragment_size_node);
 
 #ifdef DOUBLE_CHECK
 	{
@@ -2469,11 +2666,37 @@ int ext4bf_mb_init(struct super_block *sb, int needs_recovery)
 	spin_lock_init(&sbi->s_md_lock);
 	spin_lock_init(&sbi->s_bal_lock);
 
+	i = MB_NUM_ORDERS(sb);
+	sbi->s_mb_largest_free_orders =
+		kmalloc(i * sizeof(struct list_head), GFP_KERNEL);
+	sbi->s_mb_largest_free_orders_locks =
+		kmalloc(i * sizeof(rwlock_t), GFP_KERNEL);
+	sbi->s_mb_avg_fragment_size =
+		kmalloc(i * sizeof(struct list_head), GFP_KERNEL);
+	sbi->s_mb_avg_fragment_size_locks =
+		kmalloc(i * sizeof(rwlock_t), GFP_KERNEL);
+	if (!sbi->s_mb_largest_free_orders ||
+	    !sbi->s_mb_largest_free_orders_locks ||
+	    !sbi->s_mb_avg_fragment_size ||
+	    !sbi->s_mb_avg_fragment_size_locks) {
+		ret = -ENOMEM;
+		goto out_free_groupinfo_slab;
+	}
+	for (i = 0; i < MB_NUM_ORDERS(sb); i++) {
+		INIT_LIST_HEAD(&sbi->s_mb_largest_free_orders[i]);
+		rwlock_init(&sbi->s_mb_largest_free_orders_locks[i]);
+		INIT_LIST_HEAD(&sbi->s_mb_avg_fragment_size[i]);
+		rwlock_init(&sbi->s_mb_avg_fragment_size_locks[i]);
+	}
+	atomic_set(&sbi->s_mb_uninit_groups, 0);
+
 	sbi->s_mb_max_to_scan = MB_DEFAULT_MAX_TO_SCAN;
 	sbi->s_mb_min_to_scan = MB_DEFAULT_MIN_TO_SCAN;
 	sbi->s_mb_stats = MB_DEFAULT_STATS;
 	sbi->s_mb_stream_request = MB_DEFAULT_STREAM_THRESHOLD;
 	sbi->s_mb_order2_reqs = MB_DEFAULT_ORDER2_REQS;
+	sbi->s_mb_optimize_scan = ext4bf_get_groups_count(sb) >=
+				  MB_DEFAULT_LINEAR_SCAN_THRESHOLD;
 	/*
 	 * The default group preallocation is 512, which for 4k block
 	 * sizes translates to 2 megabytes.  However for bigalloc file
@@ -2535,6 +2758,14 @@ out_free_locality_groups:
 out_free_groupinfo_slab:
 	ext4bf_groupinfo_destroy_slabs();
 out:
+	kfree(sbi->s_mb_largest_free_orders);
+	sbi->s_mb_largest_free_orders = NULL;
+	kfree(sbi->s_mb_largest_free_orders_locks);
+	sbi->s_mb_largest_free_orders_locks = NULL;
+	kfree(sbi->s_mb_avg_fragment_size);
+	sbi->s_mb_avg_fragment_size = NULL;
+	kfree(sbi->s_mb_avg_fragment_size_locks);
+	sbi->s_mb_avg_fragment_size_locks = NULL;
 	kfree(sbi->s_mb_offsets);
 	sbi->s_mb_offsets = NULL;
 	kfree(sbi->s_mb_maxs);
@@ -2542,6 +2773,129 @@ out:
 	return ret;
 }
 
+/*
+ * Background buddy prefetch.
+ *
+ * After mount a few work items on an unbound workqueue take batches of
+ * groups off s_mb_prefetch_next.  A batch is a flex_bg where there is one,
+ * so its bitmaps sit next to each other on disk: all of them are read
+ * with a single plugged ll_rw_block(), and the buddies are then built
+ * from the cached bitmaps.  EXT4_MB_GRP_NEED_INIT() tells the allocator
+ * which groups are still cold.
+ */
+static void ext4bf_mb_prefetch_work(struct work_struct *work)
+{
+	struct ext4bf_mb_prefetch *pf = container_of(work,
+					struct ext4bf_mb_prefetch, pf_work);
+	struct super_block *sb = pf->pf_sb;
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+	ext4bf_group_t ngroups = ext4bf_get_groups_count(sb);
+	unsigned int batch = min_t(unsigned int, MB_PREFETCH_MAX_BATCH,
+			max_t(unsigned int, MB_PREFETCH_BATCH,
+			      ext4bf_flex_bg_size(sbi)));
+	struct ext4bf_group_desc *desc;
+	struct buffer_head **bh;
+	struct blk_plug plug;
+	ext4bf_group_t first, group, last;
+	int i, nr;
+
+	bh = kmalloc(batch * sizeof(*bh), GFP_NOFS);
+	if (!bh)
+		goto out;
+
+	while (!sbi->s_mb_prefetch_stop) {
+		first = atomic_add_return(batch, &sbi->s_mb_prefetch_next) -
+			batch;
+		if (first >= ngroups)
+			break;
+		last = min_t(ext4bf_group_t, first + batch, ngroups);
+
+		nr = 0;
+		for (group = first; group < last; group++) {
+			if (!EXT4_MB_GRP_NEED_INIT(
+					ext4bf_get_group_info(sb, group)))
+				continue;
+			desc = ext4bf_get_group_desc(sb, group, NULL);
+			/* uninit bitmaps are built in memory, no I/O */
+			if (!desc || (desc->bg_flags &
+				      cpu_to_le16(EXT4_BG_BLOCK_UNINIT)))
+				continue;
+			bh[nr] = sb_getblk(sb, ext4bf_block_bitmap(sb, desc));
+			if (bh[nr])
+				nr++;
+		}
+		if (nr) {
+			blk_start_plug(&plug);
+			ll_rw_block(READ | REQ_META, nr, bh);
+			blk_finish_plug(&plug);
+		}
+
+		for (group = first; group < last; group++) {
+			if (sbi->s_mb_prefetch_stop)
+				break;
+			if (EXT4_MB_GRP_NEED_INIT(
+					ext4bf_get_group_info(sb, group)))
+				ext4bf_mb_init_group(sb, group);
+		}
+		for (i = 0; i < nr; i++)
+			brelse(bh[i]);
+		cond_resched();
+	}
+	kfree(bh);
+out:
+	if (atomic_dec_and_test(&sbi->s_mb_prefetch_active))
+		mb_debug(1, "buddy prefetch done, %u groups\n", ngroups);
+}
+
+void ext4bf_mb_prefetch_start(struct super_block *sb)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+	int i, nr;
+
+	if (test_opt2(sb, NO_PREFETCH_BLOCK_BITMAPS) ||
+	    (sb->s_flags & MS_RDONLY) ||
+	    !atomic_read(&sbi->s_mb_uninit_groups))
+		return;
+
+	nr = min_t(int, num_online_cpus(),
+		   DIV_ROUND_UP(ext4bf_get_groups_count(sb), MB_PREFETCH_BATCH));
+	sbi->s_mb_prefetch = kcalloc(nr, sizeof(*sbi->s_mb_prefetch),
+				     GFP_KERNEL);
+	if (!sbi->s_mb_prefetch)
+		return;
+	sbi->s_mb_prefetch_wq = alloc_workqueue("ext4bf-mb-prefetch",
+						WQ_UNBOUND, nr);
+	if (!sbi->s_mb_prefetch_wq) {
+		kfree(sbi->s_mb_prefetch);
+		sbi->s_mb_prefetch = NULL;
+		return;
+	}
+
+	sbi->s_mb_prefetch_stop = 0;
+	atomic_set(&sbi->s_mb_prefetch_next, 0);
+	atomic_set(&sbi->s_mb_prefetch_active, nr);
+	for (i = 0; i < nr; i++) {
+		sbi->s_mb_prefetch[i].pf_sb = sb;
+		INIT_WORK(&sbi->s_mb_prefetch[i].pf_work,
+			  ext4bf_mb_prefetch_work);
+		queue_work(sbi->s_mb_prefetch_wq, &sbi->s_mb_prefetch[i].pf_work);
+	}
+}
+
+static void ext4bf_mb_prefetch_stop(struct super_block *sb)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+
+	if (!sbi->s_mb_prefetch_wq)
+		return;
+	sbi->s_mb_prefetch_stop = 1;
+	destroy_workqueue(sbi->s_mb_prefetch_wq);
+	sbi->s_mb_prefetch_wq = NULL;
+	kfree(sbi->s_mb_prefetch);
+	sbi->s_mb_prefetch = NULL;
+	atomic_set(&sbi->s_mb_prefetch_active, 0);
+}
+
 /* need to called with the ext4bf group lock held */
 static void ext4bf_mb_cleanup_pa(struct ext4bf_group_info *grp)
 {
@@ -2569,6 +2923,8 @@ int ext4bf_mb_release(struct super_block *sb)
 	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
 	struct kmem_cache *cachep = get_groupinfo_cache(sb->s_blocksize_bits);
 
+	ext4bf_mb_prefetch_stop(sb);
+
 	if (sbi->s_group_info) {
 		for (i = 0; i < ngroups; i++) {
 			grinfo = ext4bf_get_group_info(sb, i);
@@ -2589,6 +2945,10 @@ int ext4bf_mb_release(struct super_block *sb)
 	}
 	kfree(sbi->s_mb_offsets);
 	kfree(sbi->s_mb_maxs);
+	kfree(sbi->s_mb_largest_free_orders);
+	kfree(sbi->s_mb_largest_free_orders_locks);
+	kfree(sbi->s_mb_avg_fragment_size);
+	kfree(sbi->s_mb_avg_fragment_size_locks);
 	if (sbi->s_buddy_cache)
 		iput(sbi->s_buddy_cache);
 	if (sbi->s_mb_stats) {
@@ -2635,6 +2995,188 @@ static inline int ext4bf_issue_discard(struct super_block *sb,
 	return sb_issue_discard(sb, discard_block, count, GFP_NOFS, 0);
 }
 
+/*
+ * Put a freed extent whose wait is over back into the buddy, so that it
+ * can be allocated again.  Does not free @entry.
+ */
+static void ext4bf_mb_release_free_data(struct super_block *sb,
+					struct ext4bf_free_data *entry)
+{
+	struct ext4bf_buddy e4b;
+	struct ext4bf_group_info *db;
+	int err;
+
+	mb_debug(1, "gonna free %u blocks in group %u (0x%p):",
+		 entry->count, entry->group, entry);
+
+	err = ext4bf_mb_load_buddy(sb, entry->group, &e4b);
+	/* we expect to find existing buddy because it's pinned */
+	BUG_ON(err != 0);
+
+	db = e4b.bd_info;
+	ext4bf_lock_group(sb, entry->group);
+	/* Take it out of per group rb tree */
+	rb_erase(&entry->node, &(db->bb_free_root));
+	mb_free_blocks(NULL, &e4b, entry->start_cluster, entry->count);
+
+	/*
+	 * Clear the trimmed flag for the group so that the next
+	 * ext4bf_trim_fs can trim it.
+	 * If the volume is mounted with -o discard, online discard
+	 * is supported and the free blocks will be trimmed online.
+	 */
+	if (!test_opt(sb, DISCARD))
+		EXT4_MB_GRP_CLEAR_TRIMMED(db);
+
+	if (!db->bb_free_root.rb_node) {
+		/* No more items in the per group rb tree
+		 * balance refcounts from ext4bf_mb_free_metadata()
+		 */
+		page_cache_release(e4b.bd_buddy_page);
+		page_cache_release(e4b.bd_bitmap_page);
+	}
+	ext4bf_unlock_group(sb, entry->group);
+	ext4bf_mb_unload_buddy(&e4b);
+}
+
+static int ext4bf_free_data_cmp(void *priv, struct list_head *a,
+				struct list_head *b)
+{
+	struct ext4bf_free_data *fa, *fb;
+
+	fa = list_entry(a, struct ext4bf_free_data, list);
+	fb = list_entry(b, struct ext4bf_free_data, list);
+	if (fa->group != fb->group)
+		return fa->group < fb->group ? -1 : 1;
+	return fa->start_cluster < fb->start_cluster ? -1 : 1;
+}
+
+static void ext4bf_discard_batch_work(struct work_struct *work)
+{
+	struct ext4bf_discard_batch *batch =
+		container_of(work, struct ext4bf_discard_batch, db_work);
+	struct super_block *sb = batch->db_sb;
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+	struct ext4bf_free_data *entry, *tmp;
+
+	list_for_each_entry_safe(entry, tmp, &batch->db_entries, list) {
+		ext4bf_mb_release_free_data(sb, entry);
+		kmem_cache_free(ext4bf_free_ext_cachep, entry);
+	}
+	kfree(batch);
+	if (atomic_dec_and_test(&sbi->s_discard_batches))
+		wake_up(&sbi->s_discard_wait);
+}
+
+static void ext4bf_discard_batch_put(struct ext4bf_discard_batch *batch)
+{
+	if (atomic_dec_and_test(&batch->db_pending))
+		schedule_work(&batch->db_work);
+}
+
+static void ext4bf_discard_end_io(struct bio *bio, int err)
+{
+	/* failed discards are only lost hints */
+	ext4bf_discard_batch_put(bio->bi_private);
+	bio_put(bio);
+}
+
+/*
+ * Queue discard bios for @count clusters at @cluster in @group, each as
+ * large as the device takes, without waiting for them.
+ */
+static void ext4bf_discard_batch_add(struct ext4bf_discard_batch *batch,
+				     ext4bf_group_t group,
+				     ext4bf_grpblk_t cluster, int count)
+{
+	struct super_block *sb = batch->db_sb;
+	struct request_queue *q = bdev_get_queue(sb->s_bdev);
+	unsigned int max_sects, shift = sb->s_blocksize_bits - 9;
+	sector_t sector, nr_sects;
+	struct bio *bio;
+
+	if (!q || !blk_queue_discard(q))
+		return;
+	max_sects = min(q->limits.max_discard_sectors, UINT_MAX >> 9);
+	if (q->limits.discard_granularity)
+		max_sects &= ~((q->limits.discard_granularity >> 9) - 1);
+	if (!max_sects)
+		return;
+
+	sector = (sector_t)(EXT4_C2B(EXT4_SB(sb), cluster) +
+		 ext4bf_group_first_block_no(sb, group)) << shift;
+	nr_sects = (sector_t)EXT4_C2B(EXT4_SB(sb), count) << shift;
+	while (nr_sects) {
+		bio = bio_alloc(GFP_NOFS, 1);
+		if (!bio)
+			return;
+		bio->bi_sector = sector;
+		bio->bi_bdev = sb->s_bdev;
+		bio->bi_end_io = ext4bf_discard_end_io;
+		bio->bi_private = batch;
+		bio->bi_size = min_t(sector_t, nr_sects, max_sects) << 9;
+		sector += bio->bi_size >> 9;
+		nr_sects -= bio->bi_size >> 9;
+
+		atomic_inc(&batch->db_pending);
+		submit_bio(REQ_WRITE | REQ_DISCARD, bio);
+	}
+}
+
+/*
+ * Discard the freed extents on @list, merged into as few ranges as the
+ * sorted list allows, and release them to the buddy from a work item once
+ * the discards complete.  Returns 0 if there was no memory for the batch,
+ * in which case @list is left to the caller.
+ */
+static int ext4bf_discard_batch_start(struct super_block *sb,
+				      struct list_head *list)
+{
+	struct ext4bf_discard_batch *batch;
+	struct ext4bf_free_data *entry;
+	ext4bf_group_t group = 0;
+	ext4bf_grpblk_t start = 0, count = 0;
+
+	batch = kmalloc(sizeof(*batch), GFP_NOFS);
+	if (!batch)
+		return 0;
+	batch->db_sb = sb;
+	INIT_LIST_HEAD(&batch->db_entries);
+	atomic_set(&batch->db_pending, 1);
+	INIT_WORK(&batch->db_work, ext4bf_discard_batch_work);
+	atomic_inc(&EXT4_SB(sb)->s_discard_batches);
+
+	list_sort(NULL, list, ext4bf_free_data_cmp);
+	list_splice_init(list, &batch->db_entries);
+	list_for_each_entry(entry, &batch->db_entries, list) {
+		if (count && entry->group == group &&
+		    entry->start_cluster == start + count) {
+			count += entry->count;
+			continue;
+		}
+		if (count)
+			ext4bf_discard_batch_add(batch, group, start, count);
+		group = entry->group;
+		start = entry->start_cluster;
+		count = entry->count;
+	}
+	if (count)
+		ext4bf_discard_batch_add(batch, group, start, count);
+
+	ext4bf_discard_batch_put(batch);
+	return 1;
+}
+
+/*
+ * Wait until every discard batch has released its extents to the buddy.
+ */
+void ext4bf_mb_wait_discard(struct super_block *sb)
+{
+	struct ext4bf_sb_info *sbi = EXT4_SB(sb);
+
+	wait_event(sbi->s_discard_wait, !atomic_read(&sbi->s_discard_batches));
+}
+
 int inside_mb_free_metadata = 0;
 int dr_added = 0;
 
@@ -2654,23 +3196,15 @@ void release_blocks_after_delay(struct super_block *sb, int delay, int finish)
 	if (inside_mb_free_metadata) {
 		return;
 	}
-	struct ext4bf_buddy e4b;
-	struct ext4bf_group_info *db;
-	int err, count = 0, count2 = 0;
-	struct ext4bf_free_data *entry;
+	struct ext4bf_free_data *entry, *tmp;
 	struct list_head *l, *ltmp;
-	unsigned int diff;
+	LIST_HEAD(expired);
+	int count = 0, count2 = 0;
 	int dr_count = 0;
-    
+
 	spin_lock(&dr_lock);
 	list_for_each_safe(l, ltmp, &ext4bf_delayed_reuse_list) {
 		entry = list_entry(l, struct ext4bf_free_data, list);
-		dr_added--;
-		spin_unlock(&dr_lock);
-
-        diff = jiffies_to_msecs(jiffies - entry->d_ftime);
-        
-        dr_count++;
 
         /* Under normal circumstances, only do 100 entries at a time, and don't
          * process items which haven't undergone the 30 second delay.
@@ -2678,59 +3212,40 @@ void release_blocks_after_delay(struct super_block *sb, int delay, int finish)
          * However, if the file system is unmounting, the finish flag is set,
          * and in this case, process everything.
          */
-        if (finish) goto delete_item;
-
-        if (dr_count >= 50) goto reuse_loop_done;
-
-        if (diff < delay) {
-            goto reuse_loop_done;
+        if (!finish) {
+            if (++dr_count >= 50)
+                break;
+            if (jiffies_to_msecs(jiffies - entry->d_ftime) < delay)
+                break;
         }
+		dr_added--;
+		list_move_tail(l, &expired);
+	}
+	spin_unlock(&dr_lock);
 
-		mb_debug(1, "gonna free %u blocks in group %u (0x%p):",
-			 entry->count, entry->group, entry);
-        if (test_opt(sb, DISCARD))
-            ext4bf_issue_discard(sb, entry->group,
-                    entry->start_cluster, entry->count);
-		err = ext4bf_mb_load_buddy(sb, entry->group, &e4b);
-		/* we expect to find existing buddy because it's pinned */
-		BUG_ON(err != 0);
+	if (finish) {
+		list_for_each_entry_safe(entry, tmp, &expired, list)
+			kmem_cache_free(ext4bf_free_ext_cachep, entry);
+		return;
+	}
 
-		db = e4b.bd_info;
-		/* there are blocks to put in buddy to make them really free */
+	list_for_each_entry(entry, &expired, list) {
 		count += entry->count;
 		count2++;
-		ext4bf_lock_group(sb, entry->group);
-		/* Take it out of per group rb tree */
-		rb_erase(&entry->node, &(db->bb_free_root));
-        mb_free_blocks(NULL, &e4b, entry->start_cluster, entry->count);
+	}
+	mb_debug(1, "freeing %u blocks in %u structures\n", count, count2);
 
-		/*
-		 * Clear the trimmed flag for the group so that the next
-		 * ext4bf_trim_fs can trim it.
-		 * If the volume is mounted with -o discard, online discard
-		 * is supported and the free blocks will be trimmed online.
-		 */
-		if (!test_opt(sb, DISCARD))
-			EXT4_MB_GRP_CLEAR_TRIMMED(db);
+	/* with -o discard the blocks reach the buddy once discarded */
+	if (test_opt(sb, DISCARD) && ext4bf_discard_batch_start(sb, &expired))
+		return;
 
-		if (!db->bb_free_root.rb_node) {
-			/* No more items in the per group rb tree
-			 * balance refcounts from ext4bf_mb_free_metadata()
-			 */
-			page_cache_release(e4b.bd_buddy_page);
-			page_cache_release(e4b.bd_bitmap_page);
-		}
-		ext4bf_unlock_group(sb, entry->group);
-		ext4bf_mb_unload_buddy(&e4b);
-delete_item:
-	    spin_lock(&dr_lock);
-		list_del(l);
+	list_for_each_entry_safe(entry, tmp, &expired, list) {
+		if (test_opt(sb, DISCARD))
+			ext4bf_issue_discard(sb, entry->group,
+					   entry->start_cluster, entry->count);
+		ext4bf_mb_release_free_data(sb, entry);
 		kmem_cache_free(ext4bf_free_ext_cachep, entry);
 	}
-    spin_unlock(&dr_lock);
-
-reuse_loop_done:
-	mb_debug(1, "freed %u blocks in %u structures\n", count, count2);
 }
 
 /*
@@ -2740,9 +3255,7 @@ reuse_loop_done:
 static void release_blocks_on_commit(journal_t *journal, transaction_bf_t *txn)
 {
 	struct super_block *sb = journal->j_private;
-	struct ext4bf_buddy e4b;
-	struct ext4bf_group_info *db;
-	int err, count = 0, count2 = 0;
+	int count = 0, count2 = 0;
 	struct ext4bf_free_data *entry;
 	struct list_head *l, *ltmp;
 
@@ -2759,45 +3272,15 @@ static void release_blocks_on_commit(journal_t *journal, transaction_bf_t *txn)
 		}
 		spin_unlock(&dr_lock);
 #else
-		mb_debug(1, "gonna free %u blocks in group %u (0x%p):",
-			 entry->count, entry->group, entry);
-
 		if (test_opt(sb, DISCARD))
 			ext4bf_issue_discard(sb, entry->group,
 					   entry->start_cluster, entry->count);
 
-		err = ext4bf_mb_load_buddy(sb, entry->group, &e4b);
-		/* we expect to find existing buddy because it's pinned */
-		BUG_ON(err != 0);
-
-		db = e4b.bd_info;
 		/* there are blocks to put in buddy to make them really free */
 		count += entry->count;
 		count2++;
-		ext4bf_lock_group(sb, entry->group);
-		/* Take it out of per group rb tree */
-		rb_erase(&entry->node, &(db->bb_free_root));
-		mb_free_blocks(NULL, &e4b, entry->start_cluster, entry->count);
-
-		/*
-		 * Clear the trimmed flag for the group so that the next
-		 * ext4bf_trim_fs can trim it.
-		 * If the volume is mounted with -o discard, online discard
-		 * is supported and the free blocks will be trimmed online.
-		 */
-		if (!test_opt(sb, DISCARD))
-			EXT4_MB_GRP_CLEAR_TRIMMED(db);
-
-		if (!db->bb_free_root.rb_node) {
-			/* No more items in the per group rb tree
-			 * balance refcounts from ext4bf_mb_free_metadata()
-			 */
-			page_cache_release(e4b.bd_buddy_page);
-			page_cache_release(e4b.bd_bitmap_page);
-		}
-		ext4bf_unlock_group(sb, entry->group);
+		ext4bf_mb_release_free_data(sb, entry);
 		kmem_cache_free(ext4bf_free_ext_cachep, entry);
-		ext4bf_mb_unload_buddy(&e4b);
 #endif
 	}
 
@@ -4621,6 +5104,22 @@ ext4bf_mb_free_metadata(handle_t *handle, struct ext4bf_buddy *e4b,
 	return 0;
 }
 
+/*
+ * ext4bf: data blocks of an inode created by the running transaction were
+ * all allocated since, so no committed state points at them and they can
+ * be reused at once, without waiting for the commit or the delayed reuse
+ * window.  Metadata is left alone: an xattr block, for one, may have been
+ * shared with older inodes.
+ */
+static int ext4bf_mb_never_committed(handle_t *handle, struct inode *inode,
+				     int flags)
+{
+	return !(flags & EXT4_FREE_BLOCKS_METADATA) &&
+		ext4bf_handle_valid(handle) &&
+		ext4bf_test_inode_state(inode, EXT4_STATE_CREATED) &&
+		EXT4_I(inode)->i_create_tid == handle->h_transaction->t_tid;
+}
+
 /**
  * ext4bf_free_blocks() -- Free given blocks and update quota
  * @handle:		handle for this transaction
@@ -4688,8 +5187,12 @@ void ext4bf_free_blocks(handle_t *handle, struct inode *inode,
 	 * treating the block as metadata, below.  We make an
 	 * exception if the inode is to be written in writeback mode
 	 * since writeback mode has weak data consistency guarantees.
+	 *
+	 * ext4bf: and for the data blocks of an inode created in this
+	 * same transaction, see ext4bf_mb_never_committed().
 	 */
-	if (!ext4bf_should_writeback_data(inode))
+	if (!ext4bf_should_writeback_data(inode) &&
+	    !ext4bf_mb_never_committed(handle, inode, flags))
 		flags |= EXT4_FREE_BLOCKS_METADATA;
 
 	/*
@@ -5169,12 +5672,7 @@ int ext4bf_trim_fs(struct super_block *sb, struct fstrim_range *range)
 
 	for (group = first_group; group <= last_group; group++) {
 		grp = ext4bf_get_group_info(sb, group);
-		/* We only do this if the grp has never been initialized */
-		if (unlikely(EXT4_MB_GRP_NEED_INIT(grp))) {
-			ret = ext4bf_mb_init_group(sb, group);
-			if (ret)
-				break;
-		}
+		cnt = 0;
 
 		/*
 		 * For all the groups except the last one, last block will
@@ -5186,6 +5684,21 @@ int ext4bf_trim_fs(struct super_block *sb, struct fstrim_range *range)
 			last_cluster = first_cluster + len;
 		len -= last_cluster - first_cluster;
 
+		/*
+		 * Nothing was freed in a trimmed group since, or with
+		 * -o discard it was discarded as it was freed: skip it
+		 * without loading its buddy.
+		 */
+		if (EXT4_MB_GRP_WAS_TRIMMED(grp) &&
+		    minlen >= atomic_read(&EXT4_SB(sb)->s_last_trim_minblks))
+			goto next;
+		/* We only do this if the grp has never been initialized */
+		if (unlikely(EXT4_MB_GRP_NEED_INIT(grp))) {
+			ret = ext4bf_mb_init_group(sb, group);
+			if (ret)
+				break;
+		}
+
 		if (grp->bb_free >= minlen) {
 			cnt = ext4bf_trim_all_free(sb, group, first_cluster,
 						last_cluster, minlen);
@@ -5195,6 +5708,7 @@ int ext4bf_trim_fs(struct super_block *sb, struct fstrim_range *range)
 			}
 		}
 		trimmed += cnt;
+next:
 		first_cluster = 0;
 	}
 	range->len = trimmed * sb->s_blocksize;
@@ -95,6 +95,42 @@ extern u8 mb_enable_debug;
  */
 #define MB_DEFAULT_GROUP_PREALLOC	512
 
+/*
+ * file systems with fewer groups than this are scanned linearly
+ */
+#define MB_DEFAULT_LINEAR_SCAN_THRESHOLD	16
+
+/*
+ * how many candidate groups one lookup in the group index returns
+ */
+#define MB_INDEX_SCAN_BATCH		8
+
+/*
+ * groups per batch of the background buddy prefetch, if flex_bg
+ * doesn't give a larger one
+ */
+#define MB_PREFETCH_BATCH		16
+#define MB_PREFETCH_MAX_BATCH		256
+
+struct ext4bf_mb_prefetch {
+	struct work_struct	pf_work;
+	struct super_block	*pf_sb;
+};
+
+/*
+ * Freed extents whose delayed reuse expired together.  They are discarded
+ * as one set of bios and go back to the buddy once the last bio is done.
+ */
+struct ext4bf_discard_batch {
+	struct super_block	*db_sb;
+	struct list_head	db_entries;	/* ext4bf_free_data, sorted */
+	atomic_t		db_pending;	/* bios in flight, plus one */
+	struct work_struct	db_work;
+};
+
+/* number of buddy orders, and so of per-order group lists */
+#define MB_NUM_ORDERS(sb)		((sb)->s_blocksize_bits + 2)
+
 
 struct ext4bf_free_data {
 	/* this links the free block information from group_info */
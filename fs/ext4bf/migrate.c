@@ -447,7 +447,8 @@ int ext4bf_ext_migrate(struct inode *inode)
 	 */
 	if (!EXT4_HAS_INCOMPAT_FEATURE(inode->i_sb,
 				       EXT4_FEATURE_INCOMPAT_EXTENTS) ||
-	    (ext4bf_test_inode_flag(inode, EXT4_INODE_EXTENTS)))
+	    (ext4bf_test_inode_flag(inode, EXT4_INODE_EXTENTS)) ||
+	    ext4bf_has_inline_data(inode))
 		return -EINVAL;
 
 	if (S_ISLNK(inode->i_mode) && inode->i_blocks == 0)
@@ -0,0 +1,10 @@
+# Build an OptFS file system on /dev/sdc whose journal lives on a RAM disk
+# (stand-in for an NVRAM/fast journal device). Mount with journal_fast_dev.
+# For a tmpfs-backed journal instead of brd:
+#   dd if=/dev/zero of=/dev/shm/ext4bf-journal bs=1M count=1024
+#   losetup /dev/loop0 /dev/shm/ext4bf-journal  (and use /dev/loop0 below)
+umount /mnt/mydisk
+modprobe brd rd_nr=1 rd_size=1048576
+mke2fs -O journal_dev -b 4096 /dev/ram0
+mkfs.ext4 -b 4096 -J device=/dev/ram0 -E lazy_itable_init=0 /dev/sdc
+#mount -t ext4bf -o journal_fast_dev,discard,nodelalloc,nobarrier,nouser_xattr,noacl,data=journal  /dev/sdc /mnt/mydisk
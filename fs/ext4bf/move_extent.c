@@ -772,7 +772,7 @@ out:
 /**
  * move_extent_per_page - Move extent data per page
  *
- * @o_filp:			file structure of original file
+ * @orig_inode:		original inode
  * @donor_inode:		donor inode
  * @orig_page_offset:		page index on original file
  * @data_offset_in_page:	block index where data swapping starts
@@ -784,13 +784,15 @@ out:
  * with donor inode extents by calling mext_replace_branches().
  * Finally, write out the saved data in new original inode blocks. Return
  * replaced block count.
+ *
+ * No file is passed to the address_space operations: ext4bf's do not use
+ * it, and the background defragmenter has none to give.
  */
 static int
-move_extent_per_page(struct file *o_filp, struct inode *donor_inode,
+move_extent_per_page(struct inode *orig_inode, struct inode *donor_inode,
 		  pgoff_t orig_page_offset, int data_offset_in_page,
 		  int block_len_in_page, int uninit, int *err)
 {
-	struct inode *orig_inode = o_filp->f_dentry->d_inode;
 	struct address_space *mapping = orig_inode->i_mapping;
 	struct buffer_head *bh;
 	struct page *page = NULL;
@@ -858,13 +860,13 @@ move_extent_per_page(struct file *o_filp, struct inode *donor_inode,
 
 	replaced_size = data_size;
 
-	*err = a_ops->write_begin(o_filp, mapping, offs, data_size, w_flags,
+	*err = a_ops->write_begin(NULL, mapping, offs, data_size, w_flags,
 				 &page, &fsdata);
 	if (unlikely(*err < 0))
 		goto out;
 
 	if (!PageUptodate(page)) {
-		mapping->a_ops->readpage(o_filp, page);
+		mapping->a_ops->readpage(NULL, page);
 		lock_page(page);
 	}
 
@@ -909,7 +911,7 @@ move_extent_per_page(struct file *o_filp, struct inode *donor_inode,
 			bh = bh->b_this_page;
 	}
 
-	*err = a_ops->write_end(o_filp, mapping, offs, data_size, replaced_size,
+	*err = a_ops->write_end(NULL, mapping, offs, data_size, replaced_size,
 			       page, fsdata);
 	page = NULL;
 
@@ -1136,8 +1138,8 @@ out:
 /**
  * ext4bf_move_extents - Exchange the specified range of a file
  *
- * @o_filp:		file structure of the original file
- * @d_filp:		file structure of the donor file
+ * @orig_inode:		the original inode
+ * @donor_inode:	the donor inode
  * @orig_start:		start offset in block for orig
  * @donor_start:	start offset in block for donor
  * @len:		the number of blocks to be moved
@@ -1175,12 +1177,10 @@ out:
  * 7:Return 0 on success, or a negative error value on failure.
  */
 int
-ext4bf_move_extents(struct file *o_filp, struct file *d_filp,
+ext4bf_move_extents(struct inode *orig_inode, struct inode *donor_inode,
 		 __u64 orig_start, __u64 donor_start, __u64 len,
 		 __u64 *moved_len)
 {
-	struct inode *orig_inode = o_filp->f_dentry->d_inode;
-	struct inode *donor_inode = d_filp->f_dentry->d_inode;
 	struct ext4bf_ext_path *orig_path = NULL, *holecheck_path = NULL;
 	struct ext4bf_extent *ext_prev, *ext_cur, *ext_dummy;
 	ext4bf_lblk_t block_start = orig_start;
@@ -1216,6 +1216,9 @@ ext4bf_move_extents(struct file *o_filp, struct file *d_filp,
 
 	/* Protect extent tree against block allocations via delalloc */
 	double_down_write_data_sem(orig_inode, donor_inode);
+	/* each may end up with blocks the other had before this transaction */
+	ext4bf_clear_inode_state(orig_inode, EXT4_STATE_CREATED);
+	ext4bf_clear_inode_state(donor_inode, EXT4_STATE_CREATED);
 	/* Check the filesystem environment whether move_extent can be done */
 	ret1 = mext_check_arguments(orig_inode, donor_inode, orig_start,
 				    donor_start, &len);
@@ -1345,7 +1348,7 @@ ext4bf_move_extents(struct file *o_filp, struct file *d_filp,
 
 			/* Swap original branches with new branches */
 			block_len_in_page = move_extent_per_page(
-						o_filp, donor_inode,
+						orig_inode, donor_inode,
 						orig_page_offset,
 						data_offset_in_page,
 						block_len_in_page, uninit,
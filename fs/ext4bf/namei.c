@@ -1967,10 +1967,194 @@ static int empty_dir(struct inode *inode)
 	return 1;
 }
 
+/*
+ * With the orphan_file feature, orphans are recorded as inode numbers in
+ * the slots of a preallocated file instead of being chained through the
+ * superblock.  Adding or removing one journals only the orphan file block
+ * holding its slot, and each CPU starts looking for a free slot in a
+ * different block, so unlinks and truncates running in parallel neither
+ * serialize on s_orphan_lock nor all dirty the superblock.
+ *
+ * The file is not grown: when it is full we fall back to the list.
+ */
+static int ext4bf_orphan_file_add(handle_t *handle, struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4bf_orphan_info *oi = &EXT4_SB(sb)->s_orphan_info;
+	int inodes_per_ob = ext4bf_inodes_per_orphan_block(sb->s_blocksize);
+	struct buffer_head *bh;
+	__le32 *bdata;
+	int i, j, start, looped = 0;
+	int err;
+
+	if (!oi->of_blocks)
+		return -ENOSPC;
+	start = raw_smp_processor_id() * 13 % oi->of_blocks;
+	i = start;
+	while (!atomic_add_unless(&oi->of_binfo[i].ob_free_entries, -1, 0)) {
+		if (++i >= oi->of_blocks)
+			i = 0;
+		if (i == start)
+			return -ENOSPC;
+	}
+
+	bh = oi->of_binfo[i].ob_bh;
+	BUFFER_TRACE(bh, "get_write_access");
+	err = ext4bf_journal_get_write_access(handle, bh);
+	if (err) {
+		atomic_inc(&oi->of_binfo[i].ob_free_entries);
+		return err;
+	}
+
+	/*
+	 * A free slot is reserved for us in this block, but others may be
+	 * claiming slots in it at the same time, so take one with cmpxchg.
+	 */
+	bdata = (__le32 *)bh->b_data;
+	j = 0;
+	do {
+		while (bdata[j]) {
+			if (++j < inodes_per_ob)
+				continue;
+			j = 0;
+			/* only a corrupted block should get us here */
+			if (++looped > 3) {
+				atomic_inc(&oi->of_binfo[i].ob_free_entries);
+				return -ENOSPC;
+			}
+			cond_resched();
+		}
+	} while (cmpxchg(&bdata[j], 0, cpu_to_le32(inode->i_ino)) != 0);
+
+	EXT4_I(inode)->i_orphan_idx = i * inodes_per_ob + j;
+	ext4bf_set_inode_state(inode, EXT4_STATE_ORPHAN_FILE);
+	jbd_debug(4, "orphan inode %lu in orphan file slot %u\n",
+		  inode->i_ino, EXT4_I(inode)->i_orphan_idx);
+
+	return ext4bf_handle_dirty_metadata(handle, NULL, bh);
+}
+
+static int ext4bf_orphan_file_del(handle_t *handle, struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext4bf_orphan_info *oi = &EXT4_SB(sb)->s_orphan_info;
+	int inodes_per_ob = ext4bf_inodes_per_orphan_block(sb->s_blocksize);
+	unsigned int blk = EXT4_I(inode)->i_orphan_idx / inodes_per_ob;
+	unsigned int off = EXT4_I(inode)->i_orphan_idx % inodes_per_ob;
+	struct buffer_head *bh;
+	int err = 0;
+
+	ext4bf_clear_inode_state(inode, EXT4_STATE_ORPHAN_FILE);
+	/* As for the list, an error path without a handle leaves the slot
+	 * taken on disk; the next mount cleans it up. */
+	if (!handle || WARN_ON_ONCE(blk >= oi->of_blocks))
+		return 0;
+
+	bh = oi->of_binfo[blk].ob_bh;
+	BUFFER_TRACE(bh, "get_write_access");
+	err = ext4bf_journal_get_write_access(handle, bh);
+	if (err)
+		goto out;
+	((__le32 *)bh->b_data)[off] = 0;
+	atomic_inc(&oi->of_binfo[blk].ob_free_entries);
+	err = ext4bf_handle_dirty_metadata(handle, NULL, bh);
+out:
+	ext4bf_std_error(sb, err);
+	return err;
+}
+
+/*
+ * Read in and pin the orphan file.  Called at mount after journal replay,
+ * before ext4bf_orphan_cleanup() looks at the slots.
+ */
+int ext4bf_init_orphan_info(struct super_block *sb)
+{
+	struct ext4bf_orphan_info *oi = &EXT4_SB(sb)->s_orphan_info;
+	int inodes_per_ob = ext4bf_inodes_per_orphan_block(sb->s_blocksize);
+	struct ext4bf_orphan_block_tail *ot;
+	struct ext4bf_orphan_block *binfo;
+	struct inode *inode;
+	__le32 *bdata;
+	int i, j, nblocks, free, err = 0;
+
+	if (!EXT4_HAS_COMPAT_FEATURE(sb, EXT4_FEATURE_COMPAT_ORPHAN_FILE))
+		return 0;
+
+	inode = ext4bf_iget(sb, le32_to_cpu(EXT4_SB(sb)->s_es->s_orphan_file_inum));
+	if (IS_ERR(inode)) {
+		ext4bf_msg(sb, KERN_ERR, "get orphan file inode failed");
+		return PTR_ERR(inode);
+	}
+	nblocks = inode->i_size >> sb->s_blocksize_bits;
+	binfo = kcalloc(nblocks, sizeof(*binfo), GFP_KERNEL);
+	if (!binfo) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < nblocks; i++) {
+		binfo[i].ob_bh = ext4bf_bread(NULL, inode, i, 0, &err);
+		if (!binfo[i].ob_bh) {
+			if (!err)
+				err = -EIO;
+			goto out_free;
+		}
+		ot = (struct ext4bf_orphan_block_tail *)
+			(binfo[i].ob_bh->b_data + sb->s_blocksize - sizeof(*ot));
+		if (le32_to_cpu(ot->ob_magic) != EXT4_ORPHAN_BLOCK_MAGIC) {
+			ext4bf_error(sb, "orphan file block %d: bad magic", i);
+			err = -EIO;
+			goto out_free;
+		}
+		bdata = (__le32 *)binfo[i].ob_bh->b_data;
+		free = 0;
+		for (j = 0; j < inodes_per_ob; j++)
+			if (!bdata[j])
+				free++;
+		atomic_set(&binfo[i].ob_free_entries, free);
+	}
+	oi->of_binfo = binfo;
+	oi->of_blocks = nblocks;
+	goto out;
+
+out_free:
+	while (--i >= 0)
+		brelse(binfo[i].ob_bh);
+	kfree(binfo);
+out:
+	iput(inode);
+	return err;
+}
+
+void ext4bf_release_orphan_info(struct super_block *sb)
+{
+	struct ext4bf_orphan_info *oi = &EXT4_SB(sb)->s_orphan_info;
+	int i;
+
+	for (i = 0; i < oi->of_blocks; i++)
+		brelse(oi->of_binfo[i].ob_bh);
+	kfree(oi->of_binfo);
+	oi->of_binfo = NULL;
+	oi->of_blocks = 0;
+}
+
+int ext4bf_orphan_file_empty(struct super_block *sb)
+{
+	struct ext4bf_orphan_info *oi = &EXT4_SB(sb)->s_orphan_info;
+	int inodes_per_ob = ext4bf_inodes_per_orphan_block(sb->s_blocksize);
+	int i;
+
+	for (i = 0; i < oi->of_blocks; i++)
+		if (atomic_read(&oi->of_binfo[i].ob_free_entries) !=
+		    inodes_per_ob)
+			return 0;
+	return 1;
+}
+
 /* ext4bf_orphan_add() links an unlinked or truncated inode into a list of
  * such inodes, starting at the superblock, in case we crash before the
  * file is closed/deleted, or in case the inode truncate spans multiple
  * transactions and the last transaction is not recovered after a crash.
+ * If the fs has an orphan file, the inode is recorded there instead.
  *
  * At filesystem recovery time, we walk this list deleting unlinked
  * inodes and truncating linked inodes in ext4bf_orphan_cleanup().
@@ -1984,19 +2168,33 @@ int ext4bf_orphan_add(handle_t *handle, struct inode *inode)
 	if (!ext4bf_handle_valid(handle))
 		return 0;
 
-	mutex_lock(&EXT4_SB(sb)->s_orphan_lock);
-	if (!list_empty(&EXT4_I(inode)->i_orphan))
-		goto out_unlock;
-
 	/*
 	 * Orphan handling is only valid for files with data blocks
 	 * being truncated, or files being unlinked. Note that we either
 	 * hold i_mutex, or the inode can not be referenced from outside,
-	 * so i_nlink should not be bumped due to race
+	 * so i_nlink should not be bumped due to race, nor can the inode
+	 * be added or removed concurrently.
 	 */
 	J_ASSERT((S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) ||
 		  S_ISLNK(inode->i_mode)) || inode->i_nlink == 0);
 
+	if (ext4bf_test_inode_state(inode, EXT4_STATE_ORPHAN_FILE) ||
+	    !list_empty(&EXT4_I(inode)->i_orphan))
+		return 0;
+
+	if (EXT4_HAS_COMPAT_FEATURE(sb, EXT4_FEATURE_COMPAT_ORPHAN_FILE)) {
+		err = ext4bf_orphan_file_add(handle, inode);
+		if (err != -ENOSPC) {
+			ext4bf_std_error(sb, err);
+			return err;
+		}
+		err = 0;
+	}
+
+	mutex_lock(&EXT4_SB(sb)->s_orphan_lock);
+	if (!list_empty(&EXT4_I(inode)->i_orphan))
+		goto out_unlock;
+
 	BUFFER_TRACE(EXT4_SB(sb)->s_sbh, "get_write_access");
 	err = ext4bf_journal_get_write_access(handle, EXT4_SB(sb)->s_sbh);
 	if (err)
@@ -2059,6 +2257,9 @@ int ext4bf_orphan_del(handle_t *handle, struct inode *inode)
 	if (handle && !ext4bf_handle_valid(handle))
 		return 0;
 
+	if (ext4bf_test_inode_state(inode, EXT4_STATE_ORPHAN_FILE))
+		return ext4bf_orphan_file_del(handle, inode);
+
 	mutex_lock(&EXT4_SB(inode->i_sb)->s_orphan_lock);
 	if (list_empty(&ei->i_orphan))
 		goto out;
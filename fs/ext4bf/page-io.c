@@ -21,6 +21,7 @@
 #include <linux/namei.h>
 #include <linux/uio.h>
 #include <linux/bio.h>
+#include <linux/list_sort.h>
 #include <linux/workqueue.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
@@ -82,81 +83,116 @@ void ext4bf_free_io_end(ext4bf_io_end_t *io)
 	kmem_cache_free(io_end_cachep, io);
 }
 
+static int ext4bf_io_end_cmp(void *priv, struct list_head *a,
+			     struct list_head *b)
+{
+	ext4bf_io_end_t *ia = list_entry(a, ext4bf_io_end_t, list);
+	ext4bf_io_end_t *ib = list_entry(b, ext4bf_io_end_t, list);
+
+	if (ia->offset < ib->offset)
+		return -1;
+	return ia->offset > ib->offset;
+}
+
 /*
- * check a range of space and convert unwritten extents to written.
- *
- * Called with inode->i_mutex; we depend on this when we manipulate
- * io->flag, since we could otherwise race with ext4bf_flush_completed_IO()
+ * Complete a batch of io_ends once their unwritten extents have been
+ * converted: finish the aio, wake up waiters and free them.
  */
-int ext4bf_end_io_nolock(ext4bf_io_end_t *io)
+static void ext4bf_release_io_ends(struct inode *inode,
+				   struct list_head *head,
+				   struct list_head *stop)
 {
-	struct inode *inode = io->inode;
-	loff_t offset = io->offset;
-	ssize_t size = io->size;
-	int ret = 0;
-
-	ext4bf_debug("ext4bf_end_io_nolock: io 0x%p from inode %lu,list->next 0x%p,"
-		   "list->prev 0x%p\n",
-		   io, inode->i_ino, io->list.next, io->list.prev);
-
-	ret = ext4bf_convert_unwritten_extents(inode, offset, size);
-	if (ret < 0) {
-		ext4bf_msg(inode->i_sb, KERN_EMERG,
-			 "failed to convert unwritten extents to written "
-			 "extents -- potential data loss!  "
-			 "(inode %lu, offset %llu, size %zd, error %d)",
-			 inode->i_ino, offset, size, ret);
+	ext4bf_io_end_t *io;
+
+	while (head->next != stop) {
+		io = list_entry(head->next, ext4bf_io_end_t, list);
+		list_del_init(&io->list);
+		if (io->iocb)
+			aio_complete(io->iocb, io->result, 0);
+
+		/* Wake up anyone waiting on unwritten extent conversion */
+		if (atomic_dec_and_test(&EXT4_I(inode)->i_aiodio_unwritten))
+			wake_up_all(ext4bf_ioend_wq(inode));
+		ext4bf_free_io_end(io);
 	}
-
-	if (io->iocb)
-		aio_complete(io->iocb, io->result, 0);
-
-	/* Wake up anyone waiting on unwritten extent conversion */
-	if (atomic_dec_and_test(&EXT4_I(inode)->i_aiodio_unwritten))
-		wake_up_all(ext4bf_ioend_wq(io->inode));
-	return ret;
 }
 
 /*
- * work on completed aio dio IO, to convert unwritten extents to extents
+ * Convert the unwritten extents of every completed IO on the inode.
+ *
+ * The list is taken off the inode in one go and sorted by offset, and
+ * IOs whose ranges touch or overlap are merged so that a run of small
+ * direct writes into preallocated space costs one conversion (and one
+ * handle) instead of one each.
+ *
+ * Called with inode->i_mutex held.
  */
-static void ext4bf_end_io_work(struct work_struct *work)
+int ext4bf_do_flush_completed_IO(struct inode *inode)
 {
-	ext4bf_io_end_t		*io = container_of(work, ext4bf_io_end_t, work);
-	struct inode		*inode = io->inode;
-	struct ext4bf_inode_info	*ei = EXT4_I(inode);
-	unsigned long		flags;
+	struct ext4bf_inode_info *ei = EXT4_I(inode);
+	ext4bf_io_end_t *io, *first;
+	unsigned long flags;
+	LIST_HEAD(ios);
+	loff_t start, end;
+	int ret, err = 0;
 
 	spin_lock_irqsave(&ei->i_completed_io_lock, flags);
-	if (list_empty(&io->list)) {
-		spin_unlock_irqrestore(&ei->i_completed_io_lock, flags);
-		goto free;
+	list_splice_init(&ei->i_completed_io_list, &ios);
+	spin_unlock_irqrestore(&ei->i_completed_io_lock, flags);
+
+	list_sort(NULL, &ios, ext4bf_io_end_cmp);
+	while (!list_empty(&ios)) {
+		first = list_entry(ios.next, ext4bf_io_end_t, list);
+		start = first->offset;
+		end = first->offset + first->size;
+		io = first;
+		list_for_each_entry_continue(io, &ios, list) {
+			if (io->offset > end)
+				break;
+			end = max_t(loff_t, end, io->offset + io->size);
+		}
+
+		ext4bf_debug("ext4bf_do_flush_completed_IO: inode %lu, "
+			     "offset %llu, size %llu\n", inode->i_ino,
+			     start, end - start);
+		ret = ext4bf_convert_unwritten_extents(inode, start,
+						       end - start);
+		if (ret < 0) {
+			ext4bf_msg(inode->i_sb, KERN_EMERG,
+				 "failed to convert unwritten extents to written "
+				 "extents -- potential data loss!  "
+				 "(inode %lu, offset %llu, size %llu, error %d)",
+				 inode->i_ino, start, end - start, ret);
+			err = ret;
+		}
+		ext4bf_release_io_ends(inode, &ios, &io->list);
 	}
+	return err;
+}
+
+/*
+ * Work on completed aio dio IO, to convert unwritten extents to extents.
+ * There is one work item per inode, so everything that completed while
+ * it was pending is converted together.
+ */
+void ext4bf_end_io_work(struct work_struct *work)
+{
+	struct ext4bf_inode_info *ei = container_of(work,
+					struct ext4bf_inode_info, i_unwritten_work);
+	struct inode *inode = &ei->vfs_inode;
 
 	if (!mutex_trylock(&inode->i_mutex)) {
-		spin_unlock_irqrestore(&ei->i_completed_io_lock, flags);
 		/*
 		 * Requeue the work instead of waiting so that the work
-		 * items queued after this can be processed.
+		 * items queued after this can be processed, and yield so
+		 * the ext4bf-dio-unwritten thread doesn't spin on it.
 		 */
-		queue_work(EXT4_SB(inode->i_sb)->dio_unwritten_wq, &io->work);
-		/*
-		 * To prevent the ext4bf-dio-unwritten thread from keeping
-		 * requeueing end_io requests and occupying cpu for too long,
-		 * yield the cpu if it sees an end_io request that has already
-		 * been requeued.
-		 */
-		if (io->flag & EXT4_IO_END_QUEUED)
-			yield();
-		io->flag |= EXT4_IO_END_QUEUED;
+		queue_work(EXT4_SB(inode->i_sb)->dio_unwritten_wq, work);
+		yield();
 		return;
 	}
-	list_del_init(&io->list);
-	spin_unlock_irqrestore(&ei->i_completed_io_lock, flags);
-	(void) ext4bf_end_io_nolock(io);
+	(void) ext4bf_do_flush_completed_IO(inode);
 	mutex_unlock(&inode->i_mutex);
-free:
-	ext4bf_free_io_end(io);
 }
 
 ext4bf_io_end_t *ext4bf_init_io_end(struct inode *inode, gfp_t flags)
@@ -165,7 +201,6 @@ ext4bf_io_end_t *ext4bf_init_io_end(struct inode *inode, gfp_t flags)
 	if (io) {
 		atomic_inc(&EXT4_I(inode)->i_ioend_count);
 		io->inode = inode;
-		INIT_WORK(&io->work, ext4bf_end_io_work);
 		INIT_LIST_HEAD(&io->list);
 	}
 	return io;
@@ -186,21 +221,17 @@ static void buffer_io_error(struct buffer_head *bh)
 			(unsigned long long)bh->b_blocknr);
 }
 
-static void ext4bf_end_bio(struct bio *bio, int error)
+/*
+ * The last reference to a writeback io_end is gone: all of its bios have
+ * completed and the builder has moved on.  Finish the pages and hand
+ * unwritten extents over for conversion.
+ */
+static void ext4bf_finish_bio_io_end(ext4bf_io_end_t *io_end)
 {
-	ext4bf_io_end_t *io_end = bio->bi_private;
+	struct inode *inode = io_end->inode;
 	struct workqueue_struct *wq;
-	struct inode *inode;
 	unsigned long flags;
 	int i;
-	sector_t bi_sector = bio->bi_sector;
-
-	BUG_ON(!io_end);
-	bio->bi_private = NULL;
-	bio->bi_end_io = NULL;
-	if (test_bit(BIO_UPTODATE, &bio->bi_flags))
-		error = 0;
-	bio_put(bio);
 
 	for (i = 0; i < io_end->num_io_pages; i++) {
 		struct page *page = io_end->pages[i]->p_page;
@@ -208,7 +239,7 @@ static void ext4bf_end_bio(struct bio *bio, int error)
 		loff_t offset;
 		loff_t io_end_offset;
 
-		if (error) {
+		if (io_end->bio_error) {
 			SetPageError(page);
 			set_bit(AS_EIO, &page->mapping->flags);
 			head = page_buffers(page);
@@ -231,18 +262,9 @@ static void ext4bf_end_bio(struct bio *bio, int error)
 		put_io_page(io_end->pages[i]);
 	}
 	io_end->num_io_pages = 0;
-	inode = io_end->inode;
 
-	if (error) {
+	if (io_end->bio_error)
 		io_end->flag |= EXT4_IO_END_ERROR;
-		ext4bf_warning(inode->i_sb, "I/O error writing to inode %lu "
-			     "(offset %llu size %ld starting block %llu)",
-			     inode->i_ino,
-			     (unsigned long long) io_end->offset,
-			     (long) io_end->size,
-			     (unsigned long long)
-			     bi_sector >> (inode->i_blkbits - 9));
-	}
 
 	if (!(io_end->flag & EXT4_IO_END_UNWRITTEN)) {
 		ext4bf_free_io_end(io_end);
@@ -256,10 +278,44 @@ static void ext4bf_end_bio(struct bio *bio, int error)
 
 	wq = EXT4_SB(inode->i_sb)->dio_unwritten_wq;
 	/* queue the work to convert unwritten extents to written */
-	queue_work(wq, &io_end->work);
+	queue_work(wq, &EXT4_I(inode)->i_unwritten_work);
 }
 
-void ext4bf_io_submit(struct ext4bf_io_submit *io)
+static void ext4bf_put_bio_io_end(ext4bf_io_end_t *io_end)
+{
+	if (atomic_dec_and_test(&io_end->count))
+		ext4bf_finish_bio_io_end(io_end);
+}
+
+static void ext4bf_end_bio(struct bio *bio, int error)
+{
+	ext4bf_io_end_t *io_end = bio->bi_private;
+	struct inode *inode;
+	sector_t bi_sector = bio->bi_sector;
+
+	BUG_ON(!io_end);
+	bio->bi_private = NULL;
+	bio->bi_end_io = NULL;
+	if (test_bit(BIO_UPTODATE, &bio->bi_flags))
+		error = 0;
+	bio_put(bio);
+
+	inode = io_end->inode;
+	if (error) {
+		io_end->bio_error = error;
+		ext4bf_warning(inode->i_sb, "I/O error writing to inode %lu "
+			     "(offset %llu size %ld starting block %llu)",
+			     inode->i_ino,
+			     (unsigned long long) io_end->offset,
+			     (long) io_end->size,
+			     (unsigned long long)
+			     bi_sector >> (inode->i_blkbits - 9));
+	}
+	ext4bf_put_bio_io_end(io_end);
+}
+
+/* Send off the bio being built; the io_end stays open for the run. */
+static void ext4bf_io_submit_bio(struct ext4bf_io_submit *io)
 {
 	struct bio *bio = io->io_bio;
 
@@ -270,10 +326,37 @@ void ext4bf_io_submit(struct ext4bf_io_submit *io)
 		bio_put(io->io_bio);
 	}
 	io->io_bio = NULL;
+}
+
+/*
+ * Submit what has been built and close the run: one io_end covers one
+ * logically and physically contiguous run, however many bios it took.
+ */
+void ext4bf_io_submit(struct ext4bf_io_submit *io)
+{
+	ext4bf_io_submit_bio(io);
+	if (io->io_end)
+		ext4bf_put_bio_io_end(io->io_end);
 	io->io_op = 0;
 	io->io_end = NULL;
 }
 
+static void io_submit_init_bio(struct ext4bf_io_submit *io,
+			       struct buffer_head *bh)
+{
+	int nvecs = bio_get_nr_vecs(bh->b_bdev);
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOIO, min(nvecs, BIO_MAX_PAGES));
+	bio->bi_sector = bh->b_blocknr * (bh->b_size >> 9);
+	bio->bi_bdev = bh->b_bdev;
+	bio->bi_private = io->io_end;
+	bio->bi_end_io = ext4bf_end_bio;
+	atomic_inc(&io->io_end->count);
+
+	io->io_bio = bio;
+}
+
 static int io_submit_init(struct ext4bf_io_submit *io,
 			  struct inode *inode,
 			  struct writeback_control *wbc,
@@ -281,23 +364,18 @@ static int io_submit_init(struct ext4bf_io_submit *io,
 {
 	ext4bf_io_end_t *io_end;
 	struct page *page = bh->b_page;
-	int nvecs = bio_get_nr_vecs(bh->b_bdev);
-	struct bio *bio;
 
 	io_end = ext4bf_init_io_end(inode, GFP_NOFS);
 	if (!io_end)
 		return -ENOMEM;
-	bio = bio_alloc(GFP_NOIO, min(nvecs, BIO_MAX_PAGES));
-	bio->bi_sector = bh->b_blocknr * (bh->b_size >> 9);
-	bio->bi_bdev = bh->b_bdev;
-	bio->bi_private = io->io_end = io_end;
-	bio->bi_end_io = ext4bf_end_bio;
-
+	/* The builder's reference, dropped by ext4bf_io_submit() */
+	atomic_set(&io_end->count, 1);
 	io_end->offset = (page->index << PAGE_CACHE_SHIFT) + bh_offset(bh);
 
-	io->io_bio = bio;
+	io->io_end = io_end;
 	io->io_op = (wbc->sync_mode == WB_SYNC_ALL ?  WRITE_SYNC : WRITE);
 	io->io_next_block = bh->b_blocknr;
+	io_submit_init_bio(io, bh);
 	return 0;
 }
 
@@ -308,6 +386,7 @@ static int io_submit_add_bh(struct ext4bf_io_submit *io,
 			    struct buffer_head *bh)
 {
 	ext4bf_io_end_t *io_end;
+	loff_t pos;
 	int ret;
 
 	if (buffer_new(bh)) {
@@ -318,31 +397,37 @@ static int io_submit_add_bh(struct ext4bf_io_submit *io,
 	if (!buffer_mapped(bh) || buffer_delay(bh)) {
 		if (!buffer_mapped(bh))
 			clear_buffer_dirty(bh);
-		if (io->io_bio)
+		if (io->io_end)
 			ext4bf_io_submit(io);
 		return 0;
 	}
 
-	if (io->io_bio && bh->b_blocknr != io->io_next_block) {
-submit_and_retry:
+	pos = ((loff_t)bh->b_page->index << PAGE_CACHE_SHIFT) + bh_offset(bh);
+	io_end = io->io_end;
+	if (io_end && (bh->b_blocknr != io->io_next_block ||
+		       pos != io_end->offset + io_end->size ||
+		       (io_end->num_io_pages >= MAX_IO_PAGES &&
+			io_end->pages[io_end->num_io_pages-1] != io_page)))
 		ext4bf_io_submit(io);
-	}
-	if (io->io_bio == NULL) {
+	if (io->io_end == NULL) {
 		ret = io_submit_init(io, inode, wbc, bh);
 		if (ret)
 			return ret;
 	}
 	io_end = io->io_end;
-	if ((io_end->num_io_pages >= MAX_IO_PAGES) &&
-	    (io_end->pages[io_end->num_io_pages-1] != io_page))
-		goto submit_and_retry;
+	ret = bio_add_page(io->io_bio, bh->b_page, bh->b_size, bh_offset(bh));
+	if (ret != bh->b_size) {
+		/* The bio is full but the run goes on in a new one. */
+		ext4bf_io_submit_bio(io);
+		io_submit_init_bio(io, bh);
+		ret = bio_add_page(io->io_bio, bh->b_page, bh->b_size,
+				   bh_offset(bh));
+		BUG_ON(ret != bh->b_size);
+	}
 	if (buffer_uninit(bh))
 		ext4bf_set_io_unwritten_flag(inode, io_end);
-	io->io_end->size += bh->b_size;
+	io_end->size += bh->b_size;
 	io->io_next_block++;
-	ret = bio_add_page(io->io_bio, bh->b_page, bh->b_size, bh_offset(bh));
-	if (ret != bh->b_size)
-		goto submit_and_retry;
 	if ((io_end->num_io_pages == 0) ||
 	    (io_end->pages[io_end->num_io_pages-1] != io_page)) {
 		io_end->pages[io_end->num_io_pages++] = io_page;
@@ -0,0 +1,220 @@
+/*
+ *  linux/fs/ext4bf/readpage.c
+ *
+ * Extent-aware readpages.  This is fs/mpage.c:do_mpage_readpage() with
+ * the get_block callback replaced by ext4bf_map_blocks(): one mapping is
+ * looked up per extent rather than per page, and is reused for every
+ * page of the readahead batch that falls inside it, so a bio covers as
+ * much of each physical extent as the batch allows.  Holes and
+ * unwritten extents end the bio being built and are zero-filled without
+ * any I/O.
+ */
+
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/buffer_head.h>
+#include <linux/bio.h>
+#include <linux/highmem.h>
+#include <linux/prefetch.h>
+
+#include "ext4bf.h"
+
+/* Only written blocks are read from the disk. */
+#define ext4bf_map_readable(map)					\
+	(((map)->m_flags & (EXT4_MAP_MAPPED | EXT4_MAP_UNWRITTEN)) ==	\
+	 EXT4_MAP_MAPPED)
+
+static void ext4bf_mpage_end_io(struct bio *bio, int err)
+{
+	const int uptodate = test_bit(BIO_UPTODATE, &bio->bi_flags);
+	struct bio_vec *bvec = bio->bi_io_vec + bio->bi_vcnt - 1;
+
+	do {
+		struct page *page = bvec->bv_page;
+
+		if (--bvec >= bio->bi_io_vec)
+			prefetchw(&bvec->bv_page->flags);
+		if (uptodate) {
+			SetPageUptodate(page);
+		} else {
+			ClearPageUptodate(page);
+			SetPageError(page);
+		}
+		unlock_page(page);
+	} while (bvec >= bio->bi_io_vec);
+	bio_put(bio);
+}
+
+/*
+ * Read @nr_pages pages: either the readahead list @pages, or the single
+ * locked page @page (for ->readpage()) when @pages is NULL.
+ */
+int ext4bf_mpage_readpages(struct address_space *mapping,
+			   struct list_head *pages, struct page *page,
+			   unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	const unsigned blkbits = inode->i_blkbits;
+	const unsigned blocks_per_page = PAGE_CACHE_SIZE >> blkbits;
+	const unsigned blocksize = 1 << blkbits;
+	struct block_device *bdev = inode->i_sb->s_bdev;
+	struct ext4bf_map_blocks map;
+	struct bio *bio = NULL;
+	sector_t last_block_in_bio = 0;
+	sector_t block_in_file, last_block, last_block_in_file;
+	sector_t blocks[MAX_BUF_PER_PAGE];
+	unsigned page_block, relative_block = 0;
+	int length;
+
+	map.m_pblk = 0;
+	map.m_lblk = 0;
+	map.m_len = 0;
+	map.m_flags = 0;
+
+	for (; nr_pages; nr_pages--) {
+		unsigned first_hole = blocks_per_page;
+		int fully_mapped = 1;
+
+		if (pages) {
+			page = list_entry(pages->prev, struct page, lru);
+			prefetchw(&page->flags);
+			list_del(&page->lru);
+			if (add_to_page_cache_lru(page, mapping, page->index,
+						  GFP_KERNEL))
+				goto next_page;
+		}
+
+		if (page_has_buffers(page))
+			goto confused;
+
+		block_in_file = (sector_t)page->index <<
+				(PAGE_CACHE_SHIFT - blkbits);
+		last_block = block_in_file + nr_pages * blocks_per_page;
+		last_block_in_file = (i_size_read(inode) + blocksize - 1) >>
+				     blkbits;
+		if (last_block > last_block_in_file)
+			last_block = last_block_in_file;
+		page_block = 0;
+
+		/* Start with what is left of the previous extent. */
+		if (ext4bf_map_readable(&map) &&
+		    block_in_file > map.m_lblk &&
+		    block_in_file < map.m_lblk + map.m_len) {
+			unsigned map_offset = block_in_file - map.m_lblk;
+			unsigned last = map.m_len - map_offset;
+
+			for (relative_block = 0; ; relative_block++) {
+				if (relative_block == last) {
+					map.m_flags &= ~EXT4_MAP_MAPPED;
+					break;
+				}
+				if (page_block == blocks_per_page)
+					break;
+				blocks[page_block] = map.m_pblk + map_offset +
+						     relative_block;
+				page_block++;
+				block_in_file++;
+			}
+		}
+
+		/* Then look up further extents until the page is covered. */
+		while (page_block < blocks_per_page) {
+			map.m_flags = 0;
+			if (block_in_file < last_block) {
+				map.m_lblk = block_in_file;
+				map.m_len = last_block - block_in_file;
+				if (ext4bf_map_blocks(NULL, inode, &map, 0) < 0) {
+set_error_page:
+					SetPageError(page);
+					zero_user_segment(page, 0,
+							  PAGE_CACHE_SIZE);
+					unlock_page(page);
+					goto next_page;
+				}
+			}
+			if (!ext4bf_map_readable(&map)) {
+				fully_mapped = 0;
+				if (first_hole == blocks_per_page)
+					first_hole = page_block;
+				page_block++;
+				block_in_file++;
+				continue;
+			}
+			if (first_hole != blocks_per_page)
+				goto confused;		/* hole -> non-hole */
+
+			/* Contiguous blocks? */
+			if (page_block && blocks[page_block - 1] != map.m_pblk - 1)
+				goto confused;
+			for (relative_block = 0; ; relative_block++) {
+				if (relative_block == map.m_len) {
+					map.m_flags &= ~EXT4_MAP_MAPPED;
+					break;
+				}
+				if (page_block == blocks_per_page)
+					break;
+				blocks[page_block] = map.m_pblk + relative_block;
+				page_block++;
+				block_in_file++;
+			}
+		}
+
+		if (first_hole != blocks_per_page) {
+			zero_user_segment(page, first_hole << blkbits,
+					  PAGE_CACHE_SIZE);
+			if (first_hole == 0) {
+				SetPageUptodate(page);
+				unlock_page(page);
+				goto next_page;
+			}
+		} else if (fully_mapped) {
+			SetPageMappedToDisk(page);
+		}
+
+		/* Send off the bio first if this page does not continue it. */
+		if (bio && last_block_in_bio != blocks[0] - 1) {
+submit_and_realloc:
+			submit_bio(READ, bio);
+			bio = NULL;
+		}
+		if (!bio) {
+			bio = bio_alloc(GFP_KERNEL,
+					min_t(int, nr_pages, BIO_MAX_PAGES));
+			if (!bio)
+				goto set_error_page;
+			bio->bi_bdev = bdev;
+			bio->bi_sector = blocks[0] << (blkbits - 9);
+			bio->bi_end_io = ext4bf_mpage_end_io;
+		}
+
+		length = first_hole << blkbits;
+		if (bio_add_page(bio, page, length, 0) < length)
+			goto submit_and_realloc;
+
+		if (((map.m_flags & EXT4_MAP_BOUNDARY) &&
+		     relative_block == map.m_len) ||
+		    first_hole != blocks_per_page) {
+			submit_bio(READ, bio);
+			bio = NULL;
+		} else {
+			last_block_in_bio = blocks[blocks_per_page - 1];
+		}
+		goto next_page;
+confused:
+		if (bio) {
+			submit_bio(READ, bio);
+			bio = NULL;
+		}
+		if (!PageUptodate(page))
+			block_read_full_page(page, ext4bf_get_block);
+		else
+			unlock_page(page);
+next_page:
+		if (pages)
+			page_cache_release(page);
+	}
+	BUG_ON(pages && !list_empty(pages));
+	if (bio)
+		submit_bio(READ, bio);
+	return 0;
+}
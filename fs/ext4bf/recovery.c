@@ -302,6 +302,19 @@ static void delete_from_mismatched_blocks(struct dc_struct *dc_object, unsigned
 	}
 }
 
+/*
+ * ext4bf: a FLUSHED commit record makes the data of every earlier
+ * transaction stable, so their mismatches are later rewrites of the block.
+ */
+static void flush_mismatched_blocks(struct dc_struct *dc_object, unsigned int commit_ID) {
+	int i;
+	for(i = 0; i < 100; i++) {
+		if(dc_object->mismatched_blocks[i] != 0 &&
+		   tid_gt(commit_ID, dc_object->next_commit_ID[i]))
+			dc_object->mismatched_blocks[i] = 0;
+	}
+}
+
 static int is_datachecksum_err(struct dc_struct *dc_object, unsigned int *next_commit_ID, unsigned long long *block) {
 	int i;
 	int error_index = -1;
@@ -372,6 +385,9 @@ static int read_and_verify_checksums(journal_t *journal, struct buffer_head *bh,
                             data_checksum, crc32_sum);
 					add_to_mismatched_blocks(dc_object, blocknr, next_commit_ID);
                     chksum_err = 1;
+                } else {
+                    /* ext4bf: the newest tag of a block decides. */
+                    delete_from_mismatched_blocks(dc_object, blocknr);
                 }
             }
         } else if (blocktype == T_BLOCKTYPE_OVERWRITTENDATA) {
@@ -510,8 +526,12 @@ static int calc_chksums(journal_t *journal, struct buffer_head *bh,
 	struct buffer_head *obh;
 
 	num_blks = count_tags(journal, bh);
-	/* Calculate checksum of the descriptor block. */
-	*crc32_sum = crc32_be(*crc32_sum, (void *)bh->b_data, bh->b_size);
+	/* Calculate checksum of the descriptor block.  A descriptor that
+	 * carries its own commit record is not part of the sum. */
+	if (be32_to_cpu(((journal_bf_header_t *)bh->b_data)->h_blocktype) !=
+	    JBD2_INLINE_COMMIT_BLOCK)
+		*crc32_sum = crc32_be(*crc32_sum, (void *)bh->b_data,
+				      bh->b_size);
 
 	for (i = 0; i < num_blks; i++) {
 		io_block = (*next_log_block)++;
@@ -530,6 +550,38 @@ static int calc_chksums(journal_t *journal, struct buffer_head *bh,
 	return 0;
 }
 
+/*
+ * ext4bf: check the commit record folded into the tail of @bh.  Consumes
+ * the log blocks described by @bh; returns 1 if the transaction committed.
+ */
+static int verify_inline_commit(journal_t *journal, struct buffer_head *bh,
+				unsigned long *next_log_block, __u32 *crc32_sum,
+				unsigned int sequence)
+{
+	struct commit_header *cbh = jbdbf_inline_commit_header(journal, bh);
+
+	if (cbh->h_magic != cpu_to_be32(JBD2_MAGIC_NUMBER) ||
+	    cbh->h_blocktype != cpu_to_be32(JBD2_COMMIT_BLOCK) ||
+	    be32_to_cpu(cbh->h_sequence) != sequence) {
+		*next_log_block += count_tags(journal, bh);
+		wrap(journal, *next_log_block);
+		return 0;
+	}
+
+	if (!JBD2_HAS_COMPAT_FEATURE(journal, JBD2_FEATURE_COMPAT_CHECKSUM)) {
+		*next_log_block += count_tags(journal, bh);
+		wrap(journal, *next_log_block);
+		return 1;
+	}
+
+	if (calc_chksums(journal, bh, next_log_block, crc32_sum))
+		return 0;
+
+	return cbh->h_chksum_type == JBD2_CRC32_CHKSUM &&
+	       cbh->h_chksum_size == JBD2_CRC32_CHKSUM_SIZE &&
+	       be32_to_cpu(cbh->h_chksum[0]) == *crc32_sum;
+}
+
 static int do_one_pass(journal_t *journal,
 			struct recovery_info *info, enum passtype pass)
 {
@@ -640,6 +692,7 @@ static int do_one_pass(journal_t *journal,
 		 * to do with it?  That depends on the pass... */
 
 		switch(blocktype) {
+		case JBD2_INLINE_COMMIT_BLOCK:
 		case JBD2_DESCRIPTOR_BLOCK:
 			/* If it is a valid descriptor block, replay it
 			 * in pass REPLAY; if journal_checksums enabled, then
@@ -655,6 +708,39 @@ static int do_one_pass(journal_t *journal,
 				
 				read_and_verify_checksums(journal, bh, dc_object, next_commit_ID);
 
+				/* ext4bf: the last descriptor of the
+				 * transaction also closes it.  A torn
+				 * inline commit ends the log, since the
+				 * commit and its blocks went out together. */
+				if (blocktype == JBD2_INLINE_COMMIT_BLOCK) {
+					if (pass == PASS_SCAN &&
+					    !info->end_transaction) {
+						if (!verify_inline_commit(journal,
+							bh, &next_log_block,
+							&crc32_sum,
+							next_commit_ID)) {
+							jbd_debug(6, "EXT4BF: torn inline commit %u\n",
+								  next_commit_ID);
+							brelse(bh);
+							goto done;
+						}
+						if (jbdbf_inline_commit_header(journal,
+							bh)->h_flags &
+						    JBD2_COMMIT_FLUSHED)
+							flush_mismatched_blocks(
+								dc_object,
+								next_commit_ID);
+					} else {
+						next_log_block +=
+							count_tags(journal, bh);
+						wrap(journal, next_log_block);
+					}
+					crc32_sum = ~0;
+					brelse(bh);
+					next_commit_ID++;
+					continue;
+				}
+
 				if (pass == PASS_SCAN &&
 				    JBD2_HAS_COMPAT_FEATURE(journal,
 					    JBD2_FEATURE_COMPAT_CHECKSUM) &&
@@ -770,6 +856,8 @@ static int do_one_pass(journal_t *journal,
 			}
 
 			brelse(bh);
+			if (blocktype == JBD2_INLINE_COMMIT_BLOCK)
+				next_commit_ID++;
 			continue;
 
 		case JBD2_COMMIT_BLOCK:
@@ -858,6 +946,11 @@ static int do_one_pass(journal_t *journal,
 				}
 				crc32_sum = ~0;
 			}
+			if (pass == PASS_SCAN && !info->end_transaction &&
+			    (((struct commit_header *)bh->b_data)->h_flags &
+			     JBD2_COMMIT_FLUSHED))
+				flush_mismatched_blocks(dc_object,
+							next_commit_ID);
 			brelse(bh);
 			next_commit_ID++;
 			continue;
@@ -963,6 +963,9 @@ exit_journal:
 		update_backups(sb, primary->b_blocknr, primary->b_data,
 			       primary->b_size);
 	}
+	/* the new group's bitmaps and inode table are metadata too */
+	if (!err)
+		err = ext4bf_setup_system_zone(sb);
 exit_put:
 	iput(inode);
 	return err;
@@ -96,6 +96,7 @@ static int ext4bf_sync_fs(struct super_block *sb, int wait);
 static const char *ext4bf_decode_error(struct super_block *sb, int errno,
 				     char nbuf[16]);
 static int ext4bf_remount(struct super_block *sb, int *flags, char *data);
+static void ext4bf_kill_sb(struct super_block *sb);
 static int ext4bf_statfs(struct dentry *dentry, struct kstatfs *buf);
 static int ext4bf_unfreeze(struct super_block *sb);
 static void ext4bf_write_super(struct super_block *sb);
@@ -114,7 +115,7 @@ static struct file_system_type ext2_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "ext2",
 	.mount		= ext4bf_mount,
-	.kill_sb	= kill_block_super,
+	.kill_sb	= ext4bf_kill_sb,
 	.fs_flags	= FS_REQUIRES_DEV,
 };
 #define IS_EXT2_SB(sb) ((sb)->s_bdev->bd_holder == &ext2_fs_type)
@@ -128,7 +129,7 @@ static struct file_system_type ext3_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "ext3",
 	.mount		= ext4bf_mount,
-	.kill_sb	= kill_block_super,
+	.kill_sb	= ext4bf_kill_sb,
 	.fs_flags	= FS_REQUIRES_DEV,
 };
 #define IS_EXT3_SB(sb) ((sb)->s_bdev->bd_holder == &ext3_fs_type)
@@ -842,25 +843,33 @@ static void ext4bf_put_super(struct super_block *sb)
 		if (err < 0)
 			ext4bf_abort(sb, "Couldn't clean up the journal");
 	}
+	ext4bf_release_orphan_info(sb);
 
 	del_timer(&sbi->s_err_report);
-	ext4bf_release_system_zone(sb);
-	ext4bf_mb_release(sb);
-	ext4bf_ext_release(sb);
-	ext4bf_xattr_put_super(sb);
 
 #ifdef DELAYED_REUSE
-    /* ext4bf: freeing delayed block reuse list. */
+    /* ext4bf: freeing delayed block reuse list.  The thread is stopped
+     * first and discards in flight are waited for while the buddies
+     * they release into are still there. */
     ext4bf_debug("Stopping the thread.");
+    del_timer_sync(&ext4bf_delay_timer);
+    if (delay_reuse_task) kthread_stop(delay_reuse_task);
+    delay_reuse_task = NULL;
+    ext4bf_mb_wait_discard(sb);
     /* Release any blocks that are left. */
     release_blocks_after_delay(sb, 0, 1);
-    if (delay_reuse_task) kthread_stop(delay_reuse_task);
-    del_timer(&ext4bf_delay_timer);
     /* */
 #endif
 
+	ext4bf_release_system_zone(sb);
+	ext4bf_mb_release(sb);
+	ext4bf_ext_release(sb);
+	ext4bf_xattr_put_super(sb);
+
 	if (!(sb->s_flags & MS_RDONLY)) {
 		EXT4_CLEAR_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_RECOVER);
+		EXT4_CLEAR_RO_COMPAT_FEATURE(sb,
+				EXT4_FEATURE_RO_COMPAT_ORPHAN_PRESENT);
 		es->s_state = cpu_to_le16(sbi->s_mount_state);
 		ext4bf_commit_super(sb, 1);
 	}
@@ -877,6 +886,9 @@ static void ext4bf_put_super(struct super_block *sb)
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
 	percpu_counter_destroy(&sbi->s_dirtyclusters_counter);
+	ext4bf_es_unregister_shrinker(sbi);
+	percpu_counter_destroy(&sbi->s_extent_cache_cnt);
+	free_percpu(sbi->s_inode_cursor);
 	brelse(sbi->s_sbh);
 #ifdef CONFIG_QUOTA
 	for (i = 0; i < MAXQUOTAS; i++)
@@ -931,7 +943,12 @@ static struct inode *ext4bf_alloc_inode(struct super_block *sb)
 
 	ei->vfs_inode.i_version = 1;
 	ei->vfs_inode.i_data.writeback_index = 0;
-	memset(&ei->i_cached_extent, 0, sizeof(struct ext4bf_ext_cache));
+	ext4bf_es_init_tree(&ei->i_es_tree);
+	rwlock_init(&ei->i_es_lock);
+	INIT_LIST_HEAD(&ei->i_es_lru);
+	ei->i_es_lru_nr = 0;
+	ei->i_frag_score = 0;
+	INIT_LIST_HEAD(&ei->i_async_free);
 	INIT_LIST_HEAD(&ei->i_prealloc_list);
 	spin_lock_init(&ei->i_prealloc_lock);
 	ei->i_reserved_data_blocks = 0;
@@ -945,9 +962,15 @@ static struct inode *ext4bf_alloc_inode(struct super_block *sb)
 	ei->jinode = NULL;
 	INIT_LIST_HEAD(&ei->i_completed_io_list);
 	spin_lock_init(&ei->i_completed_io_lock);
+	INIT_WORK(&ei->i_unwritten_work, ext4bf_end_io_work);
 	ei->cur_aio_dio = NULL;
+	ei->i_dio_tags = NULL;
+	ei->i_write_task = NULL;
+	INIT_LIST_HEAD(&ei->i_deferred_list);
+	ei->i_deferred_bh = NULL;
 	ei->i_sync_tid = 0;
 	ei->i_datasync_tid = 0;
+	ei->i_create_tid = 0;
 	atomic_set(&ei->i_ioend_count, 0);
 	atomic_set(&ei->i_aiodio_unwritten, 0);
 
@@ -958,6 +981,8 @@ static int ext4bf_drop_inode(struct inode *inode)
 {
 	int drop = generic_drop_inode(inode);
 
+	if (drop && ext4bf_async_free_queue(inode))
+		drop = 0;
 	//trace_ext4_drop_inode(inode, drop);
 	return drop;
 }
@@ -971,7 +996,8 @@ static void ext4bf_i_callback(struct rcu_head *head)
 
 static void ext4bf_destroy_inode(struct inode *inode)
 {
-	if (!list_empty(&(EXT4_I(inode)->i_orphan))) {
+	if (!list_empty(&(EXT4_I(inode)->i_orphan)) ||
+	    ext4bf_test_inode_state(inode, EXT4_STATE_ORPHAN_FILE)) {
 		ext4bf_msg(inode->i_sb, KERN_ERR,
 			 "Inode %lu (%p): orphan list check failed!",
 			 inode->i_ino, EXT4_I(inode));
@@ -1016,8 +1042,12 @@ void ext4bf_clear_inode(struct inode *inode)
 {
 	invalidate_inode_buffers(inode);
 	end_writeback(inode);
+	ext4bf_flush_deferred_inode(inode);
+	ext4bf_async_free_forget(inode);
 	dquot_drop(inode);
 	ext4bf_discard_preallocations(inode);
+	ext4bf_es_lru_del(inode);
+	ext4bf_es_remove_extent(inode, 0, EXT_MAX_BLOCKS);
 	if (EXT4_I(inode)->jinode) {
 		jbdbf_journal_release_jbd_inode(EXT4_JOURNAL(inode),
 					       EXT4_I(inode)->jinode);
@@ -1145,6 +1175,8 @@ static int ext4bf_show_options(struct seq_file *seq, struct vfsmount *vfs)
 		seq_puts(seq, ",journal_async_commit");
 	else if (test_opt(sb, JOURNAL_CHECKSUM))
 		seq_puts(seq, ",journal_checksum");
+	if (test_opt2(sb, JOURNAL_FAST_DEV))
+		seq_puts(seq, ",journal_fast_dev");
 	if (test_opt(sb, I_VERSION))
 		seq_puts(seq, ",i_version");
 	if (!test_opt(sb, DELALLOC) &&
@@ -1155,6 +1187,19 @@ static int ext4bf_show_options(struct seq_file *seq, struct vfsmount *vfs)
 		seq_puts(seq, ",nomblk_io_submit");
 	if (sbi->s_stripe)
 		seq_printf(seq, ",stripe=%lu", sbi->s_stripe);
+	if (sbi->s_redirect_write)
+		seq_printf(seq, ",redirect_write=%lu",
+			   sbi->s_redirect_write >> 10);
+	if (test_opt2(sb, LAZYTIME))
+		seq_puts(seq, ",lazytime");
+	if (test_opt2(sb, NO_PREFETCH_BLOCK_BITMAPS))
+		seq_puts(seq, ",no_prefetch_block_bitmaps");
+	if (test_opt2(sb, AUTO_DEFRAG))
+		seq_puts(seq, ",auto_defrag");
+	if (test_opt2(sb, ASYNC_FREE))
+		seq_puts(seq, ",async_free");
+	if (test_opt2(sb, ORDERED_CSUM))
+		seq_puts(seq, ",ordered_csum");
 	/*
 	 * journal mode get enabled in different ways
 	 * So just print the value even if we didn't specify it
@@ -1361,7 +1406,7 @@ enum {
 	Opt_auto_da_alloc, Opt_noauto_da_alloc, Opt_noload, Opt_nobh, Opt_bh,
 	Opt_commit, Opt_min_batch_time, Opt_max_batch_time,
 	Opt_journal_update, Opt_journal_dev,
-	Opt_journal_checksum, Opt_journal_async_commit,
+	Opt_journal_checksum, Opt_journal_async_commit, Opt_journal_fast_dev,
 	Opt_abort, Opt_data_journal, Opt_data_ordered, Opt_data_writeback,
 	Opt_data_barrierfree,
 	Opt_data_err_abort, Opt_data_err_ignore,
@@ -1369,11 +1414,15 @@ enum {
 	Opt_jqfmt_vfsold, Opt_jqfmt_vfsv0, Opt_jqfmt_vfsv1, Opt_quota,
 	Opt_noquota, Opt_ignore, Opt_barrier, Opt_nobarrier, Opt_err,
 	Opt_resize, Opt_usrquota, Opt_grpquota, Opt_i_version,
-	Opt_stripe, Opt_delalloc, Opt_nodelalloc, Opt_mblk_io_submit,
-	Opt_nomblk_io_submit, Opt_block_validity, Opt_noblock_validity,
+	Opt_stripe, Opt_redirect_write, Opt_delalloc, Opt_nodelalloc,
+	Opt_mblk_io_submit, Opt_nomblk_io_submit,
+	Opt_block_validity, Opt_noblock_validity,
 	Opt_inode_readahead_blks, Opt_journal_ioprio,
 	Opt_dioread_nolock, Opt_dioread_lock,
 	Opt_discard, Opt_nodiscard, Opt_init_itable, Opt_noinit_itable,
+	Opt_lazytime, Opt_nolazytime, Opt_ordered_csum, Opt_noordered_csum,
+	Opt_prefetch_block_bitmaps, Opt_no_prefetch_block_bitmaps,
+	Opt_auto_defrag, Opt_noauto_defrag, Opt_async_free, Opt_noasync_free,
 };
 
 static const match_table_t tokens = {
@@ -1408,6 +1457,7 @@ static const match_table_t tokens = {
 	{Opt_journal_dev, "journal_dev=%u"},
 	{Opt_journal_checksum, "journal_checksum"},
 	{Opt_journal_async_commit, "journal_async_commit"},
+	{Opt_journal_fast_dev, "journal_fast_dev"},
 	{Opt_abort, "abort"},
 	{Opt_data_journal, "data=journal"},
 	{Opt_data_ordered, "data=ordered"},
@@ -1431,6 +1481,7 @@ static const match_table_t tokens = {
 	{Opt_nobarrier, "nobarrier"},
 	{Opt_i_version, "i_version"},
 	{Opt_stripe, "stripe=%u"},
+	{Opt_redirect_write, "redirect_write=%u"},
 	{Opt_resize, "resize"},
 	{Opt_delalloc, "delalloc"},
 	{Opt_nodelalloc, "nodelalloc"},
@@ -1450,6 +1501,16 @@ static const match_table_t tokens = {
 	{Opt_init_itable, "init_itable=%u"},
 	{Opt_init_itable, "init_itable"},
 	{Opt_noinit_itable, "noinit_itable"},
+	{Opt_lazytime, "lazytime"},
+	{Opt_nolazytime, "nolazytime"},
+	{Opt_prefetch_block_bitmaps, "prefetch_block_bitmaps"},
+	{Opt_no_prefetch_block_bitmaps, "no_prefetch_block_bitmaps"},
+	{Opt_auto_defrag, "auto_defrag"},
+	{Opt_noauto_defrag, "noauto_defrag"},
+	{Opt_async_free, "async_free"},
+	{Opt_noasync_free, "noasync_free"},
+	{Opt_ordered_csum, "ordered_csum"},
+	{Opt_noordered_csum, "noordered_csum"},
 	{Opt_err, NULL},
 };
 
@@ -1685,6 +1746,15 @@ static int parse_options(char *options, struct super_block *sb,
 			set_opt(sb, JOURNAL_ASYNC_COMMIT);
 			set_opt(sb, JOURNAL_CHECKSUM);
 			break;
+		case Opt_journal_fast_dev:
+			if (is_remount && !test_opt2(sb, JOURNAL_FAST_DEV)) {
+				ext4bf_msg(sb, KERN_ERR,
+					"Cannot enable journal_fast_dev on remount");
+				return 0;
+			}
+			set_opt2(sb, JOURNAL_FAST_DEV);
+			set_opt(sb, JOURNAL_CHECKSUM);
+			break;
 		case Opt_noload:
 			set_opt(sb, NOLOAD);
 			break;
@@ -1878,6 +1948,13 @@ set_qf_format:
 				return 0;
 			sbi->s_stripe = option;
 			break;
+		case Opt_redirect_write:
+			if (match_int(&args[0], &option))
+				return 0;
+			if (option < 0)
+				return 0;
+			sbi->s_redirect_write = (unsigned long) option << 10;
+			break;
 		case Opt_delalloc:
 			set_opt(sb, DELALLOC);
 			set_opt2(sb, EXPLICIT_DELALLOC);
@@ -1885,6 +1962,36 @@ set_qf_format:
 		case Opt_block_validity:
 			set_opt(sb, BLOCK_VALIDITY);
 			break;
+		case Opt_lazytime:
+			set_opt2(sb, LAZYTIME);
+			break;
+		case Opt_nolazytime:
+			clear_opt2(sb, LAZYTIME);
+			break;
+		case Opt_prefetch_block_bitmaps:
+			clear_opt2(sb, NO_PREFETCH_BLOCK_BITMAPS);
+			break;
+		case Opt_no_prefetch_block_bitmaps:
+			set_opt2(sb, NO_PREFETCH_BLOCK_BITMAPS);
+			break;
+		case Opt_auto_defrag:
+			set_opt2(sb, AUTO_DEFRAG);
+			break;
+		case Opt_noauto_defrag:
+			clear_opt2(sb, AUTO_DEFRAG);
+			break;
+		case Opt_async_free:
+			set_opt2(sb, ASYNC_FREE);
+			break;
+		case Opt_noasync_free:
+			clear_opt2(sb, ASYNC_FREE);
+			break;
+		case Opt_ordered_csum:
+			set_opt2(sb, ORDERED_CSUM);
+			break;
+		case Opt_noordered_csum:
+			clear_opt2(sb, ORDERED_CSUM);
+			break;
 		case Opt_noblock_validity:
 			clear_opt(sb, BLOCK_VALIDITY);
 			break;
@@ -2028,6 +2135,11 @@ static int ext4bf_setup_super(struct super_block *sb, struct ext4bf_super_block
 	ext4bf_update_dynamic_rev(sb);
 	if (sbi->s_journal)
 		EXT4_SET_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_RECOVER);
+	/* keep kernels that don't know the orphan file from mounting rw
+	 * over a file we may leave entries in */
+	if (EXT4_HAS_COMPAT_FEATURE(sb, EXT4_FEATURE_COMPAT_ORPHAN_FILE))
+		EXT4_SET_RO_COMPAT_FEATURE(sb,
+				EXT4_FEATURE_RO_COMPAT_ORPHAN_PRESENT);
 
 	ext4bf_commit_super(sb, 1);
 done:
@@ -2221,16 +2333,45 @@ static int ext4bf_check_descriptors(struct super_block *sb,
  * ext4bf_free_inode().  The only reason we would point at a wrong inode is if
  * e2fsck was run on this filesystem, and it must have already done the orphan
  * inode cleanup for us, so we can safely abort without any further action.
+ *
+ * The inodes recorded in the orphan file, if there is one, are handled the
+ * same way, each keeping its slot until its final iput() frees it.
  */
+static void ext4bf_process_orphan(struct inode *inode,
+				  int *nr_truncates, int *nr_orphans)
+{
+	struct super_block *sb = inode->i_sb;
+
+	dquot_initialize(inode);
+	if (inode->i_nlink) {
+		ext4bf_msg(sb, KERN_DEBUG,
+			"%s: truncating inode %lu to %lld bytes",
+			__func__, inode->i_ino, inode->i_size);
+		jbd_debug(2, "truncating inode %lu to %lld bytes\n",
+			  inode->i_ino, inode->i_size);
+		ext4bf_truncate(inode);
+		(*nr_truncates)++;
+	} else {
+		ext4bf_msg(sb, KERN_DEBUG,
+			"%s: deleting unreferenced inode %lu",
+			__func__, inode->i_ino);
+		jbd_debug(2, "deleting unreferenced inode %lu\n",
+			  inode->i_ino);
+		(*nr_orphans)++;
+	}
+	iput(inode);  /* The delete magic happens here! */
+}
+
 static void ext4bf_orphan_cleanup(struct super_block *sb,
 				struct ext4bf_super_block *es)
 {
+	struct ext4bf_orphan_info *oi = &EXT4_SB(sb)->s_orphan_info;
+	int inodes_per_ob = ext4bf_inodes_per_orphan_block(sb->s_blocksize);
 	unsigned int s_flags = sb->s_flags;
 	int nr_orphans = 0, nr_truncates = 0;
-#ifdef CONFIG_QUOTA
-	int i;
-#endif
-	if (!es->s_last_orphan) {
+	int i, j;
+
+	if (!es->s_last_orphan && ext4bf_orphan_file_empty(sb)) {
 		jbd_debug(4, "no orphan inodes to clean up\n");
 		return;
 	}
@@ -2286,24 +2427,24 @@ static void ext4bf_orphan_cleanup(struct super_block *sb,
 		}
 
 		list_add(&EXT4_I(inode)->i_orphan, &EXT4_SB(sb)->s_orphan);
-		dquot_initialize(inode);
-		if (inode->i_nlink) {
-			ext4bf_msg(sb, KERN_DEBUG,
-				"%s: truncating inode %lu to %lld bytes",
-				__func__, inode->i_ino, inode->i_size);
-			jbd_debug(2, "truncating inode %lu to %lld bytes\n",
-				  inode->i_ino, inode->i_size);
-			ext4bf_truncate(inode);
-			nr_truncates++;
-		} else {
-			ext4bf_msg(sb, KERN_DEBUG,
-				"%s: deleting unreferenced inode %lu",
-				__func__, inode->i_ino);
-			jbd_debug(2, "deleting unreferenced inode %lu\n",
-				  inode->i_ino);
-			nr_orphans++;
+		ext4bf_process_orphan(inode, &nr_truncates, &nr_orphans);
+	}
+
+	for (i = 0; i < oi->of_blocks; i++) {
+		__le32 *bdata = (__le32 *)oi->of_binfo[i].ob_bh->b_data;
+
+		for (j = 0; j < inodes_per_ob; j++) {
+			struct inode *inode;
+
+			if (!bdata[j])
+				continue;
+			inode = ext4bf_orphan_get(sb, le32_to_cpu(bdata[j]));
+			if (IS_ERR(inode))
+				continue;
+			EXT4_I(inode)->i_orphan_idx = i * inodes_per_ob + j;
+			ext4bf_set_inode_state(inode, EXT4_STATE_ORPHAN_FILE);
+			ext4bf_process_orphan(inode, &nr_truncates, &nr_orphans);
 		}
-		iput(inode);  /* The delete magic happens here! */
 	}
 
 #define PLURAL(x) (x), ((x) == 1) ? "" : "s"
@@ -2629,7 +2770,13 @@ EXT4_RW_ATTR_SBI_UI(mb_min_to_scan, s_mb_min_to_scan);
 EXT4_RW_ATTR_SBI_UI(mb_order2_req, s_mb_order2_reqs);
 EXT4_RW_ATTR_SBI_UI(mb_stream_req, s_mb_stream_request);
 EXT4_RW_ATTR_SBI_UI(mb_group_prealloc, s_mb_group_prealloc);
+EXT4_RW_ATTR_SBI_UI(mb_optimize_scan, s_mb_optimize_scan);
 EXT4_RW_ATTR_SBI_UI(max_writeback_mb_bump, s_max_writeback_mb_bump);
+EXT4_RW_ATTR_SBI_UI(defrag_frags_per_mb, s_defrag_frags_per_mb);
+EXT4_RW_ATTR_SBI_UI(defrag_max_mb, s_defrag_max_mb);
+EXT4_RW_ATTR_SBI_UI(defrag_interval, s_defrag_interval);
+EXT4_RW_ATTR_SBI_UI(async_free_min_mb, s_async_free_min_mb);
+EXT4_RW_ATTR_SBI_UI(async_free_chunk_mb, s_async_free_chunk_mb);
 
 static struct attribute *ext4bf_attrs[] = {
 	ATTR_LIST(delayed_allocation_blocks),
@@ -2645,7 +2792,13 @@ static struct attribute *ext4bf_attrs[] = {
 	ATTR_LIST(mb_order2_req),
 	ATTR_LIST(mb_stream_req),
 	ATTR_LIST(mb_group_prealloc),
+	ATTR_LIST(mb_optimize_scan),
 	ATTR_LIST(max_writeback_mb_bump),
+	ATTR_LIST(defrag_frags_per_mb),
+	ATTR_LIST(defrag_max_mb),
+	ATTR_LIST(defrag_interval),
+	ATTR_LIST(async_free_min_mb),
+	ATTR_LIST(async_free_chunk_mb),
 	NULL,
 };
 
@@ -3616,6 +3769,8 @@ static int ext4bf_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->s_gdb_count = db_count;
 	get_random_bytes(&sbi->s_next_generation, sizeof(u32));
 	spin_lock_init(&sbi->s_next_gen_lock);
+	INIT_LIST_HEAD(&sbi->s_deferred_inodes);
+	spin_lock_init(&sbi->s_deferred_lock);
 
 	init_timer(&sbi->s_err_report);
 	sbi->s_err_report.function = print_daily_error_info;
@@ -3634,11 +3789,37 @@ static int ext4bf_fill_super(struct super_block *sb, void *data, int silent)
 	if (!err) {
 		err = percpu_counter_init(&sbi->s_dirtyclusters_counter, 0);
 	}
+	if (!err) {
+		err = percpu_counter_init(&sbi->s_extent_cache_cnt, 0);
+	}
+	if (!err) {
+		sbi->s_inode_cursor = alloc_percpu(struct ext4bf_inode_cursor);
+		if (!sbi->s_inode_cursor)
+			err = -ENOMEM;
+		else
+			for_each_possible_cpu(i)
+				per_cpu_ptr(sbi->s_inode_cursor, i)->ic_group = ~0;
+	}
 	if (err) {
 		ext4bf_msg(sb, KERN_ERR, "insufficient memory");
 		goto failed_mount3;
 	}
 
+	INIT_LIST_HEAD(&sbi->s_es_lru);
+	spin_lock_init(&sbi->s_es_lru_lock);
+	spin_lock_init(&sbi->s_defrag_lock);
+	atomic_set(&sbi->s_discard_batches, 0);
+	init_waitqueue_head(&sbi->s_discard_wait);
+	sbi->s_defrag_frags_per_mb = EXT4_DEFRAG_FRAGS_PER_MB;
+	sbi->s_defrag_max_mb = EXT4_DEFRAG_MAX_MB;
+	sbi->s_defrag_interval = EXT4_DEFRAG_INTERVAL;
+	spin_lock_init(&sbi->s_async_free_lock);
+	INIT_LIST_HEAD(&sbi->s_async_free_list);
+	init_waitqueue_head(&sbi->s_async_free_wait);
+	sbi->s_async_free_min_mb = EXT4_ASYNC_FREE_MIN_MB;
+	sbi->s_async_free_chunk_mb = EXT4_ASYNC_FREE_CHUNK_MB;
+	ext4bf_es_register_shrinker(sbi);
+
 	sbi->s_stripe = ext4bf_get_stripe_size(sbi);
 	sbi->s_max_writeback_mb_bump = 128;
 
@@ -3660,6 +3841,7 @@ static int ext4bf_fill_super(struct super_block *sb, void *data, int silent)
 
 	INIT_LIST_HEAD(&sbi->s_orphan); /* unlinked but open files */
 	mutex_init(&sbi->s_orphan_lock);
+	mutex_init(&sbi->s_system_zone_mutex);
 	sbi->s_resize_flags = 0;
 
 	sb->s_root = NULL;
@@ -3715,6 +3897,22 @@ static int ext4bf_fill_super(struct super_block *sb, void *data, int silent)
 				JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT);
 	}
 
+	/* ext4bf: commit records ride in the last descriptor block when
+	 * the external journal sits on a fast device. */
+	if (test_opt2(sb, JOURNAL_FAST_DEV)) {
+		if (sbi->s_journal->j_dev == sbi->s_journal->j_fs_dev) {
+			ext4bf_msg(sb, KERN_ERR, "journal_fast_dev requires "
+				 "an external journal device");
+			goto failed_mount_wq;
+		}
+		jbdbf_journal_set_features(sbi->s_journal,
+				JBD2_FEATURE_COMPAT_CHECKSUM, 0,
+				JBD2_FEATURE_INCOMPAT_INLINE_COMMIT);
+	} else {
+		jbdbf_journal_clear_features(sbi->s_journal, 0, 0,
+				JBD2_FEATURE_INCOMPAT_INLINE_COMMIT);
+	}
+
 	/* We have now updated the journal if required, so we can
 	 * validate the data journaling mode. */
 	switch (test_opt(sb, DATA_FLAGS)) {
@@ -3768,11 +3966,13 @@ static int ext4bf_fill_super(struct super_block *sb, void *data, int silent)
 
 no_journal:
 	/*
-	 * The maximum number of concurrent works can be high and
-	 * concurrency isn't really necessary.  Limit it to 1.
+	 * There is one work item per inode, which converts everything
+	 * that completed on that inode in one batch.  Different inodes
+	 * can be converted in parallel on the CPUs that completed them.
 	 */
 	EXT4_SB(sb)->dio_unwritten_wq =
-		alloc_workqueue("ext4bf-dio-unwritten", WQ_MEM_RECLAIM | WQ_UNBOUND, 1);
+		alloc_workqueue("ext4bf-dio-unwritten",
+				WQ_MEM_RECLAIM | WQ_NON_REENTRANT, 0);
 	if (!EXT4_SB(sb)->dio_unwritten_wq) {
 		printk(KERN_ERR "EXT4BF-fs: failed to create DIO workqueue\n");
 		goto failed_mount_wq;
@@ -3843,6 +4043,10 @@ no_journal:
 		goto failed_mount5;
 	}
 
+	err = ext4bf_init_orphan_info(sb);
+	if (err)
+		goto failed_mount6;
+
 	err = ext4bf_register_li_request(sb, first_not_zeroed);
 	if (err)
 		goto failed_mount6;
@@ -3880,6 +4084,10 @@ no_journal:
 	if (es->s_error_count)
 		mod_timer(&sbi->s_err_report, jiffies + 300*HZ); /* 5 minutes */
 
+	ext4bf_mb_prefetch_start(sb);
+	ext4bf_defrag_start(sb);
+	ext4bf_async_free_start(sb);
+
 #ifdef DELAYED_REUSE
     /* ext4bf: setup the delayed block reuse list. */
     INIT_LIST_HEAD(&ext4bf_delayed_reuse_list);
@@ -3911,8 +4119,11 @@ cantfind_ext4bf:
 	goto failed_mount;
 
 failed_mount7:
+	ext4bf_defrag_stop(sb);
+	ext4bf_async_free_stop(sb);
 	ext4bf_unregister_li_request(sb);
 failed_mount6:
+	ext4bf_release_orphan_info(sb);
 	ext4bf_ext_release(sb);
 failed_mount5:
 	ext4bf_mb_release(sb);
@@ -3935,6 +4146,9 @@ failed_mount3:
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
 	percpu_counter_destroy(&sbi->s_dirtyclusters_counter);
+	ext4bf_es_unregister_shrinker(sbi);
+	percpu_counter_destroy(&sbi->s_extent_cache_cnt);
+	free_percpu(sbi->s_inode_cursor);
 	if (sbi->s_mmp_tsk)
 		kthread_stop(sbi->s_mmp_tsk);
 failed_mount2:
@@ -3972,6 +4186,7 @@ static void ext4bf_init_journal_params(struct super_block *sb, journal_t *journa
 	journal->j_commit_interval = sbi->s_commit_interval;
 	journal->j_min_batch_time = sbi->s_min_batch_time;
 	journal->j_max_batch_time = sbi->s_max_batch_time;
+	journal->j_lock_callback = ext4bf_journal_lock_callback;
 
 	write_lock(&journal->j_state_lock);
 	if (test_opt(sb, BARRIER))
@@ -3982,6 +4197,14 @@ static void ext4bf_init_journal_params(struct super_block *sb, journal_t *journa
 		journal->j_flags |= JBD2_ABORT_ON_SYNCDATA_ERR;
 	else
 		journal->j_flags &= ~JBD2_ABORT_ON_SYNCDATA_ERR;
+	if (test_opt2(sb, JOURNAL_FAST_DEV))
+		journal->j_flags |= JBD2_FAST_DEV;
+	else
+		journal->j_flags &= ~JBD2_FAST_DEV;
+	if (test_opt2(sb, ORDERED_CSUM))
+		journal->j_flags |= JBD2_ORDERED_CSUM;
+	else
+		journal->j_flags &= ~JBD2_ORDERED_CSUM;
 	write_unlock(&journal->j_state_lock);
 }
 
@@ -4303,6 +4526,9 @@ static void ext4bf_mark_recovery_complete(struct super_block *sb,
 	if (EXT4_HAS_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_RECOVER) &&
 	    sb->s_flags & MS_RDONLY) {
 		EXT4_CLEAR_INCOMPAT_FEATURE(sb, EXT4_FEATURE_INCOMPAT_RECOVER);
+		if (ext4bf_orphan_file_empty(sb))
+			EXT4_CLEAR_RO_COMPAT_FEATURE(sb,
+				EXT4_FEATURE_RO_COMPAT_ORPHAN_PRESENT);
 		ext4bf_commit_super(sb, 1);
 	}
 
@@ -4504,6 +4730,11 @@ static int ext4bf_remount(struct super_block *sb, int *flags, char *data)
 #endif
 	char *orig_data = kstrdup(data, GFP_KERNEL);
 
+	/* restarted below if the fs stays writable with auto_defrag or
+	 * async_free */
+	ext4bf_defrag_stop(sb);
+	ext4bf_async_free_stop(sb);
+
 	/* Store the original options */
 	lock_super(sb);
 	old_sb_flags = sb->s_flags;
@@ -4602,7 +4833,8 @@ static int ext4bf_remount(struct super_block *sb, int *flags, char *data)
 			 * around from a previously readonly bdev mount,
 			 * require a full umount/remount for now.
 			 */
-			if (es->s_last_orphan) {
+			if (es->s_last_orphan ||
+			    !ext4bf_orphan_file_empty(sb)) {
 				ext4bf_msg(sb, KERN_WARNING, "Couldn't "
 				       "remount RDWR because of unprocessed "
 				       "orphan inode list.  Please "
@@ -4661,6 +4893,8 @@ static int ext4bf_remount(struct super_block *sb, int *flags, char *data)
 	unlock_super(sb);
 	if (enable_quota)
 		dquot_resume(sb, -1);
+	ext4bf_defrag_start(sb);
+	ext4bf_async_free_start(sb);
 
 	ext4bf_msg(sb, KERN_INFO, "re-mounted. Opts: %s", orig_data);
 	kfree(orig_data);
@@ -4685,6 +4919,8 @@ restore_opts:
 	}
 #endif
 	unlock_super(sb);
+	ext4bf_defrag_start(sb);
+	ext4bf_async_free_start(sb);
 	kfree(orig_data);
 	return err;
 }
@@ -5115,11 +5351,25 @@ static inline void unregister_as_ext3(void) { }
 static inline int ext3_feature_set_ok(struct super_block *sb) { return 0; }
 #endif
 
+/*
+ * The defragmenter and the async_free thread hold inode references while
+ * they work, and async_free keeps unlinked inodes cached; stop both
+ * before generic_shutdown_super() evicts the inodes.
+ */
+static void ext4bf_kill_sb(struct super_block *sb)
+{
+	if (sb->s_fs_info) {
+		ext4bf_defrag_stop(sb);
+		ext4bf_async_free_stop(sb);
+	}
+	kill_block_super(sb);
+}
+
 static struct file_system_type ext4bf_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "ext4bf",
 	.mount		= ext4bf_mount,
-	.kill_sb	= kill_block_super,
+	.kill_sb	= ext4bf_kill_sb,
 	.fs_flags	= FS_REQUIRES_DEV,
 };
 
@@ -5169,9 +5419,12 @@ static int __init ext4bf_init_fs(void)
 		init_waitqueue_head(&ext4bf__ioend_wq[i]);
 	}
 
-	err = ext4bf_init_pageio();
+	err = ext4bf_init_es();
 	if (err)
 		return err;
+	err = ext4bf_init_pageio();
+	if (err)
+		goto out7;
 	err = ext4bf_init_system_zone();
 	if (err)
 		goto out6;
@@ -5221,6 +5474,8 @@ out5:
 	ext4bf_exit_system_zone();
 out6:
 	ext4bf_exit_pageio();
+out7:
+	ext4bf_exit_es();
 	return err;
 }
 
@@ -5238,6 +5493,7 @@ static void __exit ext4bf_exit_fs(void)
 	kset_unregister(ext4bf_kset);
 	ext4bf_exit_system_zone();
 	ext4bf_exit_pageio();
+	ext4bf_exit_es();
 }
 
 MODULE_AUTHOR("Remy Card, Stephen Tweedie, Andrew Morton, Andreas Dilger, Theodore Ts'o and others");
@@ -35,6 +35,10 @@
 
 static void __jbdbf_journal_temp_unlink_buffer(struct journal_bf_head *jh);
 static void __jbdbf_journal_unfile_buffer(struct journal_bf_head *jh);
+static inline void __blist_add_buffer(struct journal_bf_head **list,
+				      struct journal_bf_head *jh);
+static inline void __blist_del_buffer(struct journal_bf_head **list,
+				      struct journal_bf_head *jh);
 
 /*
  * jbdbf_get_transaction: obtain a new transaction_bf_t object.
@@ -67,6 +71,7 @@ jbdbf_get_transaction(journal_t *journal, transaction_bf_t *transaction)
 	INIT_LIST_HEAD(&transaction->t_inode_list);
 	INIT_LIST_HEAD(&transaction->t_private_list);
 	INIT_LIST_HEAD(&transaction->t_data_tag_list);
+	INIT_LIST_HEAD(&transaction->t_data_runs);
 	transaction->t_num_dirty_blocks = 0;
 	transaction->t_durable_commit = 0;
 
@@ -1190,6 +1195,47 @@ out:
 	return ret;
 }
 
+/*
+ * ext4bf: take the next buffer off @transaction's t_dirty_data_list for
+ * early writeout and return it with a reference held, or NULL once the
+ * list is empty.  A truncate or unlink may dispose of the buffer while we
+ * wait for its state lock; it is then skipped, and once it is off the
+ * list a later truncate clears its dirty bit before the write goes out,
+ * so data nobody wants any more is never written.
+ *
+ * Called under t_dirty_data_mutex.
+ */
+struct buffer_head *jbdbf_journal_next_dirty_data(journal_t *journal,
+						  transaction_bf_t *transaction)
+{
+	struct journal_bf_head *jh;
+	struct buffer_head *bh;
+
+	spin_lock(&journal->j_list_lock);
+	while ((jh = transaction->t_dirty_data_list) != NULL) {
+		bh = jh2bhbf(jh);
+		get_bh(bh);
+		if (!jbdbf_trylock_bh_state(bh)) {
+			spin_unlock(&journal->j_list_lock);
+			jbdbf_lock_bh_state(bh);
+			spin_lock(&journal->j_list_lock);
+		}
+		/* jh may be gone unless it is still attached to bh */
+		if (buffer_jbd(bh) && bh2jhbf(bh) == jh &&
+		    jh->b_transaction == transaction &&
+		    jh->b_jlist == BJ_Dirtydata) {
+			__jbdbf_journal_refile_buffer(jh);
+			spin_unlock(&journal->j_list_lock);
+			jbdbf_unlock_bh_state(bh);
+			return bh;
+		}
+		jbdbf_unlock_bh_state(bh);
+		put_bh(bh);
+	}
+	spin_unlock(&journal->j_list_lock);
+	return NULL;
+}
+
 struct buffer_head	*dirty_data_bhs[EXT4BF_DATA_BATCH];
 /* ext4bf: routine to write out data blocks listed in t_forget list of each
  * transactions. Mirros __flush_batch from checkpoint.c
@@ -1222,51 +1268,29 @@ static void write_out_dirty_blocks(journal_t *journal, transaction_bf_t *commit_
     unsigned static int wodbcnt = 0;
     printk("736: write_out_dirty_blocks called times %d \n", ++wodbcnt);
 #endif
+    struct buffer_head *bh;
+    int data_batch_count = 0;
 
     jbd_debug(6, "Doing early processing of blocks for transaction %lu\n",
             commit_transaction->t_tid);
     /* ext4bf: attempt to read the data blocks inside the t_forget list of the
      * the current transaction. */
     mutex_lock(&commit_transaction->t_dirty_data_mutex);
-    struct journal_bf_head *jh, *jh_next;
-    jh = commit_transaction->t_dirty_data_list;
-    int data_batch_count = 0;
-    /* List of buffer heads to submit. */
-    while(1) {
-        if (!jh) {
-            jbd_debug(6, "ext4bf: got empty forget list\n");
-            break;
-        }
-        struct buffer_head *bh = jh2bhbf(jh);
-        if (!bh) break;
-        jbdbf_lock_bh_state(bh);
-        if (bh->b_blocktype == B_BLOCKTYPE_DATA){
-            jbd_debug(6, "got block %lu in forget list\n", bh->b_blocknr);
-            /* Process the data buffer. */
-            get_bh(bh);
-            set_buffer_jwrite(bh);
-            dirty_data_bhs[data_batch_count++] = bh;
-            if (data_batch_count == EXT4BF_DATA_BATCH) {
-                __flush_data_batch(&data_batch_count);
-            }
-        }
-	    jbdbf_unlock_bh_state(bh);
-        /* If we are looping back, break */
-        if (jh->b_tnext == commit_transaction->t_dirty_data_list) {
-            /* We're done; flush remaining buffers and exit. */
-            if (data_batch_count) {
-                __flush_data_batch(&data_batch_count);
-            }
-            if (jh) jbdbf_journal_refile_buffer(journal, jh);
-            break;
+    while ((bh = jbdbf_journal_next_dirty_data(journal, commit_transaction))) {
+        if (bh->b_blocktype != B_BLOCKTYPE_DATA) {
+            put_bh(bh);
+            continue;
         }
-        jh_next = jh->b_tnext;
-        if (jh) jbdbf_journal_refile_buffer(journal, jh);
-		jh = jh_next;
+        jbd_debug(6, "got block %lu in forget list\n", bh->b_blocknr);
+        set_buffer_jwrite(bh);
+        dirty_data_bhs[data_batch_count++] = bh;
+        if (data_batch_count == EXT4BF_DATA_BATCH)
+            __flush_data_batch(&data_batch_count);
     }
+    if (data_batch_count)
+        __flush_data_batch(&data_batch_count);
     commit_transaction->t_num_dirty_blocks = 0;
     mutex_unlock(&commit_transaction->t_dirty_data_mutex);
-    /* */
 }
 
 unsigned prev_dirty_time = 0;
@@ -1308,11 +1332,45 @@ int jbdbf_journal_dirty_data(handle_t *handle, struct buffer_head *bh)
 
 	set_buffer_jbddirty(bh);
 
-	JBUFFER_TRACE(jh, "file as BJ_Dirtydata");
-	spin_lock(&journal->j_list_lock);
-	__jbdbf_journal_file_buffer(jh, transaction, BJ_Dirtydata);
-	transaction->t_num_dirty_blocks++;
-	spin_unlock(&journal->j_list_lock);
+	if (!jh->b_transaction) {
+		struct jbdbf_dirty_data_pcpu *pcpu;
+		int checkpointed = jh->b_cp_transaction != NULL;
+
+		/*
+		 * ext4bf: common case, a data block new to the journal.
+		 * Stage it on this CPU's list; commit merges the lists.
+		 *
+		 * Code holding only j_list_lock reaches a journal head
+		 * through a transaction's lists, which a staged buffer is
+		 * not on until the merge, or through a checkpoint list.  So
+		 * j_list_lock is needed for the assignment only when the
+		 * buffer is checkpointed.  A buffer is only put on a
+		 * checkpoint list under the bh state lock, which we hold.
+		 */
+		JBUFFER_TRACE(jh, "file as BJ_Dirtystaged");
+		jbdbf_journal_grab_journal_bf_head(bh);
+		if (checkpointed)
+			spin_lock(&journal->j_list_lock);
+		pcpu = get_cpu_ptr(journal->j_dirty_data_pcpu);
+		spin_lock(&pcpu->lock);
+		jh->b_transaction = transaction;
+		jh->b_dirty_cpu = smp_processor_id();
+		__blist_add_buffer(&pcpu->list, jh);
+		jh->b_jlist = BJ_Dirtystaged;
+		pcpu->nr++;
+		spin_unlock(&pcpu->lock);
+		put_cpu_ptr(journal->j_dirty_data_pcpu);
+		if (checkpointed)
+			spin_unlock(&journal->j_list_lock);
+	} else if (jh->b_transaction != transaction ||
+		   (jh->b_jlist != BJ_Dirtystaged &&
+		    jh->b_jlist != BJ_Dirtydata)) {
+		JBUFFER_TRACE(jh, "file as BJ_Dirtydata");
+		spin_lock(&journal->j_list_lock);
+		__jbdbf_journal_file_buffer(jh, transaction, BJ_Dirtydata);
+		transaction->t_num_dirty_blocks++;
+		spin_unlock(&journal->j_list_lock);
+	}
 	jbdbf_unlock_bh_state(bh);
 
     unsigned int diff;
@@ -1329,6 +1387,71 @@ out:
 	return ret;
 }
 
+/**
+ * int jbdbf_journal_dirty_data_run() - track a newly appended data block
+ * @handle: transaction to add buffer to.
+ * @bh: buffer to track.
+ *
+ * ext4bf: unlike jbdbf_journal_dirty_data() the buffer gets no
+ * journal_bf_head.  It is pinned and appended to a run of contiguous
+ * blocks on this CPU's staging list; commit writes the runs out and logs
+ * a NEWLYAPPENDEDDATA tag with the checksum of each block.  The caller
+ * must not have taken write access on @bh.
+ *
+ * BH_DataRun stays set until commit has taken the block's checksum, so a
+ * block rewritten before then is not staged twice.
+ */
+int jbdbf_journal_dirty_data_run(handle_t *handle, struct buffer_head *bh)
+{
+	journal_t *journal = handle->h_transaction->t_journal;
+	struct jbdbf_dirty_data_pcpu *pcpu;
+	struct jbdbf_data_run *run, *new_run = NULL;
+	unsigned long long blocknr = bh->b_blocknr;
+	int n;
+
+	if (is_handle_aborted(handle))
+		return 0;
+	J_ASSERT(!buffer_jbd(bh));
+	/* Rewritten before commit: the checksum is taken then. */
+	if (test_set_buffer_datarun(bh))
+		return 0;
+
+retry:
+	pcpu = get_cpu_ptr(journal->j_dirty_data_pcpu);
+	spin_lock(&pcpu->lock);
+	n = 0;
+	list_for_each_entry_reverse(run, &pcpu->runs, dr_list) {
+		if (blocknr == run->dr_start + run->dr_len &&
+		    run->dr_len < JBDBF_DATA_RUN_BLOCKS)
+			goto add;
+		if (++n == JBDBF_DATA_RUN_LOOKBACK)
+			break;
+	}
+	if (!new_run) {
+		spin_unlock(&pcpu->lock);
+		put_cpu_ptr(journal->j_dirty_data_pcpu);
+		new_run = jbdbf_alloc_data_run(GFP_NOFS);
+		if (!new_run) {
+			clear_buffer_datarun(bh);
+			return -ENOMEM;
+		}
+		goto retry;
+	}
+	run = new_run;
+	new_run = NULL;
+	run->dr_start = blocknr;
+	run->dr_len = 0;
+	list_add_tail(&run->dr_list, &pcpu->runs);
+add:
+	get_bh(bh);
+	run->dr_bh[run->dr_len++] = bh;
+	spin_unlock(&pcpu->lock);
+	put_cpu_ptr(journal->j_dirty_data_pcpu);
+	if (new_run)
+		jbdbf_free_data_run(new_run);
+	return 0;
+}
+
 /*
  * jbdbf_journal_release_buffer: undo a get_write_access without any buffer
  * updates, if the update decided in the end that it didn't need access.
@@ -1400,6 +1523,7 @@ int jbdbf_journal_forget (handle_t *handle, struct buffer_head *bh)
 		 * the transaction immediately. */
 		clear_buffer_dirty(bh);
 		clear_buffer_jbddirty(bh);
+		jbdbf_cancel_delayed_write(bh);
 
 		JBUFFER_TRACE(jh, "belongs to current transaction: unfile");
 
@@ -1454,6 +1578,24 @@ int jbdbf_journal_forget (handle_t *handle, struct buffer_head *bh)
 			if (was_modified)
 				drop_reserve = 1;
 		}
+	} else if (jh->b_cp_transaction) {
+		/*
+		 * ext4bf: the buffer is only waiting to be checkpointed,
+		 * typically held back by a non-durable commit.  If it has
+		 * been written we can drop the checkpoint now.  Otherwise,
+		 * including while a checkpoint write is still in flight,
+		 * pin the checkpoint until this transaction commits, as
+		 * for the cases above.
+		 */
+		if (!buffer_dirty(bh) && !buffer_locked(bh)) {
+			JBUFFER_TRACE(jh, "checkpointed: remove checkpoint");
+			__jbdbf_journal_remove_checkpoint(jh);
+		} else {
+			JBUFFER_TRACE(jh, "checkpointed: add to BJ_Forget");
+			clear_buffer_dirty(bh);
+			jbdbf_cancel_delayed_write(bh);
+			__jbdbf_journal_file_buffer(jh, transaction, BJ_Forget);
+		}
 	}
 
 not_jbd:
@@ -1777,14 +1919,61 @@ void __jbdbf_journal_temp_unlink_buffer(struct journal_bf_head *jh)
 		break;
 	case BJ_Dirtydata:
 	    list = &transaction->t_dirty_data_list;
+	    break;
+	case BJ_Dirtystaged: {
+		struct jbdbf_dirty_data_pcpu *pcpu = per_cpu_ptr(
+			transaction->t_journal->j_dirty_data_pcpu,
+			jh->b_dirty_cpu);
+
+		spin_lock(&pcpu->lock);
+		__blist_del_buffer(&pcpu->list, jh);
+		pcpu->nr--;
+		spin_unlock(&pcpu->lock);
+		break;
+	}
 	}
 
-	__blist_del_buffer(list, jh);
+	if (list)
+		__blist_del_buffer(list, jh);
 	jh->b_jlist = BJ_None;
 	if (test_clear_buffer_jbddirty(bh))
 		mark_buffer_dirty(bh);	/* Expose it to the VM */
 }
 
+/*
+ * ext4bf: move the data buffers staged per-CPU by jbdbf_journal_dirty_data()
+ * onto transaction->t_dirty_data_list, and the data runs staged by
+ * jbdbf_journal_dirty_data_run() onto transaction->t_data_runs.  The staged buffers always belong to
+ * the running transaction, so the caller must make sure @transaction still
+ * is the running one.
+ *
+ * Called under j_list_lock.
+ */
+void __jbdbf_journal_merge_dirty_data(transaction_bf_t *transaction)
+{
+	journal_t *journal = transaction->t_journal;
+	struct jbdbf_dirty_data_pcpu *pcpu;
+	struct journal_bf_head *jh;
+	int cpu;
+
+	assert_spin_locked(&journal->j_list_lock);
+
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(journal->j_dirty_data_pcpu, cpu);
+		spin_lock(&pcpu->lock);
+		while ((jh = pcpu->list) != NULL) {
+			J_ASSERT_JH(jh, jh->b_transaction == transaction);
+			__blist_del_buffer(&pcpu->list, jh);
+			__blist_add_buffer(&transaction->t_dirty_data_list, jh);
+			jh->b_jlist = BJ_Dirtydata;
+		}
+		transaction->t_num_dirty_blocks += pcpu->nr;
+		pcpu->nr = 0;
+		list_splice_tail_init(&pcpu->runs, &transaction->t_data_runs);
+		spin_unlock(&pcpu->lock);
+	}
+}
+
 /*
  * Remove buffer from all transactions.
  *
@@ -1945,6 +2134,7 @@ static int __dispose_buffer(struct journal_bf_head *jh, transaction_bf_t *transa
 		 * __journal_file_buffer
 		 */
 		clear_buffer_dirty(bh);
+		jbdbf_cancel_delayed_write(bh);
 		__jbdbf_journal_file_buffer(jh, transaction, BJ_Forget);
 		may_free = 0;
 	} else {
@@ -2134,6 +2324,8 @@ zap_buffer_no_jh:
 zap_buffer_unlocked:
 	clear_buffer_dirty(bh);
 	J_ASSERT_BH(bh, !buffer_jbddirty(bh));
+	/* a staged run entry is dropped by commit once unmapped */
+	clear_buffer_datarun(bh);
 	clear_buffer_mapped(bh);
 	clear_buffer_req(bh);
 	clear_buffer_new(bh);
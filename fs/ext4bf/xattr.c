@@ -950,6 +950,84 @@ ext4bf_xattr_ibody_set(handle_t *handle, struct inode *inode,
 	return 0;
 }
 
+/*
+ * In-inode attribute accessors for inline data (see inline.c).  The value
+ * lives in the inode body only and never spills to an attribute block.
+ * The set and free helpers work on an inode buffer the caller has
+ * reserved for write, and expect xattr_sem to be held.
+ */
+int
+ext4bf_xattr_ibody_inline_get(struct inode *inode, int name_index,
+			      const char *name, void *buffer, size_t buffer_size)
+{
+	int error;
+
+	down_read(&EXT4_I(inode)->xattr_sem);
+	error = ext4bf_xattr_ibody_get(inode, name_index, name, buffer,
+				       buffer_size);
+	up_read(&EXT4_I(inode)->xattr_sem);
+	return error;
+}
+
+int
+ext4bf_xattr_ibody_inline_set(handle_t *handle, struct inode *inode,
+			      struct ext4bf_iloc *iloc, int name_index,
+			      const char *name, const void *value,
+			      size_t value_len)
+{
+	struct ext4bf_xattr_info i = {
+		.name_index = name_index,
+		.name = name,
+		.value = value,
+		.value_len = value_len,
+	};
+	struct ext4bf_xattr_ibody_find is = {
+		.s = { .not_found = -ENODATA, },
+		.iloc = *iloc,
+	};
+	int error;
+
+	if (ext4bf_test_inode_state(inode, EXT4_STATE_NEW)) {
+		struct ext4bf_inode *raw_inode = ext4bf_raw_inode(iloc);
+		memset(raw_inode, 0, EXT4_SB(inode->i_sb)->s_inode_size);
+		ext4bf_clear_inode_state(inode, EXT4_STATE_NEW);
+	}
+	error = ext4bf_xattr_ibody_find(inode, &i, &is);
+	if (error)
+		return error;
+	if (!value && is.s.not_found)
+		return 0;
+	return ext4bf_xattr_ibody_set(handle, inode, &i, &is);
+}
+
+size_t
+ext4bf_xattr_ibody_inline_free(struct inode *inode, struct ext4bf_iloc *iloc,
+			       int name_index, const char *name)
+{
+	struct ext4bf_xattr_info i = {
+		.name_index = name_index,
+		.name = name,
+	};
+	struct ext4bf_xattr_ibody_find is = {
+		.s = { .not_found = -ENODATA, },
+		.iloc = *iloc,
+	};
+	size_t min_offs, free, name_len = EXT4_XATTR_LEN(strlen(name));
+	int total = 0;
+
+	if (ext4bf_xattr_ibody_find(inode, &i, &is) || !is.s.base)
+		return 0;
+	min_offs = is.s.end - is.s.base;
+	free = ext4bf_xattr_free_space(is.s.first, &min_offs, is.s.base,
+				       &total);
+	if (!is.s.not_found)
+		free += EXT4_XATTR_SIZE(le32_to_cpu(is.s.here->e_value_size)) +
+			name_len;
+	if (free < name_len)
+		return 0;
+	return (free - name_len) & ~EXT4_XATTR_ROUND;
+}
+
 /*
  * ext4bf_xattr_set_handle()
  *
@@ -1245,6 +1323,12 @@ retry:
 		/* Find the entry best suited to be pushed into EA block */
 		entry = NULL;
 		for (; !IS_LAST_ENTRY(last); last = EXT4_XATTR_NEXT(last)) {
+			/* inline data must stay in the inode body */
+			if (last->e_name_index == EXT4_XATTR_INDEX_SYSTEM &&
+			    last->e_name_len == strlen(EXT4_XATTR_SYSTEM_DATA) &&
+			    !memcmp(last->e_name, EXT4_XATTR_SYSTEM_DATA,
+				    last->e_name_len))
+				continue;
 			total_size =
 			EXT4_XATTR_SIZE(le32_to_cpu(last->e_value_size)) +
 					EXT4_XATTR_LEN(last->e_name_len);
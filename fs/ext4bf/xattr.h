@@ -21,6 +21,10 @@
 #define EXT4_XATTR_INDEX_TRUSTED		4
 #define	EXT4_XATTR_INDEX_LUSTRE			5
 #define EXT4_XATTR_INDEX_SECURITY	        6
+#define EXT4_XATTR_INDEX_SYSTEM			7
+
+/* In-inode attribute holding the part of inline data past i_block */
+#define EXT4_XATTR_SYSTEM_DATA			"data"
 
 struct ext4bf_xattr_header {
 	__le32	h_magic;	/* magic number for identification */
@@ -77,6 +81,15 @@ extern int ext4bf_xattr_get(struct inode *, int, const char *, void *, size_t);
 extern int ext4bf_xattr_set(struct inode *, int, const char *, const void *, size_t, int);
 extern int ext4bf_xattr_set_handle(handle_t *, struct inode *, int, const char *, const void *, size_t, int);
 
+extern int ext4bf_xattr_ibody_inline_get(struct inode *, int, const char *,
+					 void *, size_t);
+extern int ext4bf_xattr_ibody_inline_set(handle_t *, struct inode *,
+					 struct ext4bf_iloc *, int,
+					 const char *, const void *, size_t);
+extern size_t ext4bf_xattr_ibody_inline_free(struct inode *,
+					     struct ext4bf_iloc *, int,
+					     const char *);
+
 extern void ext4bf_xattr_delete_inode(handle_t *, struct inode *);
 extern void ext4bf_xattr_put_super(struct super_block *);
 
@@ -111,6 +124,28 @@ ext4bf_xattr_set_handle(handle_t *handle, struct inode *inode, int name_index,
 	return -EOPNOTSUPP;
 }
 
+static inline int
+ext4bf_xattr_ibody_inline_get(struct inode *inode, int name_index,
+			      const char *name, void *buffer, size_t size)
+{
+	return -ENODATA;
+}
+
+static inline int
+ext4bf_xattr_ibody_inline_set(handle_t *handle, struct inode *inode,
+			      struct ext4bf_iloc *iloc, int name_index,
+			      const char *name, const void *value, size_t size)
+{
+	return -ENOSPC;
+}
+
+static inline size_t
+ext4bf_xattr_ibody_inline_free(struct inode *inode, struct ext4bf_iloc *iloc,
+			       int name_index, const char *name)
+{
+	return 0;
+}
+
 static inline void
 ext4bf_xattr_delete_inode(handle_t *handle, struct inode *inode)
 {
@@ -27,6 +27,11 @@
  * async writeout immediately.
  * So by _not_ starting I/O in MS_ASYNC we provide complete flexibility to
  * applications.
+ *
+ * MS_OSYNC is MS_SYNC with osync() instead of fsync(): on file systems that
+ * provide ->osync (OptFS) it only guarantees that the mapped data is
+ * ordered before later updates, without waiting for it to be durable.
+ * Elsewhere it behaves like MS_SYNC.
  */
 SYSCALL_DEFINE3(msync, unsigned long, start, size_t, len, int, flags)
 {
@@ -36,11 +41,11 @@ SYSCALL_DEFINE3(msync, unsigned long, start, size_t, len, int, flags)
 	int unmapped_error = 0;
 	int error = -EINVAL;
 
-	if (flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC))
+	if (flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC | MS_OSYNC))
 		goto out;
 	if (start & ~PAGE_MASK)
 		goto out;
-	if ((flags & MS_ASYNC) && (flags & MS_SYNC))
+	if (hweight32(flags & (MS_ASYNC | MS_SYNC | MS_OSYNC)) > 1)
 		goto out;
 	error = -ENOMEM;
 	len = (len + ~PAGE_MASK) & PAGE_MASK;
@@ -78,11 +83,14 @@ SYSCALL_DEFINE3(msync, unsigned long, start, size_t, len, int, flags)
 		}
 		file = vma->vm_file;
 		start = vma->vm_end;
-		if ((flags & MS_SYNC) && file &&
+		if ((flags & (MS_SYNC | MS_OSYNC)) && file &&
 				(vma->vm_flags & VM_SHARED)) {
 			get_file(file);
 			up_read(&mm->mmap_sem);
-			error = vfs_fsync(file, 0);
+			if ((flags & MS_OSYNC) && file->f_op && file->f_op->osync)
+				error = file->f_op->osync(file, 0, LLONG_MAX);
+			else
+				error = vfs_fsync(file, 0);
 			fput(file);
 			if (error || start >= end)
 				goto out;